@@ -0,0 +1,202 @@
+/* alloc_check.cpp
+ * Checks that an established connection does not allocate per packet.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/*
+ * Needs a build with SSHD_COUNT_ALLOCATIONS. A client and the server are connected over
+ * an in-memory pipe, authenticate with a trivial method and request an echo service. The
+ * client then sends SSH_MSG_CHANNEL_DATA packets that the server's service sends back,
+ * one at a time. After a warm-up, in which the buffer pool and the strings reach their
+ * working size, the allocations charged to the connection threads are compared before and
+ * after a number of round trips. The allocations of a thread are charged to its connection
+ * as each packet is read or built, so the window covers readPacketNonblock, handlePacket,
+ * the service read/handle and sendPacketNonblock on both sides.
+ *
+ * Usage:
+ *      alloc_check <server settings> [-n round trips] [-s payload size]
+ *
+ * Exits with status 0 if no allocations were made in the steady state, 1 otherwise.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/* project includes */
+#include "bench.h"
+#include "services.h"
+#include "sshd.h"
+#include "CClientTransport.h"
+#include "CMemoryNetwork.h"
+#include "CStats.h"
+#include "util.h"
+
+#define CHECK_DEFAULT_ROUNDS        (10000)
+#define CHECK_DEFAULT_PAYLOAD       (1024)
+#define CHECK_WARMUP_ROUNDS         (1000)
+#define CHECK_TIMEOUT               (60000)         /* milliseconds */
+
+using namespace std;
+using namespace ssh;
+using namespace bench;
+
+namespace
+{
+    /* CEchoClient
+     * Client side service, sends packets and counts the echoes, one packet is in flight at
+     * a time.
+     */
+    class CEchoClient : public CService
+    {
+    public:
+        CEchoClient(uint32_t payload) : m_payload( payload ), m_toSend( 0 ), m_received( 0 ), m_inFlight( false ) {
+            memset( m_data, 0x5A, sizeof(m_data) );
+        }
+
+        bool init(const CSettings &)                        {return true;}
+        bool isDataAvailable(int)                           {return m_toSend > 0 && !m_inFlight;}
+        std::string GetServiceName()                        {return BENCH_ECHO_SERVICE;}
+
+        int read(uint8_t * dst, uint32_t size, uint32_t * len) {
+            *len        = WriteChannelData( dst, m_payload < size ? m_payload : size, m_data );
+            m_inFlight  = true;
+            m_toSend--;
+            return sshd_OK;
+        }
+
+        int handle(const byte *, uint32_t) {
+            m_inFlight = false;
+            m_received++;
+            return sshd_OK;
+        }
+
+        /* sends a number of packets and waits for the echoes */
+        bool exchange(uint32_t count) {
+            uint32_t target = m_received + count;
+            m_toSend = count;   /* picked up by the connection's thread */
+            for(int t = 0; m_received < target; t++) {
+                if( t >= CHECK_TIMEOUT )
+                    return false;
+                Pause( 1 );
+            }
+            return true;
+        }
+
+    protected:
+        uint32_t            m_payload;
+        volatile uint32_t   m_toSend,
+                            m_received;
+        volatile bool       m_inFlight;
+        byte                m_data[MAX_SSH_PAYLOAD];
+    };
+
+    /* CCheckPeer
+     * The client's authentication method and notifications.
+     */
+    class CCheckPeer : public INotify, public IAuthenticate
+    {
+    public:
+        CCheckPeer() : m_sent( false ) {}
+
+        void OnConnectSuccess(CClientTransport *)   {}
+        void OnConnectFailure(CClientTransport *)   {}
+        void OnCloseEvent(CClientTransport *)       {}
+
+        std::string getAuthServiceName()            {return BENCH_AUTH_SERVICE;}
+        bool authIsDataAvailable()                  {return !m_sent;}
+        int authWritePacket(byte *, size_t)         {return sshd_OK;}
+
+        int authReadPacket(byte * dst, size_t, size_t * count) {
+            dst[0]  = BENCH_AUTH_MESSAGE;
+            *count  = 1;
+            m_sent  = true;
+            return sshd_OK;
+        }
+
+    protected:
+        bool m_sent;
+    };
+};
+
+int main(int argc, char ** argv)
+{
+    const char * settingsFile = NULL;
+    uint32_t rounds = CHECK_DEFAULT_ROUNDS, payload = CHECK_DEFAULT_PAYLOAD;
+
+    for(int i = 1; i < argc; i++) {
+        if( !strcmp( argv[i], "-n" ) && i + 1 < argc )
+            rounds = (uint32_t) atoi( argv[++i] );
+        else if( !strcmp( argv[i], "-s" ) && i + 1 < argc )
+            payload = (uint32_t) atoi( argv[++i] );
+        else
+            settingsFile = argv[i];
+    }
+    if( !settingsFile || !rounds || payload < BENCH_DATA_HEADER || payload > MAX_SSH_PAYLOAD ) {
+        fprintf( stderr, "usage: %s <server settings> [-n round trips] [-s payload size]\n", argv[0] );
+        return 2;
+    }
+
+#if !defined(SSHD_COUNT_ALLOCATIONS)
+    fprintf( stderr, "Built without SSHD_COUNT_ALLOCATIONS, allocations are not counted.\n" );
+    return 2;
+#endif
+
+    sshd server;
+    if( !server.init( settingsFile ) ) {
+        fprintf( stderr, "Failed to initialize the server.\n" );
+        return 2;
+    }
+    RegisterServices( server );
+
+    CSettings settings;
+    CCheckPeer peer;
+    CEchoClient * echo = new CEchoClient( payload );
+    CClientTransport * client = new CClientTransport( settings, &peer, &peer );
+    CMemoryNetwork * a, * b;
+
+    client->setService( echo );
+    if( !client->init() || !CMemoryNetwork::CreatePair( &a, &b ) || !server.attach( a ) ||
+        client->connect( (INetwork *) b ) != sshd_OK )
+    {
+        fprintf( stderr, "Failed to connect.\n" );
+        return 2;
+    }
+
+    for(int t = 0; client->getStatus() != sshd_STATUS_CONNECTED; t++) {
+        if( client->getStatus() == sshd_STATUS_FAILURE || t >= CHECK_TIMEOUT ) {
+            fprintf( stderr, "Failed to establish the session.\n" );
+            return 2;
+        }
+        Pause( 1 );
+    }
+
+    /* warm up, then measure, a final round trip makes both threads charge the
+       allocations of the measured packets */
+    StatsCounters before, after;
+    bool ok = echo->exchange( CHECK_WARMUP_ROUNDS );
+    CStats::GetInstance().snapshot( before );
+    ok = ok && echo->exchange( rounds ) && echo->exchange( 1 );
+    CStats::GetInstance().snapshot( after );
+
+    client->shutdown();
+    client->wait();
+    delete client;
+    CLogger::GetInstance().stop();
+
+    if( !ok ) {
+        fprintf( stderr, "The echo exchange failed.\n" );
+        return 2;
+    }
+
+    uint64_t packets        = (after.packetsIn - before.packetsIn) + (after.packetsOut - before.packetsOut);
+    uint64_t allocations    = after.allocations - before.allocations;
+
+    printf( "%llu packets, %llu allocations, %.4f allocations per packet\n",
+            (unsigned long long) packets, (unsigned long long) allocations,
+            packets ? (double) allocations / packets : 0.0 );
+
+    return allocations ? 1 : 0;
+}
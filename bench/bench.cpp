@@ -0,0 +1,185 @@
+/* bench.cpp
+ * Implements the helpers shared by the benchmarks.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+/* project includes */
+#include "bench.h"
+
+#if defined(WIN32) || defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define BENCH_INCREMENT(p)          InterlockedIncrement64( (volatile LONGLONG *) (p) )
+#else
+#include <time.h>
+#define BENCH_INCREMENT(p)          __sync_fetch_and_add( (p), 1 )
+#endif
+
+using namespace std;
+
+/*
+ * Allocation counting, the global operators are replaced in the benchmark executables so
+ * every allocation made by the server and client code is seen.
+ */
+
+static volatile uint64_t s_allocations = 0;
+
+static void * CountedAlloc(size_t size)
+{
+    BENCH_INCREMENT( &s_allocations );
+    return malloc( size ? size : 1 );
+}
+
+void * operator new(size_t size) throw(std::bad_alloc)
+{
+    void * p = CountedAlloc( size );
+    if( !p )
+        throw std::bad_alloc();
+    return p;
+}
+
+void * operator new[](size_t size) throw(std::bad_alloc)
+{
+    void * p = CountedAlloc( size );
+    if( !p )
+        throw std::bad_alloc();
+    return p;
+}
+
+void * operator new(size_t size, const std::nothrow_t &) throw()
+{
+    return CountedAlloc( size );
+}
+
+void * operator new[](size_t size, const std::nothrow_t &) throw()
+{
+    return CountedAlloc( size );
+}
+
+void operator delete(void * p) throw()                          {free( p );}
+void operator delete[](void * p) throw()                        {free( p );}
+void operator delete(void * p, const std::nothrow_t &) throw()  {free( p );}
+void operator delete[](void * p, const std::nothrow_t &) throw(){free( p );}
+
+namespace bench
+{
+    /* Allocations
+     * Returns the number of allocations made so far.
+     */
+    uint64_t Allocations()
+    {
+        return s_allocations;
+    }
+
+    /* Pause
+     * Suspends the calling thread for a number of milliseconds.
+     */
+    void Pause(int ms)
+    {
+#if defined(WIN32) || defined(_WIN32)
+        Sleep( ms );
+#else
+        struct timespec ts;
+        ts.tv_sec  = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000L;
+        nanosleep( &ts, NULL );
+#endif
+    }
+
+    /* CBenchOutput::CBenchOutput
+     * Constructor.
+     */
+    CBenchOutput::CBenchOutput(const char * suite)
+    {
+        m_out           = "{\n  \"suite\": \"";
+        m_out          += suite;
+        m_out          += "\",\n  \"results\": [";
+        m_firstResult   = true;
+        m_firstField    = true;
+    }
+
+    /* CBenchOutput::begin
+     * Starts a result, the name identifies the measurement.
+     */
+    void CBenchOutput::begin(const char * name)
+    {
+        m_out += m_firstResult ? "\n    {" : ",\n    {";
+        m_firstResult   = false;
+        m_firstField    = true;
+        field( "name", name );
+    }
+
+    /* CBenchOutput::end
+     * Ends the current result.
+     */
+    void CBenchOutput::end()
+    {
+        m_out += "}";
+    }
+
+    /* CBenchOutput::key
+     * Appends the key of a field.
+     */
+    void CBenchOutput::key(const char * name)
+    {
+        if( !m_firstField )
+            m_out += ", ";
+        m_firstField = false;
+
+        m_out += "\"";
+        m_out += name;
+        m_out += "\": ";
+    }
+
+    /* CBenchOutput::field
+     * Adds a string field, quotes and backslashes are escaped.
+     */
+    void CBenchOutput::field(const char * name, const string & value)
+    {
+        key( name );
+        m_out += "\"";
+        for(string::const_iterator it = value.begin(); it != value.end(); it++) {
+            if( *it == '"' || *it == '\\' )
+                m_out += '\\';
+            m_out += *it;
+        }
+        m_out += "\"";
+    }
+
+    void CBenchOutput::field(const char * name, const char * value)
+    {
+        field( name, string(value) );
+    }
+
+    void CBenchOutput::field(const char * name, uint64_t value)
+    {
+        char buf[32];
+        sprintf( buf, "%llu", (unsigned long long) value );
+        key( name );
+        m_out += buf;
+    }
+
+    void CBenchOutput::field(const char * name, double value)
+    {
+        char buf[64];
+        sprintf( buf, "%.6g", value );
+        key( name );
+        m_out += buf;
+    }
+
+    /* CBenchOutput::finish
+     * Writes the document to stdout.
+     */
+    void CBenchOutput::finish()
+    {
+        m_out += "\n  ]\n}\n";
+        fputs( m_out.c_str(), stdout );
+        fflush( stdout );
+    }
+};
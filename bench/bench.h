@@ -0,0 +1,61 @@
+/* bench.h
+ * Helpers shared by the benchmarks.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/* C/C++ includes */
+#include <string>
+
+/* project includes */
+#include "types.h"
+
+namespace bench
+{
+    /* CBenchOutput
+     * Collects the results of a benchmark run and writes them to stdout as one JSON
+     * document, {"suite": ..., "results": [{...}, ...]}, so runs of different releases or
+     * settings can be compared by a script.
+     */
+    class CBenchOutput
+    {
+    public:
+        CBenchOutput(const char * suite);
+
+        /* starts and ends a result object */
+        void begin(const char * name);
+        void end();
+
+        /* adds a field to the current result */
+        void field(const char * key, const std::string & value);
+        void field(const char * key, const char * value);
+        void field(const char * key, uint64_t value);
+        void field(const char * key, double value);
+
+        /* writes the document */
+        void finish();
+
+    protected:
+        void key(const char * name);
+
+        std::string m_out;
+        bool        m_firstResult,
+                    m_firstField;
+    };
+
+    /* Allocations
+     * Returns the number of heap allocations made through operator new by all threads.
+     * Allocations made by C libraries (OpenSSL) are not included.
+     */
+    uint64_t Allocations();
+
+    /* Pause
+     * Suspends the calling thread for a number of milliseconds.
+     */
+    void Pause(int ms);
+};
+
+#endif
@@ -0,0 +1,797 @@
+/* loadgen.cpp
+ * Load generator, many concurrent simulated clients against a local server.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/*
+ * Starts an in-process server with the benchmark services and opens client connections
+ * to it at a fixed rate, over loopback TCP or in-memory pipes, up to a number of
+ * concurrent connections. Each client follows one of the traffic mixes:
+ *
+ *      handshake       version exchange and keyexchange, then closes
+ *      auth            also authenticates and opens the echo service
+ *      interactive     then sends keystrokes at an interval, each one is echoed
+ *      bulk            then sends a block of data as 32 KB packets
+ *
+ * The clients are started, advanced and closed by the main loop, all of them on the main
+ * thread. The loop sleeps until a stream reports an event, the next client is due or a
+ * client's timer expires, and then advances the transports that had events with
+ * CClientTransport::step. Over TCP the client sockets are served by a reactor. The report
+ * has the connection rate, the failure rate and the latency percentiles of the handshakes,
+ * authentications and keystroke echoes.
+ *
+ * Usage:
+ *      loadgen <server settings> [-c concurrency] [-r connections per second] [-d seconds]
+ *              [-x handshake:N,auth:N,interactive:N,bulk:N] [-k keystrokes] [-i keystroke ms]
+ *              [-b bulk KB] [-t mem|tcp]
+ *
+ * The results are written to stdout as JSON.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* project includes */
+#include "bench.h"
+#include "services.h"
+#include "sshd.h"
+#include "CClientTransport.h"
+#include "CHistogram.h"
+#include "CMemoryNetwork.h"
+#include "CReactor.h"
+#include "messages.h"
+#include "swap.h"
+#include "util.h"
+
+#if defined(WIN32) || defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#define LOAD_SERVER_ADDRESS         "127.0.0.1"
+#define LOAD_SERVER_PORT            "1337"          /* the port sshd listens to */
+#define LOAD_DEFAULT_CONCURRENCY    (100)
+#define LOAD_DEFAULT_RATE           (50)            /* connections per second */
+#define LOAD_DEFAULT_DURATION       (10)            /* seconds */
+#define LOAD_DEFAULT_KEYSTROKES     (20)
+#define LOAD_DEFAULT_KEY_INTERVAL   (50)            /* milliseconds */
+#define LOAD_DEFAULT_BULK           (1024)          /* KB */
+#define LOAD_BULK_PAYLOAD           (32 * 1024)
+#define LOAD_CLIENT_TIMEOUT         (60)            /* seconds a client may take */
+#define LOAD_CONNECT_TIMEOUT        (1000)          /* milliseconds for a TCP connect */
+#define LOAD_MAX_WAIT               (1000)          /* milliseconds the loop sleeps at most */
+
+#define MS                          (1000000ULL)    /* nanoseconds */
+
+using namespace std;
+using namespace ssh;
+using namespace bench;
+
+namespace
+{
+    /* traffic mixes */
+    enum {
+        MIX_HANDSHAKE = 0,
+        MIX_AUTH,
+        MIX_INTERACTIVE,
+        MIX_BULK,
+        MIX_MAX
+    };
+
+    const char * s_mixNames[MIX_MAX] = {"handshake", "auth", "interactive", "bulk"};
+
+    /* the latencies, recorded by the main loop */
+    CHistogram s_handshakeLatency( "handshake", "Connection start until the keyexchange is done." );
+    CHistogram s_authLatency( "auth", "Keyexchange done until the service has been accepted." );
+    CHistogram s_keystrokeLatency( "keystroke", "Keystroke sent until its echo arrived." );
+
+    /* Options
+     * The command line options.
+     */
+    struct Options
+    {
+        const char *    settings;
+        uint32_t        concurrency;
+        uint32_t        rate;
+        uint32_t        duration;
+        uint32_t        weights[MIX_MAX];
+        uint32_t        keystrokes;
+        uint32_t        keyInterval;
+        uint32_t        bulk;
+        bool            memory;
+    };
+
+    /* CLoadService
+     * The client side of the echo service. Keystrokes are sent one at a time and timed
+     * until the echo arrives. A bulk transfer is sent as SSH_MSG_IGNORE packets followed by
+     * one echoed SSH_MSG_CHANNEL_DATA, its echo shows that the server has read everything.
+     */
+    class CLoadService : public CService
+    {
+    public:
+        CLoadService() {
+            m_keys      = 0;
+            m_bulk      = 0;
+            m_echoes    = 0;
+            m_inFlight  = false;
+            m_sent      = 0;
+            memset( m_data, 'k', sizeof(m_data) );
+        }
+
+        bool init(const CSettings &)    {return true;}
+        std::string GetServiceName()    {return BENCH_ECHO_SERVICE;}
+
+        bool isDataAvailable(int) {
+            return !m_inFlight && (m_keys > 0 || m_bulk > 0);
+        }
+
+        int read(uint8_t * dst, uint32_t size, uint32_t * len)
+        {
+            if( m_bulk > 1 )
+            {
+                /* SSH_MSG_IGNORE, the server drops it */
+                uint32_t n = LOAD_BULK_PAYLOAD < size ? LOAD_BULK_PAYLOAD : size;
+                uint32_t length = __htonl32( n - 5 );
+
+                dst[0] = SSH_MSG_IGNORE;
+                memcpy( dst + 1, &length, 4 );
+                memcpy( dst + 5, m_data, n - 5 );
+                *len = n;
+                m_bulk--;
+                return sshd_OK;
+            }
+
+            /* a keystroke, or the end of a bulk transfer */
+            *len = WriteChannelData( dst, BENCH_DATA_HEADER + 1, m_data );
+            if( m_bulk )
+                m_bulk--;
+            else
+                m_keys--;
+            m_sent      = GetMonotonicTime();
+            m_inFlight  = true;
+            return sshd_OK;
+        }
+
+        int handle(const byte *, uint32_t) {
+            if( !m_inFlight )
+                return sshd_ERROR;
+            s_keystrokeLatency.record( GetMonotonicTime() - m_sent );
+            m_inFlight = false;
+            m_echoes++;
+            return sshd_OK;
+        }
+
+        /* queues a keystroke */
+        void key()                      {m_keys = 1;}
+        /* queues a bulk transfer of a number of packets */
+        void bulk(uint32_t packets)     {m_bulk = packets + 1;}
+        /* the echoes received so far */
+        uint32_t echoes() const         {return m_echoes;}
+
+    protected:
+        volatile uint32_t   m_keys,
+                            m_bulk,
+                            m_echoes;
+        volatile bool       m_inFlight;
+        uint64_t            m_sent;
+        byte                m_data[LOAD_BULK_PAYLOAD];
+    };
+
+    /* client states */
+    enum {
+        CLIENT_CONNECTING = 0,
+        CLIENT_TYPING,
+        CLIENT_BULK,
+        CLIENT_DONE,
+        CLIENT_FAILED
+    };
+
+    /* CLoadClient
+     * A simulated client, the notifications and the authentication method of its
+     * connection.
+     */
+    class CLoadClient : public INotify, public IAuthenticate
+    {
+    public:
+        CLoadClient(int mix) : m_mix( mix ) {
+            m_transport     = NULL;
+            m_service       = NULL;
+            m_due           = 0;
+            m_state         = CLIENT_CONNECTING;
+            m_connected     = false;
+            m_failed        = false;
+            m_authSent      = false;
+            m_start         = GetMonotonicTime();
+            m_handshakeDone = 0;
+            m_keysLeft      = 0;
+            m_nextKey       = 0;
+            m_bulkStart     = 0;
+        }
+
+        /* INotify */
+        void OnConnectSuccess(CClientTransport *) {
+            m_handshakeDone = GetMonotonicTime();
+            s_handshakeLatency.record( m_handshakeDone - m_start );
+            m_connected = true;
+        }
+        void OnConnectFailure(CClientTransport *)   {m_failed = true;}
+        void OnCloseEvent(CClientTransport *)       {}
+
+        /* IAuthenticate */
+        std::string getAuthServiceName()            {return BENCH_AUTH_SERVICE;}
+        bool authIsDataAvailable()                  {return !m_authSent;}
+        int authWritePacket(byte *, size_t)         {return sshd_OK;}
+        int authReadPacket(byte * dst, size_t, size_t * count) {
+            dst[0]      = BENCH_AUTH_MESSAGE;
+            *count      = 1;
+            m_authSent  = true;
+            return sshd_OK;
+        }
+
+        int                 m_mix;
+        int                 m_state;
+        CClientTransport *  m_transport;
+        CLoadService *      m_service;      /* owned by the transport */
+        std::list<CLoadClient *>::iterator  m_pos;  /* in the list of clients */
+        uint64_t            m_due;          /* the timer, zero if not set */
+        bool                m_connected,
+                            m_failed;
+        bool                m_authSent;
+        uint64_t            m_start,
+                            m_handshakeDone,
+                            m_nextKey,
+                            m_bulkStart;
+        uint32_t            m_keysLeft;
+    };
+
+    typedef std::set< std::pair<uint64_t, CLoadClient *> > Timers;
+
+    /* CReadyQueue
+     * The clients whose streams had events since the main loop last looked. The reactor
+     * thread, or the server's connection threads for memory pipes, add them through
+     * INetworkListener, the main loop sleeps in take until there are some.
+     */
+    class CReadyQueue : public INetworkListener
+    {
+    public:
+        CReadyQueue();
+        ~CReadyQueue();
+
+        /* INetworkListener, the context is the client */
+        void OnNetworkEvent(void * context);
+
+        /* waits up to ms milliseconds for events, moves the clients that had them to ready */
+        void take(int ms, std::set<CLoadClient *> & ready);
+        /* forgets a client whose stream has been deleted */
+        void remove(CLoadClient *);
+
+    protected:
+        void lock();
+        void unlock();
+        void wait(int ms);
+
+        std::set<CLoadClient *> m_ready;
+#if defined(WIN32) || defined(_WIN32)
+        CRITICAL_SECTION        m_lock;
+        CONDITION_VARIABLE      m_cond;
+#else
+        pthread_mutex_t         m_lock;
+        pthread_cond_t          m_cond;
+#endif
+    };
+
+#if defined(WIN32) || defined(_WIN32)
+
+    CReadyQueue::CReadyQueue()      {InitializeCriticalSection( &m_lock ); InitializeConditionVariable( &m_cond );}
+    CReadyQueue::~CReadyQueue()     {DeleteCriticalSection( &m_lock );}
+    void CReadyQueue::lock()        {EnterCriticalSection( &m_lock );}
+    void CReadyQueue::unlock()      {LeaveCriticalSection( &m_lock );}
+    void CReadyQueue::wait(int ms)  {SleepConditionVariableCS( &m_cond, &m_lock, (DWORD) ms );}
+
+    void CReadyQueue::OnNetworkEvent(void * context)
+    {
+        lock();
+        m_ready.insert( (CLoadClient *) context );
+        unlock();
+        WakeConditionVariable( &m_cond );
+    }
+
+#else
+
+    CReadyQueue::CReadyQueue()      {pthread_mutex_init( &m_lock, NULL ); pthread_cond_init( &m_cond, NULL );}
+    CReadyQueue::~CReadyQueue()     {pthread_cond_destroy( &m_cond ); pthread_mutex_destroy( &m_lock );}
+    void CReadyQueue::lock()        {pthread_mutex_lock( &m_lock );}
+    void CReadyQueue::unlock()      {pthread_mutex_unlock( &m_lock );}
+
+    void CReadyQueue::wait(int ms)
+    {
+        struct timeval now;
+        struct timespec until;
+        gettimeofday( &now, NULL );
+        until.tv_sec  = now.tv_sec + ms / 1000;
+        until.tv_nsec = now.tv_usec * 1000L + (ms % 1000) * 1000000L;
+        if( until.tv_nsec >= 1000000000L ) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait( &m_cond, &m_lock, &until );
+    }
+
+    void CReadyQueue::OnNetworkEvent(void * context)
+    {
+        lock();
+        m_ready.insert( (CLoadClient *) context );
+        unlock();
+        pthread_cond_signal( &m_cond );
+    }
+
+#endif
+
+    /* CReadyQueue::take
+     * Sleeps until a stream has an event or the time is up, and hands out the clients.
+     */
+    void CReadyQueue::take(int ms, std::set<CLoadClient *> & ready)
+    {
+        lock();
+        if( m_ready.empty() && ms > 0 )
+            wait( ms );
+        ready.insert( m_ready.begin(), m_ready.end() );
+        m_ready.clear();
+        unlock();
+    }
+
+    /* CReadyQueue::remove
+     * Drops a closed client, its stream can no longer report events.
+     */
+    void CReadyQueue::remove(CLoadClient * c)
+    {
+        lock();
+        m_ready.erase( c );
+        unlock();
+    }
+
+    /* Totals
+     * The counts of the run.
+     */
+    struct Totals
+    {
+        uint64_t    started,
+                    succeeded,
+                    failed;
+        uint64_t    failures[MIX_MAX];
+        uint64_t    bulkBytes,
+                    bulkTime;
+    };
+
+    /* StartClient
+     * Opens the connection of a client, returns false if it could not be started. The
+     * stream reports its events to the queue, over TCP it is served by the reactor.
+     */
+    bool StartClient(sshd & server, const CSettings & settings, CLoadClient * c, CReactor * reactor, CReadyQueue & ready)
+    {
+        c->m_transport = new (std::nothrow) CClientTransport( settings, c, c );
+        if( !c->m_transport )
+            return false;
+
+        if( c->m_mix != MIX_HANDSHAKE ) {
+            c->m_service = new (std::nothrow) CLoadService;
+            if( !c->m_service )
+                return false;
+            c->m_transport->setService( c->m_service );
+        }
+
+        if( !c->m_transport->init() )
+            return false;
+
+        INetwork * stream;
+        if( !reactor )
+        {
+            CMemoryNetwork * a, * b;
+            if( !CMemoryNetwork::CreatePair( &a, &b ) )
+                return false;
+            if( !server.attach( a ) ) {
+                delete b;
+                return false;
+            }
+            stream = b;
+        }
+        else
+        {
+            CNetwork * network = new (std::nothrow) CNetwork;
+            if( !network )
+                return false;
+
+            int res = network->connect( LOAD_SERVER_ADDRESS, LOAD_SERVER_PORT );
+            if( res == sshd_CONNECTION_PENDING )
+                res = network->poll( LOAD_CONNECT_TIMEOUT );
+            if( res != sshd_OK ) {
+                delete network;
+                return false;
+            }
+            if( !(stream = reactor->adopt( network )) )
+                return false;
+        }
+
+        stream->setListener( &ready, c );
+        return c->m_transport->start( stream ) == sshd_OK;
+    }
+
+    /* StepClient
+     * Advances a client, returns true once it is done or has failed.
+     */
+    bool StepClient(CLoadClient * c, const Options & options, uint64_t now, Totals & totals)
+    {
+        sshd_ConnectStatus status = c->m_transport->getStatus();
+
+        if( c->m_failed || status == sshd_STATUS_FAILURE || status == sshd_STATUS_CLOSED ||
+            now - c->m_start > LOAD_CLIENT_TIMEOUT * 1000 * MS )
+        {
+            c->m_state = CLIENT_FAILED;
+            return true;
+        }
+
+        switch( c->m_state )
+        {
+        case CLIENT_CONNECTING:
+            if( c->m_mix == MIX_HANDSHAKE ) {
+                if( c->m_connected )
+                    c->m_state = CLIENT_DONE;
+                break;
+            }
+            if( status != sshd_STATUS_CONNECTED )
+                break;
+
+            /* authenticated and the service has been accepted */
+            s_authLatency.record( now - c->m_handshakeDone );
+            if( c->m_mix == MIX_AUTH ) {
+                c->m_state = CLIENT_DONE;
+            } else if( c->m_mix == MIX_INTERACTIVE ) {
+                c->m_keysLeft   = options.keystrokes;
+                c->m_nextKey    = now;
+                c->m_state      = options.keystrokes ? CLIENT_TYPING : CLIENT_DONE;
+            } else {
+                c->m_bulkStart  = now;
+                c->m_service->bulk( (options.bulk * 1024 + LOAD_BULK_PAYLOAD - 1) / LOAD_BULK_PAYLOAD );
+                c->m_state      = CLIENT_BULK;
+            }
+            break;
+
+        case CLIENT_TYPING:
+            /* the next keystroke once the previous one has been echoed */
+            if( c->m_service->echoes() == options.keystrokes - c->m_keysLeft && now >= c->m_nextKey ) {
+                if( !c->m_keysLeft ) {
+                    c->m_state = CLIENT_DONE;
+                    break;
+                }
+                c->m_keysLeft--;
+                c->m_nextKey = now + options.keyInterval * MS;
+                c->m_service->key();
+            }
+            break;
+
+        case CLIENT_BULK:
+            if( c->m_service->echoes() ) {
+                totals.bulkBytes    += (uint64_t) options.bulk * 1024;
+                totals.bulkTime     += now - c->m_bulkStart;
+                c->m_state          = CLIENT_DONE;
+            }
+            break;
+        }
+        return c->m_state == CLIENT_DONE;
+    }
+
+    /* AdvanceClient
+     * Lets the transport handle the events of its stream, then advances the client and
+     * sends what it queued. Returns true once the client is done or has failed.
+     */
+    bool AdvanceClient(CLoadClient * c, const Options & options, uint64_t now, Totals & totals)
+    {
+        int state;
+
+        c->m_transport->step();
+        do {
+            state = c->m_state;
+            if( StepClient( c, options, now, totals ) )
+                return true;
+        } while( c->m_state != state );
+
+        c->m_transport->step();
+        return false;
+    }
+
+    /* SetTimer
+     * Sets the timer of a client to when it has to be looked at without an event: the next
+     * keystroke or the timeout.
+     */
+    void SetTimer(CLoadClient * c, uint64_t now, Timers & timers)
+    {
+        uint64_t due = c->m_start + LOAD_CLIENT_TIMEOUT * 1000 * MS;
+        if( c->m_state == CLIENT_TYPING && c->m_nextKey > now && c->m_nextKey < due )
+            due = c->m_nextKey;
+
+        if( due != c->m_due ) {
+            timers.erase( make_pair( c->m_due, c ) );
+            timers.insert( make_pair( due, c ) );
+            c->m_due = due;
+        }
+    }
+
+    /* CloseClient
+     * Closes the connection and deletes the client.
+     */
+    void CloseClient(CLoadClient * c, CReadyQueue & ready, Timers & timers)
+    {
+        if( c->m_transport ) {
+            c->m_transport->close();
+            delete c->m_transport;  /* also deletes the service and the stream */
+        }
+        ready.remove( c );
+        timers.erase( make_pair( c->m_due, c ) );
+        delete c;
+    }
+
+    /* PickMix
+     * Picks the traffic mix of the next client by the weights.
+     */
+    int PickMix(const Options & options)
+    {
+        uint32_t total = 0;
+        for(int i = 0; i < MIX_MAX; i++)
+            total += options.weights[i];
+
+        uint32_t r = (uint32_t) rand() % total;
+        for(int i = 0; i < MIX_MAX; i++) {
+            if( r < options.weights[i] )
+                return i;
+            r -= options.weights[i];
+        }
+        return MIX_HANDSHAKE;
+    }
+
+    /* WriteLatency
+     * Adds the percentiles of a histogram in milliseconds.
+     */
+    void WriteLatency(CBenchOutput & out, const char * phase, const CHistogram & h)
+    {
+        out.begin( "latency" );
+        out.field( "phase", phase );
+        out.field( "count", h.GetCount() );
+        if( h.GetCount() ) {
+            out.field( "p50_ms", h.quantile( 0.50 ) / 1e6 );
+            out.field( "p90_ms", h.quantile( 0.90 ) / 1e6 );
+            out.field( "p99_ms", h.quantile( 0.99 ) / 1e6 );
+            out.field( "max_ms", h.quantile( 1.0 ) / 1e6 );
+        }
+        out.end();
+    }
+
+    /* ParseMix
+     * Parses the weights, e.g. "handshake:50,interactive:50".
+     */
+    bool ParseMix(const char * value, Options & options)
+    {
+        vector<string> items;
+        SplitString( value, items, ',' );
+
+        memset( options.weights, 0, sizeof(options.weights) );
+        for(vector<string>::iterator it = items.begin(); it != items.end(); it++)
+        {
+            string::size_type colon = it->find( ':' );
+            string name = it->substr( 0, colon );
+            int i;
+
+            for(i = 0; i < MIX_MAX && name != s_mixNames[i]; i++);
+            if( i == MIX_MAX || colon == string::npos )
+                return false;
+            options.weights[i] = (uint32_t) atoi( it->c_str() + colon + 1 );
+        }
+
+        for(int i = 0; i < MIX_MAX; i++) {
+            if( options.weights[i] )
+                return true;
+        }
+        return false;
+    }
+
+    /* ParseOptions
+     * Parses the command line, returns false on error.
+     */
+    bool ParseOptions(int argc, char ** argv, Options & options)
+    {
+        options.settings    = NULL;
+        options.concurrency = LOAD_DEFAULT_CONCURRENCY;
+        options.rate        = LOAD_DEFAULT_RATE;
+        options.duration    = LOAD_DEFAULT_DURATION;
+        options.keystrokes  = LOAD_DEFAULT_KEYSTROKES;
+        options.keyInterval = LOAD_DEFAULT_KEY_INTERVAL;
+        options.bulk        = LOAD_DEFAULT_BULK;
+        options.memory      = false;
+        memset( options.weights, 0, sizeof(options.weights) );
+        options.weights[MIX_HANDSHAKE] = 1;
+
+        for(int i = 1; i < argc; i++)
+        {
+            if( argv[i][0] != '-' ) {
+                options.settings = argv[i];
+                continue;
+            }
+            if( i + 1 >= argc )
+                return false;
+
+            const char * value = argv[++i];
+            switch( argv[i - 1][1] )
+            {
+            case 'c': options.concurrency   = (uint32_t) atoi( value ); break;
+            case 'r': options.rate          = (uint32_t) atoi( value ); break;
+            case 'd': options.duration      = (uint32_t) atoi( value ); break;
+            case 'k': options.keystrokes    = (uint32_t) atoi( value ); break;
+            case 'i': options.keyInterval   = (uint32_t) atoi( value ); break;
+            case 'b': options.bulk          = (uint32_t) atoi( value ); break;
+            case 't': options.memory        = !strcmp( value, "mem" ); break;
+            case 'x':
+                if( !ParseMix( value, options ) )
+                    return false;
+                break;
+            default:
+                return false;
+            }
+        }
+        return options.settings && options.concurrency && options.rate;
+    }
+};
+
+int main(int argc, char ** argv)
+{
+    Options options;
+
+    if( !ParseOptions( argc, argv, options ) ) {
+        fprintf( stderr, "usage: %s <server settings> [-c concurrency] [-r connections per second] [-d seconds]\n"
+                         "       [-x handshake:N,auth:N,interactive:N,bulk:N] [-k keystrokes] [-i keystroke ms]\n"
+                         "       [-b bulk KB] [-t mem|tcp]\n", argv[0] );
+        return 1;
+    }
+
+    sshd server;
+    if( !server.init( options.settings ) ) {
+        fprintf( stderr, "Failed to initialize the server.\n" );
+        return 1;
+    }
+    RegisterServices( server );
+
+    /* the memory pipes are attached directly, the accept loop only runs for TCP */
+    if( !options.memory && !server.spawn() ) {
+        fprintf( stderr, "Failed to start the server.\n" );
+        return 1;
+    }
+
+    /* the client sockets are served by a reactor of their own */
+    CReactor * reactor = NULL;
+    if( !options.memory && (!(reactor = CReactor::Create( SSHD_BACKEND_EPOLL )) || !reactor->spawn()) ) {
+        fprintf( stderr, "Failed to start the client reactor.\n" );
+        return 1;
+    }
+
+    CSettings settings;
+    CReadyQueue ready;
+    list<CLoadClient *> clients;
+    set<CLoadClient *> active;
+    Timers timers;
+    Totals totals;
+    memset( &totals, 0, sizeof(totals) );
+    srand( 1 );
+
+    uint64_t start      = GetMonotonicTime(),
+             end        = start + (uint64_t) options.duration * 1000 * MS,
+             interval   = 1000 * MS / options.rate,
+             next       = start,
+             now        = start;
+
+    while( now < end || !clients.empty() )
+    {
+        /* start the clients that are due, the rate is not made up for later when the
+           concurrency limit holds them back */
+        while( now < end && next <= now )
+        {
+            next += interval;
+            if( clients.size() >= options.concurrency )
+                continue;
+
+            CLoadClient * c = new CLoadClient( PickMix( options ) );
+            totals.started++;
+            if( !StartClient( server, settings, c, reactor, ready ) ) {
+                totals.failed++;
+                totals.failures[c->m_mix]++;
+                CloseClient( c, ready, timers );
+                continue;
+            }
+            c->m_pos = clients.insert( clients.end(), c );
+            SetTimer( c, now, timers );
+        }
+
+        /* sleep until a stream has an event, the next client is due or the first timer */
+        uint64_t wake = now + LOAD_MAX_WAIT * MS;
+        if( now < end && next < wake )
+            wake = next;
+        if( !timers.empty() && timers.begin()->first < wake )
+            wake = timers.begin()->first;
+        ready.take( wake > now ? (int) ((wake - now + MS - 1) / MS) : 0, active );
+        now = GetMonotonicTime();
+
+        while( !timers.empty() && timers.begin()->first <= now ) {
+            active.insert( timers.begin()->second );
+            timers.begin()->second->m_due = 0;
+            timers.erase( timers.begin() );
+        }
+
+        for(set<CLoadClient *>::iterator it = active.begin(); it != active.end(); it++)
+        {
+            CLoadClient * c = *it;
+            if( !AdvanceClient( c, options, now, totals ) ) {
+                SetTimer( c, now, timers );
+                continue;
+            }
+
+            if( c->m_state == CLIENT_DONE ) {
+                totals.succeeded++;
+            } else {
+                totals.failed++;
+                totals.failures[c->m_mix]++;
+            }
+            clients.erase( c->m_pos );
+            CloseClient( c, ready, timers );
+        }
+        active.clear();
+    }
+
+    double seconds = (GetMonotonicTime() - start) / 1e9;
+
+    if( reactor ) {
+        reactor->shutdown();
+        reactor->wait();
+        delete reactor;
+    }
+
+    if( !options.memory ) {
+        server.shutdown();
+        server.wait();      /* also stops the log writer */
+    } else {
+        CLogger::GetInstance().stop();
+    }
+
+    CBenchOutput out( "load" );
+    out.begin( "summary" );
+    out.field( "transport", options.memory ? "memory" : "tcp" );
+    out.field( "seconds", seconds );
+    out.field( "concurrency", (uint64_t) options.concurrency );
+    out.field( "target_rate", (uint64_t) options.rate );
+    out.field( "started", totals.started );
+    out.field( "succeeded", totals.succeeded );
+    out.field( "failed", totals.failed );
+    out.field( "connections_per_sec", totals.succeeded / seconds );
+    out.field( "failure_rate", totals.started ? (double) totals.failed / totals.started : 0.0 );
+    for(int i = 0; i < MIX_MAX; i++) {
+        string name = string( "failed_" ) + s_mixNames[i];
+        out.field( name.c_str(), totals.failures[i] );
+    }
+    if( totals.bulkTime )
+        out.field( "bulk_mb_per_sec_per_client", totals.bulkBytes / (totals.bulkTime / 1e9) / (1024.0 * 1024.0) );
+    out.end();
+
+    WriteLatency( out, "handshake", s_handshakeLatency );
+    WriteLatency( out, "auth", s_authLatency );
+    WriteLatency( out, "keystroke", s_keystrokeLatency );
+    out.finish();
+
+    return totals.failed ? 1 : 0;
+}
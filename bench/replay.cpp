@@ -0,0 +1,383 @@
+/* replay.cpp
+ * Replays recorded sessions against a fresh server.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/*
+ * The server records the service traffic of each connection when a record directory is
+ * configured (SSHD_SETTING_RECORD_DIRECTORY). Each session file is replayed by a client
+ * over an in-memory pipe to an in-process server: the client authenticates with the
+ * benchmark method, requests the recorded service and sends the recorded input payloads,
+ * either at the recorded times or as fast as possible. A session ends once as many
+ * payloads have come back as were recorded. The recorded service must be registered with
+ * the server, RegisterServices registers the benchmark ones.
+ *
+ * The report has the duration, the packet rate and the throughput of each session, and
+ * the reply latency, from an input to the first payload after it, for the inputs that got
+ * a reply in the recording, next to the recorded latency.
+ *
+ * Usage:
+ *      replay <server settings> [-f] [-n repeats] <session files>
+ *
+ * The results are written to stdout as JSON.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/* project includes */
+#include "bench.h"
+#include "services.h"
+#include "sshd.h"
+#include "CClientTransport.h"
+#include "CHistogram.h"
+#include "CMemoryNetwork.h"
+#include "CSessionRecorder.h"
+#include "util.h"
+
+#define REPLAY_CONNECT_TIMEOUT      (30000)         /* milliseconds */
+#define REPLAY_IDLE_TIMEOUT         (30000)         /* milliseconds without progress */
+
+#define US                          (1000ULL)       /* nanoseconds */
+
+using namespace std;
+using namespace ssh;
+using namespace bench;
+
+namespace
+{
+    /* Input
+     * A recorded input payload.
+     */
+    struct Input
+    {
+        uint64_t            time;       /* microseconds after the service was accepted */
+        bool                replied;    /* an output followed it in the recording */
+        std::vector<byte>   data;
+    };
+
+    /* Session
+     * A recording loaded into memory.
+     */
+    struct Session
+    {
+        std::string         service;
+        std::vector<Input>  inputs;
+        uint32_t            outputs;
+        uint64_t            inputBytes,
+                            outputBytes,
+                            duration;   /* microseconds */
+    };
+
+    /* LoadSession
+     * Reads a session file, the recorded reply latencies are added to the histogram.
+     */
+    bool LoadSession(const char * path, Session & session, CHistogram & recorded)
+    {
+        CSessionReader reader;
+        SessionRecord record;
+        uint64_t start = 0, lastInput = 0;
+        bool pending = false;
+
+        if( !reader.open( path ) )
+            return false;
+
+        session.outputs     = 0;
+        session.inputBytes  = 0;
+        session.outputBytes = 0;
+        session.duration    = 0;
+
+        while( reader.next( record ) )
+        {
+            switch( record.type )
+            {
+            case RECORD_SERVICE:
+                session.service.assign( record.data.begin(), record.data.end() );
+                start = record.time;
+                break;
+
+            case RECORD_INPUT:
+                session.inputs.push_back( Input() );
+                session.inputs.back().time      = record.time - start;
+                session.inputs.back().replied   = false;
+                session.inputs.back().data.swap( record.data );
+                session.inputBytes             += session.inputs.back().data.size();
+                lastInput                       = record.time;
+                pending                         = true;
+                break;
+
+            case RECORD_OUTPUT:
+                if( pending && !session.inputs.empty() ) {
+                    session.inputs.back().replied = true;
+                    recorded.record( (record.time - lastInput) * US );
+                    pending = false;
+                }
+                session.outputs++;
+                session.outputBytes += record.data.size();
+                break;
+            }
+            session.duration = record.time - start;
+        }
+
+        /* a session that ended abruptly is replayed up to where it ended */
+        return !session.service.empty();
+    }
+
+    /* CReplayService
+     * Client side service that sends the recorded inputs and counts the payloads that come
+     * back.
+     */
+    class CReplayService : public CService
+    {
+    public:
+        CReplayService(const Session & session, bool fast, CHistogram & latency)
+            : m_session( session ), m_fast( fast ), m_latency( latency )
+        {
+            m_start     = 0;
+            m_next      = 0;
+            m_received  = 0;
+            m_bytes     = 0;
+            m_sent      = 0;
+            m_awaiting  = false;
+        }
+
+        bool init(const CSettings &)    {return true;}
+        std::string GetServiceName()    {return m_session.service;}
+
+        bool isDataAvailable(int) {
+            if( !m_start || m_next >= m_session.inputs.size() )
+                return false;
+            return m_fast || GetMonotonicTime() >= m_start + m_session.inputs[m_next].time * US;
+        }
+
+        int read(uint8_t * dst, uint32_t size, uint32_t * len)
+        {
+            const Input & input = m_session.inputs[m_next];
+            if( input.data.size() > size )
+                return sshd_ERROR;
+
+            if( !input.data.empty() )
+                memcpy( dst, &input.data[0], input.data.size() );
+            *len = (uint32_t) input.data.size();
+
+            if( input.replied ) {
+                m_sent      = GetMonotonicTime();
+                m_awaiting  = true;
+            }
+            m_next++;
+            return sshd_OK;
+        }
+
+        int handle(const byte *, uint32_t size)
+        {
+            if( m_awaiting ) {
+                m_latency.record( GetMonotonicTime() - m_sent );
+                m_awaiting = false;
+            }
+            m_bytes += size;
+            m_received++;
+            return sshd_OK;
+        }
+
+        /* starts sending, the recorded times count from here */
+        void start()                    {m_start = GetMonotonicTime();}
+
+        /* progress, read by the main thread */
+        uint32_t sent() const           {return m_next;}
+        uint32_t received() const       {return m_received;}
+        uint64_t receivedBytes() const  {return m_bytes;}
+
+    protected:
+        const Session &     m_session;
+        bool                m_fast;
+        CHistogram &        m_latency;
+        volatile uint64_t   m_start;
+        volatile uint32_t   m_next,
+                            m_received;
+        volatile uint64_t   m_bytes;
+        uint64_t            m_sent;
+        bool                m_awaiting;
+    };
+
+    /* CReplayPeer
+     * The client's authentication method and notifications.
+     */
+    class CReplayPeer : public INotify, public IAuthenticate
+    {
+    public:
+        CReplayPeer() : m_sent( false ) {}
+
+        void OnConnectSuccess(CClientTransport *)   {}
+        void OnConnectFailure(CClientTransport *)   {}
+        void OnCloseEvent(CClientTransport *)       {}
+
+        std::string getAuthServiceName()            {return BENCH_AUTH_SERVICE;}
+        bool authIsDataAvailable()                  {return !m_sent;}
+        int authWritePacket(byte *, size_t)         {return sshd_OK;}
+
+        int authReadPacket(byte * dst, size_t, size_t * count) {
+            dst[0]  = BENCH_AUTH_MESSAGE;
+            *count  = 1;
+            m_sent  = true;
+            return sshd_OK;
+        }
+
+    protected:
+        bool m_sent;
+    };
+
+    /* WriteLatency
+     * Adds the percentiles of a histogram in milliseconds.
+     */
+    void WriteLatency(CBenchOutput & out, const char * prefix, const CHistogram & h)
+    {
+        string name = prefix;
+
+        if( !h.GetCount() )
+            return;
+        out.field( (name + "_p50_ms").c_str(), h.quantile( 0.50 ) / 1e6 );
+        out.field( (name + "_p90_ms").c_str(), h.quantile( 0.90 ) / 1e6 );
+        out.field( (name + "_p99_ms").c_str(), h.quantile( 0.99 ) / 1e6 );
+    }
+
+    /* Replay
+     * Replays one session, returns false if it failed.
+     */
+    bool Replay(CBenchOutput & out, sshd & server, const char * path, bool fast)
+    {
+        CHistogram recorded( "recorded", "Reply latency in the recording." );
+        CHistogram latency( "replayed", "Reply latency of the replay." );
+        Session session;
+
+        out.begin( "session" );
+        out.field( "file", path );
+        out.field( "mode", fast ? "fast" : "recorded" );
+
+        if( !LoadSession( path, session, recorded ) ) {
+            out.field( "error", "not a session file" );
+            out.end();
+            return false;
+        }
+        out.field( "service", session.service );
+        out.field( "inputs", (uint64_t) session.inputs.size() );
+        out.field( "outputs", (uint64_t) session.outputs );
+        out.field( "recorded_seconds", session.duration / 1e6 );
+
+        CSettings settings;
+        CReplayPeer peer;
+        CReplayService * service = new CReplayService( session, fast, latency );
+        CClientTransport * client = new CClientTransport( settings, &peer, &peer );
+        CMemoryNetwork * a, * b;
+        const char * error = NULL;
+
+        client->setService( service );
+        if( !client->init() || !CMemoryNetwork::CreatePair( &a, &b ) || !server.attach( a ) ||
+            client->connect( (INetwork *) b ) != sshd_OK )
+        {
+            error = "connection failed";
+        }
+
+        for(int t = 0; !error && client->getStatus() != sshd_STATUS_CONNECTED; t++) {
+            if( client->getStatus() == sshd_STATUS_FAILURE || t >= REPLAY_CONNECT_TIMEOUT )
+                error = "service not accepted";
+            Pause( 1 );
+        }
+
+        uint64_t start = GetMonotonicTime(), elapsed = 0;
+        if( !error )
+        {
+            service->start();
+
+            /* done once all inputs are sent and the replies are back */
+            uint32_t progress = 0;
+            for(int idle = 0; ; idle++)
+            {
+                if( service->sent() == session.inputs.size() && service->received() >= session.outputs ) {
+                    elapsed = GetMonotonicTime() - start;
+                    break;
+                }
+                if( client->getStatus() != sshd_STATUS_CONNECTED ) {
+                    error = "connection closed";
+                    break;
+                }
+                if( service->sent() + service->received() != progress ) {
+                    progress = service->sent() + service->received();
+                    idle = 0;
+                } else if( idle >= REPLAY_IDLE_TIMEOUT && (fast || service->sent() == session.inputs.size()) ) {
+                    /* at the recorded pace a long pause between inputs is fine */
+                    error = "replies missing";
+                    break;
+                }
+                Pause( 1 );
+            }
+        }
+
+        out.field( "received", (uint64_t) service->received() );
+        if( error ) {
+            out.field( "error", error );
+        } else {
+            double seconds = elapsed / 1e9;
+            out.field( "seconds", seconds );
+            if( seconds > 0 ) {
+                out.field( "packets_per_sec", (session.inputs.size() + service->received()) / seconds );
+                out.field( "mb_per_sec", (session.inputBytes + service->receivedBytes()) / seconds / (1024.0 * 1024.0) );
+            }
+            WriteLatency( out, "recorded", recorded );
+            WriteLatency( out, "reply", latency );
+        }
+        out.end();
+
+        client->shutdown();
+        client->wait();
+        delete client;  /* also deletes the service */
+        return error == NULL;
+    }
+};
+
+int main(int argc, char ** argv)
+{
+    const char * settingsFile = NULL;
+    vector<const char *> files;
+    bool fast = false;
+    int repeats = 1;
+
+    for(int i = 1; i < argc; i++) {
+        if( !strcmp( argv[i], "-f" ) )
+            fast = true;
+        else if( !strcmp( argv[i], "-n" ) && i + 1 < argc )
+            repeats = atoi( argv[++i] );
+        else if( !settingsFile )
+            settingsFile = argv[i];
+        else
+            files.push_back( argv[i] );
+    }
+    if( !settingsFile || files.empty() || repeats < 1 ) {
+        fprintf( stderr, "usage: %s <server settings> [-f] [-n repeats] <session files>\n", argv[0] );
+        return 1;
+    }
+
+    sshd server;
+    if( !server.init( settingsFile ) ) {
+        fprintf( stderr, "Failed to initialize the server.\n" );
+        return 1;
+    }
+    RegisterServices( server );
+
+    CBenchOutput out( "replay" );
+    int failed = 0;
+
+    for(int r = 0; r < repeats; r++)
+    for(size_t i = 0; i < files.size(); i++) {
+        if( !Replay( out, server, files[i], fast ) )
+            failed++;
+    }
+
+    CLogger::GetInstance().stop();
+    out.finish();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,87 @@
+/* services.cpp
+ * Implements the server services used by the benchmarks.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstring>
+#include <new>
+
+/* project includes */
+#include "services.h"
+#include "messages.h"
+#include "swap.h"
+
+using namespace ssh;
+
+namespace bench
+{
+    /* CreateAuthentication
+     * Factory of the authentication method.
+     */
+    static CAuthenticationService * CreateAuthentication(const std::string &, CTransport *, void *)
+    {
+        return new (std::nothrow) CBenchAuthentication;
+    }
+
+    /* CreateEcho
+     * Factory of the echo service.
+     */
+    static CService * CreateEcho(const std::string &, void *)
+    {
+        return new (std::nothrow) CEchoService;
+    }
+
+    /* RegisterServices
+     * Registers the services with the server.
+     */
+    void RegisterServices(sshd & server)
+    {
+        server.registerAuthService( CreateAuthentication, BENCH_AUTH_SERVICE, NULL );
+        server.registerService( CreateEcho, BENCH_ECHO_SERVICE, NULL );
+    }
+
+    /* WriteChannelData
+     * Writes a SSH_MSG_CHANNEL_DATA payload for channel 0, the data fills what remains of
+     * the size.
+     */
+    uint32_t WriteChannelData(byte * dst, uint32_t size, const byte * data)
+    {
+        uint32_t length = __htonl32( size - BENCH_DATA_HEADER );
+
+        dst[0] = SSH_MSG_CHANNEL_DATA;
+        memset( dst + 1, 0, 4 );
+        memcpy( dst + 5, &length, 4 );
+        memcpy( dst + BENCH_DATA_HEADER, data, size - BENCH_DATA_HEADER );
+        return size;
+    }
+
+    /* CEchoService::handle
+     * Keeps the packet until it has been sent back.
+     */
+    int CEchoService::handle(const byte * src, uint32_t size)
+    {
+        if( size > sizeof(m_buffer) )
+            return sshd_ERROR;
+
+        memcpy( m_buffer, src, size );
+        m_size      = size;
+        m_pending   = true;
+        return sshd_OK;
+    }
+
+    /* CEchoService::read
+     * Returns the last packet.
+     */
+    int CEchoService::read(uint8_t * dst, uint32_t size, uint32_t * len)
+    {
+        if( m_size > size )
+            return sshd_ERROR;
+
+        memcpy( dst, m_buffer, m_size );
+        *len        = m_size;
+        m_pending   = false;
+        return sshd_OK;
+    }
+};
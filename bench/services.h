@@ -0,0 +1,62 @@
+/* services.h
+ * Server services used by the benchmarks.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _BENCH_SERVICES_H_
+#define _BENCH_SERVICES_H_
+
+/* project includes */
+#include "sshd.h"
+#include "CAuthenticationService.h"
+
+#define BENCH_AUTH_SERVICE          "bench-auth"
+#define BENCH_ECHO_SERVICE          "bench-echo"
+#define BENCH_AUTH_MESSAGE          (60)            /* any method specific message authenticates */
+#define BENCH_DATA_HEADER           (9)             /* SSH_MSG_CHANNEL_DATA, channel and length */
+
+namespace bench
+{
+    /* CBenchAuthentication
+     * Server side authentication method that accepts the first message, so sessions can
+     * be set up without user accounts.
+     */
+    class CBenchAuthentication : public ssh::CAuthenticationService
+    {
+    public:
+        bool init(const ssh::CSettings &)                   {return true;}
+        int read(uint8_t *, uint32_t, uint32_t *)           {return sshd_ERROR;}
+        bool isDataAvailable(int)                           {return false;}
+        int handle(const byte *, uint32_t)                  {return sshd_CLIENT_AUTHENTICATED;}
+        std::string GetServiceName()                        {return BENCH_AUTH_SERVICE;}
+    };
+
+    /* CEchoService
+     * Server side service that sends each packet back unchanged.
+     */
+    class CEchoService : public ssh::CService
+    {
+    public:
+        CEchoService() : m_size( 0 ), m_pending( false ) {}
+
+        bool init(const ssh::CSettings &)                   {return true;}
+        bool isDataAvailable(int)                           {return m_pending;}
+        std::string GetServiceName()                        {return BENCH_ECHO_SERVICE;}
+        int handle(const byte *, uint32_t);
+        int read(uint8_t *, uint32_t, uint32_t *);
+
+    protected:
+        byte        m_buffer[SSHD_DEFAULT_MAX_PACKET_SIZE];     /* holds any payload */
+        uint32_t    m_size;
+        bool        m_pending;
+    };
+
+    /* registers the services with the server */
+    void RegisterServices(ssh::sshd &);
+
+    /* writes a SSH_MSG_CHANNEL_DATA payload of the given total size, returns the size */
+    uint32_t WriteChannelData(byte * dst, uint32_t size, const byte * data);
+};
+
+#endif
@@ -0,0 +1,373 @@
+/* stream_bench.cpp
+ * Microbenchmarks of the wire encoding.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/*
+ * Measures the nanoseconds and heap allocations per field of the CStream encoding and
+ * decoding functions on each kind of stream:
+ *
+ *      array           ArrayWriteStream and ArrayStream over a plain buffer
+ *      hash            CHashStream (sha1), write only, includes the digest update
+ *      transport       the packet buffer of CTransport, as used by the services
+ *
+ * Fields: int32, int64, a 32 character string, a 2048 bit BIGNUM and a SSH_MSG_KEXINIT
+ * with the default algorithm lists. Each batch starts on a fresh stream, reads decode
+ * fields encoded beforehand.
+ *
+ * Usage:
+ *      stream_bench [-t milliseconds per measurement]
+ *
+ * The results are written to stdout as JSON, the README describes how to compare them
+ * with a baseline run.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/* project includes */
+#include "bench.h"
+#include "CTransport.h"
+#include "CHashStream.h"
+#include "ArrayStream.h"
+#include "errors.h"
+#include "util.h"
+
+#define BENCH_DEFAULT_TIME          (200)           /* milliseconds per measurement */
+#define BENCH_BATCH                 (256)           /* fields per stream */
+#define BENCH_BUFFER_SIZE           (256 * 1024)
+#define BENCH_STRING_LENGTH         (32)
+#define BENCH_BIGINT_BITS           (2048)
+
+#define COUNT_OF(a)                 (sizeof(a) / sizeof(a[0]))
+
+using namespace std;
+using namespace ssh;
+using namespace bench;
+
+namespace
+{
+    /* Fixture
+     * The values written and the variables read into.
+     */
+    struct Fixture
+    {
+        uint32          u32;
+        uint64          u64;
+        std::string     text;
+        BIGNUM *        number;
+        KeyExchangeInfo kex;
+    };
+
+    typedef bool (*FieldFunction)(CStream &, Fixture &);
+
+    /* Field
+     * An encoded type.
+     */
+    struct Field
+    {
+        const char *    name;
+        FieldFunction   write,
+                        read;
+    };
+
+    bool WriteInt32(CStream & s, Fixture & f)   {return s.writeInt32( f.u32 );}
+    bool ReadInt32(CStream & s, Fixture & f)    {return s.readInt32( f.u32 );}
+    bool WriteInt64(CStream & s, Fixture & f)   {return s.writeInt64( f.u64 );}
+    bool ReadInt64(CStream & s, Fixture & f)    {return s.readInt64( f.u64 );}
+    bool WriteString(CStream & s, Fixture & f)  {return s.writeString( f.text );}
+    bool ReadString(CStream & s, Fixture & f)   {return s.readString( f.text );}
+    bool WriteBigInt(CStream & s, Fixture & f)  {return s.writeBigInt( f.number );}
+    bool WriteKex(CStream & s, Fixture & f)     {return s.writeKex( f.kex );}
+    bool ReadKex(CStream & s, Fixture & f)      {return s.readKex( f.kex );}
+
+    bool ReadBigInt(CStream & s, Fixture &)
+    {
+        BIGNUM * bn = NULL;
+        if( !s.readBigInt( &bn ) )
+            return false;
+        BN_free( bn );
+        return true;
+    }
+
+    const Field s_fields[] = {
+        {"int32",   WriteInt32,     ReadInt32},
+        {"int64",   WriteInt64,     ReadInt64},
+        {"string",  WriteString,    ReadString},
+        {"bigint",  WriteBigInt,    ReadBigInt},
+        {"kexinit", WriteKex,       ReadKex}
+    };
+
+    /* CTarget
+     * A kind of stream. writer returns an empty stream, reader a stream positioned at the
+     * start of the data.
+     */
+    class CTarget
+    {
+    public:
+        virtual ~CTarget() {}
+
+        virtual const char * name() const                   = 0;
+        virtual uint32_t capacity()                         = 0;    /* bytes a batch may use */
+        virtual bool readable() const                       {return true;}
+        virtual CStream * writer()                          = 0;
+        virtual CStream * reader(const byte *, uint32_t)    {return NULL;}
+    };
+
+    /* CArrayTarget
+     * ArrayWriteStream and ArrayStream.
+     */
+    class CArrayTarget : public CTarget
+    {
+    public:
+        CArrayTarget() : m_writer( m_buffer, sizeof(m_buffer) ), m_reader( m_buffer, 0 ) {}
+
+        const char * name() const   {return "array";}
+        uint32_t capacity()         {return sizeof(m_buffer);}
+
+        CStream * writer() {
+            m_writer = ArrayWriteStream( m_buffer, sizeof(m_buffer) );
+            return &m_writer;
+        }
+        CStream * reader(const byte * data, uint32_t size) {
+            m_reader = ArrayStream( data, size );
+            return &m_reader;
+        }
+
+    protected:
+        byte                m_buffer[BENCH_BUFFER_SIZE];
+        ArrayWriteStream    m_writer;
+        ArrayStream         m_reader;
+    };
+
+    /* CHashTarget
+     * CHashStream, the digest is never finalized.
+     */
+    class CHashTarget : public CTarget
+    {
+    public:
+        CHashTarget() : m_hash( "sha1" ) {}
+
+        bool init() {
+            if( !m_hash )
+                return false;   /* no such hash */
+            return true;
+        }
+        const char * name() const   {return "hash";}
+        bool readable() const       {return false;}
+        uint32_t capacity()         {return BENCH_BUFFER_SIZE;}
+
+        CStream * writer() {
+            m_hash.reset();
+            return &m_hash;
+        }
+
+    protected:
+        CHashStream m_hash;
+    };
+
+    /* CBenchTransport
+     * A transport that is never connected, only its packet buffers are used.
+     */
+    class CBenchTransport : public CTransport
+    {
+    public:
+        CBenchTransport(const CSettings & settings) : CTransport( settings, NULL ) {}
+        ~CBenchTransport() {
+            readState.pPayload      = NULL;
+            readState.payloadSize   = 0;
+        }
+
+        bool isServer()                                     {return true;}
+        const KeyExchangeInfo & getServerKex()              {return m_localKex;}
+        const KeyExchangeInfo & getClientKex()              {return m_remoteKex;}
+        const std::string & getServerProtocolString()       {return m_remoteVersion;}
+        const std::string & getClientProtocolString()       {return m_remoteVersion;}
+        void Task() {}
+
+        /* makes the data the payload of the received packet */
+        void setInput(const byte * data, uint32_t size) {
+            readState.pPayload      = const_cast<byte *>( data );
+            readState.payloadSize   = size;
+            m_readPos               = 0;
+        }
+
+    protected:
+        int establishConnection()                           {return sshd_ERROR;}
+        CHostKey * acquireHostKey(const std::string &)      {return NULL;}
+        void InitializeKeys(const SecurityBlock &, const KeyVector &) {}
+        void TakeAlgorithmsInUse(SecurityBlock &, bool)     {}
+        int handlePacket()                                  {return sshd_ERROR;}
+    };
+
+    /* CTransportTarget
+     * The packet buffer of a transport, a batch is limited to one packet.
+     */
+    class CTransportTarget : public CTarget
+    {
+    public:
+        CTransportTarget() : m_transport( m_settings ) {}
+
+        bool init()                 {return m_transport.init();}
+        const char * name() const   {return "transport";}
+        uint32_t capacity()         {return m_transport.getMaxPayload();}
+
+        CStream * writer() {
+            return m_transport.newPacket() ? &m_transport : NULL;
+        }
+        CStream * reader(const byte * data, uint32_t size) {
+            m_transport.setInput( data, size );
+            return &m_transport;
+        }
+
+    protected:
+        CSettings       m_settings;
+        CBenchTransport m_transport;
+    };
+
+    /* InitFixture
+     * Creates the values to encode.
+     */
+    bool InitFixture(Fixture & f)
+    {
+        f.u32   = 0x12345678;
+        f.u64   = 0x0123456789ABCDEFULL;
+        f.text.assign( BENCH_STRING_LENGTH, 'x' );
+
+        f.number = BN_new();
+        if( !f.number || !BN_rand( f.number, BENCH_BIGINT_BITS, 0, 0 ) )
+            return false;
+
+        memset( f.kex.cookie, 0xA5, sizeof(f.kex.cookie) );
+        f.kex.algorithms[KEYEXCHANGE_METHOD]            = "diffie-hellman-group14-sha1,diffie-hellman-group1-sha1";
+        f.kex.algorithms[SERVER_HOSTKEY]                = "ssh-ed25519,ecdsa-sha2-nistp256,ssh-rsa";
+        f.kex.algorithms[ENCRYPTION_CLIENT_TO_SERVER]   = "aes256-cbc,aes128-cbc";
+        f.kex.algorithms[ENCRYPTION_SERVER_TO_CLIENT]   = "aes256-cbc,aes128-cbc";
+        f.kex.algorithms[MAC_CLIENT_TO_SERVER]          = "hmac-sha1";
+        f.kex.algorithms[MAC_SERVER_TO_CLIENT]          = "hmac-sha1";
+        f.kex.algorithms[COMPRESSION_CLIENT_TO_SERVER]  = "none";
+        f.kex.algorithms[COMPRESSION_SERVER_TO_CLIENT]  = "none";
+        f.kex.follows = 0;
+        return true;
+    }
+
+    /* Measure
+     * Runs batches of one field until the time is up. Returns the nanoseconds per field, or
+     * a negative value if the stream fails.
+     */
+    double Measure(CTarget & target, const Field & field, bool read, Fixture & f, uint32_t ms,
+                   uint32_t * encodedSize, double * allocationsPerField)
+    {
+        static byte encoded[BENCH_BUFFER_SIZE];
+        uint32_t size, batch, length = 0;
+
+        /* the size of one encoded field decides the batch size */
+        ArrayWriteStream probe( encoded, sizeof(encoded) );
+        if( !field.write( probe, f ) || !(size = probe.GetUsage()) )
+            return -1;
+
+        batch = target.capacity() / size;
+        if( batch > BENCH_BATCH )
+            batch = BENCH_BATCH;
+        if( !batch )
+            return -1;
+
+        if( read ) {
+            ArrayWriteStream input( encoded, sizeof(encoded) );
+            for(uint32_t i = 0; i < batch; i++) {
+                if( !field.write( input, f ) )
+                    return -1;
+            }
+            length = input.GetUsage();
+        }
+
+        uint64_t fields = 0, elapsed = 0, allocations = 0;
+        uint64_t limit = (uint64_t) ms * 1000000ULL;
+
+        /* the first round warms up the caches and is not counted */
+        for(int round = 0; elapsed < limit; round++)
+        {
+            uint64_t a = Allocations(), start = GetMonotonicTime();
+
+            CStream * s = read ? target.reader( encoded, length ) : target.writer();
+            if( !s )
+                return -1;
+
+            for(uint32_t i = 0; i < batch; i++) {
+                if( !(read ? field.read : field.write)( *s, f ) )
+                    return -1;
+            }
+
+            if( round ) {
+                elapsed     += GetMonotonicTime() - start;
+                allocations += Allocations() - a;
+                fields      += batch;
+            }
+        }
+
+        *encodedSize            = size;
+        *allocationsPerField    = (double) allocations / fields;
+        return (double) elapsed / fields;
+    }
+};
+
+int main(int argc, char ** argv)
+{
+    uint32_t ms = BENCH_DEFAULT_TIME;
+    Fixture fixture;
+
+    if( argc == 3 && !strcmp( argv[1], "-t" ) ) {
+        ms = (uint32_t) atoi( argv[2] );
+    } else if( argc != 1 ) {
+        fprintf( stderr, "usage: %s [-t milliseconds per measurement]\n", argv[0] );
+        return 1;
+    }
+
+    static CArrayTarget array;      /* holds a large buffer */
+    CHashTarget hash;
+    CTransportTarget transport;
+
+    if( !InitFixture( fixture ) || !hash.init() || !transport.init() ) {
+        fprintf( stderr, "Failed to initialize.\n" );
+        return 1;
+    }
+
+    CTarget * targets[] = {&array, &hash, &transport};
+    CBenchOutput out( "stream" );
+
+    for(size_t t = 0; t < COUNT_OF(targets); t++)
+    for(size_t i = 0; i < COUNT_OF(s_fields); i++)
+    for(int read = 0; read < 2; read++)
+    {
+        uint32_t size;
+        double allocations, ns;
+
+        if( read && !targets[t]->readable() )
+            continue;   /* write only */
+
+        ns = Measure( *targets[t], s_fields[i], read != 0, fixture, ms, &size, &allocations );
+
+        out.begin( "field" );
+        out.field( "stream", targets[t]->name() );
+        out.field( "field", s_fields[i].name );
+        out.field( "op", read ? "read" : "write" );
+        if( ns < 0 ) {
+            out.field( "error", "stream failed" );
+        } else {
+            out.field( "bytes", (uint64_t) size );
+            out.field( "ns_per_field", ns );
+            out.field( "allocations_per_field", allocations );
+        }
+        out.end();
+    }
+
+    out.finish();
+
+    BN_free( fixture.number );
+    return 0;
+}
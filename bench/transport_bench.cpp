@@ -0,0 +1,482 @@
+/* transport_bench.cpp
+ * Handshake and bulk throughput of the transport layer.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/*
+ * Runs a server and clients in one process, either over an in-memory pipe (CMemoryNetwork)
+ * or over loopback TCP, and measures
+ *
+ *      - full handshakes per second for each keyexchange and host key algorithm, from the
+ *        start of the connection until both SSH_MSG_NEWKEYS have been exchanged,
+ *      - packets per second and MB/s for each cipher and mac at 64 byte, 1 KB and 32 KB
+ *        payloads (the last one is limited to the largest payload the transport sends).
+ *
+ * The bulk data are SSH_MSG_IGNORE packets sent by the client while the server waits for
+ * the authentication, the server decrypts, verifies and discards them. A run ends when the
+ * server has counted all of them. Allocations are counted through the global operator new
+ * of the process and include both ends.
+ *
+ * With -w both ends of the memory pipe are wrapped in a CWanNetwork, e.g.
+ * -w delay=50,jitter=5,bandwidth=1250000 emulates a 100 ms round trip over 10 Mbit/s. The
+ * handshakes then also report the round trips the client waited for.
+ *
+ * Usage:
+ *      transport_bench <server settings> [-n handshakes] [-m megabytes] [-p packets] [-t mem|tcp|both]
+ *                      [-w wan settings]
+ *
+ * The results are written to stdout as JSON.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/* project includes */
+#include "bench.h"
+#include "sshd.h"
+#include "CClientTransport.h"
+#include "CMemoryNetwork.h"
+#include "CStats.h"
+#include "CWanNetwork.h"
+#include "messages.h"
+#include "swap.h"
+#include "util.h"
+
+#define BENCH_SERVER_ADDRESS        "127.0.0.1"
+#define BENCH_SERVER_PORT           "1337"          /* the port sshd listens to */
+#define BENCH_CONNECT_TIMEOUT       (30000)         /* milliseconds */
+#define BENCH_TRANSFER_TIMEOUT      (120000)        /* milliseconds */
+#define BENCH_DEFAULT_HANDSHAKES    (50)
+#define BENCH_DEFAULT_MEGABYTES     (64)
+#define BENCH_DEFAULT_PACKETS       (200000)
+#define BENCH_IGNORE_HEADER         (5)             /* message type and string length */
+
+#define COUNT_OF(a)                 (sizeof(a) / sizeof(a[0]))
+
+using namespace std;
+using namespace ssh;
+using namespace bench;
+
+namespace
+{
+    const char * s_keyexchanges[]   = {"diffie-hellman-group1-sha1", "diffie-hellman-group14-sha1"};
+    const char * s_hostkeys[]       = {"ssh-ed25519", "ecdsa-sha2-nistp256", "ssh-rsa"};
+    const char * s_ciphers[]        = {"aes128-cbc", "aes256-cbc"};
+    const char * s_hmacs[]          = {"hmac-sha1"};
+    const uint32_t s_payloads[]     = {64, 1024, 32768};
+
+    enum {
+        PEER_PENDING = 0,
+        PEER_CONNECTED,
+        PEER_FAILED,
+        PEER_CLOSED
+    };
+
+    /* CBenchPeer
+     * The application side of a benchmark client. It records when the connection is
+     * established and, in place of an authentication method, produces the SSH_MSG_IGNORE
+     * packets of a bulk transfer.
+     */
+    class CBenchPeer : public INotify, public IAuthenticate
+    {
+    public:
+        CBenchPeer() {
+            m_status        = PEER_PENDING;
+            m_connected     = 0;
+            m_remaining     = 0;
+            m_payload       = 0;
+            m_wan           = NULL;
+            m_roundTrips    = 0;
+        }
+
+        /* INotify */
+        void OnConnectSuccess(CClientTransport *) {
+            m_connected = GetMonotonicTime();
+            if( m_wan )
+                m_roundTrips = m_wan->getRoundTrips();
+            m_status    = PEER_CONNECTED;
+        }
+        void OnConnectFailure(CClientTransport *)   {m_status = PEER_FAILED;}
+        void OnCloseEvent(CClientTransport *)       {m_status = PEER_CLOSED;}
+
+        /* IAuthenticate */
+        std::string getAuthServiceName()            {return "ssh-userauth";}
+        bool authIsDataAvailable()                  {return m_remaining > 0;}
+        int authWritePacket(byte *, size_t)         {return sshd_OK;}
+
+        int authReadPacket(byte * dst, size_t size, size_t * count)
+        {
+            size_t n = m_payload < size ? m_payload : size;
+            uint32_t length = __htonl32( (uint32_t) (n - BENCH_IGNORE_HEADER) );
+
+            dst[0] = SSH_MSG_IGNORE;
+            memcpy( dst + 1, &length, sizeof(length) );
+            memcpy( dst + BENCH_IGNORE_HEADER, &m_data[0], n - BENCH_IGNORE_HEADER );
+
+            *count = n;
+            m_remaining--;
+            return sshd_OK;
+        }
+
+        /* starts sending packets with the given payload size */
+        void send(uint32_t payload, uint32_t packets) {
+            m_data.assign( payload, 0x5A );
+            m_payload   = payload;
+            m_remaining = packets;      /* picked up by the connection's thread */
+        }
+
+        /* waits while the connection is pending */
+        int waitConnected(int timeout) {
+            for(int t = 0; m_status == PEER_PENDING && t < timeout; t++)
+                Pause( 1 );
+            return m_status;
+        }
+
+        volatile int        m_status;
+        volatile uint64_t   m_connected;
+        CWanNetwork *       m_wan;          /* the client end, when emulating a WAN link */
+        uint32_t            m_roundTrips;   /* round trips until the handshake was done */
+
+    protected:
+        volatile uint32_t   m_remaining;
+        uint32_t            m_payload;
+        std::vector<byte>   m_data;
+    };
+
+    /* Options
+     * The command line options.
+     */
+    struct Options
+    {
+        const char *    settings;
+        uint32_t        handshakes;
+        uint32_t        megabytes;
+        uint32_t        packets;
+        bool            memory,
+                        tcp,
+                        wan;
+        WanSettings     wanSettings;
+        const char *    wanArgument;
+    };
+
+    /* ClientSettings
+     * Settings that make the client choose the given algorithms, the server offers all of
+     * the algorithms it supports.
+     */
+    void ClientSettings(CSettings & settings, const char * kex, const char * hostkey, const char * cipher, const char * hmac)
+    {
+        settings.StoreString( SSHD_SETTING_PREFERRED_KEYEXCHANGE, kex );
+        settings.StoreString( SSHD_SETTING_PREFERRED_HOSTKEY, hostkey );
+        settings.StoreString( SSHD_SETTING_PREFERRED_CIPHER, cipher );
+        settings.StoreString( SSHD_SETTING_PREFERRED_HMAC, hmac );
+    }
+
+    /* Connect
+     * Starts a client connection over the memory pipe or loopback TCP and waits until it is
+     * established. The memory pipe is wrapped in the WAN emulation if wan is given. Returns
+     * the client, or NULL on failure.
+     */
+    CClientTransport * Connect(sshd & server, const CSettings & settings, CBenchPeer & peer, bool memory,
+                               const WanSettings * wan)
+    {
+        CClientTransport * client = new (std::nothrow) CClientTransport( settings, &peer, &peer );
+        int res;
+
+        if( !client )
+            return NULL;
+        if( !client->init() ) {
+            delete client;
+            return NULL;
+        }
+
+        if( memory )
+        {
+            CMemoryNetwork * a, * b;
+            if( !CMemoryNetwork::CreatePair( &a, &b ) ) {
+                delete client;
+                return NULL;
+            }
+
+            INetwork * serverEnd = a, * clientEnd = b;
+            if( wan ) {
+                /* each end delays what it sends, with a sequence of its own */
+                CWanNetwork * wanServer = new (std::nothrow) CWanNetwork( a, *wan, 1 );
+                CWanNetwork * wanClient = new (std::nothrow) CWanNetwork( b, *wan, 2 );
+                if( !wanServer || !wanClient || !wanServer->init() || !wanClient->init() ) {
+                    if( wanServer ) delete wanServer; else delete a;
+                    if( wanClient ) delete wanClient; else delete b;
+                    delete client;
+                    return NULL;
+                }
+                serverEnd = wanServer;
+                clientEnd = peer.m_wan = wanClient;
+            }
+
+            if( !server.attach( serverEnd ) ) {     /* takes ownership of the server end */
+                delete clientEnd;
+                delete client;
+                return NULL;
+            }
+            res = client->connect( clientEnd );
+        } else {
+            res = client->connect( BENCH_SERVER_ADDRESS, BENCH_SERVER_PORT );
+        }
+
+        if( res != sshd_OK || peer.waitConnected( BENCH_CONNECT_TIMEOUT ) != PEER_CONNECTED ) {
+            client->shutdown();
+            client->wait();
+            delete client;
+            return NULL;
+        }
+        return client;
+    }
+
+    /* Close
+     * Closes a client connection.
+     */
+    void Close(CClientTransport * client)
+    {
+        client->shutdown();
+        client->wait();
+        delete client;      /* also closes the stream */
+    }
+
+    /* BenchHandshakes
+     * Measures full handshakes for each keyexchange and host key.
+     */
+    void BenchHandshakes(CBenchOutput & out, sshd & server, const Options & options, bool memory)
+    {
+        const WanSettings * wan = memory && options.wan ? &options.wanSettings : NULL;
+
+        for(size_t k = 0; k < COUNT_OF(s_keyexchanges); k++)
+        for(size_t h = 0; h < COUNT_OF(s_hostkeys); h++)
+        {
+            CSettings settings;
+            ClientSettings( settings, s_keyexchanges[k], s_hostkeys[h], s_ciphers[0], s_hmacs[0] );
+
+            uint64_t total = 0, fastest = 0, allocations = Allocations(), roundTrips = 0;
+            uint32_t done = 0;
+
+            for(; done < options.handshakes; done++)
+            {
+                CBenchPeer peer;
+                uint64_t start = GetMonotonicTime();
+
+                CClientTransport * client = Connect( server, settings, peer, memory, wan );
+                if( !client )
+                    break;
+
+                uint64_t elapsed = peer.m_connected - start;
+                roundTrips += peer.m_roundTrips;
+                total += elapsed;
+                if( !fastest || elapsed < fastest )
+                    fastest = elapsed;
+
+                Close( client );
+            }
+            allocations = Allocations() - allocations;
+
+            out.begin( "handshake" );
+            out.field( "transport", memory ? "memory" : "tcp" );
+            out.field( "kex", s_keyexchanges[k] );
+            out.field( "hostkey", s_hostkeys[h] );
+            if( wan )
+                out.field( "wan", options.wanArgument );
+            out.field( "handshakes", (uint64_t) done );
+            if( done < options.handshakes ) {
+                out.field( "error", "handshake failed" );
+            } else if( done ) {
+                out.field( "handshakes_per_sec", done * 1e9 / total );
+                out.field( "mean_ms", total / 1e6 / done );
+                out.field( "min_ms", fastest / 1e6 );
+                out.field( "allocations_per_handshake", (double) allocations / done );
+                if( wan )
+                    out.field( "round_trips", (double) roundTrips / done );
+            }
+            out.end();
+        }
+    }
+
+    /* BenchTransfer
+     * Sends packets of one size over an established connection, returns false if the
+     * transfer failed or timed out.
+     */
+    bool BenchTransfer(CBenchPeer & peer, uint32_t payload, uint32_t packets, uint64_t * elapsed, uint64_t * allocations)
+    {
+        StatsCounters before, now;
+
+        CStats::GetInstance().snapshot( before );
+        *allocations = Allocations();
+        uint64_t start = GetMonotonicTime();
+
+        peer.send( payload, packets );
+
+        /* the server counts the packets as it reads them */
+        for(int t = 0; t < BENCH_TRANSFER_TIMEOUT; t++)
+        {
+            CStats::GetInstance().snapshot( now );
+            if( now.packetsIn - before.packetsIn >= packets ) {
+                *elapsed        = GetMonotonicTime() - start;
+                *allocations    = Allocations() - *allocations;
+                return true;
+            }
+            if( peer.m_status != PEER_CONNECTED )
+                return false;
+            Pause( 1 );
+        }
+        return false;
+    }
+
+    /* BenchBulk
+     * Measures the packet rate and throughput for each cipher and mac.
+     */
+    void BenchBulk(CBenchOutput & out, sshd & server, const Options & options, bool memory)
+    {
+        const WanSettings * wan = memory && options.wan ? &options.wanSettings : NULL;
+
+        for(size_t c = 0; c < COUNT_OF(s_ciphers); c++)
+        for(size_t m = 0; m < COUNT_OF(s_hmacs); m++)
+        for(size_t p = 0; p < COUNT_OF(s_payloads); p++)
+        {
+            CSettings settings;
+            ClientSettings( settings, s_keyexchanges[0], s_hostkeys[COUNT_OF(s_hostkeys) - 1], s_ciphers[c], s_hmacs[m] );
+
+            /* the largest payload the transport sends without large packets */
+            uint32_t payload = s_payloads[p];
+            if( payload > MAX_SSH_PAYLOAD )
+                payload = MAX_SSH_PAYLOAD;
+
+            uint64_t bytes = (uint64_t) options.megabytes << 20;
+            uint32_t packets = (uint32_t) (bytes / payload);
+            if( packets > options.packets )
+                packets = options.packets;
+            if( !packets )
+                packets = 1;
+
+            out.begin( "bulk" );
+            out.field( "transport", memory ? "memory" : "tcp" );
+            out.field( "cipher", s_ciphers[c] );
+            out.field( "mac", s_hmacs[m] );
+            if( wan )
+                out.field( "wan", options.wanArgument );
+            out.field( "payload", (uint64_t) payload );
+            out.field( "packets", (uint64_t) packets );
+
+            CBenchPeer peer;
+            uint64_t elapsed, allocations;
+
+            CClientTransport * client = Connect( server, settings, peer, memory, wan );
+            if( !client ) {
+                out.field( "error", "connection failed" );
+            } else {
+                if( BenchTransfer( peer, payload, packets, &elapsed, &allocations ) ) {
+                    double seconds = elapsed / 1e9;
+                    out.field( "seconds", seconds );
+                    out.field( "packets_per_sec", packets / seconds );
+                    out.field( "mb_per_sec", (double) packets * payload / seconds / (1024.0 * 1024.0) );
+                    out.field( "allocations_per_packet", (double) allocations / packets );
+                } else {
+                    out.field( "error", "transfer failed" );
+                }
+                Close( client );
+            }
+            out.end();
+        }
+    }
+
+    /* ParseOptions
+     * Parses the command line, returns false on error.
+     */
+    bool ParseOptions(int argc, char ** argv, Options & options)
+    {
+        options.settings    = NULL;
+        options.handshakes  = BENCH_DEFAULT_HANDSHAKES;
+        options.megabytes   = BENCH_DEFAULT_MEGABYTES;
+        options.packets     = BENCH_DEFAULT_PACKETS;
+        options.memory      = true;
+        options.tcp         = true;
+        options.wan         = false;
+        options.wanArgument = NULL;
+
+        for(int i = 1; i < argc; i++)
+        {
+            if( argv[i][0] != '-' ) {
+                options.settings = argv[i];
+                continue;
+            }
+            if( i + 1 >= argc )
+                return false;
+
+            const char * value = argv[++i];
+            switch( argv[i - 1][1] )
+            {
+            case 'n': options.handshakes    = (uint32_t) atoi( value ); break;
+            case 'm': options.megabytes     = (uint32_t) atoi( value ); break;
+            case 'p': options.packets       = (uint32_t) atoi( value ); break;
+            case 't':
+                options.memory  = !strcmp( value, "mem" ) || !strcmp( value, "both" );
+                options.tcp     = !strcmp( value, "tcp" ) || !strcmp( value, "both" );
+                break;
+            case 'w':
+                if( !WanSettings::Parse( value, options.wanSettings ) )
+                    return false;
+                options.wan         = true;
+                options.wanArgument = value;
+                break;
+            default:
+                return false;
+            }
+        }
+        return options.settings && (options.memory || options.tcp);
+    }
+};
+
+int main(int argc, char ** argv)
+{
+    Options options;
+
+    if( !ParseOptions( argc, argv, options ) ) {
+        fprintf( stderr, "usage: %s <server settings> [-n handshakes] [-m megabytes] [-p packets] [-t mem|tcp|both]\n"
+                         "       [-w delay=ms,jitter=ms,bandwidth=bytes/s,stall=percent:ms,buffer=bytes]\n", argv[0] );
+        return 1;
+    }
+    if( options.wan && options.tcp )
+        fprintf( stderr, "The WAN emulation only applies to the memory transport.\n" );
+
+    sshd server;
+    if( !server.init( options.settings ) ) {
+        fprintf( stderr, "Failed to initialize the server.\n" );
+        return 1;
+    }
+
+    CBenchOutput out( "transport" );
+
+    /* the memory pipes are attached directly, the accept loop must not run meanwhile */
+    if( options.memory ) {
+        BenchHandshakes( out, server, options, true );
+        BenchBulk( out, server, options, true );
+    }
+
+    if( options.tcp )
+    {
+        if( !server.spawn() ) {
+            fprintf( stderr, "Failed to start the server.\n" );
+            return 1;
+        }
+        BenchHandshakes( out, server, options, false );
+        BenchBulk( out, server, options, false );
+
+        server.shutdown();
+        server.wait();      /* also stops the log writer */
+    } else {
+        CLogger::GetInstance().stop();
+    }
+
+    out.finish();
+    return 0;
+}
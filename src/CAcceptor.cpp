@@ -0,0 +1,174 @@
+/* CAcceptor.cpp
+ * Implements the accept loop.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <new>
+
+/* project includes */
+#include "CAcceptor.h"
+#include "CStats.h"
+#include "sshd.h"
+
+#if defined(WIN32) || defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <time.h>
+#endif
+
+using namespace std;
+
+namespace ssh
+{
+    /* SleepFor
+     * Suspends the calling thread for a number of milliseconds.
+     */
+    static void SleepFor(int ms)
+    {
+#if defined(WIN32) || defined(_WIN32)
+        Sleep( ms );
+#else
+        struct timespec ts;
+        ts.tv_sec  = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000L;
+        nanosleep( &ts, NULL );
+#endif
+    }
+
+    /* OpenReserve
+     * Opens the descriptor that is held back for rejecting connections, -1 on failure.
+     */
+    static int OpenReserve()
+    {
+#if defined(WIN32) || defined(_WIN32)
+        return -1;      /* no per process descriptor limit */
+#else
+        return open( "/dev/null", O_RDONLY | O_CLOEXEC );
+#endif
+    }
+
+    /* CAcceptor::CAcceptor
+     * Constructor.
+     */
+    CAcceptor::CAcceptor(sshd * server)
+    {
+        m_server    = server;
+        m_reserve   = OpenReserve();
+        m_exhausted = false;
+    }
+
+    /* CAcceptor::~CAcceptor
+     * Destructor, closes the listening sockets.
+     */
+    CAcceptor::~CAcceptor()
+    {
+        for(vector<CNetwork *>::iterator it = m_listeners.begin(); it != m_listeners.end(); it++)
+            delete *it;
+#if !defined(WIN32) && !defined(_WIN32)
+        if( m_reserve >= 0 )
+            close( m_reserve );
+#endif
+    }
+
+    /* CAcceptor::listen
+     * Listens to each address.
+     */
+    bool CAcceptor::listen(const vector<string> & addresses, int backlog, bool reusePort)
+    {
+        for(vector<string>::const_iterator it = addresses.begin(); it != addresses.end(); it++)
+        {
+            CNetwork * net = new (std::nothrow) CNetwork();
+            if( !net )
+                return false;
+
+            m_listeners.push_back( net );
+            if( !net->listen( *it, backlog, reusePort ) )
+                return false;
+        }
+        return !m_listeners.empty();
+    }
+
+    /* CAcceptor::poll
+     * Waits for any of the sockets and accepts all the connections queued on the ready
+     * ones.
+     */
+    void CAcceptor::poll(int timeout)
+    {
+        fd_set rd;
+        timeval tv;
+        SOCKET last = 0;
+
+        FD_ZERO(&rd);
+        for(vector<CNetwork *>::iterator it = m_listeners.begin(); it != m_listeners.end(); it++) {
+            FD_SET((*it)->getSocket(), &rd);
+            if( (*it)->getSocket() > last )
+                last = (*it)->getSocket();
+        }
+
+        tv.tv_sec  = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        if( select((int) last + 1, &rd, NULL, NULL, &tv) <= 0 )
+            return;
+
+        for(vector<CNetwork *>::iterator it = m_listeners.begin(); it != m_listeners.end(); it++)
+        {
+            if( !FD_ISSET((*it)->getSocket(), &rd) )
+                continue;
+
+            /* a full batch means there may be more */
+            bool exhausted = false;
+            int count;
+            do {
+                m_accepted.clear();
+                count = (*it)->acceptConnections( m_accepted, ACCEPT_BATCH, &exhausted );
+                for(vector<CNetwork *>::iterator con = m_accepted.begin(); con != m_accepted.end(); con++)
+                    m_server->accept( *con );
+                if( count )
+                    m_exhausted = false;
+            } while( count == ACCEPT_BATCH );
+
+            if( exhausted ) {
+                shed( *it );
+                return;
+            }
+        }
+    }
+
+    /* CAcceptor::shed
+     * Out of descriptors the queued connections can't be accepted, but the socket stays
+     * readable. The reserve descriptor is closed to make room for accepting and closing
+     * them, so the clients are refused instead of left waiting, then the thread pauses to
+     * let connections end.
+     */
+    void CAcceptor::shed(CNetwork * listener)
+    {
+        if( !m_exhausted ) {
+            sshd_Log(sshd_EVENT_WARNING, "Out of file descriptors, rejecting connections.");
+            m_exhausted = true;
+        }
+
+#if !defined(WIN32) && !defined(_WIN32)
+        if( m_reserve >= 0 )
+        {
+            close( m_reserve );
+            for(int i = 0; i < ACCEPT_BATCH && listener->rejectConnection(); i++)
+                CStats::GetInstance().countRejected( STATS_REJECT_DESCRIPTORS );
+            m_reserve = OpenReserve();
+        }
+#endif
+        SleepFor( ACCEPT_BACKOFF );
+    }
+
+    /* CAcceptor::Task
+     * Accepts connections until shutdown.
+     */
+    void CAcceptor::Task()
+    {
+        while( !m_abortEvent.isSignaled() )
+            poll( ACCEPT_POLL_INTERVAL );
+    }
+};
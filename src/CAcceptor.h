@@ -0,0 +1,59 @@
+/* CAcceptor.h
+ * Accepts the connections of a set of listening sockets.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CACCEPTOR_H_
+#define _CACCEPTOR_H_
+
+/* C/C++ includes */
+#include <string>
+#include <vector>
+
+/* project includes */
+#include "CNetwork.h"
+#include "CThread.h"
+
+#define ACCEPT_POLL_INTERVAL        (250)       /* milliseconds between checks for shutdown */
+#define ACCEPT_BATCH                (64)        /* connections accepted from a socket at a time */
+#define ACCEPT_BACKOFF              (100)       /* milliseconds to pause when out of descriptors */
+
+namespace ssh
+{
+    class sshd;
+
+    /* CAcceptor
+     * Listens to each configured address and hands every connection it accepts to the
+     * server. A wakeup drains all the queued connections, not just the first one. With
+     * several accept threads each has its own SO_REUSEPORT sockets, so the kernel balances
+     * the connections over the threads instead of waking all of them. Out of descriptors
+     * the queued connections are rejected and the thread backs off, as the sockets would
+     * stay readable and be retried in a busy loop.
+     */
+    class CAcceptor : public Util::CThread
+    {
+    public:
+        CAcceptor(sshd * server);
+        ~CAcceptor();
+
+        /* creates the listening sockets, fails unless all of them could be created */
+        bool listen(const std::vector<std::string> & addresses, int backlog, bool reusePort);
+
+        /* waits up to timeout milliseconds and accepts what is queued */
+        void poll(int timeout);
+
+    protected:
+        void Task();
+        /* rejects what is queued on a listener while out of descriptors */
+        void shed(CNetwork *);
+
+        sshd *                      m_server;
+        std::vector<CNetwork *>     m_listeners;
+        std::vector<CNetwork *>     m_accepted;
+        int                         m_reserve;      /* a descriptor given up to reject connections, -1 if none */
+        bool                        m_exhausted;    /* ran out of descriptors, logged once */
+    };
+};
+
+#endif
@@ -0,0 +1,247 @@
+/* CAdmission.cpp
+ * Implements the admission control.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/* project includes */
+#include "CAdmission.h"
+#include "CLogger.h"
+#include "CStats.h"
+#include "util.h"
+
+using namespace std;
+
+namespace ssh
+{
+    /* CAdmission::CAdmission
+     * Constructor, the default limits apply until configure is called.
+     */
+    CAdmission::CAdmission()
+    {
+        m_start         = 10;
+        m_rate          = 30;
+        m_full          = 100;
+        m_sourceRate    = 0;
+        m_sourceBurst   = ADMISSION_DEFAULT_BURST;
+        m_startups      = 0;
+
+        m_overflow.tokens   = m_sourceBurst;
+        m_overflow.last     = 0;
+    }
+
+    /* CAdmission::configure
+     * Reads the limits. An invalid SSHD_SETTING_MAX_STARTUPS keeps the defaults, "0"
+     * removes the limit.
+     */
+    void CAdmission::configure(const CSettings & settings)
+    {
+        string startups = ADMISSION_DEFAULT_STARTUPS;
+        vector<string> parts;
+        int rate = 0, burst = ADMISSION_DEFAULT_BURST;
+
+        settings.GetString(SSHD_SETTING_MAX_STARTUPS, startups);
+        SplitString( startups, parts, ':' );
+
+        if( parts.size() == 1 ) {
+            /* a single number is a hard limit */
+            m_start = m_full = (uint32_t) atoi( parts[0].c_str() );
+            m_rate  = 100;
+        } else if( parts.size() == 3 && atoi( parts[1].c_str() ) <= 100 &&
+                   atoi( parts[0].c_str() ) <= atoi( parts[2].c_str() ) )
+        {
+            m_start = (uint32_t) atoi( parts[0].c_str() );
+            m_rate  = (uint32_t) atoi( parts[1].c_str() );
+            m_full  = (uint32_t) atoi( parts[2].c_str() );
+        } else {
+            sshd_Log(sshd_EVENT_WARNING, "Invalid SSHD_SETTING_MAX_STARTUPS, using the default.");
+        }
+
+        settings.GetValue(SSHD_SETTING_SOURCE_RATE, rate);
+        settings.GetValue(SSHD_SETTING_SOURCE_BURST, burst);
+        m_sourceRate    = rate > 0 ? rate / 60.0 : 0;
+        m_sourceBurst   = burst > 0 ? burst : 1;
+        m_overflow.tokens = m_sourceBurst;
+
+        if( !m_random.seed() )
+            sshd_Log(sshd_EVENT_WARNING, "Failed to seed the admission control, early drop disabled.");
+    }
+
+    /* CAdmission::admit
+     * Applies the limits to a new connection.
+     */
+    bool CAdmission::admit(const string & source, int * reason)
+    {
+        bool admitted = true;
+
+        m_lock.acquire();
+        if( m_full && m_startups >= m_full ) {
+            *reason  = STATS_REJECT_FULL;
+            admitted = false;
+        } else if( m_full && m_startups >= m_start && m_random.isSeeded() ) {
+            uint32_t p = m_rate + (100 - m_rate) * (m_startups - m_start) / (m_full - m_start);
+            uint32_t r;
+
+            m_random.generate( (byte *) &r, sizeof(r) );
+            if( r % 100 < p ) {
+                *reason  = STATS_REJECT_EARLY_DROP;
+                admitted = false;
+            }
+        }
+
+        /* a dropped connection does not use up the source's attempts */
+        if( admitted && m_sourceRate > 0 && !takeToken( source, GetMonotonicTime() ) ) {
+            *reason  = STATS_REJECT_SOURCE_RATE;
+            admitted = false;
+        }
+
+        if( admitted )
+            m_startups++;
+        m_lock.release();
+
+        return admitted;
+    }
+
+    /* CAdmission::release
+     * Ends a startup, called once the connection has authenticated or closed.
+     */
+    void CAdmission::release()
+    {
+        m_lock.acquire();
+        if( m_startups > 0 )
+            m_startups--;
+        m_lock.release();
+    }
+
+    /* CAdmission::refill
+     * Adds the attempts earned since the last refill.
+     */
+    void CAdmission::refill(Bucket & bucket, uint64_t now) const
+    {
+        bucket.tokens += (now - bucket.last) / 1e9 * m_sourceRate;
+        if( bucket.tokens > m_sourceBurst )
+            bucket.tokens = m_sourceBurst;
+        bucket.last = now;
+    }
+
+    /* CAdmission::take
+     * Takes an attempt from a bucket.
+     */
+    bool CAdmission::take(Bucket & bucket, uint64_t now) const
+    {
+        refill( bucket, now );
+        if( bucket.tokens < 1 )
+            return false;
+
+        bucket.tokens -= 1;
+        return true;
+    }
+
+    /* ParseGroup
+     * Parses a group of up to four hex digits of an IPv6 address.
+     */
+    static bool ParseGroup(const string & str, uint16_t & group)
+    {
+        if( str.empty() || str.size() > 4 )
+            return false;
+
+        group = 0;
+        for(size_t i = 0; i < str.size(); i++) {
+            char c = str[i];
+            int digit;
+            if( c >= '0' && c <= '9' )      digit = c - '0';
+            else if( c >= 'a' && c <= 'f' ) digit = c - 'a' + 10;
+            else if( c >= 'A' && c <= 'F' ) digit = c - 'A' + 10;
+            else                            return false;
+            group = (uint16_t) ((group << 4) | digit);
+        }
+        return true;
+    }
+
+    /* SourceKey
+     * Returns the bucket key of a numeric source address. An IPv6 address is cut to its
+     * /64 and one with an embedded IPv4 address, e.g. ::ffff:10.0.0.1, is the IPv4
+     * address. Anything else is its own key.
+     */
+    static string SourceKey(const string & source)
+    {
+        vector<string> head, tail;
+        uint16_t groups[8] = {0}, group;
+        char key[48];
+
+        if( source.find(':') == string::npos )
+            return source;
+
+        string addr = source.substr( 0, source.find('%') );     /* drop the zone */
+        if( addr.find('.') != string::npos )
+            return addr.substr( addr.rfind(':') + 1 );
+
+        /* split at the "::" that stands for the zero groups */
+        size_t gap = addr.find("::");
+        if( gap == string::npos ) {
+            SplitString( addr, head, ':' );
+        } else {
+            if( gap > 0 )
+                SplitString( addr.substr( 0, gap ), head, ':' );
+            if( gap + 2 < addr.size() )
+                SplitString( addr.substr( gap + 2 ), tail, ':' );
+        }
+
+        if( head.size() + tail.size() > (gap == string::npos ? 8U : 7U) ||
+            (gap == string::npos && head.size() != 8) )
+        {
+            return source;
+        }
+        for(size_t i = 0; i < head.size(); i++) {
+            if( !ParseGroup( head[i], groups[i] ) )
+                return source;
+        }
+        for(size_t i = 0; i < tail.size(); i++) {
+            if( !ParseGroup( tail[i], group ) )
+                return source;
+            groups[8 - tail.size() + i] = group;
+        }
+
+        sprintf( key, "%x:%x:%x:%x::/64", groups[0], groups[1], groups[2], groups[3] );
+        return key;
+    }
+
+    /* CAdmission::takeToken
+     * Takes an attempt from the source's bucket, called with the lock held.
+     */
+    bool CAdmission::takeToken(const string & source, uint64_t now)
+    {
+        string key = SourceKey( source );
+        map<string, Bucket>::iterator it = m_buckets.find( key );
+
+        if( it == m_buckets.end() )
+        {
+            if( m_buckets.size() >= ADMISSION_MAX_SOURCES )
+            {
+                /* forget the least recently seen source if it behaves, it has a full bucket */
+                map<string, Bucket>::iterator oldest = m_buckets.find( m_lru.back() );
+                refill( oldest->second, now );
+                if( oldest->second.tokens < m_sourceBurst )
+                    return take( m_overflow, now );
+
+                m_buckets.erase( oldest );
+                m_lru.pop_back();
+            }
+
+            m_lru.push_front( key );
+            Bucket bucket = {m_sourceBurst, now, m_lru.begin()};
+            it = m_buckets.insert( make_pair( key, bucket ) ).first;
+        }
+        else
+        {
+            m_lru.splice( m_lru.begin(), m_lru, it->second.lru );
+        }
+
+        return take( it->second, now );
+    }
+};
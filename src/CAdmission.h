@@ -0,0 +1,83 @@
+/* CAdmission.h
+ * Admission control for new connections.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CADMISSION_H_
+#define _CADMISSION_H_
+
+/* C/C++ includes */
+#include <list>
+#include <map>
+#include <string>
+
+/* project includes */
+#include "types.h"
+#include "Mutex.h"
+#include "CRandom.h"
+#include "CSettings.h"
+
+#define ADMISSION_DEFAULT_STARTUPS  "10:30:100"     /* start:rate:full, as sshd's MaxStartups */
+#define ADMISSION_DEFAULT_BURST     (10)            /* handshakes a source may start at once */
+#define ADMISSION_MAX_SOURCES       (16384)         /* source buckets kept */
+
+namespace ssh
+{
+    /* CAdmission
+     * Decides, before a thread or any crypto is spent on it, whether a new connection may
+     * start its handshake. A connection counts as a startup from admission until it has
+     * authenticated or closed.
+     *
+     *  - Up to start startups every connection is admitted, from there on each one is
+     *    dropped with a probability of rate percent, rising linearly to 100 at full.
+     *  - Each source address has a bucket of burst handshake attempts that refills at the
+     *    configured rate per minute. Disabled unless the rate is set. IPv6 sources are
+     *    grouped by their /64, as a single host usually has all of one.
+     *  - Once ADMISSION_MAX_SOURCES are tracked the least recently seen source is forgotten
+     *    if its bucket is full again, otherwise the new sources share a single bucket.
+     *
+     * Called by all the accept threads.
+     */
+    class CAdmission
+    {
+    public:
+        CAdmission();
+
+        /* reads SSHD_SETTING_MAX_STARTUPS, SOURCE_RATE and SOURCE_BURST */
+        void configure(const CSettings &);
+
+        /* returns true if the connection may start, it then holds a startup until
+           release, otherwise the STATS_REJECT_* reason is stored */
+        bool admit(const std::string & source, int * reason);
+        void release();
+
+        uint32_t getStartups() const    {return m_startups;}
+
+    protected:
+        /* a source address' handshake attempts */
+        struct Bucket {
+            double                              tokens;
+            uint64_t                            last;   /* monotonic time of the last refill */
+            std::list<std::string>::iterator    lru;    /* position in m_lru */
+        };
+
+        bool takeToken(const std::string & source, uint64_t now);
+        bool take(Bucket &, uint64_t now) const;
+        void refill(Bucket &, uint64_t now) const;
+
+        Util::Mutex                     m_lock;
+        uint32_t                        m_start,
+                                        m_rate,         /* percent */
+                                        m_full;         /* 0 if unlimited */
+        double                          m_sourceRate,   /* attempts per second, 0 if disabled */
+                                        m_sourceBurst;
+        volatile uint32_t               m_startups;
+        std::map<std::string, Bucket>   m_buckets;
+        std::list<std::string>          m_lru;          /* the sources, most recently seen first */
+        Bucket                          m_overflow;     /* shared by new sources while the table is full */
+        CRandom                         m_random;       /* an attacker must not predict the drops */
+    };
+};
+
+#endif
@@ -0,0 +1,86 @@
+/* CArena.cpp
+ * Implements the bump pointer allocator.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* project includes */
+#include "CArena.h"
+
+#if defined(USE_OPENSSL)
+#include <openssl/crypto.h>
+#endif
+
+/* the chunk header is padded to keep the data aligned */
+#define CHUNK_HEADER_SIZE   ((sizeof(Chunk) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+namespace ssh
+{
+    /* CArena::CArena
+     * Constructor, memory is reserved by the first allocation.
+     */
+    CArena::CArena()
+    {
+        m_head = NULL;
+        m_used = 0;
+    }
+
+    /* CArena::~CArena
+     * Destructor.
+     */
+    CArena::~CArena()
+    {
+        reset();
+    }
+
+    /* CArena::allocate
+     * Returns memory from the current chunk, a new chunk is reserved when the request does
+     * not fit.
+     */
+    void * CArena::allocate(size_t size)
+    {
+        size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+        if( !m_head || (m_head->size - m_head->pos) < size )
+        {
+            size_t chunkSize = (size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+            byte * mem = new (std::nothrow) byte[CHUNK_HEADER_SIZE + chunkSize];
+            if( !mem )
+                return NULL;
+
+            Chunk * chunk = reinterpret_cast<Chunk *>( mem );
+            chunk->next = m_head;
+            chunk->size = chunkSize;
+            chunk->pos  = 0;
+            m_head      = chunk;
+        }
+
+        byte * p = reinterpret_cast<byte *>( m_head ) + CHUNK_HEADER_SIZE + m_head->pos;
+        m_head->pos += size;
+        m_used      += size;
+        return p;
+    }
+
+    /* CArena::reset
+     * Wipes the used part of every chunk and returns the chunks to the system.
+     */
+    void CArena::reset()
+    {
+        while( m_head )
+        {
+            Chunk * next = m_head->next;
+            byte * data = reinterpret_cast<byte *>( m_head ) + CHUNK_HEADER_SIZE;
+
+#if defined(USE_OPENSSL)
+            OPENSSL_cleanse( data, m_head->pos );
+#else
+            volatile byte * p = data;
+            for(size_t i = 0; i < m_head->pos; i++)
+                p[i] = 0;
+#endif
+            delete [] reinterpret_cast<byte *>( m_head );
+            m_head = next;
+        }
+        m_used = 0;
+    }
+};
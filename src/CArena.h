@@ -0,0 +1,77 @@
+/* CArena.h
+ * Bump pointer allocator for short lived objects.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CARENA_H_
+#define _CARENA_H_
+
+/* C/C++ includes */
+#include <cstddef>
+#include <new>
+
+/* project includes */
+#include "types.h"
+
+#define ARENA_CHUNK_SIZE    (16 * 1024)     /* covers a complete keyexchange */
+#define ARENA_ALIGNMENT     (16)
+
+namespace ssh
+{
+    /* CArena
+     * Hands out memory from large chunks by moving a pointer, nothing is freed individually.
+     * All memory is wiped and returned in one step by reset(), which makes the arena suitable
+     * for the temporaries of a keyexchange, some of which are secret.
+     *
+     * Objects created with create() must be destroyed with destroy() before the arena is
+     * reset, destroy() only runs the destructor.
+     */
+    class CArena
+    {
+    public:
+        CArena();
+        ~CArena();
+
+        /* returns aligned memory, or NULL if no memory is available */
+        void * allocate(size_t);
+        /* wipes and releases all memory */
+        void reset();
+
+        /* bytes handed out since the last reset */
+        size_t GetUsed() const {return m_used;}
+
+        template<class T> T * create() {
+            void * p = allocate(sizeof(T));
+            return p ? new (p) T() : NULL;
+        }
+        template<class T, class A> T * create(A a) {
+            void * p = allocate(sizeof(T));
+            return p ? new (p) T(a) : NULL;
+        }
+        template<class T, class A, class B, class C> T * create(A a, B b, C c) {
+            void * p = allocate(sizeof(T));
+            return p ? new (p) T(a, b, c) : NULL;
+        }
+        template<class T> static void destroy(T * obj) {
+            if( obj )
+                obj->~T();
+        }
+
+    protected:
+        struct Chunk {
+            Chunk *     next;
+            size_t      size;       /* usable bytes after the header */
+            size_t      pos;        /* next free byte */
+        };
+
+        Chunk * m_head;     /* the chunk currently allocated from, followed by the full ones */
+        size_t  m_used;
+
+    private:
+        CArena(const CArena &);
+        CArena & operator=(const CArena &);
+    };
+};
+
+#endif
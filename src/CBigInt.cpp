@@ -5,7 +5,7 @@
 #include "CStream.h"
 #include "CBigInt.h"
 
-#define MAX_NUMBER_LENGTH 512
+#include <cstring>
 
 namespace ssh
 {
@@ -21,13 +21,10 @@ namespace ssh
         if(BN_is_negative(m_bn)) {
             return false;
         }
+        /* serialized on the stack, the number is at most MAX_NUMBER_LENGTH bytes */
+        byte data[MAX_NUMBER_LENGTH + 1];
         int numBytes = BN_num_bytes(m_bn) + 1;
-        if(numBytes < 2) {
-            return false;
-        }
-        // get the length required to store the data
-        unsigned char * data = new (std::nothrow) unsigned char[numBytes];
-        if(data == NULL) {
+        if(numBytes < 2 || numBytes > (int) sizeof(data)) {
             return false;
         }
         // padding byte
@@ -35,19 +32,16 @@ namespace ssh
         // convert the BN to the right representation
         int val = BN_bn2bin(m_bn, data+1);
         if(val != numBytes - 1) {
-            delete [] data;
             return false;
         }
         // check the first byte
         int nohighbit = (data[1] & 0x80) ? 0 : 1;
         uint32 len = (uint32)(numBytes - nohighbit);
-        if( !stream.writeInt32(len) || !stream.writeBytes(data + nohighbit,len) ) {
-            delete [] data;
-            return false;
-        }
+        bool res = stream.writeInt32(len) && stream.writeBytes(data + nohighbit,len);
 
-        delete [] data;
-        return true;
+        /* the number may be a shared secret */
+        memset(data, 0, numBytes);
+        return res;
 #else
         return false;
 #endif
@@ -98,7 +92,7 @@ namespace ssh
     {
 #if defined(USE_OPENSSL)
         if( m_bn )
-            BN_free(m_bn);
+            BN_clear_free(m_bn);    /* may hold a shared secret */
 #endif
     }
 
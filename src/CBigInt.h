@@ -7,6 +7,9 @@
 
 #include "CStream.h"
 
+/* longest number accepted, in bytes */
+#define MAX_NUMBER_LENGTH 512
+
 namespace ssh
 {
     /* CBigInt
@@ -0,0 +1,247 @@
+/* CBufferPool.cpp
+ * Implements the process wide pool of packet buffers.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <new>
+
+/* project includes */
+#include "CBufferPool.h"
+
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+namespace ssh
+{
+    /* the pool shared by all connections */
+    static CBufferPool pool;
+
+    /* CBufferPool::CBufferPool
+     * Constructor, no memory is reserved until the first buffer is requested.
+     */
+    CBufferPool::CBufferPool()
+    {
+        for(int i = 0; i < BUFFER_POOL_CLASSES; i++)
+            m_available[i] = NULL;
+        m_reserved = 0;
+        m_borrowed = 0;
+    }
+
+    /* CBufferPool::~CBufferPool
+     * Destructor, returns the slabs to the system.
+     */
+    CBufferPool::~CBufferPool()
+    {
+        for(std::map<byte *, Slab *>::iterator it = m_slabs.begin(); it != m_slabs.end(); it++) {
+            deallocate( it->second->base, it->second->size );
+            delete it->second;
+        }
+    }
+
+    /* CBufferPool::GetInstance
+     * Returns the pool shared by all connections.
+     */
+    CBufferPool & CBufferPool::GetInstance()
+    {
+        return pool;
+    }
+
+    /* CBufferPool::acquire
+     * Returns a buffer from a slab of the size class, requests larger than the largest class
+     * are allocated directly.
+     */
+    byte * CBufferPool::acquire(uint32_t size, uint32_t * actual)
+    {
+        byte * buffer;
+        Slab * slab;
+        int cls = sizeClass( size );
+
+        if( cls < 0 )
+        {
+            if( (buffer = allocate( size )) != NULL )
+                *actual = size;
+            return buffer;
+        }
+
+        m_lock.acquire();
+        if( !(slab = m_available[cls]) && !(slab = grow( cls )) ) {
+            m_lock.release();
+            return NULL;
+        }
+
+        buffer      = reinterpret_cast<byte *>( slab->free );
+        slab->free  = slab->free->next;
+        slab->used++;
+        if( !slab->free )
+            unlink( slab );
+
+        *actual     = classSize( cls );
+        m_borrowed += *actual;
+        m_lock.release();
+
+        return buffer;
+    }
+
+    /* CBufferPool::release
+     * Puts the buffer back in its slab. A slab that is no longer used is returned to the
+     * system if the class has another slab with free buffers.
+     */
+    void CBufferPool::release(byte * buffer, uint32_t size)
+    {
+        Slab * slab;
+
+        if( !buffer )
+            return;
+
+        if( sizeClass( size ) < 0 ) {
+            deallocate( buffer, size );
+            return;
+        }
+
+        FreeBuffer * node = reinterpret_cast<FreeBuffer *>( buffer );
+
+        m_lock.acquire();
+        slab = findSlab( buffer );
+        if( !slab->free )
+            link( slab );
+        node->next  = slab->free;
+        slab->free  = node;
+        slab->used--;
+        m_borrowed -= size;
+
+        if( !slab->used && (m_available[slab->cls] != slab || slab->next) )
+        {
+            unlink( slab );
+            m_slabs.erase( slab->base );
+            m_reserved -= slab->size;
+            deallocate( slab->base, slab->size );
+            delete slab;
+        }
+        m_lock.release();
+    }
+
+    /* CBufferPool::sizeClass
+     * Returns the smallest class that holds the size, or -1 if the size is too large.
+     */
+    int CBufferPool::sizeClass(uint32_t size)
+    {
+        for(int cls = 0; cls < BUFFER_POOL_CLASSES; cls++) {
+            if( size <= classSize( cls ) )
+                return cls;
+        }
+        return -1;
+    }
+
+    /* CBufferPool::classSize
+     * Returns the size of the buffers of a class, 4, 8 and 16 KB and from there on the
+     * default transport buffer of 36 KB doubled.
+     */
+    uint32_t CBufferPool::classSize(int cls)
+    {
+        return cls < 3 ? (4096U << cls) : ((36U * 1024) << (cls - 3));
+    }
+
+    /* CBufferPool::grow
+     * Reserves a new slab and carves it into buffers for the class. Called with the lock held.
+     */
+    CBufferPool::Slab * CBufferPool::grow(int cls)
+    {
+        uint32_t size = classSize( cls );
+        uint32_t count = BUFFER_POOL_SLAB_SIZE / size;
+        Slab * slab = new (std::nothrow) Slab;
+
+        if( !slab )
+            return NULL;
+
+        slab->size  = (count ? count : 1) * size;
+        slab->used  = 0;
+        slab->cls   = cls;
+        slab->free  = NULL;
+        slab->prev  = slab->next = NULL;
+        if( !(slab->base = allocate( slab->size )) ) {
+            delete slab;
+            return NULL;
+        }
+
+        try {
+            m_slabs.insert( std::make_pair( slab->base, slab ) );
+        } catch(std::bad_alloc &) {
+            deallocate( slab->base, slab->size );
+            delete slab;
+            return NULL;
+        }
+        m_reserved += slab->size;
+
+        for(uint32_t offset = 0; offset + size <= slab->size; offset += size) {
+            FreeBuffer * node = reinterpret_cast<FreeBuffer *>( slab->base + offset );
+            node->next  = slab->free;
+            slab->free  = node;
+        }
+        link( slab );
+        return slab;
+    }
+
+    /* CBufferPool::findSlab
+     * Returns the slab a buffer was carved from. Called with the lock held.
+     */
+    CBufferPool::Slab * CBufferPool::findSlab(byte * buffer) const
+    {
+        std::map<byte *, Slab *>::const_iterator it = m_slabs.upper_bound( buffer );
+        return (--it)->second;
+    }
+
+    /* CBufferPool::link
+     * Adds a slab to the slabs of its class with free buffers.
+     */
+    void CBufferPool::link(Slab * slab)
+    {
+        slab->prev = NULL;
+        slab->next = m_available[slab->cls];
+        if( slab->next )
+            slab->next->prev = slab;
+        m_available[slab->cls] = slab;
+    }
+
+    /* CBufferPool::unlink
+     * Removes a slab from the slabs of its class with free buffers.
+     */
+    void CBufferPool::unlink(Slab * slab)
+    {
+        if( slab->prev )
+            slab->prev->next = slab->next;
+        else
+            m_available[slab->cls] = slab->next;
+        if( slab->next )
+            slab->next->prev = slab->prev;
+        slab->prev = slab->next = NULL;
+    }
+
+    /* CBufferPool::allocate
+     * Reserves memory from the system.
+     */
+    byte * CBufferPool::allocate(uint32_t size)
+    {
+#ifdef WIN32
+        /* disable code execution from the buffers */
+        return (byte *) VirtualAlloc(NULL, size, MEM_COMMIT, PAGE_READWRITE);
+#else
+        return new (std::nothrow) byte[size];
+#endif
+    }
+
+    /* CBufferPool::deallocate
+     * Returns memory to the system.
+     */
+    void CBufferPool::deallocate(byte * buffer, uint32_t size)
+    {
+#ifdef WIN32
+        VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+        delete [] buffer;
+#endif
+    }
+};
@@ -0,0 +1,90 @@
+/* CBufferPool.h
+ * Process wide pool of packet buffers.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CBUFFERPOOL_H_
+#define _CBUFFERPOOL_H_
+
+/* C/C++ includes */
+#include <map>
+
+/* project includes */
+#include "types.h"
+#include "Mutex.h"
+
+#define BUFFER_POOL_CLASSES         (8)                         /* 4 KB to 576 KB */
+#define BUFFER_POOL_MAX_SIZE        (576 * 1024)                /* largest class, a large packet and its overhead */
+#define BUFFER_POOL_SLAB_SIZE       (512 * 1024)                /* memory reserved at a time, at least one buffer */
+
+namespace ssh
+{
+    /* CBufferPool
+     * Hands out packet buffers in size classes. The classes from 36 KB up double the default
+     * transport buffer, so the default packet and a large packet each fit a class without
+     * rounding up to twice the size. Memory is reserved from the system in slabs which are
+     * carved into buffers of a single class and reused by any connection. A slab that is
+     * entirely free is returned to the system, unless it is the only one of its class with
+     * free buffers.
+     *
+     * The transports only borrow buffers while a packet is being read or written, so the
+     * memory in use follows the number of active connections rather than the number of open
+     * ones.
+     */
+    class CBufferPool
+    {
+    public:
+        CBufferPool();
+        ~CBufferPool();
+
+        /* returns a buffer of at least the requested size, the usable size is stored in actual */
+        byte * acquire(uint32_t size, uint32_t * actual);
+        /* returns a buffer to the pool, size is the usable size returned by acquire */
+        void release(byte *, uint32_t size);
+
+        /* bytes reserved from the system and bytes currently borrowed */
+        uint64_t GetReserved() const    {return m_reserved;}
+        uint64_t GetBorrowed() const    {return m_borrowed;}
+
+        /* the pool shared by all connections */
+        static CBufferPool & GetInstance();
+
+    protected:
+        struct FreeBuffer {
+            FreeBuffer * next;
+        };
+
+        /* a slab of buffers of one class */
+        struct Slab {
+            byte *          base;
+            uint32_t        size,       /* bytes reserved */
+                            used;       /* buffers borrowed */
+            int             cls;
+            FreeBuffer *    free;
+            Slab *          prev,       /* the slabs of the class with free buffers */
+                 *          next;
+        };
+
+        static int      sizeClass(uint32_t size);
+        static uint32_t classSize(int cls);
+        static byte *   allocate(uint32_t size);
+        static void     deallocate(byte *, uint32_t size);
+        Slab *          grow(int cls);
+        Slab *          findSlab(byte *) const;
+        void            link(Slab *);
+        void            unlink(Slab *);
+
+        Slab *                  m_available[BUFFER_POOL_CLASSES];   /* slabs with free buffers per class */
+        std::map<byte *, Slab*> m_slabs;                            /* by base address */
+        uint64_t                m_reserved,
+                                m_borrowed;
+        Util::Mutex             m_lock;
+
+    private:
+        CBufferPool(const CBufferPool &);
+        CBufferPool & operator=(const CBufferPool &);
+    };
+};
+
+#endif
@@ -9,6 +9,8 @@
 #include "messages.h"
 #include "errors.h"
 #include "sshd.h"
+#include "CHistogram.h"
+#include "util.h"
 
 /* C/C++ includes */
 #include <string>
@@ -31,8 +33,11 @@ namespace ssh
     CClientTransport::CClientTransport(const ssh::CSettings & settings, ssh::INotify * notify, ssh::IAuthenticate * auth) 
         : CTransport( settings, NULL ), m_iAuth( auth ), m_pNotify( notify )
     {
-        m_pService  = NULL;
-        m_status    = sshd_STATUS_IDLE;
+        m_pService      = NULL;
+        m_status        = sshd_STATUS_IDLE;
+        m_phase         = CLIENT_PHASE_CLOSED;  /* until start */
+        m_phaseStart    = 0;
+        m_bannerLines   = 0;
     }
 
     /* CClientTransport::~CClientTransport
@@ -42,6 +47,10 @@ namespace ssh
     {
         if( m_pService )
             delete m_pService;
+
+        /* the base class can't call releaseHostKey once this part is destroyed */
+        releaseHostKey( m_kexHostKey );
+        m_kexHostKey = NULL;
     }
 
 
@@ -84,11 +93,33 @@ namespace ssh
         return sshd_OK;
     }
 
+    /* CClientTransport::connect
+     * Runs the connection over an already connected stream, e.g. one end of a CMemoryNetwork
+     * pair. The transport owns the stream even if the call fails.
+     */
+    int CClientTransport::connect(ssh::INetwork * network)
+    {
+        if( !network )
+            return sshd_ERROR;
+
+        ds = network;
+        m_addr.clear();
+        m_port.clear();
+
+        /* spawn the connection thread */
+        if (!spawn() )
+            return sshd_ERROR;
+
+        return sshd_OK;
+    }
+
     /* CClientTransport::Task()
      * The entry-point for the thread that handles the client connection. 
      */
     void CClientTransport::Task()
     {
+        CLogContext context( getConnectionId() );
+        CHistogramContext histograms;
         int res;
 
         setStatus(sshd_STATUS_CONNECTING);
@@ -153,6 +184,8 @@ namespace ssh
     {
         int res;
     
+        uint64_t start = GetMonotonicTime();
+
         ds->setBlockingMode( true );
         res = exchangeProtocolVersions();
         if( res != sshd_OK )
@@ -168,6 +201,7 @@ namespace ssh
             return sshd_ERROR;
         }
         ds->setBlockingMode( false );
+        CHistogram::Get( HISTOGRAM_VERSION_EXCHANGE ).record( GetMonotonicTime() - start );
 
         /* check if the attempt is aborted */
         sshd_CheckAbortEvent();
@@ -177,6 +211,7 @@ namespace ssh
         if( res != sshd_OK ) 
         {
             sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+            disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
             return sshd_PROTOCOL_ERROR;
         }
 
@@ -186,95 +221,30 @@ namespace ssh
         return sshd_OK;
     }
 
-    /* CClientTransport::performKeyExchange
-     * Performs the keyexchange.
+    /* CClientTransport::createGuessedKex
+     * Creates the keyexchange for the preferred algorithm, its first packet is sent right
+     * after the SSH_MSG_KEXINIT as a guess.
      */
-    int CClientTransport::performKeyExchange(bool bInitial, bool bInitiator)
+    CKeyExchange * CClientTransport::createGuessedKex()
     {
-        int             res;
-        bool            guess = false;
-        std::string     matches[MAX_ALGORITHM_COUNT];
-        KeyVector       keyvec;
-        CKeyExchange *  keyexchange = NULL;
-        CHostKey *      hostkey     = NULL;
-        vector<byte>    exchangeHash;
-        const CBigInt * sharedSecret;
-
-        /* create the local kex packet */
-        if( !buildLocalKex() ) {
-            goto cleanup;
-        }
-
-        res = exchangeKeyExchanges(m_localKex, m_remoteKex, bInitial, bInitiator);
-        if( res != sshd_OK ) {
-            sshd_Log(sshd_EVENT_FATAL, "Failed to exchange SSH_MSG_KEXINIT messages.");
-            goto cleanup;
-        }
-
-        /* Decide what algorithms to use */
-        if( !DecideAlgorithms(m_localKex.algorithms, m_remoteKex.algorithms, matches, MAX_ALGORITHM_COUNT) ) {
-            sshd_Log(sshd_EVENT_FATAL, "Algorithm missmatch.");
-            goto cleanup;
-        }
-        /* create the keyexchange instance */
-        keyexchange = CKeyExchange::CreateInstance(matches[KEYEXCHANGE_METHOD], this);
-        if( !keyexchange ) {
-            goto cleanup;
-        }
-
-        /* create the hostkey */
-        hostkey = CHostKey::CreateInstance(matches[SERVER_HOSTKEY]);
-        if( !hostkey ) {
-            goto cleanup;
-        }
-
-        res = keyexchange->ClientKeyExchange(hostkey, guess && m_remoteKex.follows);
-        if( res != sshd_OK ) {
-            sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
-            goto cleanup;
-        }
-
-        /* */
-        //hostkey->fingerprint();
-
-        /* We need both the exchange hash and the shared secret to derive the keys */
-        exchangeHash        = keyexchange->GetExchangeHash();
-        sharedSecret        = keyexchange->GetSharedSecret();
-
-        m_exchangeHash = exchangeHash;
-
-        if( m_sessionIdent.empty() )
-            m_sessionIdent = exchangeHash;  /* first keyexchange, use the exchange hash as session identifier */
-
-        /* Now derive the required keys */
-        res = DeriveKeys(exchangeHash, m_sessionIdent, *sharedSecret, keyexchange->GetHash(), keyvec);
-        if( res != sshd_OK )
-        {
-            sshd_Log(sshd_EVENT_FATAL, "Key derivation process failed.");
-            goto cleanup;
-        }
-
-        res = TakeKeysIntoUse( keyvec, matches );
-        if( res != sshd_OK )
-        {
-            sshd_Log(sshd_EVENT_FATAL, "Failed to take the new keys into use.");
-            goto cleanup;
-        }
-
-        /* keyexchange successfull, but we still need to verify the host */
-        delete keyexchange;
-        delete hostkey;
-
-        /* return success */
-        return sshd_OK;
+        const std::string & list = m_template->GetAlgorithms()[KEYEXCHANGE_METHOD];
+        return CKeyExchange::CreateInstance( list.substr(0, list.find(',')), this );
+    }
 
-cleanup:
-        delete keyexchange;
-        delete hostkey;
+    /* CClientTransport::acquireHostKey
+     * Creates the hostkey used to parse and verify the server's keyblob and signature.
+     */
+    CHostKey * CClientTransport::acquireHostKey(const std::string & name)
+    {
+        return CHostKey::CreateInstance( name );
+    }
 
-        /* disconnect */
-        disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
-        return sshd_ERROR;
+    /* CClientTransport::releaseHostKey
+     * Deletes the hostkey once the keyexchange is done.
+     */
+    void CClientTransport::releaseHostKey(CHostKey * key)
+    {
+        delete key;
     }
 
     /* CServerTransport::InitializeKeys
@@ -297,24 +267,31 @@ cleanup:
             block.hmac_server_to_client->Init( vec.keys[INTEGRITY_KEY_SERVER_TO_CLIENT].key );
     }
 
-    /* CServerTransport::TakeAlgorithmsInUse
-     *
+    /* CClientTransport::TakeAlgorithmsInUse
+     * Takes the new algorithms into use for one direction.
      */
-    int CClientTransport::TakeAlgorithmsInUse( const SecurityBlock & block )
+    void CClientTransport::TakeAlgorithmsInUse( SecurityBlock & block, bool bSend )
     {
-        /* delete old instances */
-        delete sendState.cipher;
-        delete sendState.hmac;
-        delete readState.cipher;
-        delete readState.hmac;
-
-        /* use the new ones */
-        sendState.cipher    = block.enc_client_to_server;
-        sendState.hmac      = block.hmac_client_to_server;
-        readState.cipher    = block.enc_server_to_client;
-        readState.hmac      = block.hmac_server_to_client;
+        if( bSend )
+        {
+            delete sendState.cipher;
+            delete sendState.hmac;
 
-        return sshd_OK;
+            sendState.cipher            = block.enc_client_to_server;
+            sendState.hmac              = block.hmac_client_to_server;
+            block.enc_client_to_server  = NULL;
+            block.hmac_client_to_server = NULL;
+        }
+        else
+        {
+            delete readState.cipher;
+            delete readState.hmac;
+
+            readState.cipher            = block.enc_server_to_client;
+            readState.hmac              = block.hmac_server_to_client;
+            block.enc_server_to_client  = NULL;
+            block.hmac_server_to_client = NULL;
+        }
     }
 
     /* CClientTransport::getStatus
@@ -25,6 +25,19 @@ typedef enum {
     sshd_STATUS_CLOSED
 } sshd_ConnectStatus;
 
+/* the phases of a connection driven by CClientTransport::step */
+enum {
+    CLIENT_PHASE_VERSION = 0,       /* waiting for the server's version string */
+    CLIENT_PHASE_KEX,               /* the initial keyexchange */
+    CLIENT_PHASE_AUTH_REQUEST,      /* the authentication service is to be requested */
+    CLIENT_PHASE_AUTH_ACCEPT,
+    CLIENT_PHASE_AUTH,
+    CLIENT_PHASE_SERVICE_REQUEST,   /* the service is to be requested */
+    CLIENT_PHASE_SERVICE_ACCEPT,
+    CLIENT_PHASE_CONNECTED,
+    CLIENT_PHASE_CLOSED
+};
+
 namespace ssh
 {
     /* CClientTransport
@@ -41,12 +54,25 @@ namespace ssh
         /* connects to the remote server */
         int connect(const char *, const char * port);
         int connect(const std::string &, const std::string &);
+        /* runs the connection over an already connected stream, takes ownership of it */
+        int connect(ssh::INetwork *);
+
+        /* runs the connection from the caller's thread instead, it is advanced by step
+           whenever the stream has events; takes ownership of the stream */
+        int start(ssh::INetwork *);
+        /* does what can be done without waiting, sshd_OK while the connection is open */
+        int step();
+        /* closes a connection run by step */
+        void close();
+
+        /* sets the service requested after the authentication, takes ownership of it */
+        void setService(ssh::CService * service)    {delete m_pService; m_pService = service;}
 
         /* */
         virtual const KeyExchangeInfo & getServerKex()  {return m_remoteKex;}
         virtual const KeyExchangeInfo & getClientKex()  {return m_localKex;}
         virtual const std::string & getServerProtocolString() {return m_remoteVersion;}
-        virtual const std::string & getClientProtocolString() {return m_localVersion;}
+        virtual const std::string & getClientProtocolString() {return m_template->GetVersionString();}
 
         /* CThread */
         void Task();
@@ -58,7 +84,9 @@ namespace ssh
         void setStatus(sshd_ConnectStatus);     /* sets the connection state */
         int establishConnection();
         void mainTask();
-        int performKeyExchange(bool bInitial = true, bool bInitiator = true);
+        CKeyExchange * createGuessedKex();
+        CHostKey * acquireHostKey(const std::string &);
+        void releaseHostKey(CHostKey *);
         int handlePacket();
         int requestService(const std::string & name);
         int handleAuthPacket();
@@ -66,7 +94,14 @@ namespace ssh
     
         int performAuthentication(); /* performs the client authentication */
 
-        int TakeAlgorithmsInUse( const SecurityBlock & block );
+        /* the parts of step */
+        int stepVersion(bool & progress);
+        int stepPackets(bool & progress);
+        int stepOutput();
+        int stepInput();
+        void stepFailed();
+
+        void TakeAlgorithmsInUse( SecurityBlock & block, bool bSend );
         void InitializeKeys(const SecurityBlock & block, const KeyVector & vec);
 
         /* variables */
@@ -78,6 +113,11 @@ namespace ssh
         ssh::INotify *                  m_pNotify;      /* notification interface */
         sshd_ConnectStatus              m_status;       /* connection status */
         Util::Mutex                     m_lock;
+
+        /* the connection run by step */
+        int                             m_phase;
+        uint64_t                        m_phaseStart;
+        int                             m_bannerLines;  /* lines before the version string */
     };
 };
 
@@ -12,6 +12,9 @@
 #include "CHashStream.h"
 #include "messages.h"       /* SSH messages */
 #include "sha1.h"
+#include "CHistogram.h"
+#include "probes.h"
+#include "util.h"
 
 namespace ssh
 {
@@ -43,12 +46,10 @@ namespace ssh
         if( m_key ) 
             delete [] m_key;
 #endif
-        if( m_e )
-            delete m_e;
-        if( m_f )
-            delete m_f;
-        if( m_secret )
-            delete m_secret;
+        /* the integers live in the keyexchange arena */
+        CArena::destroy( m_e );
+        CArena::destroy( m_f );
+        CArena::destroy( m_secret );
     }
 
     /* CDiffieHellman::GenerateKeys
@@ -92,10 +93,10 @@ namespace ssh
 
         if( server )
         {
-            if( !(m_f = new (std::nothrow) CBigInt(m_dh->pub_key)) )
+            if( !(m_f = m_ts->getKexArena().create<CBigInt>(m_dh->pub_key)) )
                 return false;
         } else {
-            if( !(m_e = new (std::nothrow) CBigInt(m_dh->pub_key)) )
+            if( !(m_e = m_ts->getKexArena().create<CBigInt>(m_dh->pub_key)) )
                 return false;
         }   
         return true;
@@ -114,33 +115,33 @@ namespace ssh
         BIGNUM * bn;
 
 #if defined(USE_OPENSSL)
-        key = new (std::nothrow) byte[DH_size(m_dh)];
+        /* wiped when the arena is reset */
+        key = (byte *) m_ts->getKexArena().allocate( DH_size(m_dh) );
         if( !key ) {
             DBG("Memory allocation failed.");
             return false;
         }
 
+        uint64_t start = GetMonotonicTime();
         res = DH_compute_key(key, (const BIGNUM *)pub_key.Native(), m_dh);
+        uint64_t elapsed = GetMonotonicTime() - start;
+        CHistogram::Get( HISTOGRAM_DH_COMPUTE ).record( elapsed );
+        SSHD_PROBE3(dh__compute, m_ts->getConnectionId(), elapsed, res);
         if( res == -1 ) {
             unsigned long e = ERR_get_error();
             ERR_error_string(e, buf);
             DBG("DH_Compute_key failed.");
-            delete []key;
             return false;
         }
 
         bn = BN_bin2bn(key, res, NULL);
-        delete [] key;
-
         if( !bn )
             return false;
 
-        m_secret = new CBigInt( bn );
-        if( !m_secret ) {
-            BN_free( bn);
+        m_secret = m_ts->getKexArena().create<CBigInt>( bn );
+        BN_clear_free( bn );
+        if( !m_secret )
             return false;
-        }
-        BN_free( bn );
 
         m_size = res;   /* the size of the shared secret */
         return true;
@@ -171,10 +172,10 @@ namespace ssh
         /* write everything to the hash */
         if( !hash.writeString(clientProtocolString) || 
             !hash.writeString(serverProtocolString) ||
-            !hash.writeInt32(clientKex.packetSize - clientKex.paddingSize - 1) || /* ignored by the writeKex method */
-            !hash.writeKex(clientKex) ||
-            !hash.writeInt32(serverKex.packetSize - serverKex.paddingSize - 1) ||
-            !hash.writeKex(serverKex) ||
+            !hash.writeInt32(static_cast<uint32>(clientKex.payload.size())) ||   /* the raw payloads */
+            !hash.writeVector(clientKex.payload) ||
+            !hash.writeInt32(static_cast<uint32>(serverKex.payload.size())) ||
+            !hash.writeVector(serverKex.payload) ||
             !hostkey->WriteKeyblob(hash) ||
             !m_e->write(hash) ||                /* write the client's public key */
             !m_f->write(hash) ||                /* write the server's public key */
@@ -195,7 +196,13 @@ namespace ssh
         std::vector<byte> & signature
         )
     {
-        return hostkey->Sign( m_exchange, signature);
+        uint64_t start = GetMonotonicTime();
+        bool res = hostkey->Sign( m_exchange, signature);
+        uint64_t elapsed = GetMonotonicTime() - start;
+
+        CHistogram::Get( HISTOGRAM_SIGN ).record( elapsed );
+        SSHD_PROBE3(dh__sign, m_ts->getConnectionId(), elapsed, res);
+        return res;
     }
 
     /* CDiffieHellman::validPrivateKey
@@ -23,8 +23,10 @@ namespace ssh
         CDiffieHellman(CTransport *, const char * prime, const char * generator);
         ~CDiffieHellman();
 
-        int ServerKeyExchange(CHostKey *, bool guess);
-        int ClientKeyExchange(CHostKey *, bool guess);
+        bool ClientWriteInit();
+        int ClientHandleReply(CHostKey *);
+        int ServerHandleInit(CHostKey *);
+        bool ServerWriteReply(CHostKey *);
 
         /* returns the name of the hash used by the keyexchange */
         const char * GetHash() const {return "sha1";}
@@ -42,6 +44,7 @@ namespace ssh
         const char * m_p, * m_g;
         CBigInt * m_e , * m_f;
         byte * key;
+        std::vector<byte> m_signature;  /* the server's signature of the exchange hash */
 
 #if defined(USE_OPENSSL)
         DH * m_dh;      /* OpenSSL DiffieHellman */
@@ -0,0 +1,118 @@
+/* CHandshakeTemplate.cpp
+ * Builds the pre-serialized handshake messages.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstring>
+#include <new>
+
+/* project includes */
+#include "CHandshakeTemplate.h"
+#include "CHostKey.h"
+#include "ArrayStream.h"
+
+using namespace std;
+
+namespace ssh
+{
+    /*
+     * Default algorithms
+     */
+    static const char * defaultKeyexchange  = "diffie-hellman-group14-sha1";
+#if defined(SSHD_HAVE_ED25519)
+    static const char * defaultHostkey      = "ssh-ed25519,ecdsa-sha2-nistp256,ssh-rsa";
+#else
+    static const char * defaultHostkey      = "ecdsa-sha2-nistp256,ssh-rsa";
+#endif
+    static const char * defaultCiphers      = "aes256-cbc,aes128-cbc";
+    static const char * defaultHmacs        = "hmac-sha1";
+
+    /* CHandshakeTemplate::CHandshakeTemplate
+     * Constructor.
+     */
+    CHandshakeTemplate::CHandshakeTemplate()
+    {
+        m_generation = 0;
+    }
+
+    /* CHandshakeTemplate::Refresh
+     * Builds a new template when the settings generation has changed, the old one stays with
+     * whoever still references it. Used both by the server for the template it shares and by
+     * a transport that was not handed one.
+     */
+    bool CHandshakeTemplate::Refresh(boost::shared_ptr<const CHandshakeTemplate> & current, const CSettings & settings)
+    {
+        if( current && current->isCurrent( settings ) )
+            return true;
+
+        CHandshakeTemplate * t = new (std::nothrow) CHandshakeTemplate;
+        if( !t )
+            return false;
+
+        if( !t->build( settings ) ) {
+            delete t;
+            return false;
+        }
+        current.reset( t );
+        return true;
+    }
+
+    /* CHandshakeTemplate::build
+     * Builds the protocol version string and the SSH_MSG_KEXINIT payload from the settings.
+     * The cookie is left zeroed.
+     */
+    bool CHandshakeTemplate::build(const CSettings & settings)
+    {
+        string name, version;
+        KeyExchangeInfo kex;
+        int large;
+        byte buf[MAX_KEXINIT_PAYLOAD];
+
+        m_generation = settings.GetGeneration();
+
+        /* get the software name */
+        if( !settings.GetString(SSHD_SETTING_SOFTWARE_NAME, name) ) {
+            name = "lwSSH";
+        }
+        /* get the software version as a string */
+        if( !settings.GetString(SSHD_SETTING_SOFTWARE_VERSION, version) ) {
+            version = "0.01";
+        }
+        m_version = "SSH-2.0-" + name + "_" + version;
+
+        if( !settings.GetString(SSHD_SETTING_PREFERRED_KEYEXCHANGE, m_algorithms[KEYEXCHANGE_METHOD]) )
+            m_algorithms[KEYEXCHANGE_METHOD] = defaultKeyexchange;
+        if( !settings.GetString(SSHD_SETTING_PREFERRED_HOSTKEY, m_algorithms[SERVER_HOSTKEY]) )
+            m_algorithms[SERVER_HOSTKEY] = defaultHostkey;
+        if( !settings.GetString(SSHD_SETTING_PREFERRED_CIPHER, m_algorithms[ENCRYPTION_CLIENT_TO_SERVER]) )
+            m_algorithms[ENCRYPTION_CLIENT_TO_SERVER] = defaultCiphers;
+        if( !settings.GetString(SSHD_SETTING_PREFERRED_HMAC, m_algorithms[MAC_CLIENT_TO_SERVER]) )
+            m_algorithms[MAC_CLIENT_TO_SERVER] = defaultHmacs;
+
+        /* extensions are advertised after the real methods */
+        if( settings.GetValue(SSHD_SETTING_LARGE_PACKETS, large) && large )
+            m_algorithms[KEYEXCHANGE_METHOD] += "," LARGE_PACKETS_EXTENSION;
+
+        m_algorithms[ENCRYPTION_SERVER_TO_CLIENT]   = m_algorithms[ENCRYPTION_CLIENT_TO_SERVER];
+        m_algorithms[MAC_SERVER_TO_CLIENT]          = m_algorithms[MAC_CLIENT_TO_SERVER];
+        m_algorithms[COMPRESSION_CLIENT_TO_SERVER]  = "none";
+        m_algorithms[COMPRESSION_SERVER_TO_CLIENT]  = "none";
+        m_algorithms[LANGUAGES_CLIENT_TO_SERVER]    = "";
+        m_algorithms[LANGUAGES_SERVER_TO_CLIENT]    = "";
+
+        /* serialize the payload with a zero cookie */
+        for(int i = 0; i < MAX_ALGORITHM_COUNT; i++)
+            kex.algorithms[i] = m_algorithms[i];
+        memset(kex.cookie, 0, sizeof(kex.cookie));
+        kex.follows = 0;
+
+        ArrayWriteStream stream( buf, sizeof(buf) );
+        if( !stream.writeKex( kex ) )
+            return false;
+
+        m_kexinit.assign( buf, buf + stream.GetUsage() );
+        return true;
+    }
+};
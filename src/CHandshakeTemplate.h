@@ -0,0 +1,67 @@
+/* CHandshakeTemplate.h
+ * Pre-serialized handshake messages.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CHANDSHAKETEMPLATE_H_
+#define _CHANDSHAKETEMPLATE_H_
+
+/* C/C++ includes */
+#include <string>
+#include <boost/shared_ptr.hpp>
+
+/* project includes */
+#include "types.h"
+#include "defines.h"
+#include "KeyExchange.h"
+#include "CSettings.h"
+
+/* offset and size of the cookie in the SSH_MSG_KEXINIT payload */
+#define KEXINIT_COOKIE_OFFSET       (1)
+#define KEXINIT_COOKIE_SIZE         (16)
+/* the first_kex_packet_follows byte is followed by the reserved uint32 */
+#define KEXINIT_FOLLOWS_TRAILER     (5)
+
+#define MAX_KEXINIT_PAYLOAD         (8192)
+
+/* pseudo keyexchange algorithm offered by this software, two instances that both offer it
+   may send packets up to SSHD_LARGE_PACKET_SIZE. Other implementations ignore the name. */
+#define LARGE_PACKETS_EXTENSION     "large-packets@lwssh"
+
+namespace ssh
+{
+    /* CHandshakeTemplate
+     * Holds the local protocol version string and the SSH_MSG_KEXINIT payload, serialized
+     * once from the settings. A template is immutable once built and is shared by all
+     * connections using the same settings generation, each connection only patches the
+     * cookie (and the follows byte) in its own copy of the payload.
+     */
+    class CHandshakeTemplate
+    {
+    public:
+        CHandshakeTemplate();
+
+        /* serializes the handshake messages from the settings */
+        bool build(const CSettings &);
+        /* returns true if the template was built from the current settings generation */
+        bool isCurrent(const CSettings & settings) const {return m_generation == settings.GetGeneration();}
+        /* replaces the template with one built from the settings unless it is current */
+        static bool Refresh(boost::shared_ptr<const CHandshakeTemplate> &, const CSettings &);
+
+        /* the local protocol version string, without the line terminator */
+        const std::string & GetVersionString() const        {return m_version;}
+        /* the SSH_MSG_KEXINIT payload with a zero cookie */
+        const ByteVector & GetKexinit() const               {return m_kexinit;}
+        /* the advertised algorithm lists */
+        const std::string * GetAlgorithms() const           {return m_algorithms;}
+
+    protected:
+        uint32_t    m_generation;
+        std::string m_version;
+        std::string m_algorithms[MAX_ALGORITHM_COUNT];
+        ByteVector  m_kexinit;
+    };
+};
+
+#endif
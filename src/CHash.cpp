@@ -3,6 +3,7 @@
 
 /* The different hash algorithms, used for the factory functions */
 #include "sha1.h"
+#include "sha2.h"
 
 namespace ssh
 {
@@ -68,6 +69,21 @@ namespace ssh
 #endif
     }
 
+    /* CHash::copy
+     * Replaces the state of the hash with the state of another instance of the same
+     * algorithm, used to continue hashing from a common prefix.
+     */
+    bool CHash::copy(const CHash & src)
+    {
+#if defined(USE_OPENSSL)
+        if( src.m_evp != m_evp )
+            return false;
+        return EVP_MD_CTX_copy_ex(&md, &src.md) == 1;
+#else
+        return false;
+#endif
+    }
+
     /* CHash::hash
      * Hashes the contents of the vector and stores the digest in 'digest'.
      */
@@ -86,6 +102,10 @@ namespace ssh
     {
         if( !strcmp(name, "sha1") )
             return new (std::nothrow) sha1;
+        if( !strcmp(name, "sha256") )
+            return new (std::nothrow) sha256;
+        if( !strcmp(name, "sha512") )
+            return new (std::nothrow) sha512;
             
         return NULL;
     }
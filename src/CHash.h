@@ -8,6 +8,9 @@
 #include "types.h"
 #include <vector>
 
+/* the largest digest of the supported hash algorithms */
+#define MAX_DIGEST_LENGTH   (64)
+
 namespace ssh
 {
     /* CHash
@@ -24,6 +27,7 @@ namespace ssh
         virtual void finalize(byte * digest, unsigned int *);
         virtual void finalize(std::vector<byte> &);
         virtual void reinit();
+        bool copy(const CHash &);
         virtual unsigned int length() {return EVP_MD_size(m_evp);}
 
         void hash( const std::vector<byte> &, byte * );
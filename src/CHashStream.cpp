@@ -52,4 +52,12 @@ namespace ssh
     {
         m_hash->reinit();
     }
+
+    /* copies the hash state of another stream */
+    bool CHashStream::copy(const CHashStream & src)
+    {
+        if( !m_hash || !src.m_hash )
+            return false;
+        return m_hash->copy( *src.m_hash );
+    }
 }
\ No newline at end of file
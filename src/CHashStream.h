@@ -19,8 +19,10 @@ namespace ssh
         void finalize(byte *, unsigned int *);      /* finalizes the hash */
         void finalize(std::vector<byte> &);
         void reset();
+        /* continues from the state of another stream using the same hash */
+        bool copy(const CHashStream &);
 
-        bool operator!() {return false;}
+        bool operator!() {return m_hash == NULL;}
     protected:
         CHash * m_hash;
     };
@@ -0,0 +1,302 @@
+/* CHistogram.cpp
+ * Implements the latency histograms.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+/* project includes */
+#include "CHistogram.h"
+#include "CLogger.h"
+#include "Mutex.h"
+
+#if defined(WIN32) || defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define ATOMIC_INCREMENT32(p)       InterlockedIncrement( (volatile LONG *) (p) )
+#define ATOMIC_ADD64(p, v)          InterlockedExchangeAdd64( (volatile LONGLONG *) (p), (LONGLONG) (v) )
+#define HISTOGRAM_BARRIER()         MemoryBarrier()
+#else
+#define ATOMIC_INCREMENT32(p)       __sync_add_and_fetch( (p), 1 )
+#define ATOMIC_ADD64(p, v)          __sync_add_and_fetch( (p), (v) )
+#define HISTOGRAM_BARRIER()         __sync_synchronize()
+#endif
+
+using namespace std;
+
+namespace ssh
+{
+    /* the histograms shared by all connections */
+    static CHistogram versionExchange("version_exchange", "Time to exchange the protocol version strings.", HISTOGRAM_VERSION_EXCHANGE);
+    static CHistogram keyexchange("keyexchange", "Time from the start of a keyexchange until both sides use the new keys.", HISTOGRAM_KEYEXCHANGE);
+    static CHistogram dhCompute("dh_compute", "Time to compute the shared secret.", HISTOGRAM_DH_COMPUTE);
+    static CHistogram sign("sign", "Time to sign the exchange hash.", HISTOGRAM_SIGN);
+    static CHistogram newkeys("newkeys", "Time to derive the keys and set up the new algorithms.", HISTOGRAM_NEWKEYS);
+    static CHistogram authentication("authentication", "Time to authenticate the user.", HISTOGRAM_AUTHENTICATION);
+    static CHistogram packetOpen("packet_open", "Time to decrypt and verify a received packet.", HISTOGRAM_PACKET_OPEN);
+    static CHistogram packetSeal("packet_seal", "Time to mac and encrypt a packet to send.", HISTOGRAM_PACKET_SEAL);
+
+    static CHistogram * histograms[HISTOGRAM_MAX] = {
+        &versionExchange,
+        &keyexchange,
+        &dhCompute,
+        &sign,
+        &newkeys,
+        &authentication,
+        &packetOpen,
+        &packetSeal
+    };
+
+    /* the quantiles exported for each histogram */
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    /* the shard sets of all threads, never freed, and the set of the calling thread */
+    static HistogramShardSet * volatile shardSets = NULL;
+    static SSHD_THREAD_LOCAL HistogramShardSet * currentSet = NULL;
+    static Util::Mutex shardLock;
+
+    /* CHistogram::CHistogram
+     * Constructor, the name becomes part of the metric name.
+     */
+    CHistogram::CHistogram(const char * name, const char * help, int id)
+    {
+        m_name  = name;
+        m_help  = help;
+        m_id    = id;
+        m_count = 0;
+        m_sum   = 0;
+        memset( (void *) m_buckets, 0, sizeof(m_buckets) );
+    }
+
+    /* CHistogram::Get
+     * Returns one of the HISTOGRAM_* histograms.
+     */
+    CHistogram & CHistogram::Get(int id)
+    {
+        return *histograms[id];
+    }
+
+    /* CHistogram::bucketIndex
+     * Values below HISTOGRAM_SUB_BUCKETS have a bucket each, larger values are placed by
+     * their highest set bit and the HISTOGRAM_SUB_BITS bits following it.
+     */
+    int CHistogram::bucketIndex(uint64_t ns)
+    {
+        int exponent = 0;
+
+        if( ns < HISTOGRAM_SUB_BUCKETS )
+            return (int) ns;
+
+        /* find the highest set bit */
+        for(int shift = 32; shift > 0; shift >>= 1) {
+            if( ns >> (exponent + shift) )
+                exponent += shift;
+        }
+        if( exponent > HISTOGRAM_MAX_EXPONENT )
+            return HISTOGRAM_BUCKETS - 1;
+
+        return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+               (int) ((ns >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+    }
+
+    /* CHistogram::bucketValue
+     * Returns the largest value that is placed in the bucket.
+     */
+    uint64_t CHistogram::bucketValue(int index)
+    {
+        int group   = index / HISTOGRAM_SUB_BUCKETS,
+            sub     = index % HISTOGRAM_SUB_BUCKETS;
+
+        if( group == 0 )
+            return sub;
+
+        int shift = group - 1;
+        return (((uint64_t) (HISTOGRAM_SUB_BUCKETS + sub + 1)) << shift) - 1;
+    }
+
+    /* CHistogram::record
+     * Records a duration, into the shard of the calling thread if it has one.
+     */
+    void CHistogram::record(uint64_t ns)
+    {
+        if( m_id >= 0 && currentSet )
+        {
+            HistogramShard & shard = currentSet->shards[m_id];
+            shard.buckets[bucketIndex( ns )]++;
+            shard.count++;
+            shard.sum += ns;
+            return;
+        }
+
+        ATOMIC_INCREMENT32( &m_buckets[bucketIndex( ns )] );
+        ATOMIC_ADD64( &m_count, 1 );
+        ATOMIC_ADD64( &m_sum, ns );
+    }
+
+    /* CHistogram::sum
+     * Adds the shared counts and those of every thread's shard.
+     */
+    void CHistogram::sum(uint64_t * buckets, uint64_t & count, uint64_t & sum) const
+    {
+        count   = m_count;
+        sum     = m_sum;
+        for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            buckets[i] = m_buckets[i];
+
+        if( m_id < 0 )
+            return;
+
+        for(HistogramShardSet * set = shardSets; set; set = set->next)
+        {
+            const HistogramShard & shard = set->shards[m_id];
+            count   += shard.count;
+            sum     += shard.sum;
+            for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+                buckets[i] += shard.buckets[i];
+        }
+    }
+
+    /* CHistogram::GetCount
+     * Returns the number of recorded values.
+     */
+    uint64_t CHistogram::GetCount() const
+    {
+        uint64_t buckets[HISTOGRAM_BUCKETS], count, total;
+        sum( buckets, count, total );
+        return count;
+    }
+
+    /* CHistogram::GetSum
+     * Returns the sum of the recorded values.
+     */
+    uint64_t CHistogram::GetSum() const
+    {
+        uint64_t buckets[HISTOGRAM_BUCKETS], count, total;
+        sum( buckets, count, total );
+        return total;
+    }
+
+    /* CHistogram::quantile
+     * Returns the quantile of the values recorded so far.
+     */
+    uint64_t CHistogram::quantile(double q) const
+    {
+        uint64_t buckets[HISTOGRAM_BUCKETS], count, total;
+        sum( buckets, count, total );
+        return quantile( buckets, q );
+    }
+
+    /* CHistogram::quantile
+     * Walks the buckets until the fraction q of the values has been passed.
+     */
+    uint64_t CHistogram::quantile(const uint64_t * buckets, double q)
+    {
+        uint64_t total = 0, target, seen = 0;
+
+        for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            total += buckets[i];
+        if( !total )
+            return 0;
+
+        target = (uint64_t) (q * total);
+        if( target < q * total || !target )
+            target++;       /* round up, at least one value */
+
+        for(int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += buckets[i];
+            if( seen >= target )
+                return bucketValue( i );
+        }
+        return bucketValue( HISTOGRAM_BUCKETS - 1 );
+    }
+
+    /* CHistogram::write
+     * Appends the histogram as a Prometheus summary in seconds.
+     */
+    void CHistogram::write(std::string & out) const
+    {
+        char buf[128];
+        string metric = string("sshd_") + m_name + "_seconds";
+        uint64_t buckets[HISTOGRAM_BUCKETS], count, total;
+
+        sum( buckets, count, total );
+
+        out += "# HELP " + metric + " " + m_help + "\n";
+        out += "# TYPE " + metric + " summary\n";
+
+        for(size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            sprintf( buf, "{quantile=\"%g\"} %.9f\n", quantiles[i], (double) quantile( buckets, quantiles[i] ) / 1000000000.0 );
+            out += metric + buf;
+        }
+
+        sprintf( buf, "_sum %.9f\n", (double) total / 1000000000.0 );
+        out += metric + buf;
+        sprintf( buf, "_count %.0f\n", (double) count );
+        out += metric + buf;
+    }
+
+    /* CHistogram::WriteAll
+     * Appends all histograms.
+     */
+    void CHistogram::WriteAll(std::string & out)
+    {
+        for(int i = 0; i < HISTOGRAM_MAX; i++)
+            histograms[i]->write( out );
+    }
+
+    /* CHistogramContext::CHistogramContext
+     * Takes a shard set given up by an earlier thread, or a new one. Without memory the
+     * thread records into the shared counts.
+     */
+    CHistogramContext::CHistogramContext()
+    {
+        HistogramShardSet * set;
+        bool created = false;
+
+        m_set = NULL;
+        if( currentSet )
+            return;     /* nested, the outer context owns the set */
+
+        shardLock.acquire();
+        for(set = shardSets; set; set = set->next) {
+            if( set->retired )
+                break;
+        }
+
+        if( !set )
+        {
+            if( (set = new (std::nothrow) HistogramShardSet) != NULL ) {
+                memset( (void *) set->shards, 0, sizeof(set->shards) );
+                set->next   = shardSets;
+                created     = true;
+            }
+        }
+
+        if( set ) {
+            set->retired = false;
+            HISTOGRAM_BARRIER();
+            if( created )       /* publish the set to the readers */
+                shardSets = set;
+        }
+        shardLock.release();
+
+        currentSet = m_set = set;
+    }
+
+    /* CHistogramContext::~CHistogramContext
+     * Gives the set up, its counts stay with it.
+     */
+    CHistogramContext::~CHistogramContext()
+    {
+        if( m_set ) {
+            currentSet = NULL;
+            shardLock.acquire();
+            m_set->retired = true;
+            shardLock.release();
+        }
+    }
+};
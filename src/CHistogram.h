@@ -0,0 +1,126 @@
+/* CHistogram.h
+ * Latency histograms.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CHISTOGRAM_H_
+#define _CHISTOGRAM_H_
+
+/* C/C++ includes */
+#include <string>
+
+/* project includes */
+#include "types.h"
+
+/* each power of two is split into 2^HISTOGRAM_SUB_BITS buckets, the relative error of a
+   recorded value is below 1 / 2^HISTOGRAM_SUB_BITS */
+#define HISTOGRAM_SUB_BITS          (4)
+#define HISTOGRAM_SUB_BUCKETS       (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXPONENT      (40)        /* values up to 2^41 ns, about 36 minutes */
+#define HISTOGRAM_BUCKETS           ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+/* the recorded latencies */
+enum
+{
+    HISTOGRAM_VERSION_EXCHANGE = 0,     /* exchange of the protocol version strings */
+    HISTOGRAM_KEYEXCHANGE,              /* SSH_MSG_KEXINIT until both SSH_MSG_NEWKEYS */
+    HISTOGRAM_DH_COMPUTE,               /* computation of the shared secret */
+    HISTOGRAM_SIGN,                     /* signature of the exchange hash */
+    HISTOGRAM_NEWKEYS,                  /* key derivation and cipher setup */
+    HISTOGRAM_AUTHENTICATION,           /* the user authentication */
+    HISTOGRAM_PACKET_OPEN,              /* decryption and mac of a received packet */
+    HISTOGRAM_PACKET_SEAL,              /* mac and encryption of a sent packet */
+    HISTOGRAM_MAX
+};
+
+namespace ssh
+{
+    /* HistogramShard
+     * The values a single thread recorded into one of the HISTOGRAM_* histograms. Only the
+     * owning thread updates them, so they are plain integers.
+     */
+    struct HistogramShard
+    {
+        volatile uint32_t   buckets[HISTOGRAM_BUCKETS];
+        volatile uint64_t   count,
+                            sum;
+    };
+
+    /* HistogramShardSet
+     * The shards of all HISTOGRAM_* histograms of a thread.
+     */
+    struct HistogramShardSet
+    {
+        HistogramShard      shards[HISTOGRAM_MAX];
+        volatile bool       retired;    /* the owner is gone, the set is reused */
+        HistogramShardSet * next;
+    };
+
+    /* CHistogram
+     * Records durations in nanoseconds into log-linear buckets. A thread inside a
+     * CHistogramContext records the HISTOGRAM_* histograms into its own shards, other
+     * threads and the stand-alone histograms use atomic increments, so recording never
+     * takes a lock. Readers sum the live counts, a quantile may be off by the values
+     * recorded while it is computed.
+     */
+    class CHistogram
+    {
+    public:
+        /* id is one of HISTOGRAM_*, or -1 for a histogram of its own */
+        CHistogram(const char * name, const char * help, int id = -1);
+
+        /* records a duration */
+        void record(uint64_t ns);
+
+        /* returns the value below which the fraction q of the recorded values lie */
+        uint64_t quantile(double q) const;
+        uint64_t GetCount() const;
+        uint64_t GetSum() const;
+
+        /* appends the histogram as a Prometheus summary */
+        void write(std::string &) const;
+
+        /* returns one of the HISTOGRAM_* histograms */
+        static CHistogram & Get(int id);
+        /* appends all histograms */
+        static void WriteAll(std::string &);
+
+    protected:
+        static int      bucketIndex(uint64_t ns);
+        static uint64_t bucketValue(int index);
+        static uint64_t quantile(const uint64_t * buckets, double q);
+
+        /* adds the counts of the histogram and its shards */
+        void sum(uint64_t * buckets, uint64_t & count, uint64_t & sum) const;
+
+        const char *        m_name;
+        const char *        m_help;
+        int                 m_id;
+        volatile uint32_t   m_buckets[HISTOGRAM_BUCKETS];
+        volatile uint64_t   m_count,
+                            m_sum;
+
+    private:
+        CHistogram(const CHistogram &);
+        CHistogram & operator=(const CHistogram &);
+    };
+
+    /* CHistogramContext
+     * Gives the current thread shards of its own for the HISTOGRAM_* histograms, so the
+     * connection threads do not share cache lines when they record a packet. The counts are
+     * kept when the context ends and the shards are reused by the next thread, the memory
+     * follows the number of threads that record at the same time.
+     */
+    class CHistogramContext
+    {
+    public:
+        CHistogramContext();
+        ~CHistogramContext();
+
+    protected:
+        HistogramShardSet * m_set;
+    };
+};
+
+#endif
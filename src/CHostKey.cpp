@@ -6,6 +6,9 @@
 
 #include "CHostKey.h"
 #include "rsa.h"
+#include "ecdsa.h"
+#include "ed25519.h"
+#include "ArrayStream.h"
 
 namespace ssh
 {
@@ -19,6 +22,57 @@ namespace ssh
             /* RSA */
             return new (std::nothrow) ssh::rsa;
         } 
+        else if( name == "ecdsa-sha2-nistp256" )
+        {
+            /* ECDSA using the NIST P-256 curve */
+            return new (std::nothrow) ssh::ecdsa;
+        }
+#if defined(SSHD_HAVE_ED25519)
+        else if( name == "ssh-ed25519" )
+        {
+            /* Ed25519 */
+            return new (std::nothrow) ssh::ed25519;
+        }
+#endif
         return NULL;
     }
+
+    /* CHostKey::CacheKeyblob
+     * Serializes the public key blob so later keyexchanges only copy it.
+     */
+    bool CHostKey::CacheKeyblob()
+    {
+        byte src[MAX_HOSTKEY_KEYBLOB_LENGTH];
+        ArrayWriteStream as( src, sizeof(src) );
+
+        if( !WritePublicKey( as ) )
+            return false;
+
+        m_keyblob.assign( src, src + as.GetUsage() );
+        return true;
+    }
+
+    /* CHostKey::WriteKeyblob
+     * Writes a keyblob containing the public key, the blob begins with its length.
+     */
+    bool CHostKey::WriteKeyblob( CStream & stream )
+    {
+        if( !m_keyblob.empty() ) {
+            return stream.writeInt32( static_cast<uint32>(m_keyblob.size()) ) &&
+                   stream.writeVector( m_keyblob );
+        }
+
+        byte src[MAX_HOSTKEY_KEYBLOB_LENGTH];
+        ArrayWriteStream as( src, sizeof(src) );
+
+        if( !WritePublicKey( as ) )
+            return false;
+
+        if( !stream.writeInt32( as.GetUsage() ) ||
+            !stream.writeBytes( src, as.GetUsage() ) )
+        {
+            return false;
+        }
+        return true;
+    }
 };
\ No newline at end of file
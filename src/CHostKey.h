@@ -3,10 +3,22 @@
 
 /* project includes */
 #include "types.h"
+#include "defines.h"
 #include "CStream.h"
 #include "CAlgorithm.h"
 #include "CSettings.h"
 
+#if defined(USE_OPENSSL)
+#include <openssl/opensslv.h>
+/* Ed25519 is only available through the EVP interface in OpenSSL 1.1.1 and later */
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define SSHD_HAVE_ED25519
+#endif
+#endif
+
+/* upper limit of a serialized public key blob */
+#define MAX_HOSTKEY_KEYBLOB_LENGTH  (4096)
+
 namespace ssh
 {
     /* CHostKey
@@ -20,6 +32,9 @@ namespace ssh
 
         int GetType() {return CAlgorithm::HOSTKEY;}
 
+        /* returns the name of the hostkey algorithm */
+        virtual const char * GetName() const                    = 0;
+
         /*
          * Client operations.
          */
@@ -27,7 +42,10 @@ namespace ssh
         virtual bool ParseKeyblob( const byte *, uint32 )       = 0;
         virtual bool ParseKeyblob( CStream & stream )           = 0;
 
-        virtual bool WriteKeyblob( CStream & stream )           = 0;
+        /* writes the length prefixed public key blob, uses the cached blob if one is built */
+        bool WriteKeyblob( CStream & stream );
+        /* serializes the public key blob once, the key must not change afterwards */
+        bool CacheKeyblob();
 
         /* Parses the signature blob sent by the server */
         virtual bool ParseSignature( const byte *, uint32 )     = 0;;
@@ -50,6 +68,9 @@ namespace ssh
          * Factory function.
          */
         static CHostKey * CreateInstance(const std::string &);
+
+    protected:
+        ByteVector m_keyblob;   /* the cached public key blob, empty if not built */
     };
 };
 
@@ -0,0 +1,148 @@
+/* CHostKeySet.cpp
+ * Implements the set of resident host keys.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* project includes */
+#include "CHostKeySet.h"
+#include "sshd.h"
+#include "util.h"
+
+/* C/C++ includes */
+#include <algorithm>
+
+using namespace std;
+
+namespace ssh
+{
+    /* the hostkey algorithms the server is able to load */
+    static const char * hostkeyAlgorithms[] = {
+        "ssh-ed25519",
+        "ecdsa-sha2-nistp256",
+        "ssh-rsa"
+    };
+
+    /* CHostKeySet::CHostKeySet
+     * Constructor.
+     */
+    CHostKeySet::CHostKeySet()
+    {
+    }
+
+    /* CHostKeySet::~CHostKeySet
+     * Destructor, deletes the keys.
+     */
+    CHostKeySet::~CHostKeySet()
+    {
+        for(vector<Entry>::iterator it = m_keys.begin(); it != m_keys.end(); it++) {
+            delete it->key;
+        }
+    }
+
+    /* CHostKeySet::load
+     * Loads every host key that is configured in the settings. Algorithms without a
+     * configured key file are skipped.
+     */
+    int CHostKeySet::load(const CSettings & settings)
+    {
+        int count = 0;
+
+        for(size_t i = 0; i < sizeof(hostkeyAlgorithms) / sizeof(hostkeyAlgorithms[0]); i++)
+        {
+            CHostKey * key = CHostKey::CreateInstance( hostkeyAlgorithms[i] );
+            if( !key )
+                continue;   /* not supported by this build */
+
+            if( !key->loadKeys( settings ) || !add( key ) ) {
+                delete key;
+                continue;
+            }
+            count++;
+        }
+        return count;
+    }
+
+    /* CHostKeySet::add
+     * Adds a key to the set, replacing any key for the same algorithm. The public key blob
+     * is serialized once here, the keys never change while they are resident.
+     */
+    bool CHostKeySet::add(CHostKey * key)
+    {
+        if( !key || !key->CacheKeyblob() )
+            return false;
+
+        for(vector<Entry>::iterator it = m_keys.begin(); it != m_keys.end(); it++) {
+            if( !strcmp(it->key->GetName(), key->GetName()) ) {
+                delete it->key;
+                it->key = key;
+                return true;
+            }
+        }
+
+        Entry entry = {key, 0};
+        m_keys.push_back( entry );
+        return true;
+    }
+
+    /* CHostKeySet::calibrate
+     * Signs a dummy exchange hash with each key a number of times and orders the keys
+     * from the cheapest to the most expensive one.
+     */
+    void CHostKeySet::calibrate(int rounds)
+    {
+        vector<byte> hash(20, 0x5A), signature;
+
+        if( rounds <= 0 )
+            return;
+
+        for(vector<Entry>::iterator it = m_keys.begin(); it != m_keys.end(); it++)
+        {
+            uint64_t start = GetMonotonicTime();
+            for(int i = 0; i < rounds; i++) {
+                if( !it->key->Sign( hash, signature ) ) {
+                    sshd_Log(sshd_EVENT_WARNING, "Failed to sign with host key during calibration.");
+                    break;
+                }
+            }
+            it->cost = (GetMonotonicTime() - start) / rounds;
+        }
+
+        /* keep the configured order for keys with the same cost */
+        stable_sort( m_keys.begin(), m_keys.end(), CHostKeySet::compareCost );
+    }
+
+    /* CHostKeySet::compareCost
+     * Orders the entries by signing cost.
+     */
+    bool CHostKeySet::compareCost(const Entry & a, const Entry & b)
+    {
+        return a.cost < b.cost;
+    }
+
+    /* CHostKeySet::find
+     * Returns the key used for the algorithm.
+     */
+    CHostKey * CHostKeySet::find(const std::string & name) const
+    {
+        for(vector<Entry>::const_iterator it = m_keys.begin(); it != m_keys.end(); it++) {
+            if( name == it->key->GetName() )
+                return it->key;
+        }
+        return NULL;
+    }
+
+    /* CHostKeySet::GetAlgorithmList
+     * Returns the name-list of the loaded keys in the order they should be advertised.
+     */
+    std::string CHostKeySet::GetAlgorithmList() const
+    {
+        string list;
+        for(vector<Entry>::const_iterator it = m_keys.begin(); it != m_keys.end(); it++) {
+            if( !list.empty() )
+                list += ",";
+            list += it->key->GetName();
+        }
+        return list;
+    }
+};
@@ -0,0 +1,62 @@
+/* CHostKeySet.h
+ * The set of host keys loaded by the server.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CHOSTKEYSET_H_
+#define _CHOSTKEYSET_H_
+
+/* C/C++ includes */
+#include <string>
+#include <vector>
+
+/* project includes */
+#include "types.h"
+#include "CHostKey.h"
+#include "CSettings.h"
+
+/* number of signatures made per key when measuring the signing cost */
+#define HOSTKEY_CALIBRATION_ROUNDS      (8)
+
+namespace ssh
+{
+    /* CHostKeySet
+     * Keeps the server's host keys resident for the lifetime of the server. The keys are
+     * ordered by the measured cost of a signature, cheapest first, which is the order they
+     * are advertised in. The keys are shared by all connections and must only be used for
+     * const operations (Sign, WriteKeyblob, WriteSignature) once the set has been loaded.
+     */
+    class CHostKeySet
+    {
+    public:
+        CHostKeySet();
+        ~CHostKeySet();
+
+        /* loads the host keys configured in the settings, returns the number of keys loaded */
+        int load(const CSettings &);
+        /* adds a key to the set, the set takes ownership of the key */
+        bool add(CHostKey *);
+        /* measures the cost of signing with each key and orders the keys by it */
+        void calibrate(int rounds = HOSTKEY_CALIBRATION_ROUNDS);
+
+        /* returns the key for the algorithm, or NULL if no such key is loaded */
+        CHostKey * find(const std::string &) const;
+        /* returns the comma separated list of algorithms, cheapest first */
+        std::string GetAlgorithmList() const;
+
+        bool empty() const {return m_keys.empty();}
+
+    protected:
+        struct Entry {
+            CHostKey *  key;    /* the key */
+            uint64_t    cost;   /* average time for a signature in nanoseconds */
+        };
+
+        static bool compareCost(const Entry &, const Entry &);
+
+        std::vector<Entry> m_keys;
+    };
+};
+
+#endif
@@ -13,18 +13,27 @@
 namespace ssh
 {
     /* CKeyExchange::CreateInstance
-     * Creates a keyexchange instance based on the supplied name.
+     * Creates a keyexchange instance based on the supplied name. The instance lives in the
+     * transport's keyexchange arena and is destroyed with Destroy().
      */
     CKeyExchange * CKeyExchange::CreateInstance(const std::string & name, CTransport * ts)
     {
         if( name == "diffie-hellman-group1-sha1" ) 
         {
-            return new (std::nothrow) CDiffieHellman( ts, DH_group1_safe_prime,DH_group1_generator );
+            return ts->getKexArena().create<CDiffieHellman>( ts, DH_group1_safe_prime,DH_group1_generator );
         }
         else if( name == "diffie-hellman-group14-sha1" )
         {
-            return new (std::nothrow) CDiffieHellman( ts, DH_group14_safe_prime,DH_group14_generator );
+            return ts->getKexArena().create<CDiffieHellman>( ts, DH_group14_safe_prime,DH_group14_generator );
         }
         return NULL;
     }
+
+    /* CKeyExchange::Destroy
+     * Destroys an instance created by CreateInstance, the memory is released with the arena.
+     */
+    void CKeyExchange::Destroy(CKeyExchange * kex)
+    {
+        CArena::destroy( kex );
+    }
 };
\ No newline at end of file
@@ -24,8 +24,11 @@ namespace ssh
 
         int GetType() {return CAlgorithm::KEYEXCHANGE;}
 
-        virtual int ServerKeyExchange(CHostKey *, bool guess)   = 0;    /* performs the server-side keyexchange */
-        virtual int ClientKeyExchange(CHostKey *, bool guess)   = 0;    /* performs the client-side keyexchange */
+        /* the keyexchange is driven by the transport, packets are handled one at a time */
+        virtual bool ClientWriteInit()                          = 0;    /* writes the client's first packet to the output buffer */
+        virtual int ClientHandleReply(CHostKey *)               = 0;    /* handles the server's reply in the input buffer */
+        virtual int ServerHandleInit(CHostKey *)                = 0;    /* handles the client's first packet in the input buffer */
+        virtual bool ServerWriteReply(CHostKey *)               = 0;    /* writes the server's reply to the output buffer */
 
         const CBigInt * GetSharedSecret()           {return m_secret;}      /* returns the shared secret */
         const std::vector<byte> & GetExchangeHash() {return m_exchange;}    /* returns the exchange hash */
@@ -34,6 +37,7 @@ namespace ssh
 
         /* factory */
         static CKeyExchange * CreateInstance(const std::string &, CTransport *);
+        static void Destroy(CKeyExchange *);
     protected:
         CBigInt *               m_secret;       /* the shared secret */
         CTransport *            m_ts;           /* required in order to send packets */
@@ -0,0 +1,357 @@
+/* CLogger.cpp
+ * Implements the asynchronous logging.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+/* project includes */
+#include "CLogger.h"
+#include "util.h"
+
+#if defined(WIN32) || defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define LOG_BARRIER()               MemoryBarrier()
+#define LOG_INCREMENT(p)            ((uint32_t) InterlockedIncrement( (volatile LONG *) (p) ))
+#else
+#include <time.h>
+#define LOG_BARRIER()               __sync_synchronize()
+#define LOG_INCREMENT(p)            __sync_add_and_fetch( (p), 1 )
+#endif
+
+namespace ssh
+{
+    /* the logger shared by all threads */
+    static CLogger logger;
+
+    /* the last connection identifier handed out */
+    static volatile uint32_t lastConnectionId = 0;
+
+    static const char * levelNames[] = {
+        "FATAL",
+        "WARNING",
+        "NOTIFY",
+        "DEBUG"
+    };
+
+    SSHD_THREAD_LOCAL CLogger::Ring * CLogger::s_current = NULL;
+
+    /* Pause
+     * Suspends the calling thread for a number of milliseconds.
+     */
+    static void Pause(int ms)
+    {
+#if defined(WIN32) || defined(_WIN32)
+        Sleep( ms );
+#else
+        struct timespec ts;
+        ts.tv_sec  = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000L;
+        nanosleep( &ts, NULL );
+#endif
+    }
+
+    /* CLogger::CLogger
+     * Constructor, messages are written directly until the writer thread is started.
+     */
+    CLogger::CLogger()
+    {
+        m_rings     = NULL;
+        m_running   = false;
+        m_start     = GetMonotonicTime();
+        m_batchSize = 0;
+    }
+
+    /* CLogger::~CLogger
+     * Destructor, frees the rings.
+     */
+    CLogger::~CLogger()
+    {
+        stop();
+
+        Ring * ring = m_rings;
+        while( ring ) {
+            Ring * next = ring->next;
+            delete ring;
+            ring = next;
+        }
+    }
+
+    /* CLogger::GetInstance
+     * Returns the logger shared by all threads.
+     */
+    CLogger & CLogger::GetInstance()
+    {
+        return logger;
+    }
+
+    /* CLogger::NextConnectionId
+     * Returns a new connection identifier, identifiers start at one.
+     */
+    uint32_t CLogger::NextConnectionId()
+    {
+        return LOG_INCREMENT( &lastConnectionId );
+    }
+
+    /* CLogger::start
+     * Starts the writer thread, messages are queued from now on.
+     */
+    bool CLogger::start()
+    {
+        if( m_running )
+            return true;
+
+        m_running = true;
+        if( !spawn() ) {
+            m_running = false;
+            return false;
+        }
+        return true;
+    }
+
+    /* CLogger::stop
+     * Stops the writer thread once the queued messages have been written. Messages that are
+     * queued while the writer is stopping may be lost.
+     */
+    void CLogger::stop()
+    {
+        if( !m_running )
+            return;
+
+        m_running = false;      /* new messages are written directly */
+        shutdown();
+        wait();
+    }
+
+    /* CLogger::Log
+     * Appends a record to the ring of the calling thread. The thread is given a ring the
+     * first time it logs outside of a CLogContext.
+     */
+    void CLogger::Log(int event, const char * message)
+    {
+        Ring * ring = s_current;
+
+        if( !logger.m_running ) {
+            logger.writeDirect( event, ring ? ring->connection : 0, message );
+            return;
+        }
+
+        if( !ring ) {
+            if( !(ring = logger.attach( 0 )) ) {
+                logger.writeDirect( event, 0, message );
+                return;
+            }
+            s_current = ring;
+        }
+
+        uint32_t head = ring->head;
+        if( head - ring->tail >= SSHD_LOG_RING_SIZE ) {
+            ring->dropped++;    /* never wait for the writer */
+            return;
+        }
+
+        Record & record = ring->records[head & (SSHD_LOG_RING_SIZE - 1)];
+        record.time         = GetMonotonicTime();
+        record.message      = message;
+        record.connection   = ring->connection;
+        record.event        = event;
+
+        /* the record must be complete before the writer can see it */
+        LOG_BARRIER();
+        ring->head = head + 1;
+    }
+
+    /* CLogger::attach
+     * Returns a drained ring that has been given up by its previous owner, or a new one.
+     */
+    CLogger::Ring * CLogger::attach(uint32_t connection)
+    {
+        Ring * ring;
+        bool created = false;
+
+        m_lock.acquire();
+        for(ring = m_rings; ring; ring = ring->next) {
+            if( ring->retired && ring->head == ring->tail )
+                break;
+        }
+
+        if( !ring )
+        {
+            if( (ring = new (std::nothrow) Ring) != NULL ) {
+                ring->head      = 0;
+                ring->tail      = 0;
+                ring->dropped   = 0;
+                ring->reported  = 0;
+                ring->next      = m_rings;
+                created         = true;
+            }
+        }
+
+        if( ring ) {
+            ring->connection    = connection;
+            ring->retired       = false;
+            LOG_BARRIER();
+            if( created )       /* publish the ring to the writer */
+                m_rings = ring;
+        }
+        m_lock.release();
+        return ring;
+    }
+
+    /* CLogger::detach
+     * Gives up a ring, the writer still drains the records left in it.
+     */
+    void CLogger::detach(Ring * ring)
+    {
+        LOG_BARRIER();
+        ring->retired = true;
+    }
+
+    /* CLogger::Task
+     * The writer thread, drains the rings and writes the messages in batches.
+     */
+    void CLogger::Task()
+    {
+        while( !m_abortEvent.isSignaled() )
+        {
+            bool busy = false;
+
+            for(Ring * ring = m_rings; ring; ring = ring->next) {
+                if( drain( ring ) )
+                    busy = true;
+            }
+            flush();
+
+            if( !busy )
+                Pause( SSHD_LOG_FLUSH_INTERVAL );
+        }
+
+        /* write what is left */
+        for(Ring * ring = m_rings; ring; ring = ring->next)
+            drain( ring );
+        flush();
+    }
+
+    /* CLogger::drain
+     * Formats the records queued in the ring, returns true if there were any.
+     */
+    bool CLogger::drain(Ring * ring)
+    {
+        uint32_t tail = ring->tail,
+                 head = ring->head;
+
+        /* read the records only after the head that published them */
+        LOG_BARRIER();
+
+        if( ring->dropped != ring->reported ) {
+            char line[96];
+            uint32_t dropped = ring->dropped;
+            int len = formatPrefix( line, sshd_EVENT_WARNING, ring->connection, GetMonotonicTime() );
+            sprintf( line + len, "%u log messages dropped.\r\n", dropped - ring->reported );
+            flush();
+            fputs( line, stderr );
+            ring->reported = dropped;
+        }
+
+        if( tail == head )
+            return false;
+
+        for(; tail != head; tail++)
+            format( ring->records[tail & (SSHD_LOG_RING_SIZE - 1)] );
+
+        /* the slots may be reused once the tail has moved */
+        LOG_BARRIER();
+        ring->tail = tail;
+        return true;
+    }
+
+    /* CLogger::formatPrefix
+     * Writes the time, level and connection of a message, returns the length.
+     */
+    int CLogger::formatPrefix(char * dst, uint32_t event, uint32_t connection, uint64_t time) const
+    {
+        const char * level = event < sizeof(levelNames) / sizeof(levelNames[0]) ? levelNames[event] : "?";
+
+        time -= m_start;
+        if( connection )
+            return sprintf( dst, "%lu.%06lu %-7s [%u] ", (unsigned long) (time / 1000000000ULL),
+                            (unsigned long) ((time % 1000000000ULL) / 1000), level, connection );
+        return sprintf( dst, "%lu.%06lu %-7s ", (unsigned long) (time / 1000000000ULL),
+                        (unsigned long) ((time % 1000000000ULL) / 1000), level );
+    }
+
+    /* CLogger::format
+     * Appends a formatted record to the batch, the batch is written out when it is full.
+     */
+    void CLogger::format(const Record & record)
+    {
+        char prefix[64];
+        int len     = formatPrefix( prefix, record.event, record.connection, record.time );
+        size_t size = strlen( record.message );
+
+        if( m_batchSize + len + size + 2 > sizeof(m_batch) )
+            flush();
+
+        if( len + size + 2 > sizeof(m_batch) ) {
+            /* a huge message, write it as it is */
+            fprintf( stderr, "%s%s\r\n", prefix, record.message );
+            return;
+        }
+
+        memcpy( m_batch + m_batchSize, prefix, len );
+        m_batchSize += len;
+        memcpy( m_batch + m_batchSize, record.message, size );
+        m_batchSize += size;
+        m_batch[m_batchSize++] = '\r';
+        m_batch[m_batchSize++] = '\n';
+    }
+
+    /* CLogger::flush
+     * Writes the batch to the output.
+     */
+    void CLogger::flush()
+    {
+        if( m_batchSize ) {
+            fwrite( m_batch, 1, m_batchSize, stderr );
+            fflush( stderr );
+            m_batchSize = 0;
+        }
+    }
+
+    /* CLogger::writeDirect
+     * Writes a message from the calling thread, used while the writer is not running.
+     */
+    void CLogger::writeDirect(int event, uint32_t connection, const char * message)
+    {
+        char prefix[64];
+        formatPrefix( prefix, event, connection, GetMonotonicTime() );
+        fprintf( stderr, "%s%s\r\n", prefix, message );
+    }
+
+    /* CLogContext::CLogContext
+     * Borrows a ring for the messages of the connection.
+     */
+    CLogContext::CLogContext(uint32_t connection)
+    {
+        m_previous  = CLogger::s_current;
+        m_ring      = logger.attach( connection );
+        if( m_ring )
+            CLogger::s_current = m_ring;
+    }
+
+    /* CLogContext::~CLogContext
+     * Gives the ring back, the thread logs through its previous ring again.
+     */
+    CLogContext::~CLogContext()
+    {
+        if( m_ring ) {
+            CLogger::s_current = m_previous;
+            logger.detach( m_ring );
+        }
+    }
+};
@@ -0,0 +1,146 @@
+/* CLogger.h
+ * Asynchronous logging.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CLOGGER_H_
+#define _CLOGGER_H_
+
+/* project includes */
+#include "types.h"
+#include "Mutex.h"
+#include "CThread.h"
+
+namespace ssh
+{
+    /* log levels, the most severe first */
+    typedef enum
+    {
+        sshd_EVENT_FATAL = 0,       /* fatal error */
+        sshd_EVENT_WARNING,         /* warning */
+        sshd_EVENT_NOTIFY,          /* general notification */
+        sshd_EVENT_DEBUG            /* debug output */
+    } LogEvents;
+};
+
+/* the least severe level compiled in, messages above it cost nothing */
+#ifndef SSHD_LOG_LEVEL
+#if defined(_DEBUG)
+#define SSHD_LOG_LEVEL      ssh::sshd_EVENT_DEBUG
+#else
+#define SSHD_LOG_LEVEL      ssh::sshd_EVENT_NOTIFY
+#endif
+#endif
+
+/* the message must be a string literal, only the pointer to it is queued */
+#define sshd_Log(event, message) \
+    do{ if( (event) <= SSHD_LOG_LEVEL ) ssh::CLogger::Log( (event), "" message ); } while(0)
+
+#define SSHD_LOG_RING_SIZE          (256)           /* records per thread, a power of two */
+#define SSHD_LOG_BATCH_SIZE         (16 * 1024)     /* bytes written to the output at a time */
+#define SSHD_LOG_FLUSH_INTERVAL     (10)            /* milliseconds the writer sleeps when idle */
+
+#if defined(WIN32) || defined(_WIN32)
+#define SSHD_THREAD_LOCAL           __declspec(thread)
+#else
+#define SSHD_THREAD_LOCAL           __thread
+#endif
+
+namespace ssh
+{
+    /* CLogger
+     * Moves the formatting and the writing of log messages off the connection threads. Each
+     * thread appends fixed size records to its own single producer, single consumer ring,
+     * which takes no locks, and a background thread drains the rings and writes the
+     * formatted messages to stderr in batches. A thread never blocks on the output, when its
+     * ring is full the record is dropped and counted.
+     *
+     * Until the writer thread has been started, and after it has been stopped, messages are
+     * written directly.
+     */
+    class CLogger : public Util::CThread
+    {
+    public:
+        CLogger();
+        ~CLogger();
+
+        /* starts the writer thread */
+        bool start();
+        /* writes the queued messages and stops the writer thread */
+        void stop();
+
+        /* queues a message from the calling thread, the message must have static storage */
+        static void Log(int event, const char * message);
+        /* returns a new connection identifier */
+        static uint32_t NextConnectionId();
+
+        /* the logger shared by all threads */
+        static CLogger & GetInstance();
+
+    protected:
+        friend class CLogContext;
+
+        struct Record {
+            uint64_t        time;           /* monotonic time in nanoseconds */
+            const char *    message;
+            uint32_t        connection;
+            uint32_t        event;
+        };
+
+        /* Ring
+         * The head is only written by the owning thread and the tail only by the writer.
+         */
+        struct Ring {
+            Record              records[SSHD_LOG_RING_SIZE];
+            volatile uint32_t   head,
+                                tail;
+            volatile uint32_t   dropped;        /* records lost because the ring was full */
+            uint32_t            reported;       /* drops already reported by the writer */
+            uint32_t            connection;     /* connection of the owning thread */
+            volatile bool       retired;        /* the owner is gone, reused once drained */
+            Ring *              next;
+        };
+
+        void Task();
+
+        Ring *  attach(uint32_t connection);
+        void    detach(Ring *);
+        bool    drain(Ring *);
+        void    format(const Record &);
+        void    flush();
+        void    writeDirect(int event, uint32_t connection, const char * message);
+        int     formatPrefix(char * dst, uint32_t event, uint32_t connection, uint64_t time) const;
+
+        static SSHD_THREAD_LOCAL Ring * s_current;  /* the ring of the calling thread */
+
+        Ring * volatile     m_rings;            /* rings are never freed while running */
+        volatile bool       m_running;
+        uint64_t            m_start;            /* the times are printed relative to it */
+        char                m_batch[SSHD_LOG_BATCH_SIZE];
+        uint32_t            m_batchSize;
+        Util::Mutex         m_lock;             /* taken when rings are attached */
+
+    private:
+        CLogger(const CLogger &);
+        CLogger & operator=(const CLogger &);
+    };
+
+    /* CLogContext
+     * Tags the messages of the current thread with a connection. The thread borrows a ring
+     * for as long as the context exists, the ring is reused by another thread once its
+     * records have been written.
+     */
+    class CLogContext
+    {
+    public:
+        CLogContext(uint32_t connection);
+        ~CLogContext();
+
+    protected:
+        CLogger::Ring * m_ring;
+        CLogger::Ring * m_previous;
+    };
+};
+
+#endif
@@ -0,0 +1,481 @@
+/* CMemoryNetwork.cpp
+ * Implements the in-process byte stream.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstring>
+#include <new>
+
+/* project includes */
+#include "CMemoryNetwork.h"
+#include "util.h"
+
+#if defined(WIN32) || defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#define MEMORY_MAX_LINE             (1024)
+
+namespace ssh
+{
+    /* CMemoryPipe
+     * The state shared by the two ends, a ring buffer for each direction. Channel n is read
+     * by end n and written by the other end.
+     */
+    class CMemoryPipe
+    {
+    public:
+        CMemoryPipe(uint32_t capacity);
+        ~CMemoryPipe();
+
+        bool init();
+
+        int  read(int channel, byte * dst, int count, int * rcount, bool block);
+        int  write(int channel, const byte * src, int count, int * wcount, bool block);
+        bool waitReadable(int channel, int timeout);
+        bool waitWritable(int channel, int timeout);
+        void setListener(int side, INetworkListener *, void *);
+        void close();
+
+    protected:
+        struct Channel {
+            byte *      data;
+            uint32_t    head,           /* first byte to read */
+                        count;          /* bytes buffered */
+        };
+
+        bool readable(int channel) const    {return m_closed || m_channels[channel].count > 0;}
+        bool writable(int channel) const    {return m_closed || m_channels[channel].count < m_capacity;}
+        bool waitUntil(bool (CMemoryPipe::*ready)(int) const, int channel, int timeout);
+
+        /* wakes the waiting ends and tells their listeners, with the lock held */
+        void broadcast();
+
+        /* platform primitives, wait returns when signalled or after ms milliseconds, a
+           negative time waits forever */
+        void lock();
+        void unlock();
+        void wait(int ms);
+        void wakeAll();
+
+        Channel     m_channels[2];
+        INetworkListener *  m_listeners[2];     /* of each end */
+        void *              m_listenerContexts[2];
+        uint32_t    m_capacity;
+        bool        m_closed;
+        bool        m_initialized;
+
+#if defined(WIN32) || defined(_WIN32)
+        CRITICAL_SECTION    m_lock;
+        CONDITION_VARIABLE  m_cond;
+#else
+        pthread_mutex_t     m_lock;
+        pthread_cond_t      m_cond;
+#endif
+    };
+
+    /* CMemoryPipe::CMemoryPipe
+     * Constructor, the buffers are allocated by init.
+     */
+    CMemoryPipe::CMemoryPipe(uint32_t capacity)
+    {
+        memset( m_channels, 0, sizeof(m_channels) );
+        memset( m_listeners, 0, sizeof(m_listeners) );
+        memset( m_listenerContexts, 0, sizeof(m_listenerContexts) );
+        m_capacity      = capacity;
+        m_closed        = false;
+        m_initialized   = false;
+    }
+
+    /* CMemoryPipe::~CMemoryPipe
+     * Destructor.
+     */
+    CMemoryPipe::~CMemoryPipe()
+    {
+        delete [] m_channels[0].data;
+        delete [] m_channels[1].data;
+
+        if( m_initialized ) {
+#if defined(WIN32) || defined(_WIN32)
+            DeleteCriticalSection( &m_lock );
+#else
+            pthread_cond_destroy( &m_cond );
+            pthread_mutex_destroy( &m_lock );
+#endif
+        }
+    }
+
+    /* CMemoryPipe::init
+     * Allocates the buffers and the synchronization objects.
+     */
+    bool CMemoryPipe::init()
+    {
+        if( !m_capacity ||
+            !(m_channels[0].data = new (std::nothrow) byte[m_capacity]) ||
+            !(m_channels[1].data = new (std::nothrow) byte[m_capacity]) )
+        {
+            return false;
+        }
+
+#if defined(WIN32) || defined(_WIN32)
+        InitializeCriticalSection( &m_lock );
+        InitializeConditionVariable( &m_cond );
+#else
+        if( pthread_mutex_init( &m_lock, NULL ) != 0 )
+            return false;
+        if( pthread_cond_init( &m_cond, NULL ) != 0 ) {
+            pthread_mutex_destroy( &m_lock );
+            return false;
+        }
+#endif
+        m_initialized = true;
+        return true;
+    }
+
+#if defined(WIN32) || defined(_WIN32)
+
+    void CMemoryPipe::lock()        {EnterCriticalSection( &m_lock );}
+    void CMemoryPipe::unlock()      {LeaveCriticalSection( &m_lock );}
+    void CMemoryPipe::wakeAll()     {WakeAllConditionVariable( &m_cond );}
+
+    void CMemoryPipe::wait(int ms)
+    {
+        SleepConditionVariableCS( &m_cond, &m_lock, ms < 0 ? INFINITE : ms );
+    }
+
+#else
+
+    void CMemoryPipe::lock()        {pthread_mutex_lock( &m_lock );}
+    void CMemoryPipe::unlock()      {pthread_mutex_unlock( &m_lock );}
+    void CMemoryPipe::wakeAll()     {pthread_cond_broadcast( &m_cond );}
+
+    void CMemoryPipe::wait(int ms)
+    {
+        if( ms < 0 ) {
+            pthread_cond_wait( &m_cond, &m_lock );
+            return;
+        }
+
+        /* the condition variable uses the wall clock */
+        struct timeval now;
+        struct timespec until;
+        gettimeofday( &now, NULL );
+        until.tv_sec    = now.tv_sec + ms / 1000;
+        until.tv_nsec   = now.tv_usec * 1000L + (ms % 1000) * 1000000L;
+        if( until.tv_nsec >= 1000000000L ) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait( &m_cond, &m_lock, &until );
+    }
+
+#endif
+
+    /* CMemoryPipe::broadcast
+     * Wakes the ends waiting for the pipe and tells the listeners.
+     */
+    void CMemoryPipe::broadcast()
+    {
+        wakeAll();
+        for(int i = 0; i < 2; i++) {
+            if( m_listeners[i] )
+                m_listeners[i]->OnNetworkEvent( m_listenerContexts[i] );
+        }
+    }
+
+    /* CMemoryPipe::waitUntil
+     * Waits with the lock held until the channel is ready, a timeout of zero only checks and
+     * a negative one waits forever.
+     */
+    bool CMemoryPipe::waitUntil(bool (CMemoryPipe::*ready)(int) const, int channel, int timeout)
+    {
+        uint64_t deadline = timeout > 0 ? GetMonotonicTime() + (uint64_t) timeout * 1000000ULL : 0;
+
+        while( !(this->*ready)( channel ) )
+        {
+            int ms = -1;
+
+            if( timeout == 0 )
+                return false;
+            if( timeout > 0 ) {
+                uint64_t now = GetMonotonicTime();
+                if( now >= deadline )
+                    return false;
+                ms = (int) ((deadline - now + 999999) / 1000000);
+            }
+            wait( ms );
+        }
+        return true;
+    }
+
+    /* CMemoryPipe::read
+     * Copies the buffered bytes of the channel, waits for data in blocking mode. Data
+     * written before the pipe was closed can still be read.
+     */
+    int CMemoryPipe::read(int channel, byte * dst, int count, int * rcount, bool block)
+    {
+        Channel & c = m_channels[channel];
+        uint32_t n, first;
+
+        if( !dst || count <= 0 )
+            return sshd_ERROR;
+
+        lock();
+        if( block )
+            waitUntil( &CMemoryPipe::readable, channel, -1 );
+
+        if( !c.count ) {
+            bool closed = m_closed;
+            unlock();
+            *rcount = 0;
+            return closed ? sshd_DISCONNECTED : sshd_OK;
+        }
+
+        n = c.count < (uint32_t) count ? c.count : (uint32_t) count;
+        first = m_capacity - c.head;
+        if( first > n )
+            first = n;
+
+        memcpy( dst, c.data + c.head, first );
+        memcpy( dst + first, c.data, n - first );
+        c.head   = (c.head + n) % m_capacity;
+        c.count -= n;
+
+        broadcast();
+        unlock();
+
+        *rcount = n;
+        return sshd_OK;
+    }
+
+    /* CMemoryPipe::write
+     * Appends bytes to the channel. A non-blocking write stores what fits, a blocking write
+     * waits until everything has been stored.
+     */
+    int CMemoryPipe::write(int channel, const byte * src, int count, int * wcount, bool block)
+    {
+        Channel & c = m_channels[channel];
+        uint32_t done = 0;
+
+        if( !src || count <= 0 )
+            return sshd_ERROR;
+
+        lock();
+        while( done < (uint32_t) count )
+        {
+            if( block )
+                waitUntil( &CMemoryPipe::writable, channel, -1 );
+            if( m_closed ) {
+                unlock();
+                *wcount = 0;    /* nothing reaches a closed pipe */
+                return sshd_ERROR;
+            }
+
+            uint32_t tail   = (c.head + c.count) % m_capacity,
+                     space  = m_capacity - c.count,
+                     n      = (uint32_t) count - done;
+            if( n > space )
+                n = space;
+            if( !n )
+                break;      /* full, non-blocking */
+
+            uint32_t first = m_capacity - tail;
+            if( first > n )
+                first = n;
+
+            memcpy( c.data + tail, src + done, first );
+            memcpy( c.data, src + done + first, n - first );
+            c.count += n;
+            done    += n;
+
+            broadcast();
+            if( !block )
+                break;
+        }
+        unlock();
+
+        *wcount = done;
+        return sshd_OK;
+    }
+
+    /* CMemoryPipe::waitReadable
+     * Returns true if data can be read, or the pipe has been closed.
+     */
+    bool CMemoryPipe::waitReadable(int channel, int timeout)
+    {
+        lock();
+        bool res = waitUntil( &CMemoryPipe::readable, channel, timeout );
+        unlock();
+        return res;
+    }
+
+    /* CMemoryPipe::waitWritable
+     * Returns true if there is space in the channel, or the pipe has been closed.
+     */
+    bool CMemoryPipe::waitWritable(int channel, int timeout)
+    {
+        lock();
+        bool res = waitUntil( &CMemoryPipe::writable, channel, timeout );
+        unlock();
+        return res;
+    }
+
+    /* CMemoryPipe::setListener
+     * Sets the listener of an end, it is told once right away in case data is waiting.
+     */
+    void CMemoryPipe::setListener(int side, INetworkListener * listener, void * context)
+    {
+        lock();
+        m_listeners[side]           = listener;
+        m_listenerContexts[side]    = context;
+        if( listener )
+            listener->OnNetworkEvent( context );
+        unlock();
+    }
+
+    /* CMemoryPipe::close
+     * Closes both directions and wakes any waiting end.
+     */
+    void CMemoryPipe::close()
+    {
+        lock();
+        m_closed = true;
+        broadcast();
+        unlock();
+    }
+
+    /* CMemoryNetwork::CMemoryNetwork
+     * Constructor.
+     */
+    CMemoryNetwork::CMemoryNetwork(const boost::shared_ptr<CMemoryPipe> & pipe, int side)
+        : m_pipe( pipe ), m_side( side )
+    {
+        m_blocking = true;
+    }
+
+    /* CMemoryNetwork::~CMemoryNetwork
+     * Destructor, the other end sees the stream as closed.
+     */
+    CMemoryNetwork::~CMemoryNetwork()
+    {
+        m_pipe->setListener( m_side, NULL, NULL );
+        disconnect();
+    }
+
+    /* CMemoryNetwork::CreatePair
+     * Creates two connected ends.
+     */
+    bool CMemoryNetwork::CreatePair(CMemoryNetwork ** first, CMemoryNetwork ** second, uint32_t capacity)
+    {
+        CMemoryPipe * p = new (std::nothrow) CMemoryPipe( capacity );
+        if( !p )
+            return false;
+
+        boost::shared_ptr<CMemoryPipe> pipe( p );
+        if( !pipe->init() )
+            return false;
+
+        *first  = new (std::nothrow) CMemoryNetwork( pipe, 0 );
+        *second = new (std::nothrow) CMemoryNetwork( pipe, 1 );
+        if( !*first || !*second ) {
+            delete *first;
+            delete *second;
+            *first = *second = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    /* CMemoryNetwork::disconnect
+     * Closes the stream in both directions.
+     */
+    void CMemoryNetwork::disconnect()
+    {
+        m_pipe->close();
+    }
+
+    /* CMemoryNetwork::dataAvailable
+     * Returns true if data is available, or the other end has closed the stream.
+     */
+    bool CMemoryNetwork::dataAvailable(int timeout)
+    {
+        return m_pipe->waitReadable( m_side, timeout );
+    }
+
+    /* CMemoryNetwork::writePossible
+     * Returns true if there is space for more data.
+     */
+    bool CMemoryNetwork::writePossible(int timeout)
+    {
+        return m_pipe->waitWritable( 1 - m_side, timeout );
+    }
+
+    /* CMemoryNetwork::setListener
+     * Reports the events of the pipe to the listener.
+     */
+    bool CMemoryNetwork::setListener(INetworkListener * listener, void * context)
+    {
+        m_pipe->setListener( m_side, listener, context );
+        return true;
+    }
+
+    /* CMemoryNetwork::readBytes
+     * Reads up to count bytes, sshd_DISCONNECTED once the stream is closed and drained.
+     */
+    int CMemoryNetwork::readBytes(byte * dst, int count, int * rcount)
+    {
+        return m_pipe->read( m_side, dst, count, rcount, m_blocking );
+    }
+
+    /* CMemoryNetwork::writeBytes
+     * Writes up to count bytes.
+     */
+    int CMemoryNetwork::writeBytes(const byte * src, int count, int * wcount)
+    {
+        return m_pipe->write( 1 - m_side, src, count, wcount, m_blocking );
+    }
+
+    /* CMemoryNetwork::writeLine
+     * Writes a CR LF terminated line, waits until all of it has been stored.
+     */
+    bool CMemoryNetwork::writeLine(const std::string & line)
+    {
+        std::string data = line + "\r\n";
+        int wcount;
+
+        return m_pipe->write( 1 - m_side, (const byte *) data.data(), (int) data.size(), &wcount, true ) == sshd_OK &&
+               wcount == (int) data.size();
+    }
+
+    /* CMemoryNetwork::readLine
+     * Reads a CR LF terminated line.
+     */
+    bool CMemoryNetwork::readLine(std::string & line)
+    {
+        char c, last = 0;
+        int rcount;
+
+        line.clear();
+        while( line.size() < MEMORY_MAX_LINE )
+        {
+            if( m_pipe->read( m_side, (byte *) &c, 1, &rcount, true ) != sshd_OK || rcount != 1 )
+                return false;
+
+            if( c == 0x0A ) {
+                if( last != 0x0D )
+                    return false;   /* a line feed without a carriage return */
+                line.erase( line.size() - 1 );
+                return true;
+            }
+            line += c;
+            last = c;
+        }
+        return false;
+    }
+};
@@ -0,0 +1,68 @@
+/* CMemoryNetwork.h
+ * In-process byte stream.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CMEMORYNETWORK_H_
+#define _CMEMORYNETWORK_H_
+
+/* project includes */
+#include "INetwork.h"
+#include "errors.h"
+
+/* Boost */
+#include <boost/shared_ptr.hpp>
+
+#define MEMORY_PIPE_CAPACITY        (256 * 1024)    /* bytes buffered in each direction */
+
+namespace ssh
+{
+    class CMemoryPipe;
+
+    /* CMemoryNetwork
+     * One end of a pair of connected in-memory byte streams, what is written to one end is
+     * read from the other. It is used to run a server and a client transport back-to-back
+     * in one process, one thread each, without the network stack adding noise to
+     * measurements. The pair stays usable until both ends are destroyed.
+     */
+    class CMemoryNetwork : public INetwork
+    {
+    public:
+        ~CMemoryNetwork();
+
+        /* creates two connected ends, the caller owns both */
+        static bool CreatePair(CMemoryNetwork ** first, CMemoryNetwork ** second,
+                               uint32_t capacity = MEMORY_PIPE_CAPACITY);
+
+        /* INetwork, the ends are connected from the start */
+        int connect(const char *, const char *)         {return sshd_OK;}
+        int poll(int)                                   {return sshd_OK;}
+        void disconnect();
+
+        bool dataAvailable(int timeout);
+        bool writePossible(int timeout);
+
+        int readBytes(byte *, int count, int *);
+        int writeBytes(const byte *, int count, int *);
+
+        bool writeLine(const std::string &);
+        bool readLine(std::string &);
+
+        CMemoryNetwork & setBlockingMode(bool block = true)    {m_blocking = block; return *this;}
+        bool setListener(INetworkListener *, void *);
+
+    protected:
+        CMemoryNetwork(const boost::shared_ptr<CMemoryPipe> &, int side);
+
+        boost::shared_ptr<CMemoryPipe>  m_pipe;
+        int                             m_side;     /* reads channel m_side, writes the other */
+        bool                            m_blocking;
+
+    private:
+        CMemoryNetwork(const CMemoryNetwork &);
+        CMemoryNetwork & operator=(const CMemoryNetwork &);
+    };
+};
+
+#endif
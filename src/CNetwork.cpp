@@ -19,8 +19,27 @@
 /* project includes */
 #include "errors.h"
 
+/* C/C++ includes */
+#include <new>
+
+#if !defined(WIN32) && !defined(_WIN32)
+#include <fcntl.h>
+#endif
+
 namespace ssh
 {
+    /* Timeout
+     * Converts a timeout in milliseconds for select, a negative timeout waits forever.
+     */
+    static timeval * Timeout(int timeout, timeval & tv)
+    {
+        if( timeout < 0 )
+            return NULL;
+        tv.tv_sec  = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        return &tv;
+    }
+
     /* CNetwork::CNetwork
      * Performs the required initialization-
      */
@@ -41,6 +60,16 @@ namespace ssh
             freeaddrinfo(m_addr);
     }
 
+    /* CNetwork::release
+     * Gives up the socket without closing it.
+     */
+    SOCKET CNetwork::release()
+    {
+        SOCKET sock = m_sock;
+        m_sock = 0;
+        return sock;
+    }
+
     /*
      * initializes the socket
      */
@@ -82,7 +111,7 @@ namespace ssh
         res = ::connect(m_sock, m_addr->ai_addr, (int)m_addr->ai_addrlen);
         if( res == SOCKET_ERROR )
         {
-            if( WSAGetLastError() == WSAEWOULDBLOCK )
+            if( WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINPROGRESS )
                 /* connection is pending */
                 return sshd_CONNECTION_PENDING;
             else
@@ -99,10 +128,10 @@ namespace ssh
     {
         int res;
         fd_set rd;
-        timeval tv = {0, timeout * 1000};
+        timeval tv;
         FD_ZERO(&rd);
         FD_SET(m_sock, &rd);
-        res = select(0, 0, &rd, 0, &tv);
+        res = select((int) m_sock + 1, 0, &rd, 0, Timeout( timeout, tv ));
         if( res == 1 )
             return sshd_OK;
         else if( res == 0 )
@@ -127,10 +156,10 @@ namespace ssh
     bool CNetwork::dataAvailable(int timeout)
     {
         fd_set rd;
-        timeval tv = {0, timeout * 1000};
+        timeval tv;
         FD_ZERO(&rd);
         FD_SET(m_sock, &rd);
-        return (select(0, &rd, 0, 0, &tv) > 0);
+        return (select((int) m_sock + 1, &rd, 0, 0, Timeout( timeout, tv )) > 0);
     }
 
     /* CNetwork::writePossible
@@ -139,10 +168,10 @@ namespace ssh
     bool CNetwork::writePossible(int timeout)
     {
         fd_set rd;
-        timeval tv = {0, timeout * 1000};
+        timeval tv;
         FD_ZERO(&rd);
         FD_SET(m_sock, &rd);
-        return (select(0, 0, &rd, 0, &tv) > 0);
+        return (select((int) m_sock + 1, 0, &rd, 0, Timeout( timeout, tv )) > 0);
     }
 
     /* CNetwork::readBytes
@@ -208,23 +237,17 @@ namespace ssh
     CNetwork * CNetwork::waitForConnections(int timeout, int * status) 
     {
         *status = SSHD_NETWORK_ERROR;
-#ifdef WIN32
         if( !m_sock )
             return NULL;
 
         int res;
         fd_set rd;
         timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = timeout * 1000;    /* convert timeout to microseconds */
-
-        if( !m_sock )
-            return NULL;
 
         FD_ZERO(&rd);
         FD_SET(m_sock, &rd);
         /* check for any incoming socket */
-        res = select(0, &rd, NULL, NULL, &tv);
+        res = select((int) m_sock + 1, &rd, NULL, NULL, Timeout( timeout, tv ));
         if( res == SOCKET_ERROR )
             return NULL;
         else if( res == 0 ) {
@@ -233,11 +256,12 @@ namespace ssh
         } else if( res > 0 ) {
             /* incoming connection */
             SOCKET sock = accept(m_sock, NULL, NULL);
-            if( !sock ) {
+            if( sock == INVALID_SOCKET ) {
                 return NULL;
             }
-            CNetwork * rd = new CNetwork();
+            CNetwork * rd = new (std::nothrow) CNetwork();
             if( !rd ) {
+                closesocket( sock );
                 return NULL;
             }
             rd->m_sock = sock;
@@ -246,45 +270,163 @@ namespace ssh
         } else {
             return NULL;
         }
-#else
-        return NULL;
-#endif
     }
 
-    /* CNetwork::bind
-     * Binds the socket to a specific port.
+    /* SplitAddress
+     * Splits "host", "host:port", "[v6]" or "[v6]:port" into the host and the port, an IPv6
+     * address without brackets is all host. "*" is any IPv4 address.
      */
-    bool CNetwork::bind(uint16_t port)
+    static void SplitAddress(const std::string & address, std::string & host, std::string & port)
     {
-#ifdef WIN32
-        if( !m_sock ) {
-            m_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-            if( !m_sock )
-                return false;
+        std::string::size_type colon = address.rfind( ':' );
+
+        port = SSHD_DEFAULT_PORT;
+        if( !address.empty() && address[0] == '[' ) {
+            std::string::size_type end = address.find( ']' );
+            host = address.substr( 1, end == std::string::npos ? std::string::npos : end - 1 );
+            if( end != std::string::npos && colon == end + 1 )
+                port = address.substr( colon + 1 );
+        } else if( colon != std::string::npos && address.find( ':' ) == colon ) {
+            host = address.substr( 0, colon );
+            port = address.substr( colon + 1 );
+        } else {
+            host = address;
         }
+        if( host == "*" )
+            host = "0.0.0.0";
+    }
 
-        struct sockaddr_in saServer;
-        hostent* localHost;
-        char* localIP;
+    /* CNetwork::listen
+     * Binds a non-blocking socket to the address and listens with the given backlog. With
+     * reusePort several sockets, one per accept thread, can listen to the same address and
+     * the kernel spreads the connections over them.
+     */
+    bool CNetwork::listen(const std::string & address, int backlog, bool reusePort)
+    {
+        std::string host, port;
+        addrinfo hints, * res = NULL;
+        int on = 1;
 
-        localHost = gethostbyname("127.0.0.1");
-        localIP = inet_ntoa (*(struct in_addr *)*localHost->h_addr_list);
+        disconnect();
+        SplitAddress( address, host, port );
 
-        saServer.sin_family = AF_INET;
-        saServer.sin_addr.s_addr = inet_addr(localIP);
-        saServer.sin_port = htons(port);
+        ZeroMemory( &hints, sizeof(hints) );
+        hints.ai_family     = AF_UNSPEC;
+        hints.ai_socktype   = SOCK_STREAM;
+        hints.ai_protocol   = IPPROTO_TCP;
+        hints.ai_flags      = AI_PASSIVE | AI_NUMERICSERV;
+        if( getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res ) != 0 )
+            return false;
 
-        if( ::bind( m_sock,(SOCKADDR*) &saServer, sizeof(saServer) ) != 0 ) {
+        m_sock = socket( res->ai_family, SOCK_STREAM, IPPROTO_TCP );
+        if( m_sock == INVALID_SOCKET ) {
+            m_sock = 0;
+            freeaddrinfo( res );
             return false;
         }
 
-        if( ::listen(m_sock, 10) != 0 )
+#if !defined(WIN32) && !defined(_WIN32)
+        /* restart without waiting for the old connections to time out */
+        setsockopt( m_sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on) );
+#endif
+#if defined(SO_REUSEPORT)
+        bool ok = !reusePort || setsockopt( m_sock, SOL_SOCKET, SO_REUSEPORT, (const char *) &on, sizeof(on) ) == 0;
+#else
+        bool ok = !reusePort;
+#endif
+        /* "::" only takes IPv6, IPv4 is listened to separately */
+        if( res->ai_family == AF_INET6 )
+            setsockopt( m_sock, IPPROTO_IPV6, IPV6_V6ONLY, (const char *) &on, sizeof(on) );
+
+        ok = ok && ::bind( m_sock, res->ai_addr, (int) res->ai_addrlen ) == 0 &&
+             ::listen( m_sock, backlog ) == 0;
+        freeaddrinfo( res );
+
+        if( !ok ) {
+            disconnect();
             return false;
+        }
 
+        /* accepting stops when the queue is empty */
+        setBlockingMode( false );
         return true;
+    }
+
+    /* CNetwork::getPeerAddress
+     * Returns the address of the connected peer without the port.
+     */
+    std::string CNetwork::getPeerAddress() const
+    {
+        sockaddr_storage addr;
+        socklen_t length = sizeof(addr);
+        char host[NI_MAXHOST];
+
+        if( getpeername( m_sock, (SOCKADDR *) &addr, &length ) != 0 ||
+            getnameinfo( (SOCKADDR *) &addr, length, host, sizeof(host), NULL, 0, NI_NUMERICHOST ) != 0 )
+        {
+            return std::string();
+        }
+        return host;
+    }
+
+    /* CNetwork::acceptConnections
+     * Accepts the pending connections of a listening socket, up to max, and returns the
+     * number accepted. The new sockets are blocking. Running out of descriptors stops
+     * the call like an empty queue would, but sets exhausted as the socket stays readable.
+     */
+    int CNetwork::acceptConnections(std::vector<CNetwork *> & connections, int max, bool * exhausted)
+    {
+        int count = 0;
+
+        while( count < max )
+        {
+#if defined(__linux__)
+            /* no separate call to keep the socket from child processes */
+            SOCKET sock = accept4( m_sock, NULL, NULL, SOCK_CLOEXEC );
 #else
-        return false;
+            SOCKET sock = accept( m_sock, NULL, NULL );
+#endif
+            if( sock == INVALID_SOCKET ) {
+#if !defined(WIN32) && !defined(_WIN32)
+                /* the peer gave up while queued, the next one may be fine */
+                if( errno == ECONNABORTED || errno == EINTR )
+                    continue;
+                if( exhausted && (errno == EMFILE || errno == ENFILE) )
+                    *exhausted = true;
+#else
+                if( exhausted && WSAGetLastError() == WSAEMFILE )
+                    *exhausted = true;
 #endif
+                break;      /* the queue is empty */
+            }
+
+            CNetwork * con = new (std::nothrow) CNetwork();
+            if( !con ) {
+                closesocket( sock );
+                break;
+            }
+            con->m_sock = sock;
+#if !defined(__linux__)
+            /* elsewhere the socket inherits the non-blocking mode of the listener */
+            con->setBlockingMode( true );
+#endif
+            connections.push_back( con );
+            count++;
+        }
+        return count;
+    }
+
+    /* CNetwork::rejectConnection
+     * Accepts the first pending connection of a listening socket and closes it.
+     */
+    bool CNetwork::rejectConnection()
+    {
+        SOCKET sock = accept( m_sock, NULL, NULL );
+        if( sock == INVALID_SOCKET )
+            return false;
+
+        closesocket( sock );
+        return true;
     }
 
     /* CNetwork::setBlockingMode
@@ -292,8 +434,14 @@ namespace ssh
      */
     CNetwork & CNetwork::setBlockingMode(bool block)
     {
+#if defined(WIN32) || defined(_WIN32)
         u_long iMode = (block ? 0 : 1);
         ioctlsocket(m_sock,FIONBIO,&iMode);
+#else
+        int flags = fcntl(m_sock, F_GETFL, 0);
+        if( flags != -1 )
+            fcntl(m_sock, F_SETFL, block ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
         return (*this);
     }
 
@@ -7,11 +7,39 @@
 #include <windows.h>
 #include <winsock2.h>
 #include <Ws2tcpip.h>
+#else
+/* BSD sockets, the Winsock names used by the implementation are mapped onto them */
+#include <cerrno>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+
+typedef int                         SOCKET;
+typedef struct sockaddr             SOCKADDR;
+#define INVALID_SOCKET              (-1)
+#define SOCKET_ERROR                (-1)
+#define closesocket(s)              close(s)
+#define WSAGetLastError()           (errno)
+#define WSAEWOULDBLOCK              EWOULDBLOCK
+#define WSAEINPROGRESS              EINPROGRESS
+#define ZeroMemory(p, n)            memset( (p), 0, (n) )
 #endif
 
+/* C/C++ includes */
+#include <vector>
+
 /* project specific headers */
 #include "types.h"
 #include "CComponent.h"
+#include "INetwork.h"
+
+#define SSHD_DEFAULT_PORT           "1337"
+#define SSHD_DEFAULT_BACKLOG        (128)   /* connections queued by each listener */
 
 enum {
     SSHD_NETWORK_OK = 0,                /* success */
@@ -24,14 +52,14 @@ enum {
 namespace ssh
 {
     /* sshd::CNetwork
-     * The networking component
+     * The networking component, a TCP socket.
      */
-    class CNetwork
+    class CNetwork : public INetwork
     {
     public:
         
         CNetwork();
-        ~CNetwork();
+        virtual ~CNetwork();
 
         /* initializes the socket */
         bool init();
@@ -46,8 +74,8 @@ namespace ssh
         bool writeLine(const std::string &);    /* writes a raw CR LF terminated line to the socket */
         bool readLine(std::string &);           /* reads a raw CR LFT terminated line from the socket */
 
-        /* binds the socket to a specific port */
-        bool bind(uint16_t);
+        /* listens to "host[:port]" or "[v6][:port]", see SSHD_SETTING_LISTEN_ADDRESS */
+        bool listen(const std::string & address, int backlog, bool reusePort = false);
         /* connects to a remote host */
         int connect(const char *, const char * port);
         /* polls the interface for connection status */
@@ -58,12 +86,22 @@ namespace ssh
         
         /* listens to any incoming connection */
         CNetwork * waitForConnections(int timeout, int * status);
+        /* accepts the queued connections of a listening socket without waiting, exhausted
+           is set if the process or the system ran out of descriptors */
+        int acceptConnections(std::vector<CNetwork *> &, int max, bool * exhausted = NULL);
+        /* accepts a queued connection and closes it at once, false if there was none */
+        bool rejectConnection();
+
+        SOCKET getSocket() const    {return m_sock;}
+        /* the numeric address of the peer, empty if unknown */
+        std::string getPeerAddress() const;
+
+        /* gives up the socket, the caller becomes responsible for closing it */
+        SOCKET release();
 
     protected:
-#ifdef WIN32
         SOCKET m_sock;
         addrinfo * m_addr;
-#endif
     };
 };
 
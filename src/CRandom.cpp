@@ -0,0 +1,215 @@
+/* CRandom.cpp
+ * Implements the buffered ChaCha20 random number generator.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstring>
+#include <new>
+
+/* project includes */
+#include "CRandom.h"
+
+#if defined(USE_OPENSSL)
+#include <openssl/rand.h>
+#endif
+
+#define ROTL32(v, n)    (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d)                \
+    a += b; d ^= a; d = ROTL32(d, 16);          \
+    c += d; b ^= c; b = ROTL32(b, 12);          \
+    a += b; d ^= a; d = ROTL32(d, 8);           \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+namespace ssh
+{
+    /* CRandom::CRandom
+     * Constructor, the generator is unusable until it has been seeded.
+     */
+    CRandom::CRandom()
+    {
+        memset(m_key, 0, sizeof(m_key));
+        m_buffer    = NULL;
+        m_pos       = RANDOM_BUFFER_SIZE;
+        m_generated = 0;
+        m_seeded    = false;
+    }
+
+    /* CRandom::~CRandom
+     * Destructor, wipes the state.
+     */
+    CRandom::~CRandom()
+    {
+        memset(m_key, 0, sizeof(m_key));
+        hibernate();
+    }
+
+    /* CRandom::hibernate
+     * Frees the output buffer of an idle generator. The buffered output is discarded, the
+     * next call to generate allocates a new buffer and refills it from the current key.
+     */
+    void CRandom::hibernate()
+    {
+        if( m_buffer ) {
+            memset(m_buffer, 0, RANDOM_BUFFER_SIZE);
+            delete [] m_buffer;
+            m_buffer = NULL;
+        }
+        m_pos = RANDOM_BUFFER_SIZE;
+    }
+
+    /* CRandom::seed
+     * Mixes system entropy into the key and discards any buffered output.
+     */
+    bool CRandom::seed()
+    {
+        byte entropy[RANDOM_KEY_SIZE];
+
+#if defined(USE_OPENSSL)
+        /* OpenSSL's generator is seeded by the operating system */
+        if( RAND_bytes(entropy, sizeof(entropy)) != 1 )
+            return false;
+#else
+        return false;
+#endif
+
+        for(int i = 0; i < 8; i++) {
+            m_key[i] ^= (uint32_t) entropy[4*i] |
+                        ((uint32_t) entropy[4*i + 1] << 8) |
+                        ((uint32_t) entropy[4*i + 2] << 16) |
+                        ((uint32_t) entropy[4*i + 3] << 24);
+        }
+        memset(entropy, 0, sizeof(entropy));
+
+        m_pos       = RANDOM_BUFFER_SIZE;   /* force a refill with the new key */
+        m_generated = 0;
+        m_seeded    = true;
+        return true;
+    }
+
+    /* CRandom::generate
+     * Copies random bytes from the buffer, refilling it when it runs out.
+     */
+    void CRandom::generate(byte * dst, size_t len)
+    {
+        while( len > 0 )
+        {
+            if( m_pos == RANDOM_BUFFER_SIZE && !refill() )
+            {
+                /* no memory for the buffer, produce a single block at a time */
+                byte out[RANDOM_BLOCK_SIZE];
+                size_t count = RANDOM_BLOCK_SIZE - RANDOM_KEY_SIZE;
+                if( count > len )
+                    count = len;
+
+                block(m_key, 0, out);
+                setKey(out);
+                memcpy(dst, out + RANDOM_KEY_SIZE, count);
+                memset(out, 0, sizeof(out));
+
+                m_generated += count;
+                dst         += count;
+                len         -= count;
+                continue;
+            }
+
+            size_t count = RANDOM_BUFFER_SIZE - m_pos;
+            if( count > len )
+                count = len;
+
+            memcpy(dst, m_buffer + m_pos, count);
+            memset(m_buffer + m_pos, 0, count);     /* never hand out the same bytes twice */
+
+            m_pos       += count;
+            dst         += count;
+            len         -= count;
+        }
+    }
+
+    /* CRandom::refill
+     * Fills the buffer with a new key followed by output, the old key is overwritten.
+     * Returns false if the buffer could not be allocated.
+     */
+    bool CRandom::refill()
+    {
+        if( !m_seeded || m_generated >= RANDOM_RESEED_INTERVAL ) {
+            /* a failed reseed keeps the current key, it is still unpredictable */
+            seed();
+        }
+
+        if( !m_buffer && !(m_buffer = new (std::nothrow) byte[RANDOM_BUFFER_SIZE]) )
+            return false;
+
+        for(uint32_t i = 0; i < RANDOM_BUFFER_SIZE / RANDOM_BLOCK_SIZE; i++)
+            block(m_key, i, m_buffer + i * RANDOM_BLOCK_SIZE);
+
+        /* the first bytes become the next key */
+        setKey(m_buffer);
+        memset(m_buffer, 0, RANDOM_KEY_SIZE);
+
+        m_pos        = RANDOM_KEY_SIZE;
+        m_generated += RANDOM_BUFFER_SIZE - RANDOM_KEY_SIZE;
+        return true;
+    }
+
+    /* CRandom::setKey
+     * Replaces the key with the first RANDOM_KEY_SIZE bytes of the source.
+     */
+    void CRandom::setKey(const byte * src)
+    {
+        for(int i = 0; i < 8; i++) {
+            m_key[i] = (uint32_t) src[4*i] |
+                       ((uint32_t) src[4*i + 1] << 8) |
+                       ((uint32_t) src[4*i + 2] << 16) |
+                       ((uint32_t) src[4*i + 3] << 24);
+        }
+    }
+
+    /* CRandom::block
+     * Computes a single ChaCha20 block with a zero nonce.
+     */
+    void CRandom::block(const uint32_t key[8], uint32_t counter, byte out[RANDOM_BLOCK_SIZE])
+    {
+        uint32_t input[16], x[16];
+
+        /* "expand 32-byte k" */
+        input[0]  = 0x61707865;
+        input[1]  = 0x3320646e;
+        input[2]  = 0x79622d32;
+        input[3]  = 0x6b206574;
+        for(int i = 0; i < 8; i++)
+            input[4 + i] = key[i];
+        input[12] = counter;
+        input[13] = 0;
+        input[14] = 0;
+        input[15] = 0;
+
+        memcpy(x, input, sizeof(x));
+        for(int i = 0; i < 10; i++)
+        {
+            /* column round */
+            QUARTERROUND(x[0], x[4], x[8],  x[12])
+            QUARTERROUND(x[1], x[5], x[9],  x[13])
+            QUARTERROUND(x[2], x[6], x[10], x[14])
+            QUARTERROUND(x[3], x[7], x[11], x[15])
+            /* diagonal round */
+            QUARTERROUND(x[0], x[5], x[10], x[15])
+            QUARTERROUND(x[1], x[6], x[11], x[12])
+            QUARTERROUND(x[2], x[7], x[8],  x[13])
+            QUARTERROUND(x[3], x[4], x[9],  x[14])
+        }
+
+        for(int i = 0; i < 16; i++) {
+            uint32_t v = x[i] + input[i];
+            out[4*i]     = (byte) v;
+            out[4*i + 1] = (byte) (v >> 8);
+            out[4*i + 2] = (byte) (v >> 16);
+            out[4*i + 3] = (byte) (v >> 24);
+        }
+
+        memset(x, 0, sizeof(x));
+        memset(input, 0, sizeof(input));
+    }
+};
@@ -0,0 +1,66 @@
+/* CRandom.h
+ * Buffered ChaCha20 based random number generator.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CRANDOM_H_
+#define _CRANDOM_H_
+
+/* C/C++ includes */
+#include <cstddef>
+
+/* project includes */
+#include "types.h"
+
+#define RANDOM_KEY_SIZE             (32)
+#define RANDOM_BLOCK_SIZE           (64)
+#define RANDOM_BUFFER_SIZE          (4096)                  /* a multiple of the block size */
+#define RANDOM_RESEED_INTERVAL      (1024 * 1024)           /* bytes generated between reseeds */
+
+namespace ssh
+{
+    /* CRandom
+     * Generates random bytes for the packet padding and the SSH_MSG_KEXINIT cookie. Each
+     * connection owns its own instance, so no locks are taken on the packet path.
+     *
+     * The generator is seeded from the system and uses ChaCha20 with fast key erasure: each
+     * refill of the buffer produces the next key along with the output, and the bytes handed
+     * out are wiped from the buffer. A compromised state therefore reveals nothing about the
+     * bytes already returned. The key is mixed with fresh system entropy every
+     * RANDOM_RESEED_INTERVAL bytes.
+     */
+    class CRandom
+    {
+    public:
+        CRandom();
+        ~CRandom();
+
+        /* seeds the generator from the system, must succeed before generate is used */
+        bool seed();
+        bool isSeeded() const {return m_seeded;}
+
+        /* fills the buffer with random bytes */
+        void generate(byte *, size_t);
+        /* wipes and frees the output buffer, the key is kept */
+        void hibernate();
+
+    protected:
+        bool refill();
+        void setKey(const byte * src);
+        static void block(const uint32_t key[8], uint32_t counter, byte out[RANDOM_BLOCK_SIZE]);
+
+        uint32_t    m_key[8];
+        byte *      m_buffer;           /* RANDOM_BUFFER_SIZE bytes, allocated on first use */
+        size_t      m_pos;              /* next unused byte in the buffer */
+        size_t      m_generated;        /* bytes generated since the last reseed */
+        bool        m_seeded;
+
+    private:
+        /* the state must never be duplicated */
+        CRandom(const CRandom &);
+        CRandom & operator=(const CRandom &);
+    };
+};
+
+#endif
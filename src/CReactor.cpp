@@ -0,0 +1,617 @@
+/* CReactor.cpp
+ * Implements the reactor and its streams.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+/* project includes */
+#include "CReactor.h"
+#include "CLogger.h"
+#include "errors.h"
+#include "util.h"
+
+#if !defined(WIN32) && !defined(_WIN32)
+#include <sys/time.h>
+#endif
+
+#define REACTOR_MAX_LINE            (1024)
+
+using namespace std;
+
+namespace ssh
+{
+    /* ReactorRing::contiguousSpace
+     * Returns the free bytes after the tail, up to the end of the buffer.
+     */
+    uint32_t ReactorRing::contiguousSpace() const
+    {
+        uint32_t t = tail();
+        if( count == REACTOR_BUFFER_SIZE )
+            return 0;
+        return t >= head ? REACTOR_BUFFER_SIZE - t : head - t;
+    }
+
+    /* ReactorRing::read
+     * Removes up to n bytes, returns the number removed.
+     */
+    uint32_t ReactorRing::read(byte * dst, uint32_t n)
+    {
+        if( n > count )
+            n = count;
+
+        uint32_t first = REACTOR_BUFFER_SIZE - head;
+        if( first > n )
+            first = n;
+
+        memcpy( dst, data + head, first );
+        memcpy( dst + first, data, n - first );
+        head   = (head + n) % REACTOR_BUFFER_SIZE;
+        count -= n;
+        return n;
+    }
+
+    /* ReactorRing::write
+     * Appends up to n bytes, returns the number stored.
+     */
+    uint32_t ReactorRing::write(const byte * src, uint32_t n)
+    {
+        if( n > space() )
+            n = space();
+
+        uint32_t t = tail(), first = REACTOR_BUFFER_SIZE - t;
+        if( first > n )
+            first = n;
+
+        memcpy( data + t, src, first );
+        memcpy( data, src + first, n - first );
+        count += n;
+        return n;
+    }
+
+    /* CReactorStream::CReactorStream
+     * Constructor, the stream is handed to the reactor by CReactor::adopt.
+     */
+    CReactorStream::CReactorStream(CReactor * reactor, SOCKET sock)
+    {
+        m_reactor       = reactor;
+        m_sock          = sock;
+        m_blocking      = true;
+        m_in.data       = new (std::nothrow) byte[REACTOR_BUFFER_SIZE];
+        m_out.data      = new (std::nothrow) byte[REACTOR_BUFFER_SIZE];
+        m_in.head       = m_in.count    = 0;
+        m_out.head      = m_out.count   = 0;
+        m_closed        = !m_in.data || !m_out.data;
+        m_readBlocked   = false;
+        m_detached      = false;
+        m_listener      = NULL;
+        m_listenerContext = NULL;
+        m_queued        = false;
+        m_detaching     = false;
+        m_backend       = NULL;
+
+#if defined(WIN32) || defined(_WIN32)
+        InitializeCriticalSection( &m_lock );
+        InitializeConditionVariable( &m_cond );
+#else
+        pthread_mutex_init( &m_lock, NULL );
+        pthread_cond_init( &m_cond, NULL );
+#endif
+    }
+
+    /* CReactorStream::~CReactorStream
+     * Destructor, closes the connection.
+     */
+    CReactorStream::~CReactorStream()
+    {
+        disconnect();
+
+        delete [] m_in.data;
+        delete [] m_out.data;
+#if defined(WIN32) || defined(_WIN32)
+        DeleteCriticalSection( &m_lock );
+#else
+        pthread_cond_destroy( &m_cond );
+        pthread_mutex_destroy( &m_lock );
+#endif
+    }
+
+#if defined(WIN32) || defined(_WIN32)
+
+    void CReactorStream::lock()         {EnterCriticalSection( &m_lock );}
+    void CReactorStream::unlock()       {LeaveCriticalSection( &m_lock );}
+    void CReactorStream::wakeAll()      {WakeAllConditionVariable( &m_cond );}
+    void CReactorStream::wait(int ms)   {SleepConditionVariableCS( &m_cond, &m_lock, ms < 0 ? INFINITE : (DWORD) ms );}
+
+#else
+
+    void CReactorStream::lock()         {pthread_mutex_lock( &m_lock );}
+    void CReactorStream::unlock()       {pthread_mutex_unlock( &m_lock );}
+    void CReactorStream::wakeAll()      {pthread_cond_broadcast( &m_cond );}
+
+    void CReactorStream::wait(int ms)
+    {
+        if( ms < 0 ) {
+            pthread_cond_wait( &m_cond, &m_lock );
+            return;
+        }
+
+        struct timeval now;
+        struct timespec until;
+        gettimeofday( &now, NULL );
+        until.tv_sec  = now.tv_sec + ms / 1000;
+        until.tv_nsec = now.tv_usec * 1000L + (ms % 1000) * 1000000L;
+        if( until.tv_nsec >= 1000000000L ) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait( &m_cond, &m_lock, &until );
+    }
+
+#endif
+
+    /* CReactorStream::broadcast
+     * Wakes the threads waiting for the stream and tells the listener.
+     */
+    void CReactorStream::broadcast()
+    {
+        wakeAll();
+        if( m_listener )
+            m_listener->OnNetworkEvent( m_listenerContext );
+    }
+
+    /* CReactorStream::setListener
+     * Reports the stream's events to the listener, it is told once right away in case the
+     * stream is already readable.
+     */
+    bool CReactorStream::setListener(INetworkListener * listener, void * context)
+    {
+        lock();
+        m_listener          = listener;
+        m_listenerContext   = context;
+        if( m_listener )
+            m_listener->OnNetworkEvent( m_listenerContext );
+        unlock();
+        return true;
+    }
+
+    /* CReactorStream::waitUntil
+     * Waits with the lock held until the stream is ready, a timeout of zero only checks and
+     * a negative timeout waits forever.
+     */
+    bool CReactorStream::waitUntil(bool (CReactorStream::*ready)() const, int timeout)
+    {
+        uint64_t deadline = timeout > 0 ? GetMonotonicTime() + (uint64_t) timeout * 1000000ULL : 0;
+
+        while( !(this->*ready)() )
+        {
+            if( timeout == 0 )
+                return false;
+            if( timeout > 0 ) {
+                uint64_t now = GetMonotonicTime();
+                if( now >= deadline )
+                    return false;
+                wait( (int) ((deadline - now + 999999) / 1000000) );
+            } else {
+                wait( -1 );
+            }
+        }
+        return true;
+    }
+
+    /* CReactorStream::disconnect
+     * Sends what is left of the output, for up to REACTOR_LINGER milliseconds, and closes
+     * the connection. The reactor stops using the stream before the socket is closed, which
+     * happens only once however often the stream is disconnected.
+     */
+    void CReactorStream::disconnect()
+    {
+        lock();
+        bool open = m_sock != INVALID_SOCKET, detached = m_detached;
+        if( open && !detached )
+            waitUntil( &CReactorStream::drained, REACTOR_LINGER );
+        m_closed = true;
+        unlock();
+
+        if( !open )
+            return;     /* already closed */
+
+        if( !detached )
+            m_reactor->detach( this );
+
+        /* the reactor is done with the socket */
+        lock();
+        SOCKET sock = m_sock;
+        m_sock = INVALID_SOCKET;
+        unlock();
+
+        shutdown( sock, 2 );    /* both directions */
+        closesocket( sock );
+    }
+
+    /* CReactorStream::dataAvailable
+     * Returns true if data is available, or the connection has been closed.
+     */
+    bool CReactorStream::dataAvailable(int timeout)
+    {
+        lock();
+        bool res = waitUntil( &CReactorStream::readable, timeout );
+        unlock();
+        return res;
+    }
+
+    /* CReactorStream::writePossible
+     * Returns true if there is space for more output.
+     */
+    bool CReactorStream::writePossible(int timeout)
+    {
+        lock();
+        bool res = waitUntil( &CReactorStream::writable, timeout );
+        unlock();
+        return res;
+    }
+
+    /* CReactorStream::readBytes
+     * Reads up to count bytes, sshd_DISCONNECTED once the connection is closed and the
+     * input drained. Space freed for a reactor that stopped reading wakes it.
+     */
+    int CReactorStream::readBytes(byte * dst, int count, int * rcount)
+    {
+        if( !dst || count <= 0 )
+            return sshd_ERROR;
+
+        lock();
+        if( m_blocking )
+            waitUntil( &CReactorStream::readable, -1 );
+
+        uint32_t n = m_in.read( dst, (uint32_t) count );
+        bool closed = m_closed, resume = m_readBlocked && n > 0;
+        if( resume )
+            m_readBlocked = false;
+        unlock();
+
+        if( resume )
+            m_reactor->queue( this );
+
+        *rcount = (int) n;
+        if( !n && closed )
+            return sshd_DISCONNECTED;
+        return sshd_OK;
+    }
+
+    /* CReactorStream::writeBytes
+     * Stores up to count bytes for the reactor to send, a blocking write waits until
+     * everything has been stored.
+     */
+    int CReactorStream::writeBytes(const byte * src, int count, int * wcount)
+    {
+        uint32_t done = 0;
+
+        if( !src || count <= 0 )
+            return sshd_ERROR;
+
+        lock();
+        while( done < (uint32_t) count )
+        {
+            if( m_blocking && m_out.space() == 0 )
+            {
+                /* let the reactor send while waiting */
+                unlock();
+                m_reactor->queue( this );
+                lock();
+                waitUntil( &CReactorStream::writable, -1 );
+            }
+            if( m_closed ) {
+                unlock();
+                return sshd_ERROR;
+            }
+
+            uint32_t n = m_out.write( src + done, (uint32_t) count - done );
+            done += n;
+            if( !m_blocking || !n )
+                break;
+        }
+        unlock();
+
+        if( done )
+            m_reactor->queue( this );
+
+        *wcount = (int) done;
+        return sshd_OK;
+    }
+
+    /* CReactorStream::writeLine
+     * Writes a CR LF terminated line, waits until all of it has been stored.
+     */
+    bool CReactorStream::writeLine(const string & line)
+    {
+        string data = line + "\r\n";
+        bool blocking = m_blocking;
+        int wcount;
+
+        m_blocking = true;
+        int res = writeBytes( (const byte *) data.data(), (int) data.size(), &wcount );
+        m_blocking = blocking;
+
+        return res == sshd_OK && wcount == (int) data.size();
+    }
+
+    /* CReactorStream::readLine
+     * Reads a CR LF terminated line.
+     */
+    bool CReactorStream::readLine(string & line)
+    {
+        bool blocking = m_blocking;
+        char c, last = 0;
+        int rcount;
+
+        line.clear();
+        m_blocking = true;
+        while( line.size() < REACTOR_MAX_LINE )
+        {
+            if( readBytes( (byte *) &c, 1, &rcount ) != sshd_OK || rcount != 1 )
+                break;
+
+            if( c == 0x0A ) {
+                if( last != 0x0D )
+                    break;      /* a line feed without a carriage return */
+                line.erase( line.size() - 1 );
+                m_blocking = blocking;
+                return true;
+            }
+            line += c;
+            last = c;
+        }
+        m_blocking = blocking;
+        return false;
+    }
+
+    /* CReactor::CReactor
+     * Constructor.
+     */
+    CReactor::CReactor(CReactorBackend * backend)
+    {
+        m_backend       = backend;
+        m_wakePending   = false;
+        m_stopped       = false;
+    }
+
+    /* CReactor::~CReactor
+     * Destructor, the thread must have ended.
+     */
+    CReactor::~CReactor()
+    {
+        delete m_backend;
+    }
+
+    /* CReactor::ParseBackend
+     * Returns the backend named by the setting, select for unknown names.
+     */
+    int CReactor::ParseBackend(const string & name)
+    {
+        string value = Trim( name );
+        if( value == "epoll" )
+            return SSHD_BACKEND_EPOLL;
+        if( value == "io_uring" )
+            return SSHD_BACKEND_IO_URING;
+        return SSHD_BACKEND_SELECT;
+    }
+
+    /* CReactor::Create
+     * Creates a reactor, io_uring falls back to epoll.
+     */
+    CReactor * CReactor::Create(int type)
+    {
+        CReactor * reactor = new (std::nothrow) CReactor( NULL );
+        if( !reactor )
+            return NULL;
+
+        if( type == SSHD_BACKEND_IO_URING ) {
+            reactor->m_backend = CreateUringBackend( reactor );
+            if( reactor->m_backend && !reactor->m_backend->init() ) {
+                delete reactor->m_backend;
+                reactor->m_backend = NULL;
+            }
+            if( !reactor->m_backend )
+                sshd_Log(sshd_EVENT_WARNING, "io_uring is not supported, using epoll.");
+        }
+        if( !reactor->m_backend && type != SSHD_BACKEND_SELECT ) {
+            reactor->m_backend = CreateEpollBackend( reactor );
+            if( reactor->m_backend && !reactor->m_backend->init() ) {
+                delete reactor->m_backend;
+                reactor->m_backend = NULL;
+            }
+        }
+
+        if( !reactor->m_backend ) {
+            delete reactor;
+            return NULL;
+        }
+        return reactor;
+    }
+
+    /* CReactor::adopt
+     * Moves the socket of a connected stream to a new reactor stream.
+     */
+    CReactorStream * CReactor::adopt(CNetwork * network)
+    {
+        SOCKET sock = network->release();
+        delete network;
+
+        CReactorStream * stream = new (std::nothrow) CReactorStream( this, sock );
+        if( !stream ) {
+            closesocket( sock );
+            return NULL;
+        }
+        if( stream->m_closed ) {    /* the buffers could not be allocated */
+            stream->m_detached = true;
+            delete stream;          /* also closes the socket */
+            return NULL;
+        }
+
+        queue( stream );    /* the reactor adds it to the backend */
+        return stream;
+    }
+
+    /* CReactor::queue
+     * Asks the reactor to service a stream, the reactor is only woken if it has not been
+     * woken already.
+     */
+    void CReactor::queue(CReactorStream * stream)
+    {
+        bool wake;
+
+        m_lock.acquire();
+        if( !stream->m_queued ) {
+            stream->m_queued = true;
+            m_pending.push_back( stream );
+        }
+        wake = !m_wakePending && !m_stopped;
+        m_wakePending = true;
+        m_lock.release();
+
+        if( wake )
+            m_backend->wake();
+    }
+
+    /* CReactor::detach
+     * Waits until the reactor no longer uses the stream.
+     */
+    void CReactor::detach(CReactorStream * stream)
+    {
+        m_lock.acquire();
+        bool stopped = m_stopped;
+        if( !stopped )
+            stream->m_detaching = true;
+        m_lock.release();
+
+        /* once the thread has ended it only releases the streams it had added */
+        if( stopped && !stream->m_backend )
+            return;
+        if( !stopped )
+            queue( stream );
+
+        stream->lock();
+        while( !stream->m_detached )
+            stream->wait( -1 );
+        stream->unlock();
+    }
+
+    /* CReactor::release
+     * Marks a stream as no longer used by the reactor, it can no longer be read. The stream
+     * may have been queued again while it was being detached, it is taken off the queue
+     * first since the owner deletes it as soon as it is marked detached.
+     */
+    void CReactor::release(CReactorStream * stream)
+    {
+        m_lock.acquire();
+        if( stream->m_queued ) {
+            m_pending.erase( remove( m_pending.begin(), m_pending.end(), stream ), m_pending.end() );
+            stream->m_queued = false;
+        }
+        m_lock.release();
+
+        stream->lock();
+        stream->m_closed    = true;
+        stream->m_detached  = true;
+        stream->broadcast();
+        stream->unlock();
+    }
+
+    /* CReactor::Task
+     * Services the streams that asked for it and handles the events of the backend.
+     */
+    void CReactor::Task()
+    {
+        deque<CReactorStream *> pending;
+
+        while( !m_abortEvent.isSignaled() )
+        {
+            m_lock.acquire();
+            pending.swap( m_pending );
+            m_wakePending = false;
+            for(deque<CReactorStream *>::iterator it = pending.begin(); it != pending.end(); it++)
+                (*it)->m_queued = false;
+            m_lock.release();
+
+            while( !pending.empty() )
+            {
+                CReactorStream * stream = pending.front();
+                pending.pop_front();
+
+                if( stream->m_detaching ) {
+                    if( find( m_detaching.begin(), m_detaching.end(), stream ) == m_detaching.end() )
+                        m_detaching.push_back( stream );
+                } else if( !stream->m_backend ) {
+                    if( m_backend->add( stream ) ) {
+                        m_streams.push_back( stream );
+                    } else {
+                        stream->lock();
+                        stream->m_closed = true;    /* seen on the next read */
+                        stream->broadcast();
+                        stream->unlock();
+                    }
+                } else {
+                    m_backend->service( stream );
+                }
+            }
+
+            /* a stream is released once its operations have completed */
+            for(list<CReactorStream *>::iterator it = m_detaching.begin(); it != m_detaching.end(); )
+            {
+                CReactorStream * stream = *it;
+                if( stream->m_backend && !m_backend->remove( stream ) ) {
+                    it++;
+                    continue;
+                }
+                m_streams.remove( stream );
+                release( stream );
+                it = m_detaching.erase( it );
+            }
+
+            m_backend->run( m_detaching.empty() ? REACTOR_POLL_INTERVAL : 1 );
+        }
+
+        /* let go of the remaining streams, they can no longer be used */
+        m_lock.acquire();
+        m_stopped = true;
+        m_lock.release();
+
+        for(list<CReactorStream *>::iterator it = m_streams.begin(); it != m_streams.end(); it++) {
+            (*it)->lock();
+            (*it)->m_closed = true;
+            (*it)->broadcast();
+            (*it)->unlock();
+        }
+        for(int t = 0; !m_streams.empty() && t < REACTOR_LINGER; t++)
+        {
+            for(list<CReactorStream *>::iterator it = m_streams.begin(); it != m_streams.end(); ) {
+                if( m_backend->remove( *it ) ) {
+                    release( *it );
+                    it = m_streams.erase( it );
+                } else {
+                    it++;
+                }
+            }
+            if( !m_streams.empty() )
+                m_backend->run( 1 );
+        }
+        for(list<CReactorStream *>::iterator it = m_streams.begin(); it != m_streams.end(); it++)
+            release( *it );
+        m_streams.clear();
+
+        /* streams still waiting to be detached were released above or never added */
+        m_lock.acquire();
+        pending.swap( m_pending );
+        m_lock.release();
+        for(deque<CReactorStream *>::iterator it = pending.begin(); it != pending.end(); it++)
+            release( *it );
+        for(list<CReactorStream *>::iterator it = m_detaching.begin(); it != m_detaching.end(); it++)
+            release( *it );
+        m_detaching.clear();
+    }
+};
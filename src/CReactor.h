@@ -0,0 +1,234 @@
+/* CReactor.h
+ * Socket I/O for many connections from one thread.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CREACTOR_H_
+#define _CREACTOR_H_
+
+/* C/C++ includes */
+#include <deque>
+#include <list>
+#include <string>
+
+/* project includes */
+#include "INetwork.h"
+#include "CNetwork.h"
+#include "CThread.h"
+#include "Mutex.h"
+#include "errors.h"
+
+#if !defined(WIN32) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+#define REACTOR_BUFFER_SIZE         (64 * 1024)     /* bytes buffered in each direction */
+#define REACTOR_POLL_INTERVAL       (250)           /* milliseconds between abort checks */
+#define REACTOR_LINGER              (1000)          /* milliseconds to send what is left on close */
+
+/* network backends, SSHD_SETTING_NETWORK_BACKEND */
+enum {
+    SSHD_BACKEND_SELECT = 0,    /* each connection calls select/recv/send on its own socket */
+    SSHD_BACKEND_EPOLL,         /* a reactor thread does the socket I/O, epoll */
+    SSHD_BACKEND_IO_URING       /* a reactor thread does the socket I/O, io_uring */
+};
+
+namespace ssh
+{
+    class CReactor;
+    class CReactorBackend;
+
+    /* ReactorRing
+     * A ring buffer of REACTOR_BUFFER_SIZE bytes.
+     */
+    struct ReactorRing
+    {
+        byte *      data;
+        uint32_t    head,           /* first byte */
+                    count;          /* bytes stored */
+
+        uint32_t space() const      {return REACTOR_BUFFER_SIZE - count;}
+        uint32_t tail() const       {return (head + count) % REACTOR_BUFFER_SIZE;}
+        /* the stored bytes that follow the head without wrapping */
+        uint32_t contiguous() const {return count < REACTOR_BUFFER_SIZE - head ? count : REACTOR_BUFFER_SIZE - head;}
+        /* the free bytes that follow the tail without wrapping */
+        uint32_t contiguousSpace() const;
+
+        uint32_t read(byte * dst, uint32_t n);
+        uint32_t write(const byte * src, uint32_t n);
+    };
+
+    /* CReactorStream
+     * A connection whose socket I/O is done by a CReactor. The transport reads and writes
+     * the buffers, the reactor moves the data between them and the socket, so the
+     * connection's own thread makes no socket calls. Only waits on an empty input or a full
+     * output block. Deleting the stream sends the remaining output, for up to
+     * REACTOR_LINGER milliseconds, and closes the socket.
+     */
+    class CReactorStream : public INetwork
+    {
+    public:
+        ~CReactorStream();
+
+        /* INetwork, the socket is already connected */
+        int connect(const char *, const char *)     {return sshd_ERROR;}
+        int poll(int)                               {return sshd_OK;}
+        void disconnect();
+
+        bool dataAvailable(int timeout);
+        bool writePossible(int timeout);
+
+        int readBytes(byte *, int count, int *);
+        int writeBytes(const byte *, int count, int *);
+
+        bool writeLine(const std::string &);
+        bool readLine(std::string &);
+
+        CReactorStream & setBlockingMode(bool block = true)    {m_blocking = block; return *this;}
+        bool setListener(INetworkListener *, void *);
+
+    protected:
+        friend class CReactor;
+        friend class CEpollBackend;
+        friend class CUringBackend;
+
+        CReactorStream(CReactor *, SOCKET);
+
+        /* waits with the lock held until ready() or the timeout, a negative timeout waits
+           forever */
+        bool waitUntil(bool (CReactorStream::*ready)() const, int timeout);
+        bool readable() const       {return m_in.count > 0 || m_closed;}
+        bool writable() const       {return m_out.space() > 0 || m_closed;}
+        bool drained() const        {return m_out.count == 0 || m_closed;}
+
+        /* wakes the waiting threads and tells the listener, with the lock held */
+        void broadcast();
+
+        /* platform primitives, wait returns when signalled or after ms milliseconds, a
+           negative time waits forever */
+        void lock();
+        void unlock();
+        void wait(int ms);
+        void wakeAll();
+
+        CReactor *          m_reactor;
+        SOCKET              m_sock;
+        bool                m_blocking;
+
+        /* shared with the reactor, under m_lock */
+#if defined(WIN32) || defined(_WIN32)
+        CRITICAL_SECTION    m_lock;
+        CONDITION_VARIABLE  m_cond;
+#else
+        pthread_mutex_t     m_lock;
+        pthread_cond_t      m_cond;
+#endif
+        ReactorRing         m_in,
+                            m_out;
+        bool                m_closed;       /* the peer closed the connection, or an error */
+        bool                m_readBlocked;  /* the reactor stopped reading, m_in was full */
+        bool                m_detached;     /* the reactor no longer uses the stream */
+        INetworkListener *  m_listener;
+        void *              m_listenerContext;
+
+        /* owned by the reactor thread */
+        bool                m_queued;       /* in the reactor's list of streams to service */
+        bool                m_detaching;
+        void *              m_backend;      /* per stream data of the backend */
+
+    private:
+        CReactorStream(const CReactorStream &);
+        CReactorStream & operator=(const CReactorStream &);
+    };
+
+    /* CReactorBackend
+     * The part of the reactor that talks to the kernel.
+     */
+    class CReactorBackend
+    {
+    public:
+        virtual ~CReactorBackend() {}
+
+        virtual bool init()                             = 0;
+        virtual const char * name() const               = 0;
+
+        /* true if a write to a connection the peer has closed raises SIGPIPE */
+        virtual bool raisesSigpipe() const              {return false;}
+
+        /* starts or stops the I/O of a stream, called by the reactor thread; remove
+           returns false while operations are still in flight */
+        virtual bool add(CReactorStream *)              = 0;
+        virtual bool remove(CReactorStream *)           = 0;
+
+        /* moves data for a stream whose buffers changed */
+        virtual void service(CReactorStream *)          = 0;
+
+        /* waits up to timeout milliseconds for events and handles them */
+        virtual void run(int timeout)                   = 0;
+
+        /* wakes run from another thread */
+        virtual void wake()                             = 0;
+    };
+
+    /* the backends, NULL if not supported by the build */
+    CReactorBackend * CreateEpollBackend(CReactor *);
+    CReactorBackend * CreateUringBackend(CReactor *);
+
+    /* CReactor
+     * A thread that does the socket I/O of many connections with epoll or io_uring, so the
+     * syscalls of all of them are batched. The connection threads only exchange data with
+     * the reactor through the stream buffers. Linux only, elsewhere Create fails and the
+     * connections use their sockets directly.
+     */
+    class CReactor : public Util::CThread
+    {
+    public:
+        ~CReactor();
+
+        /* creates a reactor with the backend, io_uring falls back to epoll when the kernel
+           or the build lacks support; NULL if no backend is available */
+        static CReactor * Create(int backend);
+
+        /* parses a SSHD_SETTING_NETWORK_BACKEND value */
+        static int ParseBackend(const std::string &);
+
+        /* takes over the socket of a connected stream, which is deleted */
+        CReactorStream * adopt(CNetwork *);
+
+        const char * getBackendName() const {return m_backend->name();}
+        /* true if the process has to ignore SIGPIPE, the io_uring fixed writes have no
+           MSG_NOSIGNAL */
+        bool raisesSigpipe() const          {return m_backend->raisesSigpipe();}
+
+    protected:
+        friend class CReactorStream;
+        friend class CEpollBackend;
+        friend class CUringBackend;
+
+        CReactor(CReactorBackend *);
+
+        void Task();
+
+        /* called by the connection threads */
+        void queue(CReactorStream *);
+        void detach(CReactorStream *);
+
+        /* the reactor no longer uses the stream, wakes the thread waiting in detach */
+        void release(CReactorStream *);
+
+        CReactorBackend *               m_backend;
+
+        /* streams that need the reactor, under m_lock */
+        Util::Mutex                     m_lock;
+        std::deque<CReactorStream *>    m_pending;
+        bool                            m_wakePending;
+        bool                            m_stopped;      /* the thread has ended */
+
+        /* reactor thread only */
+        std::list<CReactorStream *>     m_streams;      /* added to the backend */
+        std::list<CReactorStream *>     m_detaching;
+    };
+};
+
+#endif
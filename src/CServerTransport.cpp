@@ -12,6 +12,8 @@
 #include "CKeyExchange.h"
 #include "reasons.h"
 #include "errors.h"
+#include "CHistogram.h"
+#include "util.h"
 
 /* C/C++ includes */
 #include <memory>   /* for auto_ptr */
@@ -30,12 +32,27 @@ namespace ssh
      */
     CServerTransport::CServerTransport(
         const ssh::CSettings & settings,                            /* settings to be used */
-        CNetwork * network,                                         /* network (socket) */
+        INetwork * network,                                         /* network (socket or pipe) */
         ssh::sshd * server)                                         /* the ssh server */
         :   CTransport(settings, network), m_sshd( server )
     {
+        int value;
+
         m_pAuthService  = NULL;
         m_pService      = NULL;
+
+        if( !settings.GetValue(SSHD_SETTING_IDLE_HIBERNATE, value) )
+            value = SSHD_DEFAULT_IDLE_HIBERNATE;
+        m_idleHibernate = value > 0 ? static_cast<uint64_t>(value) * 1000000000ULL : 0;
+
+        /* the connection is created as it is accepted, the grace time starts now */
+        if( !settings.GetValue(SSHD_SETTING_LOGIN_GRACE_TIME, value) )
+            value = SSHD_DEFAULT_LOGIN_GRACE_TIME;
+        m_deadline      = value > 0 ? GetMonotonicTime() + static_cast<uint64_t>(value) * 1000000000ULL : 0;
+        m_lastActivity  = 0;
+        m_hibernating   = false;
+        m_recorder      = NULL;
+        m_admission     = NULL;
     }
 
     /* CServerTransport::~CServerTransport
@@ -47,6 +64,8 @@ namespace ssh
             delete m_pService;
         if( m_pAuthService )
             delete m_pAuthService;
+        if( m_recorder )
+            delete m_recorder;
     }
 
     /* CServerTransport::displayMotd
@@ -111,105 +130,30 @@ namespace ssh
 
         ds->setBlockingMode( true );
         /* Exchange the protocol version strings */
+        uint64_t start = GetMonotonicTime();
         if( (res = exchangeProtocolVersions()) != sshd_OK ) 
         {
             return sshd_ERROR;
         }
+        CHistogram::Get( HISTOGRAM_VERSION_EXCHANGE ).record( GetMonotonicTime() - start );
         ds->setBlockingMode( false );
 
         res = performKeyExchange();
-        if( res != sshd_OK )
+        if( res != sshd_OK ) {
+            sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+            disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
             return sshd_ERROR;
+        }
 
         return sshd_OK;
     }
 
-    /* CServerTransport::performKeyExchange 
-     * Performs the server-side keyexchange.
+    /* CServerTransport::acquireHostKey
+     * Returns the resident hostkey for the negotiated algorithm.
      */
-    int CServerTransport::performKeyExchange(bool bInitial, bool bInitiator)
+    CHostKey * CServerTransport::acquireHostKey(const std::string & name)
     {
-        int res;
-        bool guess = false;
-        CKeyExchange * keyexchange;
-        CHostKey * hostkey;
-
-        std::string matches[MAX_ALGORITHM_COUNT];
-
-        /* create the local kex packet */
-        if( !buildLocalKex() ) {
-            return sshd_INTERNAL_ERROR;
-        }
-
-        res = exchangeKeyExchanges(m_localKex, m_remoteKex, bInitial, bInitiator);
-        if( res != sshd_OK )
-            return sshd_ERROR;
-
-        /* Decide what algorithms to use */
-        if( !DecideAlgorithms(m_remoteKex.algorithms, m_localKex.algorithms, matches, MAX_ALGORITHM_COUNT) ) {
-            /* algorithms does not match */
-            sshd_Log(sshd_EVENT_FATAL, "Algorithm missmatch.");
-            disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
-            return sshd_ERROR;
-        }
-
-        /* create the keyexchange instance */
-        keyexchange = CKeyExchange::CreateInstance(matches[KEYEXCHANGE_METHOD], this);
-        if( !keyexchange ) {
-            disconnect( SSH_DISCONNECT_BY_APPLICATION );
-            sshd_Log(sshd_EVENT_FATAL, "Failed to instansiate algorithms.");
-            return sshd_INTERNAL_ERROR;
-        }
-
-        /* create the hostkey */
-        hostkey = CHostKey::CreateInstance(matches[SERVER_HOSTKEY]);
-        if( !hostkey ) {
-            disconnect( SSH_DISCONNECT_BY_APPLICATION );
-            return sshd_INTERNAL_ERROR;
-        }
-
-        /* load the server's private keys */
-        if( !hostkey->loadKeys(m_settings) ) {
-            sshd_Log(sshd_EVENT_FATAL, "Failed to load key-pair.");
-            return sshd_INTERNAL_ERROR;
-        }
-
-        res = keyexchange->ServerKeyExchange(hostkey, guess && m_remoteKex.follows);
-        if( res != sshd_OK )
-        {
-            sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
-            disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
-            return sshd_ERROR;
-        }
-
-        /* We need both the exchange hash and the shared secret to derive the keys */
-        vector<byte> exchangeHash       = keyexchange->GetExchangeHash();
-        const CBigInt * sharedSecret    = keyexchange->GetSharedSecret();
-
-        m_exchangeHash = exchangeHash;
-
-        if( m_sessionIdent.empty() ) {
-            /* the first exchange hash is also the session identifier */
-            DBG("First keyexchange, using the exchange hash as session identifier.");
-            m_sessionIdent = exchangeHash;
-        }
-
-        KeyVector keyvec;
-
-        /* Now derive the required keys */
-        res = DeriveKeys(exchangeHash, m_sessionIdent, *sharedSecret, keyexchange->GetHash(), keyvec);
-        if( res != sshd_OK ) {
-            disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
-            return sshd_ERROR;
-        }
-
-        /* Now initialize the algorithms */
-        if( TakeKeysIntoUse( keyvec, matches ) != sshd_OK ) {
-            disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
-            return sshd_ERROR;
-        }
-
-        return sshd_OK;
+        return m_sshd->getHostKeys().find( name );
     }
 
     /* CServerTransport::InitializeKeys
@@ -233,22 +177,29 @@ namespace ssh
     }
 
     /* CServerTransport::TakeAlgorithmsInUse
-     *
+     * Takes the new algorithms into use for one direction.
      */
-    int CServerTransport::TakeAlgorithmsInUse( const SecurityBlock & block )
+    void CServerTransport::TakeAlgorithmsInUse( SecurityBlock & block, bool bSend )
     {
-        /* delete old instances */
-        delete sendState.cipher;
-        delete sendState.hmac;
-        delete readState.cipher;
-        delete readState.hmac;
-
-        /* use the new ones */
-        sendState.cipher    = block.enc_server_to_client;
-        sendState.hmac      = block.hmac_server_to_client;
-        readState.cipher    = block.enc_client_to_server;
-        readState.hmac      = block.hmac_client_to_server;
+        if( bSend )
+        {
+            delete sendState.cipher;
+            delete sendState.hmac;
 
-        return sshd_OK;
+            sendState.cipher            = block.enc_server_to_client;
+            sendState.hmac              = block.hmac_server_to_client;
+            block.enc_server_to_client  = NULL;
+            block.hmac_server_to_client = NULL;
+        }
+        else
+        {
+            delete readState.cipher;
+            delete readState.hmac;
+
+            readState.cipher            = block.enc_client_to_server;
+            readState.hmac              = block.hmac_client_to_server;
+            block.enc_client_to_server  = NULL;
+            block.hmac_client_to_server = NULL;
+        }
     }
 };
\ No newline at end of file
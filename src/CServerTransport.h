@@ -16,8 +16,15 @@
 //#include "CService.h"
 #include "CAuthenticationService.h"
 #include "CNetwork.h"
+#include "CSessionRecorder.h"
+#include "CAdmission.h"
 #include "CThread.h"
 
+/* idle connections */
+#define SSHD_DEFAULT_IDLE_HIBERNATE         (300)   /* seconds */
+#define SSHD_HIBERNATE_POLL_INTERVAL        (250)   /* milliseconds to wait for data while hibernating */
+#define SSHD_DEFAULT_LOGIN_GRACE_TIME       (120)   /* seconds */
+
 /* server states */
 typedef enum {
     sshd_AUTH_STATE_WAIT_SERVICE_REQUEST = 0,
@@ -38,7 +45,7 @@ namespace ssh
     class CServerTransport : public CTransport
     {
     public:
-        CServerTransport(const CSettings &, ssh::CNetwork *, ssh::sshd *);
+        CServerTransport(const CSettings &, ssh::INetwork *, ssh::sshd *);
         ~CServerTransport();
 
         /*
@@ -54,8 +61,6 @@ namespace ssh
 
         /* establishes the connection */
         int establishConnection();
-        /* performs a keyexchange */
-        int performKeyExchange(bool bInitial = true, bool bInitiator = true);
     
         bool isServer() {return true;}
 
@@ -64,9 +69,12 @@ namespace ssh
 
         const KeyExchangeInfo & getServerKex() {return m_localKex;}
         const KeyExchangeInfo & getClientKex() {return m_remoteKex;}
-        const std::string & getServerProtocolString() {return m_localVersion;}
+        const std::string & getServerProtocolString() {return m_template->GetVersionString();}
         const std::string & getClientProtocolString() {return m_remoteVersion;}
 
+        /* the connection holds a startup of the admission control until it authenticates */
+        void setAdmission(CAdmission * admission) {m_admission = admission;}
+
     protected:
 
         void Task();
@@ -78,9 +86,21 @@ namespace ssh
         int tryHandleAuthServiceRequest();
         
         int handlePacket();
+        int sendServiceAccept();
+
+        /* idle connections */
+        bool hibernate();
+        void wake();
+
+        /* session recording */
+        void startRecording();
+
+        /* admission control */
+        void releaseStartup();
 
         virtual void InitializeKeys(const SecurityBlock & block, const KeyVector & vec);
-        virtual int TakeAlgorithmsInUse( const SecurityBlock & block );
+        virtual void TakeAlgorithmsInUse( SecurityBlock & block, bool bSend );
+        virtual CHostKey * acquireHostKey(const std::string &);
 
 
         CAuthenticationService *    createAuthenticationService(const std::string & name, ssh::CTransport *);
@@ -97,9 +117,21 @@ namespace ssh
 
         /* service */
         ssh::CService *             m_pService;
+        std::string                 m_pendingAccept;    /* service whose SSH_MSG_SERVICE_ACCEPT is not sent yet */
 
         /* the SSH server */
         ssh::sshd *                 m_sshd;
+
+        /* idle connections */
+        uint64_t                    m_idleHibernate;    /* nanoseconds, 0 if disabled */
+        uint64_t                    m_lastActivity;     /* monotonic time of the last packet */
+        bool                        m_hibernating;
+
+        /* the service traffic, NULL unless recording is enabled */
+        CSessionRecorder *          m_recorder;
+
+        /* released once authenticated or closed, NULL if not admitted by it */
+        CAdmission *                m_admission;
     };
 };
 
@@ -39,6 +39,12 @@ namespace ssh
         /* returns the name of the service */
         virtual std::string GetServiceName()                            = 0;
 
+        /* called when the connection has been idle for a while, the service should free
+           any memory it can rebuild later */
+        virtual void hibernate() {}
+        /* called before the service is used again after hibernate */
+        virtual void wake() {}
+
     protected:
         ssh::CTransport * m_pTransport;     /* the associated transport layer */
     };
@@ -0,0 +1,225 @@
+/* CSessionRecorder.cpp
+ * Implements the session recording.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstring>
+
+/* project includes */
+#include "CSessionRecorder.h"
+#include "CLogger.h"
+#include "util.h"
+
+#if defined(WIN32) || defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define RECORD_MAX_LENGTH           (16 * 1024 * 1024)  /* sanity limit when reading */
+
+using namespace std;
+
+namespace ssh
+{
+    /* CSessionRecorder::CSessionRecorder
+     * Constructor.
+     */
+    CSessionRecorder::CSessionRecorder()
+    {
+        m_file = NULL;
+        m_last = 0;
+    }
+
+    /* CSessionRecorder::~CSessionRecorder
+     * Destructor, closes the file.
+     */
+    CSessionRecorder::~CSessionRecorder()
+    {
+        close();
+    }
+
+    /* CSessionRecorder::open
+     * Creates the session file. Fails if the path already exists, also as a symbolic link,
+     * so a recording never replaces or writes through another file.
+     */
+    bool CSessionRecorder::open(const string & path)
+    {
+        close();
+
+#if defined(WIN32) || defined(_WIN32)
+        int fd = _open( path.c_str(), _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE );
+        if( fd >= 0 && !(m_file = _fdopen( fd, "wb" )) )
+            _close( fd );
+#else
+        int fd = ::open( path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600 );
+        if( fd >= 0 && !(m_file = fdopen( fd, "wb" )) )
+            ::close( fd );
+#endif
+        if( !m_file )
+            return false;
+
+        if( fwrite( SESSION_FILE_MAGIC, 1, SESSION_FILE_MAGIC_LENGTH, m_file ) != SESSION_FILE_MAGIC_LENGTH ) {
+            close();
+            return false;
+        }
+        m_last = GetMonotonicTime();
+        return true;
+    }
+
+    /* CSessionRecorder::close
+     * Writes the buffered records and closes the file.
+     */
+    void CSessionRecorder::close()
+    {
+        if( m_file ) {
+            fclose( m_file );
+            m_file = NULL;
+        }
+    }
+
+    /* CSessionRecorder::writeVarint
+     * Writes a value 7 bits at a time.
+     */
+    void CSessionRecorder::writeVarint(uint64_t value)
+    {
+        byte buf[10];
+        int n = 0;
+
+        do {
+            buf[n] = (byte) (value & 0x7F);
+            value >>= 7;
+            if( value )
+                buf[n] |= 0x80;
+            n++;
+        } while( value );
+
+        fwrite( buf, 1, n, m_file );
+    }
+
+    /* CSessionRecorder::record
+     * Appends a record. The file is buffered, so this is usually a copy.
+     */
+    void CSessionRecorder::record(int type, const byte * data, uint32_t length)
+    {
+        if( !m_file )
+            return;
+
+        uint64_t delta = (GetMonotonicTime() - m_last) / 1000;
+        byte t = (byte) type;
+
+        fwrite( &t, 1, 1, m_file );
+        writeVarint( delta );
+        writeVarint( length );
+        fwrite( data, 1, length, m_file );
+        m_last += delta * 1000;     /* the rounding does not add up over the records */
+
+        if( ferror( m_file ) ) {
+            sshd_Log(sshd_EVENT_WARNING, "Failed to write the session file, recording stopped.");
+            close();
+        }
+    }
+
+    /* CSessionReader::CSessionReader
+     * Constructor.
+     */
+    CSessionReader::CSessionReader()
+    {
+        m_file      = NULL;
+        m_time      = 0;
+        m_truncated = false;
+    }
+
+    /* CSessionReader::~CSessionReader
+     * Destructor.
+     */
+    CSessionReader::~CSessionReader()
+    {
+        close();
+    }
+
+    /* CSessionReader::open
+     * Opens a session file, fails if it does not start with the magic.
+     */
+    bool CSessionReader::open(const string & path)
+    {
+        char magic[SESSION_FILE_MAGIC_LENGTH];
+
+        close();
+        if( !(m_file = fopen( path.c_str(), "rb" )) )
+            return false;
+
+        if( fread( magic, 1, SESSION_FILE_MAGIC_LENGTH, m_file ) != SESSION_FILE_MAGIC_LENGTH ||
+            memcmp( magic, SESSION_FILE_MAGIC, SESSION_FILE_MAGIC_LENGTH ) != 0 )
+        {
+            close();
+            return false;
+        }
+        m_time      = 0;
+        m_truncated = false;
+        return true;
+    }
+
+    /* CSessionReader::close
+     * Closes the file.
+     */
+    void CSessionReader::close()
+    {
+        if( m_file ) {
+            fclose( m_file );
+            m_file = NULL;
+        }
+    }
+
+    /* CSessionReader::readVarint
+     * Reads a value written by CSessionRecorder::writeVarint.
+     */
+    bool CSessionReader::readVarint(uint64_t & value)
+    {
+        value = 0;
+        for(int shift = 0; shift < 64; shift += 7)
+        {
+            int c = fgetc( m_file );
+            if( c == EOF )
+                return false;
+
+            value |= (uint64_t) (c & 0x7F) << shift;
+            if( !(c & 0x80) )
+                return true;
+        }
+        return false;
+    }
+
+    /* CSessionReader::next
+     * Reads the next record.
+     */
+    bool CSessionReader::next(SessionRecord & record)
+    {
+        uint64_t delta, length;
+        int type;
+
+        if( !m_file || (type = fgetc( m_file )) == EOF )
+            return false;
+
+        if( !readVarint( delta ) || !readVarint( length ) || length > RECORD_MAX_LENGTH ) {
+            m_truncated = true;
+            return false;
+        }
+
+        record.type = type;
+        record.data.resize( (size_t) length );
+        if( length && fread( &record.data[0], 1, (size_t) length, m_file ) != length ) {
+            m_truncated = true;
+            return false;
+        }
+
+        m_time     += delta;
+        record.time = m_time;
+        return true;
+    }
+};
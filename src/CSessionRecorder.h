@@ -0,0 +1,113 @@
+/* CSessionRecorder.h
+ * Records the service traffic of a connection for replay.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CSESSIONRECORDER_H_
+#define _CSESSIONRECORDER_H_
+
+/* C/C++ includes */
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* project includes */
+#include "types.h"
+
+/*
+ * Session file format. The file starts with SESSION_FILE_MAGIC, followed by records of
+ *
+ *      byte        type            one of the RECORD_* types
+ *      varint      delta           microseconds since the previous record
+ *      varint      length
+ *      byte[n]     data
+ *
+ * where a varint is stored 7 bits at a time, least significant first, with the high bit
+ * set on all but the last byte.
+ */
+#define SESSION_FILE_MAGIC          "SSHDREC1"
+#define SESSION_FILE_MAGIC_LENGTH   (8)
+#define SESSION_FILE_EXTENSION      ".rec"
+
+enum {
+    RECORD_SERVICE = 1,     /* the name of the accepted service */
+    RECORD_INPUT,           /* a payload handed to the service */
+    RECORD_OUTPUT           /* a payload read from the service and sent */
+};
+
+namespace ssh
+{
+    /* CSessionRecorder
+     * Writes the decrypted payloads exchanged with the service of one connection, and when
+     * they were seen, to a session file. Only the traffic after the authentication is
+     * recorded, but the files still hold everything the user sent, so they are created
+     * readable by the owner only. A failed write stops the recording, never the connection.
+     */
+    class CSessionRecorder
+    {
+    public:
+        CSessionRecorder();
+        ~CSessionRecorder();
+
+        /* creates the file and writes the header */
+        bool open(const std::string & path);
+        void close();
+        bool isOpen() const     {return m_file != NULL;}
+
+        /* appends a record, stamped with the current time */
+        void record(int type, const byte * data, uint32_t length);
+
+    protected:
+        void writeVarint(uint64_t value);
+
+        FILE *      m_file;
+        uint64_t    m_last;         /* monotonic time of the previous record */
+
+    private:
+        CSessionRecorder(const CSessionRecorder &);
+        CSessionRecorder & operator=(const CSessionRecorder &);
+    };
+
+    /* SessionRecord
+     * A record read back from a session file.
+     */
+    struct SessionRecord
+    {
+        int                 type;
+        uint64_t            time;   /* microseconds since the start of the recording */
+        std::vector<byte>   data;
+    };
+
+    /* CSessionReader
+     * Reads a session file.
+     */
+    class CSessionReader
+    {
+    public:
+        CSessionReader();
+        ~CSessionReader();
+
+        /* opens the file and checks the header */
+        bool open(const std::string & path);
+        void close();
+
+        /* reads the next record, false at the end of the file or on error */
+        bool next(SessionRecord &);
+        /* true if the file ended in the middle of a record */
+        bool isTruncated() const    {return m_truncated;}
+
+    protected:
+        bool readVarint(uint64_t & value);
+
+        FILE *      m_file;
+        uint64_t    m_time;
+        bool        m_truncated;
+
+    private:
+        CSessionReader(const CSessionReader &);
+        CSessionReader & operator=(const CSessionReader &);
+    };
+};
+
+#endif
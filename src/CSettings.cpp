@@ -25,6 +25,7 @@ namespace ssh
      */
     CSettings::CSettings()
     {
+        m_generation = 1;
         for(int i = 0; i < SSHD_SETTING_MAX; i++)
             settings[i].type = SETTING_NO_VALUE;
     }
@@ -36,6 +37,7 @@ namespace ssh
     {
         settings[setting].sValue    = str;
         settings[setting].type      = SETTING_STRING_VALUE;
+        m_generation++;
 
         return true;
     }
@@ -47,6 +49,7 @@ namespace ssh
     {
         settings[setting].iValue = value;
         settings[setting].type = SETTING_INT_VALUE;
+        m_generation++;
 
         return true;
     }
@@ -3,6 +3,8 @@
 
 #include <string>
 
+#include "types.h"
+
 enum 
 {
     SSHD_SETTING_MOTD_ENABLED,
@@ -27,6 +29,37 @@ enum
 
     SSHD_SETTING_RSA_PUBLIC_KEY_FILE,           /* Server's private RSA key file */
     SSHD_SETTING_RSA_PRIVATE_KEY_FILE,          /* Server's public RSA key file */
+    SSHD_SETTING_ECDSA_PRIVATE_KEY_FILE,        /* Server's private ECDSA (P-256) key file */
+    SSHD_SETTING_ED25519_PRIVATE_KEY_FILE,      /* Server's private Ed25519 key file */
+
+    /* rekey limits, a keyexchange is started when any limit is reached, zero disables a limit */
+    SSHD_SETTING_REKEY_DATA_LIMIT,              /* megabytes transferred */
+    SSHD_SETTING_REKEY_PACKET_LIMIT,            /* packets transferred in either direction */
+    SSHD_SETTING_REKEY_TIME_LIMIT,              /* seconds */
+
+    /* packet sizes */
+    SSHD_SETTING_BUFFER_SIZE,                   /* size of each transport buffer in bytes */
+    SSHD_SETTING_MAX_PACKET_SIZE,               /* largest packet_length accepted, at least 35000, 32000 sent without large packets */
+    SSHD_SETTING_LARGE_PACKETS,                 /* offer large-packets@lwssh to the peer */
+
+    /* idle connections */
+    SSHD_SETTING_IDLE_HIBERNATE,                /* seconds without traffic before hibernating, 0 disables */
+
+    /* connections */
+    SSHD_SETTING_NETWORK_BACKEND,               /* socket I/O of the connections, "select", "epoll" or "io_uring" */
+    SSHD_SETTING_LISTEN_ADDRESS,                /* comma separated "host[:port]" or "[v6][:port]", "*" is any IPv4 address */
+    SSHD_SETTING_LISTEN_BACKLOG,                /* connections queued by each listening socket */
+    SSHD_SETTING_ACCEPT_THREADS,                /* accept threads, more than one needs SO_REUSEPORT */
+
+    /* admission control, applied before the handshake */
+    SSHD_SETTING_MAX_STARTUPS,                  /* unauthenticated connections, "start:rate:full" or "limit" */
+    SSHD_SETTING_SOURCE_RATE,                   /* handshakes per minute from one address, 0 disables */
+    SSHD_SETTING_SOURCE_BURST,                  /* handshakes one address may start at once */
+    SSHD_SETTING_LOGIN_GRACE_TIME,              /* seconds from accept to authenticate in, 0 disables */
+
+    /* monitoring */
+    SSHD_SETTING_STATS_SOCKET,                  /* path of the Unix domain statistics socket */
+    SSHD_SETTING_RECORD_DIRECTORY,              /* directory to record the sessions in, unset disables */
 
     /* new settings must be added before this */
     SSHD_SETTING_MAX
@@ -50,6 +83,9 @@ namespace ssh
         bool GetString(int, std::string &) const;       /* reads a stored string */
         bool GetValue(int, int &) const;                /* reads a stored integer value */
 
+        /* incremented each time a setting is stored, used to detect stale cached data */
+        uint32_t GetGeneration() const {return m_generation;}
+
     protected:
 
         enum {
@@ -65,6 +101,7 @@ namespace ssh
         };
 
         Element settings[SSHD_SETTING_MAX];
+        uint32_t m_generation;
     };
 };
 
@@ -0,0 +1,350 @@
+/* CStats.cpp
+ * Implements the performance counters.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstdio>
+#include <cstring>
+
+/* project includes */
+#include "CStats.h"
+#include "CHistogram.h"
+
+using namespace std;
+
+namespace ssh
+{
+    /* the statistics of the process */
+    static CStats stats;
+
+    static const char * errorNames[STATS_ERROR_MAX] = {
+        "protocol",
+        "mac",
+        "network",
+        "internal"
+    };
+
+    static const char * rejectNames[STATS_REJECT_MAX] = {
+        "full",
+        "early_drop",
+        "source_rate",
+        "descriptors"
+    };
+
+    /* AppendNumber
+     * Appends an unsigned integer in decimal.
+     */
+    static void AppendNumber(string & out, uint64_t value)
+    {
+        char buf[24];
+        int pos = sizeof(buf);
+
+        do {
+            buf[--pos] = '0' + (char) (value % 10);
+            value /= 10;
+        } while( value );
+        out.append( buf + pos, sizeof(buf) - pos );
+    }
+
+    /* AppendSeconds
+     * Appends a duration in nanoseconds as seconds.
+     */
+    static void AppendSeconds(string & out, uint64_t ns)
+    {
+        char buf[32];
+        sprintf( buf, "%.6f", (double) ns / 1000000000.0 );
+        out += buf;
+    }
+
+    /* AppendHeader
+     * Appends the help and type lines of a metric.
+     */
+    static void AppendHeader(string & out, const char * name, const char * type, const char * help)
+    {
+        out += "# HELP ";
+        out += name;
+        out += " ";
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += " ";
+        out += type;
+        out += "\n";
+    }
+
+    /* AppendMetric
+     * Appends a metric with a single value.
+     */
+    static void AppendMetric(string & out, const char * name, const char * type, const char * help, uint64_t value)
+    {
+        AppendHeader( out, name, type, help );
+        out += name;
+        out += " ";
+        AppendNumber( out, value );
+        out += "\n";
+    }
+
+    /* StatsCounters::add
+     * Adds the counters of another connection.
+     */
+    void StatsCounters::add(const StatsCounters & other)
+    {
+        bytesIn             += other.bytesIn;
+        bytesOut            += other.bytesOut;
+        packetsIn           += other.packetsIn;
+        packetsOut          += other.packetsOut;
+        cryptoTime          += other.cryptoTime;
+        handshakesStarted   += other.handshakesStarted;
+        handshakesCompleted += other.handshakesCompleted;
+        handshakeTime       += other.handshakeTime;
+        authSuccess         += other.authSuccess;
+        authFailure         += other.authFailure;
+        for(int i = 0; i < STATS_ERROR_MAX; i++)
+            errors[i] += other.errors[i];
+        allocations         += other.allocations;
+    }
+
+    /* CStatsBlock::CStatsBlock
+     * Constructor, registers the block. The first slot is used until a cipher has been
+     * negotiated.
+     */
+    CStatsBlock::CStatsBlock()
+    {
+        memset( &counters, 0, sizeof(counters) );
+        memset( ciphers, 0, sizeof(ciphers) );
+        strcpy( ciphers[0].name, "none" );
+        cipherCount = 1;
+        readCipher  = 0;
+        sendCipher  = 0;
+        m_allocationMark = 0;
+
+        stats.attach( this );
+    }
+
+    /* CStatsBlock::~CStatsBlock
+     * Destructor, the counters are added to the totals.
+     */
+    CStatsBlock::~CStatsBlock()
+    {
+        stats.detach( this );
+    }
+
+    /* CStatsBlock::selectCipher
+     * Returns the slot for the cipher, a new slot is taken under the lock since the stats
+     * writer reads the names.
+     */
+    int CStatsBlock::selectCipher(const std::string & name)
+    {
+        for(int i = 0; i < cipherCount; i++) {
+            if( name == ciphers[i].name )
+                return i;
+        }
+        return stats.selectCipher( this, name );
+    }
+
+    /* CStats::CStats
+     * Constructor.
+     */
+    CStats::CStats()
+    {
+        m_blocks        = NULL;
+        m_open          = 0;
+        m_connections   = 0;
+        memset( &m_closed, 0, sizeof(m_closed) );
+        memset( m_rejected, 0, sizeof(m_rejected) );
+    }
+
+    /* CStats::GetInstance
+     * Returns the statistics of the process.
+     */
+    CStats & CStats::GetInstance()
+    {
+        return stats;
+    }
+
+    /* CStats::attach
+     * Registers the counters of a new connection.
+     */
+    void CStats::attach(CStatsBlock * block)
+    {
+        m_lock.acquire();
+        block->m_prev = NULL;
+        block->m_next = m_blocks;
+        if( m_blocks )
+            m_blocks->m_prev = block;
+        m_blocks = block;
+        m_open++;
+        m_connections++;
+        m_lock.release();
+    }
+
+    /* CStats::countRejected
+     * Counts a connection that was closed before its handshake started.
+     */
+    void CStats::countRejected(int reason)
+    {
+        m_lock.acquire();
+        m_rejected[reason]++;
+        m_lock.release();
+    }
+
+    /* CStats::detach
+     * Adds the counters of a closed connection to the totals.
+     */
+    void CStats::detach(CStatsBlock * block)
+    {
+        m_lock.acquire();
+        if( block->m_prev )
+            block->m_prev->m_next = block->m_next;
+        else
+            m_blocks = block->m_next;
+        if( block->m_next )
+            block->m_next->m_prev = block->m_prev;
+        m_open--;
+
+        m_closed.add( block->counters );
+        addCiphers( m_closedCiphers, block->ciphers, block->cipherCount );
+        m_lock.release();
+    }
+
+    /* CStats::selectCipher
+     * Takes a new cipher slot in the block. When the slots run out the last one is renamed,
+     * the bytes counted so far stay with the new name.
+     */
+    int CStats::selectCipher(CStatsBlock * block, const std::string & name)
+    {
+        int slot;
+
+        m_lock.acquire();
+        slot = block->cipherCount < STATS_CIPHER_SLOTS ? block->cipherCount++ : STATS_CIPHER_SLOTS - 1;
+        strncpy( block->ciphers[slot].name, name.c_str(), STATS_CIPHER_NAME_LENGTH - 1 );
+        block->ciphers[slot].name[STATS_CIPHER_NAME_LENGTH - 1] = 0;
+        m_lock.release();
+        return slot;
+    }
+
+    /* CStats::addCiphers
+     * Adds the per cipher byte counts to a list, merging entries with the same name.
+     */
+    void CStats::addCiphers(std::vector<StatsCipher> & list, const StatsCipher * ciphers, int count)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            vector<StatsCipher>::iterator it;
+            for(it = list.begin(); it != list.end(); it++) {
+                if( !strcmp( it->name, ciphers[i].name ) )
+                    break;
+            }
+
+            if( it == list.end() ) {
+                list.push_back( ciphers[i] );
+            } else {
+                it->bytesIn     += ciphers[i].bytesIn;
+                it->bytesOut    += ciphers[i].bytesOut;
+            }
+        }
+    }
+
+    /* CStats::snapshot
+     * Sums the counters of the open connections with the totals.
+     */
+    void CStats::snapshot(StatsCounters & total)
+    {
+        m_lock.acquire();
+        total = m_closed;
+        for(CStatsBlock * block = m_blocks; block; block = block->m_next)
+            total.add( block->counters );
+        m_lock.release();
+    }
+
+    /* CStats::write
+     * Sums the counters of the open connections with the totals and writes them in the
+     * Prometheus text exposition format.
+     */
+    void CStats::write(std::string & out)
+    {
+        StatsCounters total;
+        vector<StatsCipher> ciphers;
+        uint32_t open;
+        uint64_t connections, rejected[STATS_REJECT_MAX];
+
+        m_lock.acquire();
+        total       = m_closed;
+        ciphers     = m_closedCiphers;
+        open        = m_open;
+        connections = m_connections;
+        memcpy( rejected, m_rejected, sizeof(rejected) );
+        for(CStatsBlock * block = m_blocks; block; block = block->m_next) {
+            total.add( block->counters );
+            addCiphers( ciphers, block->ciphers, block->cipherCount );
+        }
+        m_lock.release();
+
+        out.clear();
+        AppendMetric( out, "sshd_connections_open", "gauge", "Connections currently open.", open );
+        AppendMetric( out, "sshd_connections_total", "counter", "Connections accepted or opened.", connections );
+
+        AppendHeader( out, "sshd_connections_rejected_total", "counter", "Connections refused before the handshake by reason." );
+        for(int i = 0; i < STATS_REJECT_MAX; i++) {
+            out += "sshd_connections_rejected_total{reason=\"";
+            out += rejectNames[i];
+            out += "\"} ";
+            AppendNumber( out, rejected[i] );
+            out += "\n";
+        }
+        AppendMetric( out, "sshd_received_bytes_total", "counter", "Bytes of packets received.", total.bytesIn );
+        AppendMetric( out, "sshd_sent_bytes_total", "counter", "Bytes of packets sent.", total.bytesOut );
+        AppendMetric( out, "sshd_received_packets_total", "counter", "Packets received.", total.packetsIn );
+        AppendMetric( out, "sshd_sent_packets_total", "counter", "Packets sent.", total.packetsOut );
+        AppendMetric( out, "sshd_handshakes_started_total", "counter", "Keyexchanges started.", total.handshakesStarted );
+        AppendMetric( out, "sshd_handshakes_completed_total", "counter", "Keyexchanges completed.", total.handshakesCompleted );
+
+        AppendHeader( out, "sshd_handshake_seconds_total", "counter", "Time spent in completed keyexchanges." );
+        out += "sshd_handshake_seconds_total ";
+        AppendSeconds( out, total.handshakeTime );
+        out += "\n";
+
+        AppendHeader( out, "sshd_crypto_seconds_total", "counter", "Time spent encrypting, decrypting and computing macs." );
+        out += "sshd_crypto_seconds_total ";
+        AppendSeconds( out, total.cryptoTime );
+        out += "\n";
+
+        AppendHeader( out, "sshd_authentications_total", "counter", "Completed authentications by result." );
+        out += "sshd_authentications_total{result=\"success\"} ";
+        AppendNumber( out, total.authSuccess );
+        out += "\nsshd_authentications_total{result=\"failure\"} ";
+        AppendNumber( out, total.authFailure );
+        out += "\n";
+
+        AppendHeader( out, "sshd_errors_total", "counter", "Connection errors by category." );
+        for(int i = 0; i < STATS_ERROR_MAX; i++) {
+            out += "sshd_errors_total{type=\"";
+            out += errorNames[i];
+            out += "\"} ";
+            AppendNumber( out, total.errors[i] );
+            out += "\n";
+        }
+
+#if defined(SSHD_COUNT_ALLOCATIONS)
+        AppendMetric( out, "sshd_allocations_total", "counter", "Heap allocations of the connection threads.", total.allocations );
+#endif
+
+        AppendHeader( out, "sshd_cipher_bytes_total", "counter", "Bytes of packets by cipher and direction." );
+        for(vector<StatsCipher>::iterator it = ciphers.begin(); it != ciphers.end(); it++) {
+            out += "sshd_cipher_bytes_total{cipher=\"";
+            out += it->name;
+            out += "\",direction=\"in\"} ";
+            AppendNumber( out, it->bytesIn );
+            out += "\nsshd_cipher_bytes_total{cipher=\"";
+            out += it->name;
+            out += "\",direction=\"out\"} ";
+            AppendNumber( out, it->bytesOut );
+            out += "\n";
+        }
+
+        /* the latency distributions are shared by all connections */
+        CHistogram::WriteAll( out );
+    }
+};
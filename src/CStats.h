@@ -0,0 +1,170 @@
+/* CStats.h
+ * Performance counters.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CSTATS_H_
+#define _CSTATS_H_
+
+/* C/C++ includes */
+#include <string>
+#include <vector>
+
+/* project includes */
+#include "types.h"
+#include "util.h"
+#include "Mutex.h"
+
+#define STATS_CIPHER_SLOTS          (4)         /* ciphers tracked per connection */
+#define STATS_CIPHER_NAME_LENGTH    (32)
+
+/* error categories */
+enum
+{
+    STATS_ERROR_PROTOCOL = 0,       /* malformed packets */
+    STATS_ERROR_MAC,                /* failed integrity checks */
+    STATS_ERROR_NETWORK,            /* socket errors */
+    STATS_ERROR_INTERNAL,           /* out of memory and the like */
+    STATS_ERROR_MAX
+};
+
+/* reasons a connection is refused before its handshake, see CAdmission */
+enum
+{
+    STATS_REJECT_FULL = 0,          /* the unauthenticated connections are at the hard limit */
+    STATS_REJECT_EARLY_DROP,        /* dropped at random between the soft and the hard limit */
+    STATS_REJECT_SOURCE_RATE,       /* the source address ran out of handshake attempts */
+    STATS_REJECT_DESCRIPTORS,       /* out of file descriptors, closed as soon as accepted */
+    STATS_REJECT_MAX
+};
+
+namespace ssh
+{
+    /* StatsCounters
+     * The counters of a connection, or the sum over several connections.
+     */
+    struct StatsCounters
+    {
+        uint64_t    bytesIn,
+                    bytesOut,
+                    packetsIn,
+                    packetsOut;
+        uint64_t    cryptoTime;             /* nanoseconds spent in ciphers and macs */
+        uint64_t    handshakesStarted,
+                    handshakesCompleted,
+                    handshakeTime;          /* nanoseconds from start to completion */
+        uint64_t    authSuccess,
+                    authFailure;
+        uint64_t    errors[STATS_ERROR_MAX];
+        uint64_t    allocations;            /* heap allocations of the connection's thread */
+
+        void add(const StatsCounters &);
+    };
+
+    /* StatsCipher
+     * Bytes transferred with a cipher.
+     */
+    struct StatsCipher
+    {
+        char        name[STATS_CIPHER_NAME_LENGTH];
+        uint64_t    bytesIn,
+                    bytesOut;
+    };
+
+    /* CStatsBlock
+     * The counters of a single connection. Only the connection's own thread updates them,
+     * so they are plain integers, the aggregated values may lag behind by a packet. The
+     * block is registered with CStats for as long as it exists.
+     */
+    class CStatsBlock
+    {
+    public:
+        CStatsBlock();
+        ~CStatsBlock();
+
+        /* counts a received and a sent packet */
+        void countRead(uint32_t bytes) {
+            counters.bytesIn += bytes;
+            counters.packetsIn++;
+            ciphers[readCipher].bytesIn += bytes;
+            countAllocations();
+        }
+        void countSend(uint32_t bytes) {
+            counters.bytesOut += bytes;
+            counters.packetsOut++;
+            ciphers[sendCipher].bytesOut += bytes;
+            countAllocations();
+        }
+        void countError(int category)   {counters.errors[category]++;}
+
+        /* returns the slot used for the cipher */
+        int selectCipher(const std::string & name);
+
+        StatsCounters   counters;
+        StatsCipher     ciphers[STATS_CIPHER_SLOTS];
+        int             cipherCount;
+        int             readCipher,         /* the slots of the ciphers in use */
+                        sendCipher;
+
+    protected:
+        friend class CStats;
+
+        /* charges the allocations the thread made since the last packet to the connection */
+        void countAllocations() {
+#if defined(SSHD_COUNT_ALLOCATIONS)
+            uint64_t count = GetThreadAllocations();
+            counters.allocations += count - m_allocationMark;
+            m_allocationMark = count;
+#endif
+        }
+
+        CStatsBlock *   m_next;
+        CStatsBlock *   m_prev;
+        uint64_t        m_allocationMark;
+
+    private:
+        CStatsBlock(const CStatsBlock &);
+        CStatsBlock & operator=(const CStatsBlock &);
+    };
+
+    /* CStats
+     * Keeps track of the counters of all connections. The counters of closed connections
+     * are folded into a set of totals, the open ones are summed when the statistics are
+     * requested.
+     */
+    class CStats
+    {
+    public:
+        CStats();
+
+        /* writes the statistics in the Prometheus text format */
+        void write(std::string &);
+        /* sums the counters of all connections */
+        void snapshot(StatsCounters &);
+        /* counts a connection refused by the admission control */
+        void countRejected(int reason);
+
+        /* the statistics of the process */
+        static CStats & GetInstance();
+
+    protected:
+        friend class CStatsBlock;
+
+        void attach(CStatsBlock *);
+        void detach(CStatsBlock *);
+        int  selectCipher(CStatsBlock *, const std::string &);
+
+        static void addCiphers(std::vector<StatsCipher> &, const StatsCipher *, int count);
+
+        CStatsBlock *               m_blocks;           /* the open connections */
+        uint32_t                    m_open;
+        uint64_t                    m_connections;      /* connections ever opened */
+        StatsCounters               m_closed;           /* totals of the closed connections */
+        uint64_t                    m_rejected[STATS_REJECT_MAX];
+        std::vector<StatsCipher>    m_closedCiphers;
+        Util::Mutex                 m_lock;
+    };
+};
+
+#endif
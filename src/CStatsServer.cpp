@@ -0,0 +1,162 @@
+/* CStatsServer.cpp
+ * Implements the local statistics endpoint.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstring>
+
+/* project includes */
+#include "CStatsServer.h"
+#include "CStats.h"
+#include "sshd.h"
+
+#if !defined(WIN32) && !defined(_WIN32)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+namespace ssh
+{
+    /* CStatsServer::CStatsServer
+     * Constructor.
+     */
+    CStatsServer::CStatsServer()
+    {
+        m_socket = -1;
+    }
+
+    /* CStatsServer::~CStatsServer
+     * Destructor.
+     */
+    CStatsServer::~CStatsServer()
+    {
+        stop();
+    }
+
+#if defined(WIN32) || defined(_WIN32)
+
+    bool CStatsServer::start(const std::string &)
+    {
+        return false;
+    }
+
+    void CStatsServer::stop()
+    {
+    }
+
+    void CStatsServer::Task()
+    {
+    }
+
+    void CStatsServer::serve(int)
+    {
+    }
+
+#else
+
+    /* CStatsServer::start
+     * Binds the socket, any stale socket file from a previous run is removed first.
+     */
+    bool CStatsServer::start(const std::string & path)
+    {
+        struct sockaddr_un addr;
+
+        if( m_socket != -1 )
+            return true;
+        if( path.empty() || path.size() >= sizeof(addr.sun_path) )
+            return false;
+
+        if( (m_socket = socket( AF_UNIX, SOCK_STREAM, 0 )) == -1 )
+            return false;
+
+        memset( &addr, 0, sizeof(addr) );
+        addr.sun_family = AF_UNIX;
+        strcpy( addr.sun_path, path.c_str() );
+        unlink( addr.sun_path );
+
+        if( bind( m_socket, (struct sockaddr *) &addr, sizeof(addr) ) != 0 ||
+            listen( m_socket, 8 ) != 0 )
+        {
+            close( m_socket );
+            m_socket = -1;
+            return false;
+        }
+        m_path = path;
+
+        if( !spawn() ) {
+            stop();
+            return false;
+        }
+        return true;
+    }
+
+    /* CStatsServer::stop
+     * Waits for the thread and removes the socket.
+     */
+    void CStatsServer::stop()
+    {
+        if( m_socket == -1 )
+            return;
+
+        shutdown();
+        wait();
+
+        close( m_socket );
+        unlink( m_path.c_str() );
+        m_socket = -1;
+    }
+
+    /* CStatsServer::Task
+     * Accepts clients until the server is stopped.
+     */
+    void CStatsServer::Task()
+    {
+        while( !m_abortEvent.isSignaled() )
+        {
+            struct pollfd pfd;
+            pfd.fd      = m_socket;
+            pfd.events  = POLLIN;
+
+            if( poll( &pfd, 1, STATS_POLL_INTERVAL ) <= 0 )
+                continue;
+
+            int client = accept( m_socket, NULL, NULL );
+            if( client == -1 )
+                continue;
+
+            serve( client );
+            close( client );
+        }
+    }
+
+    /* CStatsServer::serve
+     * Writes the statistics to a client.
+     */
+    void CStatsServer::serve(int client)
+    {
+        string text;
+        size_t pos = 0;
+
+        CStats::GetInstance().write( text );
+        while( pos < text.size() )
+        {
+            ssize_t n = ::write( client, text.data() + pos, text.size() - pos );
+            if( n < 0 ) {
+                if( errno == EINTR )
+                    continue;
+                sshd_Log(sshd_EVENT_WARNING, "Failed to write statistics.");
+                return;
+            }
+            pos += n;
+        }
+    }
+
+#endif
+};
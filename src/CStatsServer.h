@@ -0,0 +1,46 @@
+/* CStatsServer.h
+ * Serves the performance counters on a local socket.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CSTATSSERVER_H_
+#define _CSTATSSERVER_H_
+
+/* C/C++ includes */
+#include <string>
+
+/* project includes */
+#include "CThread.h"
+
+#define STATS_POLL_INTERVAL         (250)       /* milliseconds between checks for shutdown */
+
+namespace ssh
+{
+    /* CStatsServer
+     * Listens on a Unix domain socket and writes the statistics in the Prometheus text
+     * format to each client that connects, then closes the connection. The socket is only
+     * reachable from the local host, a scraper or a proxy on the host forwards the data.
+     * Not available on Windows.
+     */
+    class CStatsServer : public Util::CThread
+    {
+    public:
+        CStatsServer();
+        ~CStatsServer();
+
+        /* creates the socket and starts serving */
+        bool start(const std::string & path);
+        /* stops serving and removes the socket */
+        void stop();
+
+    protected:
+        void Task();
+        void serve(int client);
+
+        int         m_socket;
+        std::string m_path;
+    };
+};
+
+#endif
@@ -19,6 +19,7 @@
 #include <windows.h>
 
 #define MAX_STRING_LENGTH       (4096)
+#define MAX_BIGINT_LENGTH       (4096)
 
 using namespace std;
 
@@ -196,19 +197,12 @@ namespace ssh
         if( len == 0 || (len > MAX_STRING_LENGTH) )
             return true;    /* empty string */
 
-        char * dst = new char[len + 1];
-        if( !dst )
-            return false;
-
-        if( !readBytes((byte *)dst, len) ) {
-            delete [] dst;
+        /* read straight into the string, its memory is reused when it is large enough */
+        str.resize( len );
+        if( !readBytes((byte *) &str[0], len) ) {
+            str.clear();
             return false;
         }
-
-        dst[len] = 0;   /* null-terminate it */
-        str = dst;
-
-        delete [] dst;
         return true;
     }
 
@@ -287,16 +281,15 @@ namespace ssh
     bool CStream::readBigInt(BIGNUM ** bn)
     {
         uint32 length;
-        std::vector<byte> vec;
+        byte buf[MAX_BIGINT_LENGTH];
 
-        if( !readInt32( length ) || (length > 4096) )
+        if( !readInt32( length ) || (length > MAX_BIGINT_LENGTH) )
             return false;
 
-        vec.resize( length );
-        if( !readBytes( &vec[0], length ) )
+        if( length && !readBytes( buf, length ) )
             return false;
         
-        if( !(*bn = BN_bin2bn( &vec[0], length, 0 )) )
+        if( !(*bn = BN_bin2bn( buf, length, 0 )) )
             return false;
 
         if( (*bn)->neg ) {
@@ -312,7 +305,7 @@ namespace ssh
     bool CStream::writeBigInt(const BIGNUM * bn)
     {
         int numBytes;
-        vector<uint8_t> dst;
+        uint8_t dst[MAX_NUMBER_LENGTH + 1];
 
         assert(bn != NULL);
         if(BN_is_zero(bn)) {
@@ -322,11 +315,9 @@ namespace ssh
             return false;
         }
         numBytes = BN_num_bytes(bn) + 1;
-        if(numBytes < 2) {
+        if(numBytes < 2 || numBytes > (int) sizeof(dst)) {
             return false;
         }
-        /* resize the vector to store the binary representation */
-        dst.resize(numBytes);
         
         // padding byte
         dst[0] = 0x00;
@@ -338,10 +329,9 @@ namespace ssh
         // check the first byte
         int nohighbit = (dst[1] & 0x80) ? 0 : 1;
         uint32 len = (uint32)(numBytes - nohighbit);
-        if( !writeInt32(len) || !writeBytes(&dst[nohighbit], len) )
-            return false;
-
-        return true;
+        bool res = writeInt32(len) && writeBytes(&dst[nohighbit], len);
+        memset(dst, 0, numBytes);
+        return res;
     }
 #endif
 
@@ -1,33 +1,24 @@
 /* C/C++ standard includes */
 #include <cstdlib>
-#include <sstream>
 
 /* project specific includes */
 #include "CTransport.h"
+#include "CBufferPool.h"
 #include "sshd.h"
 #include "CAlgorithm.h"
 #include "messages.h"
 #include "errors.h"
 
 #include <boost\shared_ptr.hpp>
-#include <openssl/rand.h>
 
 using namespace std;
 
 namespace ssh
 {
-    /*
-     * Default algorithms
-     */
-    const char * defaultKeyexchange     = "diffie-hellman-group14-sha1";
-    const char * defaultHostkey         = "ssh-rsa, ssh-dss";
-    const char * defaultCiphers         = "aes256-cbc,aes128-cbc";
-    const char * defaultHmacs           = "hmac-sha1";
-
     /* CTransport::CTransport
      * Performs the required initialization.
      */
-    CTransport::CTransport(const ssh::CSettings & settings, ssh::CNetwork * network) 
+    CTransport::CTransport(const ssh::CSettings & settings, ssh::INetwork * network) 
         : m_settings(settings), ds( network )
     {
         memset(&readState, 0, sizeof(readState));
@@ -36,6 +27,38 @@ namespace ssh
         /* set initial packet state */
         readState.state = sshd_STATE_NO_PACKET;
         sendState.state = sshd_STATE_NO_PACKET;
+
+        m_connectionId  = CLogger::NextConnectionId();
+        m_kexStart      = 0;
+        m_newReadCipher = 0;
+        m_newSendCipher = 0;
+
+        m_localKexSent      = false;
+        m_guessedKex        = NULL;
+
+        m_kexState          = KEX_STATE_NONE;
+        m_kexOutput         = 0;
+        m_newkeysSent       = false;
+        m_newkeysReceived   = false;
+        m_discardGuess      = false;
+        m_kex               = NULL;
+        m_kexHostKey        = NULL;
+        m_kexTime           = 0;
+        memset(&m_newKeys, 0, sizeof(m_newKeys));
+
+        m_sendPacketLimit   = SSHD_DEFAULT_MAX_PACKET_SIZE;
+        m_readPacketLimit   = SSHD_MIN_READ_PACKET_SIZE;
+        m_largePackets      = false;
+
+        m_readAhead         = NULL;
+        m_readAheadPos      = 0;
+        m_readAheadCount    = 0;
+        m_deadline          = 0;
+
+        m_bufferSize        = SSHD_DEFAULT_BUFFER_SIZE;
+        readState.pData     = m_readScratch;
+        readState.pPayload  = m_readScratch + sizeof(ssh_hdr);
+        readState.bufSize   = sizeof(m_readScratch);
     }
 
     /* CTransport::~CTransport
@@ -43,28 +66,14 @@ namespace ssh
      */
     CTransport::~CTransport()
     {
-#ifdef WIN32
-        if( readState.pData ) {
-            VirtualFree(readState.pData, readState.bufSize, MEM_RELEASE);
-            readState.pData = NULL;
-        }
+        /* return any borrowed buffers to the pool */
+        releaseReadBuffer();
+        releaseSendBuffer();
+        releaseReadAhead();
 
-        if( sendState.pData ) {
-            VirtualFree(sendState.pData, sendState.bufSize, MEM_RELEASE);
-            sendState.pData = NULL;
-        }
-
-#else
-        if( readState.pData ) {
-            delete [] readState.pData;
-            readState.pData = NULL;
-        }
+        CKeyExchange::Destroy( m_guessedKex );
+        resetKeyExchange();
 
-        if( sendState.pData ) {
-            delete [] sendState.pData;
-            sendState.pData = NULL;
-        }
-#endif
         if( ds ) {
             delete ds;
             ds = 0;
@@ -76,62 +85,146 @@ namespace ssh
      */
     bool CTransport::init()
     {
-        uint32_t size = 1024 * 36;
+        uint32_t size;
+        int value;
 
-        sendState.bufSize = size;
-        readState.bufSize = size;
-
-#ifdef WIN32
-        /* allocate the memory and disable code execution from them. */
-        readState.pData = (uint8_t *) VirtualAlloc(NULL, size, MEM_COMMIT, PAGE_READWRITE);
-        if( !readState.pData ) {
-            goto cleanup;
-        }
-        sendState.pData = (uint8_t *) VirtualAlloc(NULL, size, MEM_COMMIT, PAGE_READWRITE);
-        if( !sendState.pData ) {
-            goto cleanup;
+        /* padding and cookies come from a per-connection generator */
+        if( !m_random.seed() ) {
+            sshd_Log(sshd_EVENT_FATAL, "Failed to seed the random number generator.");
+            return false;
         }
 
-#else
-        /* C++ implementation */
-        readState.pData = new unsigned char[size];
-        if( !readState.pData )
-            goto cleanup;
+        /* rekey limits */
+        if( !m_settings.GetValue(SSHD_SETTING_REKEY_DATA_LIMIT, value) )
+            value = SSHD_DEFAULT_REKEY_DATA_LIMIT;
+        m_rekeyBytes = static_cast<uint64_t>(value) << 20;
 
-        sendState.pData = new unsigned char[size];
-        if( !readState.pData )
-            goto cleanup;
-#endif
+        /* the packet limit can not be disabled, it rekeys before the sequence numbers wrap */
+        if( !m_settings.GetValue(SSHD_SETTING_REKEY_PACKET_LIMIT, value) || value <= 0 )
+            value = SSHD_DEFAULT_REKEY_PACKET_LIMIT;
+        m_rekeyPackets = static_cast<uint32_t>(value);
 
-        sendState.pPayload = sendState.pData + sizeof(ssh_hdr);
-        readState.pPayload = readState.pData + sizeof(ssh_hdr);
+        if( !m_settings.GetValue(SSHD_SETTING_REKEY_TIME_LIMIT, value) )
+            value = SSHD_DEFAULT_REKEY_TIME_LIMIT;
+        m_rekeyInterval = static_cast<uint64_t>(value) * 1000000000ULL;
+
+        /* packet and buffer sizes, the buffers must hold the largest packet. Both sides have
+           to accept 35000 bytes (RFC 4253 6.1), so the setting only raises what we read,
+           larger packets are sent once large-packets@lwssh has been negotiated */
+        if( !m_settings.GetValue(SSHD_SETTING_MAX_PACKET_SIZE, value) || value < SSHD_MIN_READ_PACKET_SIZE )
+            value = SSHD_MIN_READ_PACKET_SIZE;
+        if( value > SSHD_LARGE_PACKET_SIZE )
+            value = SSHD_LARGE_PACKET_SIZE;
+        m_readPacketLimit = static_cast<uint32_t>(value);
+        m_sendPacketLimit = SSHD_DEFAULT_MAX_PACKET_SIZE;
+
+        if( !m_settings.GetValue(SSHD_SETTING_BUFFER_SIZE, value) || value <= 0 )
+            value = SSHD_DEFAULT_BUFFER_SIZE;
+        size = static_cast<uint32_t>(value);
+        if( size < m_readPacketLimit + SSHD_PACKET_OVERHEAD )
+            size = m_readPacketLimit + SSHD_PACKET_OVERHEAD;
 
-        /* return success */
+        /* the buffers are borrowed from the pool while a packet is in flight, the input
+           buffer is sized by each packet and the output buffer by the send limit */
+        m_bufferSize = size;
         return true;
-cleanup:
+    }
+
+    /* CTransport::acquireSendBuffer
+     * Borrows an output buffer from the pool unless one is already held. The buffer is large
+     * enough for the current send packet limit.
+     */
+    bool CTransport::acquireSendBuffer()
+    {
+        uint32_t size = m_bufferSize;
+
+        if( sendState.pData )
+            return true;
+
+        if( size < m_sendPacketLimit + SSHD_PACKET_OVERHEAD )
+            size = m_sendPacketLimit + SSHD_PACKET_OVERHEAD;
 
-#ifdef WIN32
-        if( readState.pData ) {
-            VirtualFree(readState.pData, size, MEM_RELEASE);
-            readState.pData = NULL;
+        sendState.pData = CBufferPool::GetInstance().acquire( size, &sendState.bufSize );
+        if( !sendState.pData ) {
+            sshd_Log(sshd_EVENT_WARNING, "Out of packet buffers.");
+            sendState.bufSize = 0;
+            return false;
         }
+        sendState.pPayload = sendState.pData + sizeof(ssh_hdr);
+        return true;
+    }
 
+    /* CTransport::releaseSendBuffer
+     * Returns the output buffer to the pool.
+     */
+    void CTransport::releaseSendBuffer()
+    {
         if( sendState.pData ) {
-            VirtualFree(sendState.pData, size, MEM_RELEASE);
-            sendState.pData = NULL;
+            CBufferPool::GetInstance().release( sendState.pData, sendState.bufSize );
+            sendState.pData     = NULL;
+            sendState.pPayload  = NULL;
+            sendState.bufSize   = 0;
         }
-#else
-        if( readState.pData ) {
-            delete [] readState.pData;
-            readState.pData = NULL;
+    }
+
+    /* CTransport::acquireReadBuffer
+     * Borrows an input buffer for a packet of the given size once the first block has been
+     * read into the scratch area, the first block is copied to the new buffer.
+     */
+    bool CTransport::acquireReadBuffer(uint32_t size)
+    {
+        byte * buffer;
+
+        buffer = CBufferPool::GetInstance().acquire( size, &readState.bufSize );
+        if( !buffer ) {
+            sshd_Log(sshd_EVENT_WARNING, "Out of packet buffers.");
+            readState.bufSize = 0;
+            return false;
         }
 
-        if( sendState.pData ) {
-            delete [] sendState.pData;
-            sendState.pData = NULL;
+        memcpy( buffer, m_readScratch, readState.count );
+        readState.pData = buffer;
+        readState.pHdr  = (ssh_hdr *) readState.pData;
+        return true;
+    }
+
+    /* CTransport::releaseReadBuffer
+     * Returns the input buffer to the pool, the scratch area holds the first block of the next
+     * packet.
+     */
+    void CTransport::releaseReadBuffer()
+    {
+        if( readState.pData && readState.pData != m_readScratch )
+            CBufferPool::GetInstance().release( readState.pData, readState.bufSize );
+
+        readState.pData     = m_readScratch;
+        readState.pPayload  = m_readScratch + sizeof(ssh_hdr);
+        readState.bufSize   = sizeof(m_readScratch);
+    }
+
+    /* CTransport::hibernate
+     * Gives the packet buffers back to the pool and frees the per-connection state that is
+     * rebuilt on demand. Nothing is done while a packet or a keyexchange is in progress.
+     */
+    bool CTransport::hibernate()
+    {
+        if( sendState.state != sshd_STATE_NO_PACKET ||
+            readState.state != sshd_STATE_NO_PACKET ||
+            isKeyExchangeActive() || m_localKexSent ||
+            m_readAheadPos < m_readAheadCount )
+        {
+            return false;
         }
-#endif
-        return false;
+
+        releaseSendBuffer();
+        releaseReadBuffer();
+        releaseReadAhead();
+        m_random.hibernate();
+
+        /* the SSH_MSG_KEXINIT payloads are only needed during a keyexchange */
+        ByteVector().swap( m_localKex.payload );
+        ByteVector().swap( m_remoteKex.payload );
+        return true;
     }
 
     /* CTransport::disconnect
@@ -148,9 +241,9 @@ cleanup:
         } 
         else
         {
-            newPacket();
             /* write packet payload */
-            if( !writeByte(SSH_MSG_DISCONNECT) ||               /* message type */
+            if( !newPacket() ||
+                !writeByte(SSH_MSG_DISCONNECT) ||               /* message type */
                 !writeInt32( reason ) ||                        /* reason for disconnect */
                 (str ? writeString(str) : writeInt32(0)) ||     /* string describing the reson */
                 !writeInt32(0) )                                /* language tag */
@@ -165,73 +258,51 @@ cleanup:
         }
     }
 
-    /* CTransport::buildLocalVersionString
-     *
+    /* CTransport::prepareHandshakeTemplate
+     * Makes sure a handshake template built from the current settings is available. The
+     * server normally hands over a shared template, otherwise one is built here.
      */
-    bool CTransport::buildLocalVersionString()
+    bool CTransport::prepareHandshakeTemplate()
     {
-        std::stringstream ss;
-        string name, version;
-
-        /* get the software name */
-        if( !m_settings.GetString(SSHD_SETTING_SOFTWARE_NAME, name) ) {
-            name = "lwSSH";
-        }
-        /* get the software version as a string */
-        if( !m_settings.GetString(SSHD_SETTING_SOFTWARE_VERSION, version) ) {
-            version = "0.01";
-        }
-        ss << "SSH-2.0-" << name << "_" << version;
-
-        m_localVersion = ss.str();
-        return true;
+        return CHandshakeTemplate::Refresh( m_template, m_settings );
     }
 
     /* CTransport::buildLocalKex
-     * Constructs the local Keyexchange information based on the settings. 
+     * Constructs the local SSH_MSG_KEXINIT payload by copying the template and patching in
+     * a new random cookie.
      */
     bool CTransport::buildLocalKex()
     {
-        std::string keyexchange, hostkey, ciphers, hmac;
-
-        if( !m_settings.GetString( SSHD_SETTING_PREFERRED_KEYEXCHANGE, keyexchange) )
-            keyexchange = defaultKeyexchange;
-        if( !m_settings.GetString(SSHD_SETTING_PREFERRED_HOSTKEY, hostkey) )
-            hostkey = defaultHostkey;
-        if( !m_settings.GetString(SSHD_SETTING_PREFERRED_CIPHER, ciphers) )
-            ciphers = defaultCiphers;
-        if( !m_settings.GetString(SSHD_SETTING_PREFERRED_HMAC, hmac) )
-            hmac = defaultHmacs;
-
-        /* store algorithms */
-        m_localKex.algorithms[KEYEXCHANGE_METHOD]           = keyexchange;
-        m_localKex.algorithms[SERVER_HOSTKEY]               = hostkey;
-        m_localKex.algorithms[ENCRYPTION_CLIENT_TO_SERVER]  = ciphers;
-        m_localKex.algorithms[ENCRYPTION_SERVER_TO_CLIENT]  = ciphers;
-        m_localKex.algorithms[MAC_CLIENT_TO_SERVER]         = hmac;
-        m_localKex.algorithms[MAC_SERVER_TO_CLIENT]         = hmac;
-        m_localKex.algorithms[COMPRESSION_CLIENT_TO_SERVER] = "none";
-        m_localKex.algorithms[COMPRESSION_SERVER_TO_CLIENT] = "none";
+        if( !prepareHandshakeTemplate() )
+            return false;
+
+        /* the vector keeps its capacity between keyexchanges */
+        m_localKex.payload = m_template->GetKexinit();
 
         /* randomize the cookie */
-        randomizeData( m_localKex.cookie, 16 );
+        randomizeData( &m_localKex.payload[KEXINIT_COOKIE_OFFSET], KEXINIT_COOKIE_SIZE );
+        memcpy( m_localKex.cookie, &m_localKex.payload[KEXINIT_COOKIE_OFFSET], KEXINIT_COOKIE_SIZE );
         m_localKex.follows = 0;
 
         return true;
     }
+
+    /* CTransport::parseRemoteKex
+     * Parses the SSH_MSG_KEXINIT message in the input buffer and keeps the raw payload for
+     * the exchange hash.
+     */
+    bool CTransport::parseRemoteKex(KeyExchangeInfo & remote)
+    {
+        remote.payload.assign( readState.pPayload, readState.pPayload + readState.payloadSize );
+        return readKex( remote );
+    }
     
     /* CTransport::randomizeData
-     * Fills the supplied buffer with pseudo random numbers.
+     * Fills the supplied buffer with random numbers from the connection's own generator.
      */
-    void CTransport::randomizeData(uint8_t * dst, uint32_t len)
+    void CTransport::randomizeData(uint8_t * dst, size_t len)
     {
-#if 0
-        for(uint32_t i = 0; i < len; i++) {
-            dst[i] = rand() % 255;
-        }
-#else
-        RAND_pseudo_bytes(dst, (int)len);
-#endif
+        m_random.generate(dst, len);
     }
 
     /* CTransport::isTransportMessage
@@ -254,7 +325,16 @@ cleanup:
         case SSH_MSG_NEWKEYS:
             return true;
         default:
-            return false;
+            return isKexPacket( type );
         }
     }
+
+    /* CTransport::isKexPacket
+     * Returns true for the messages handled by the keyexchange.
+     */
+    bool CTransport::isKexPacket(byte type) const
+    {
+        /* 30 to 49 are reserved for the keyexchange methods */
+        return (type == SSH_MSG_KEXINIT) || (type == SSH_MSG_NEWKEYS) || (type >= 30 && type <= 49);
+    }
 };
\ No newline at end of file
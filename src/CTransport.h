@@ -3,6 +3,7 @@
 
 /* standard C/C++ includes */
 #include <vector>
+#include <boost/shared_ptr.hpp>
 
 /* project specific includes */
 #include "dmx.h"
@@ -13,6 +14,8 @@
 #include "CBigInt.h"
 #include "CSettings.h"
 #include "CNetwork.h"
+#include "CHandshakeTemplate.h"
+#include "CKeyExchange.h"
 
 /* algorithms */
 #include "CCipher.h"
@@ -25,11 +28,15 @@
 #include "Mutex.h"
 #include "ssh_hdr.h"
 #include "sequence_number.h"
+#include "CRandom.h"
+#include "CArena.h"
+#include "CStats.h"
 
 /* Declarations */
 #define MAX_EVENT_NOTIFY            (16)
 #define MAX_KEYS                    (6)
 #define MAX_KEY_LENGTH              (64)
+#define SSHD_DEADLINE_POLL_INTERVAL (250)       /* milliseconds to wait for data between deadline checks */
 /* */
 enum {
     INITIAL_IV_CLIENT_TO_SERVER = 0,
@@ -40,6 +47,22 @@ enum {
     INTEGRITY_KEY_SERVER_TO_CLIENT
 };
 
+/* keyexchange states */
+enum {
+    KEX_STATE_NONE = 0,         /* no keyexchange in progress */
+    KEX_STATE_KEXINIT,          /* waiting for the remote SSH_MSG_KEXINIT */
+    KEX_STATE_EXCHANGE,         /* running the keyexchange method */
+    KEX_STATE_NEWKEYS           /* keys derived, exchanging SSH_MSG_NEWKEYS */
+};
+
+/* keyexchange packets waiting to be sent, sent in this order */
+enum {
+    KEX_OUTPUT_KEXINIT  = 0x01,
+    KEX_OUTPUT_INIT     = 0x02,     /* the client's first keyexchange packet */
+    KEX_OUTPUT_REPLY    = 0x04,     /* the server's reply */
+    KEX_OUTPUT_NEWKEYS  = 0x08
+};
+
 /* */
 enum {
     sshd_STATE_NO_PACKET = 0, 
@@ -52,10 +75,27 @@ enum {
 
 #define MAX_SSH_PAYLOAD         (32000 - sizeof(ssh_hdr) - 255) /* padding and header is included in the size limit */
 
+/* packet and buffer sizes */
+#define SSHD_DEFAULT_BUFFER_SIZE        (1024 * 36)
+#define SSHD_DEFAULT_MAX_PACKET_SIZE    (32000)
+#define SSHD_MIN_READ_PACKET_SIZE       (35000)         /* every implementation must accept this much (RFC 4253 6.1) */
+#define SSHD_LARGE_PACKET_SIZE          (256 * 1024)    /* packet limit once large-packets@lwssh is negotiated */
+#define SSHD_PACKET_OVERHEAD            (sizeof(ssh_hdr) + 255 + 64)    /* header, padding and digest */
+#define SSHD_READ_SCRATCH_SIZE          (64)            /* holds the first block of a packet */
+
+/* default rekey limits, a keyexchange is started when any of them is reached */
+#define SSHD_DEFAULT_REKEY_DATA_LIMIT       (1024)          /* megabytes in both directions */
+#define SSHD_DEFAULT_REKEY_PACKET_LIMIT     (1 << 30)       /* packets in either direction, also keeps the sequence numbers from wrapping */
+#define SSHD_DEFAULT_REKEY_TIME_LIMIT       (3600)          /* seconds */
+
+#define SSHD_MAX_LINE_LENGTH    (1024)                      /* longest accepted line before the first packet */
+#define SSHD_READ_AHEAD_SIZE    (SSHD_MAX_LINE_LENGTH + 2)  /* a line including CR LF */
+
 namespace ssh
 {
     /* Forward declarations */
     class CTransport;
+    class CHashStream;
 
     typedef void (*EventNotification) (uint32, CTransport *, void *);
 
@@ -85,10 +125,13 @@ namespace ssh
 
         ssh_hdr         hdr;            
         sequence_number<uint32_t> seq;  /* sequence number */
+
+        uint64_t        bytes;          /* bytes transferred since the last keyexchange */
+        uint32_t        packets;        /* packets transferred since the last keyexchange */
     };
 
     struct KeyElement {
-        byte key[256/8/*MAX_KEY_SIZE*/];
+        byte key[MAX_KEY_LENGTH];
     };
 
     struct KeyVector {
@@ -117,14 +160,27 @@ namespace ssh
     {
     public:
         /* */
-        CTransport(const CSettings &, ssh::CNetwork *);
+        CTransport(const CSettings &, ssh::INetwork *);
         virtual ~CTransport();
 
         /* performs required initialization */
         bool init();
 
         virtual bool isServer() = 0;
-        virtual int performKeyExchange(bool, bool) = 0;
+
+        /* starts a keyexchange, it is then driven by kexStep and kexHandlePacket */
+        int startKeyExchange();
+        /* runs a keyexchange to completion, used for the initial keyexchange */
+        int performKeyExchange();
+        bool isKeyExchangeActive() const {return m_kexState != KEX_STATE_NONE;}
+        /* memory for the temporaries of the current keyexchange */
+        CArena & getKexArena() {return m_kexArena;}
+
+        /* identifies the connection in the log */
+        uint32_t getConnectionId() const {return m_connectionId;}
+
+        /* the largest payload that may be sent, services size their data packets by it */
+        uint32_t getMaxPayload() const {return m_sendPacketLimit - sizeof(ssh_hdr) - 255;}
 
         bool writeBytes(const byte *, int);
         bool readBytes(byte *, int);
@@ -132,7 +188,7 @@ namespace ssh
         int sendPacket(int timeout = 10000);    /* sends a packet to the remote host */
         int readPacket(int timeout = 10000);    /* reads a packet from the remote host */
 
-        void newPacket();
+        bool newPacket();                       /* false if no output buffer could be borrowed */
         int exchangeAndExpect(byte);            /* sends a message and expects a specific message type back */
 
         virtual const KeyExchangeInfo & getServerKex() = 0;
@@ -142,6 +198,9 @@ namespace ssh
 
         const std::vector<byte> & getExchangeHash() const       {return m_exchangeHash;}
         const std::vector<byte> & getSessionIdentifier() const  {return m_sessionIdent;}
+
+        /* uses a prebuilt handshake template instead of building one from the settings */
+        void setHandshakeTemplate(const boost::shared_ptr<const CHandshakeTemplate> & t) {m_template = t;}
         
     protected:
         void notify(uint32 mask, void * param = NULL);  /* perform the required notifications */
@@ -151,25 +210,53 @@ namespace ssh
 
         /* exchanges the protocol versions */
         int     exchangeProtocolVersions();
+        int     sendVersionAndKex();
+        bool    guessMatches(const std::string client[], const std::string server[]) const;
+        /* creates the keyexchange used to send a guessed first keyexchange packet, NULL if no guess is made */
+        virtual CKeyExchange * createGuessedKex() {return NULL;}
+        int     checkRemoteVersion();
+        bool    readLine(std::string &);
+        int     readLineNonblock(std::string &);
+        int     takeLine(std::string &);
+        void    releaseReadAhead();
         bool    parseProtocolVersion(const std::string &, ProtocolVersion *) const;
-        int     exchangeKeyExchanges(const KeyExchangeInfo &, KeyExchangeInfo &, bool bInitial = true, bool bInitiator = true);
         bool    buildLocalKex();
-        bool    buildLocalVersionString();
-        int     parseRemoteKex(KeyExchangeInfo &);
+        bool    prepareHandshakeTemplate();
+        bool    parseRemoteKex(KeyExchangeInfo &);
         bool    isTransportPacket();
+        bool    isKexPacket(byte) const;
+        bool    offersExtension(const std::string &, const char *) const;
+
+        /* keyexchange state machine */
+        int     kexStep();
+        int     kexHandlePacket();
+        int     decideKeyExchange();
+        int     takeNewKeys();
+        void    finishKeyExchange();
+        void    resetKeyExchange();
+        bool    rekeyNeeded() const;
+        bool    isSendAllowed() const {return m_kexState == KEX_STATE_NONE || m_newkeysSent;}
+
+        /* the handshake deadline, the blocking handshake loops give up once it has passed */
+        bool    deadlinePassed() const;
+
+        /* returns the hostkey used for the algorithm and releases it after the keyexchange */
+        virtual CHostKey *  acquireHostKey(const std::string &) = 0;
+        virtual void        releaseHostKey(CHostKey *) {}
 
         bool DecideAlgorithms(const std::string client[],const std::string server[],std::string match[],int count) const;
         bool DecideAlgorithm(const std::string &, const std::string &, std::string &) const;
 
         /* Key derivation process */
         int     DeriveKeys(const ByteVector &, const ByteVector &, const CBigInt &, const char *, KeyVector &) const;
-        int     DeriveKey(const ByteVector &, const ByteVector &, const CBigInt &, const char *, char, KeyElement &, unsigned int) const;
+        int     DeriveKey(const CHashStream &, CHashStream &, const ByteVector &, char, KeyElement &, unsigned int) const;
         
-        int     TakeKeysIntoUse(const KeyVector & vec, const std::string matches[MAX_ALGORITHM_COUNT]);
         int     createAlgorithmInstances( const std::string names[MAX_ALGORITHM_COUNT], SecurityBlock & block );
+        void    deleteAlgorithmInstances( SecurityBlock & block );
 
         virtual void    InitializeKeys(const SecurityBlock & block, const KeyVector & vec) = 0;
-        virtual int     TakeAlgorithmsInUse( const SecurityBlock & block ) = 0;
+        /* takes the algorithms for one direction into use, ownership is moved from the block */
+        virtual void    TakeAlgorithmsInUse( SecurityBlock & block, bool bSend ) = 0;
 
         virtual int handlePacket()  = 0;    /* handles the packet in the input buffer */
         bool getPacketType(byte &);
@@ -178,19 +265,31 @@ namespace ssh
         /* Send/Read functions */
 
         int flushPacket(uint32_t);
+        bool recvAvailable(int);
+        int recvBytes(byte *, int, int *);
         int sendPacketNonblock(int timeout = 0);
         int readPacketNonblock(int timeout = 0);
 
+        void buildPacket();
         void sendEncryptData();
         void sendCalcDigest(const byte * src, uint32_t len, uint32_t seq, byte * dst);
         void initSendState(uint32_t & seq);
         void randomizeData(uint8_t *, size_t);
 
+        /* packet buffers are borrowed from the buffer pool */
+        bool acquireSendBuffer();
+        void releaseSendBuffer();
+        bool acquireReadBuffer(uint32_t);
+        void releaseReadBuffer();
+
+        /* frees the memory an idle connection can do without, returns false if busy */
+        virtual bool hibernate();
+
         /*
          * Variables
          */
     
-        CNetwork * ds;      /* down-stream component */
+        INetwork * ds;      /* down-stream component, owned by the transport */
 
         /* the current read and write positions */
         int               m_writePos, m_readPos;
@@ -198,17 +297,61 @@ namespace ssh
         TransferState   readState,  /* the read state */
                         sendState;  /* the send state */
 
+        CRandom         m_random;   /* padding and cookie bytes */
+
+        uint32_t        m_bufferSize;                           /* minimum size of the output buffer */
+        byte            m_readScratch[SSHD_READ_SCRATCH_SIZE];  /* input buffer between packets */
+
         KeyExchangeInfo m_localKex,     /* local keyexchange information */
                         m_remoteKex;    /* remote keyexchange information */
 
-        /* protocol version strings */
-        std::string m_localVersion,
-                    m_remoteVersion;
+        /* the remote protocol version string, the local one is in the template */
+        std::string m_remoteVersion;
+
+        /* the pre-serialized local version string and SSH_MSG_KEXINIT payload */
+        boost::shared_ptr<const CHandshakeTemplate> m_template;
+        bool m_localKexSent;    /* the local SSH_MSG_KEXINIT of this keyexchange has been sent */
+        CKeyExchange * m_guessedKex;    /* the keyexchange that sent a guessed packet */
+
+        /* keyexchange state */
+        int             m_kexState;
+        uint32_t        m_kexOutput;        /* KEX_OUTPUT_* packets waiting to be sent */
+        bool            m_newkeysSent,
+                        m_newkeysReceived,
+                        m_discardGuess;     /* the remote side guessed wrong, ignore its next keyexchange packet */
+        CKeyExchange *  m_kex;              /* the keyexchange in progress */
+        CHostKey *      m_kexHostKey;
+        CArena          m_kexArena;         /* wiped and released when the keyexchange ends */
+        SecurityBlock   m_newKeys;          /* algorithms not yet taken into use */
+        uint64_t        m_kexTime;          /* time of the last keyexchange */
+        uint64_t        m_kexStart;         /* time the current keyexchange started */
+        int             m_newReadCipher,    /* counter slots of the negotiated ciphers */
+                        m_newSendCipher;
+
+        /* rekey limits */
+        uint64_t        m_rekeyBytes;
+        uint32_t        m_rekeyPackets;
+        uint64_t        m_rekeyInterval;    /* nanoseconds */
+
+        /* packet size limits, raised when large packets are negotiated */
+        uint32_t        m_sendPacketLimit,
+                        m_readPacketLimit;
+        bool            m_largePackets;     /* both sides offered large-packets@lwssh */
+
+        /* the version exchange reads the socket in chunks, bytes following the remote
+           version string are kept here until the packet reader has consumed them */
+        byte *      m_readAhead;        /* allocated by readLine, released once drained */
+        uint32_t    m_readAheadPos,
+                    m_readAheadCount;
+
+        uint64_t    m_deadline;         /* monotonic time the handshake must be done by, 0 if none */
 
         std::vector<byte> m_sessionIdent;   /* the session identifier */
         std::vector<byte> m_exchangeHash;   /* the last exchange hash */
 
         const CSettings & m_settings;
+        uint32_t          m_connectionId;   /* tags the log messages of the connection */
+        CStatsBlock       m_stats;          /* only updated by the connection's thread */
 
         Util::Mutex m_notifyLock;
     };
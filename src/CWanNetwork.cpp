@@ -0,0 +1,395 @@
+/* CWanNetwork.cpp
+ * Implements the wide area link emulation.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* C/C++ includes */
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+/* project includes */
+#include "CWanNetwork.h"
+#include "errors.h"
+#include "util.h"
+
+#if defined(WIN32) || defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define WAN_MAX_LINE                (1024)
+#define WAN_MS                      (1000000ULL)    /* nanoseconds */
+
+using namespace std;
+
+namespace ssh
+{
+    /* SleepFor
+     * Suspends the calling thread for a number of milliseconds.
+     */
+    static void SleepFor(int ms)
+    {
+#if defined(WIN32) || defined(_WIN32)
+        Sleep( ms );
+#else
+        struct timespec ts;
+        ts.tv_sec  = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000L;
+        nanosleep( &ts, NULL );
+#endif
+    }
+
+    /* WanSettings::Parse
+     * Parses a comma separated list of name=value pairs, the names that are left out keep
+     * their current values.
+     */
+    bool WanSettings::Parse(const string & str, WanSettings & settings)
+    {
+        vector<string> items;
+        SplitString( str, items, ',' );
+
+        for(vector<string>::iterator it = items.begin(); it != items.end(); it++)
+        {
+            string::size_type eq = it->find( '=' );
+            if( eq == string::npos )
+                return false;
+
+            string name = Trim( it->substr( 0, eq ) );
+            const char * value = it->c_str() + eq + 1;
+
+            if( name == "delay" )
+                settings.delay = (uint32_t) atoi( value );
+            else if( name == "jitter" )
+                settings.jitter = (uint32_t) atoi( value );
+            else if( name == "bandwidth" )
+                settings.bandwidth = (uint64_t) strtod( value, NULL );
+            else if( name == "buffer" )
+                settings.buffer = (uint32_t) atoi( value );
+            else if( name == "stall" ) {
+                /* percentage:milliseconds */
+                const char * colon = strchr( value, ':' );
+                if( !colon )
+                    return false;
+                settings.stallRate = atof( value );
+                settings.stallTime = (uint32_t) atoi( colon + 1 );
+            }
+            else
+                return false;
+        }
+        return settings.buffer > 0;
+    }
+
+    /* CWanNetwork::CWanNetwork
+     * Constructor, init allocates the buffer.
+     */
+    CWanNetwork::CWanNetwork(INetwork * network, const WanSettings & settings, uint32_t seed)
+        : m_network( network ), m_settings( settings )
+    {
+        m_blocking          = true;
+        m_data              = NULL;
+        m_head              = 0;
+        m_count             = 0;
+        m_linkFree          = 0;
+        m_lastRelease       = 0;
+        m_seed              = seed;
+        m_roundTrips        = 0;
+        m_readSinceWrite    = false;
+
+        /* the wrapped stream never blocks, blocking is emulated on top so the held back
+           data are passed on while waiting */
+        m_network->setBlockingMode( false );
+    }
+
+    /* CWanNetwork::init
+     * Allocates the buffer of the data in flight, fails if the settings have no buffer or
+     * it could not be allocated. Writes fail until the stream has been initialized.
+     */
+    bool CWanNetwork::init()
+    {
+        if( !m_settings.buffer )
+            return false;
+        if( !m_data )
+            m_data = new (std::nothrow) byte[m_settings.buffer];
+        return m_data != NULL;
+    }
+
+    /* CWanNetwork::~CWanNetwork
+     * Destructor, closes the wrapped stream. Data that are still held back are lost.
+     */
+    CWanNetwork::~CWanNetwork()
+    {
+        delete m_network;
+        delete [] m_data;
+    }
+
+    /* CWanNetwork::random
+     * Returns a pseudo random number in [0, 2^30), each stream has its own sequence so
+     * runs can be repeated.
+     */
+    uint32_t CWanNetwork::random()
+    {
+        uint32_t res = 0;
+        for(int i = 0; i < 2; i++) {
+            m_seed = m_seed * 1103515245 + 12345;
+            res = (res << 15) | ((m_seed >> 16) & 0x7FFF);
+        }
+        return res;
+    }
+
+    /* CWanNetwork::queue
+     * Stores a write and works out when it arrives at the other end: once the link has
+     * sent the data before it and the data itself, plus the delay and the jitter.
+     */
+    void CWanNetwork::queue(const byte * src, uint32_t count)
+    {
+        uint32_t tail = (m_head + m_count) % m_settings.buffer;
+        uint32_t first = count < m_settings.buffer - tail ? count : m_settings.buffer - tail;
+
+        memcpy( m_data + tail, src, first );
+        memcpy( m_data, src + first, count - first );
+        m_count += count;
+
+        uint64_t now = GetMonotonicTime();
+        if( m_linkFree < now )
+            m_linkFree = now;
+        if( m_settings.bandwidth )
+            m_linkFree += (uint64_t) count * 1000000000ULL / m_settings.bandwidth;
+        if( m_settings.stallRate > 0 && random() % 10000 < m_settings.stallRate * 100 )
+            m_linkFree += m_settings.stallTime * WAN_MS;
+
+        Segment s;
+        s.length    = count;
+        s.release   = m_linkFree + m_settings.delay * WAN_MS;
+        if( m_settings.jitter )
+            s.release += (random() % (m_settings.jitter * 1000 + 1)) * 1000ULL;
+
+        /* the jitter must not reorder the data */
+        if( s.release < m_lastRelease )
+            s.release = m_lastRelease;
+        m_lastRelease = s.release;
+
+        m_segments.push_back( s );
+    }
+
+    /* CWanNetwork::flush
+     * Passes the data that are due to the wrapped stream, as much as it accepts.
+     */
+    int CWanNetwork::flush()
+    {
+        uint64_t now = m_segments.empty() ? 0 : GetMonotonicTime();
+
+        while( !m_segments.empty() && m_segments.front().release <= now )
+        {
+            Segment & s = m_segments.front();
+            uint32_t chunk = m_settings.buffer - m_head;
+            int wcount = 0, res;
+
+            if( chunk > s.length )
+                chunk = s.length;
+            if( !m_network->writePossible( 0 ) )
+                break;
+            if( (res = m_network->writeBytes( m_data + m_head, (int) chunk, &wcount )) != sshd_OK )
+                return res;
+
+            m_head      = (m_head + wcount) % m_settings.buffer;
+            m_count    -= wcount;
+            s.length   -= wcount;
+            if( !s.length )
+                m_segments.pop_front();
+            if( (uint32_t) wcount < chunk )
+                break;
+        }
+        return sshd_OK;
+    }
+
+    /* CWanNetwork::msUntilRelease
+     * Returns the milliseconds until the next write is due, at least one if it is due but
+     * the wrapped stream is full, or -1 if nothing is held back.
+     */
+    int CWanNetwork::msUntilRelease() const
+    {
+        if( m_segments.empty() )
+            return -1;
+
+        uint64_t now = GetMonotonicTime(), release = m_segments.front().release;
+        if( release <= now )
+            return 1;
+        return (int) ((release - now + WAN_MS - 1) / WAN_MS);
+    }
+
+    /* CWanNetwork::disconnect
+     * Closes the stream.
+     */
+    void CWanNetwork::disconnect()
+    {
+        m_network->disconnect();
+    }
+
+    /* CWanNetwork::dataAvailable
+     * Waits for input, waking up to pass on the held back data as they become due. A
+     * negative timeout waits until data arrive.
+     */
+    bool CWanNetwork::dataAvailable(int timeout)
+    {
+        uint64_t deadline = timeout > 0 ? GetMonotonicTime() + timeout * WAN_MS : 0;
+
+        while( 1 )
+        {
+            if( flush() != sshd_OK )
+                return true;    /* the read reports the error */
+
+            int ms = msUntilRelease();
+            if( timeout >= 0 ) {
+                uint64_t now = GetMonotonicTime();
+                int left = now < deadline ? (int) ((deadline - now + WAN_MS - 1) / WAN_MS) : 0;
+                if( ms < 0 || left < ms )
+                    ms = left;
+            }
+
+            if( m_network->dataAvailable( ms ) )
+                return true;
+            if( timeout == 0 || (timeout > 0 && GetMonotonicTime() >= deadline) )
+                return false;
+        }
+    }
+
+    /* CWanNetwork::writePossible
+     * Waits until there is room in the link for more data.
+     */
+    bool CWanNetwork::writePossible(int timeout)
+    {
+        uint64_t deadline = timeout > 0 ? GetMonotonicTime() + timeout * WAN_MS : 0;
+
+        while( 1 )
+        {
+            if( flush() != sshd_OK )
+                return true;    /* the write reports the error */
+            if( m_count < m_settings.buffer )
+                return true;
+            if( timeout == 0 )
+                return false;
+
+            /* the buffer is full, so something is held back */
+            int ms = msUntilRelease();
+            if( timeout > 0 ) {
+                uint64_t now = GetMonotonicTime();
+                if( now >= deadline )
+                    return false;
+                int left = (int) ((deadline - now + WAN_MS - 1) / WAN_MS);
+                if( left < ms )
+                    ms = left;
+            }
+            SleepFor( ms );
+        }
+    }
+
+    /* CWanNetwork::readBytes
+     * Reads up to count bytes, the input is not delayed.
+     */
+    int CWanNetwork::readBytes(byte * dst, int count, int * rcount)
+    {
+        /* the wrapped stream must not block while data are held back */
+        if( m_blocking )
+            dataAvailable( -1 );
+        else
+            flush();
+
+        int res = m_network->readBytes( dst, count, rcount );
+        if( res == sshd_OK && *rcount > 0 )
+            m_readSinceWrite = true;
+        return res;
+    }
+
+    /* CWanNetwork::writeBytes
+     * Writes up to count bytes, in blocking mode all of them.
+     */
+    int CWanNetwork::writeBytes(const byte * src, int count, int * wcount)
+    {
+        int res;
+
+        if( !m_data || !src || count <= 0 )
+            return sshd_ERROR;
+
+        *wcount = 0;
+        while( *wcount < count )
+        {
+            if( (res = flush()) != sshd_OK )
+                return res;
+            if( m_count == m_settings.buffer ) {
+                if( !m_blocking )
+                    break;
+                writePossible( -1 );
+                continue;
+            }
+
+            uint32_t n = m_settings.buffer - m_count;
+            if( n > (uint32_t) (count - *wcount) )
+                n = (uint32_t) (count - *wcount);
+            queue( src + *wcount, n );
+            *wcount += (int) n;
+        }
+
+        if( *wcount > 0 && m_readSinceWrite ) {
+            m_readSinceWrite = false;
+            m_roundTrips++;
+        }
+        return flush();
+    }
+
+    /* CWanNetwork::writeLine
+     * Writes a CR LF terminated line.
+     */
+    bool CWanNetwork::writeLine(const string & line)
+    {
+        string data = line + "\r\n";
+        bool blocking = m_blocking;
+        int wcount;
+
+        m_blocking = true;
+        int res = writeBytes( (const byte *) data.data(), (int) data.size(), &wcount );
+        m_blocking = blocking;
+
+        return res == sshd_OK && wcount == (int) data.size();
+    }
+
+    /* CWanNetwork::readLine
+     * Reads a CR LF terminated line.
+     */
+    bool CWanNetwork::readLine(string & line)
+    {
+        char c, last = 0;
+        int rcount;
+
+        line.clear();
+        while( line.size() < WAN_MAX_LINE )
+        {
+            if( !dataAvailable( -1 ) || m_network->readBytes( (byte *) &c, 1, &rcount ) != sshd_OK || rcount != 1 )
+                return false;
+            m_readSinceWrite = true;
+
+            if( c == 0x0A ) {
+                if( last != 0x0D )
+                    return false;   /* a line feed without a carriage return */
+                line.erase( line.size() - 1 );
+                return true;
+            }
+            line += c;
+            last = c;
+        }
+        return false;
+    }
+
+    /* CWanNetwork::setBlockingMode
+     * Sets blocking/non-blocking mode, the wrapped stream stays non-blocking.
+     */
+    CWanNetwork & CWanNetwork::setBlockingMode(bool block)
+    {
+        m_blocking = block;
+        return *this;
+    }
+};
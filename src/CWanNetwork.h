@@ -0,0 +1,115 @@
+/* CWanNetwork.h
+ * Byte stream decorator that emulates a wide area link.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _CWANNETWORK_H_
+#define _CWANNETWORK_H_
+
+/* C/C++ includes */
+#include <deque>
+#include <string>
+
+/* project includes */
+#include "INetwork.h"
+
+#define WAN_DEFAULT_BUFFER          (256 * 1024)    /* bytes in flight in each direction */
+
+namespace ssh
+{
+    /* WanSettings
+     * The properties of the emulated link in one direction.
+     */
+    struct WanSettings
+    {
+        uint32_t    delay;          /* one-way delay in milliseconds */
+        uint32_t    jitter;         /* random extra delay, up to this many milliseconds */
+        uint64_t    bandwidth;      /* bytes per second, zero for unlimited */
+        double      stallRate;      /* percentage of writes that stall the link */
+        uint32_t    stallTime;      /* milliseconds a stall lasts */
+        uint32_t    buffer;         /* bytes that may be in flight */
+
+        WanSettings() : delay( 0 ), jitter( 0 ), bandwidth( 0 ), stallRate( 0 ), stallTime( 0 ),
+                        buffer( WAN_DEFAULT_BUFFER ) {}
+
+        /* parses "delay=25,jitter=2,bandwidth=1250000,stall=1:200,buffer=65536" */
+        static bool Parse(const std::string &, WanSettings &);
+    };
+
+    /* CWanNetwork
+     * Wraps a stream and holds back what is written to it as a link with the given delay,
+     * jitter, bandwidth and occasional stalls would. The data stay in order, like on a TCP
+     * connection, and at most settings.buffer bytes are in flight, so a sender that waits
+     * for replies is limited by the round trip time. Reads are passed through, wrapping both
+     * ends of a CMemoryNetwork pair emulates both directions.
+     *
+     * Nothing runs in the background, the held back data are passed on whenever the stream
+     * is used, and waits for input wake up in time to do so. Both the transport loops do
+     * that, a stream that is not used also holds back its data.
+     */
+    class CWanNetwork : public INetwork
+    {
+    public:
+        /* takes ownership of the wrapped stream */
+        CWanNetwork(INetwork * network, const WanSettings & settings, uint32_t seed = 1);
+        ~CWanNetwork();
+
+        /* allocates the buffer, false if settings.buffer is 0 or out of memory */
+        bool init();
+
+        /* INetwork */
+        int connect(const char * host, const char * port)   {return m_network->connect( host, port );}
+        int poll(int timeout)                               {return m_network->poll( timeout );}
+        void disconnect();
+
+        bool dataAvailable(int timeout);
+        bool writePossible(int timeout);
+
+        int readBytes(byte *, int count, int *);
+        int writeBytes(const byte *, int count, int *);
+
+        bool writeLine(const std::string &);
+        bool readLine(std::string &);
+
+        CWanNetwork & setBlockingMode(bool block = true);
+
+        /* the times a write followed data that had been read since the previous write, the
+           round trips the sender has waited for */
+        uint32_t getRoundTrips() const  {return m_roundTrips;}
+
+    protected:
+        /* a write, released to the wrapped stream at a point in time */
+        struct Segment {
+            uint32_t    length;
+            uint64_t    release;
+        };
+
+        int  flush();
+        int  msUntilRelease() const;
+        void queue(const byte *, uint32_t count);
+        uint32_t random();
+
+        INetwork *              m_network;
+        WanSettings             m_settings;
+        bool                    m_blocking;
+
+        /* the data in flight, a ring buffer of settings.buffer bytes */
+        byte *                  m_data;
+        uint32_t                m_head,
+                                m_count;
+        std::deque<Segment>     m_segments;
+        uint64_t                m_linkFree;     /* when the link has sent what is queued */
+        uint64_t                m_lastRelease;
+
+        uint32_t                m_seed;
+        uint32_t                m_roundTrips;
+        bool                    m_readSinceWrite;
+
+    private:
+        CWanNetwork(const CWanNetwork &);
+        CWanNetwork & operator=(const CWanNetwork &);
+    };
+};
+
+#endif
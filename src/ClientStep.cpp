@@ -0,0 +1,362 @@
+/* ClientStep.cpp
+ * Runs a client connection from the caller's thread, one step at a time.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+#include "CClientTransport.h"
+#include "CKeyExchange.h"
+#include "CHistogram.h"
+#include "reasons.h"
+#include "messages.h"
+#include "errors.h"
+#include "sshd.h"
+#include "util.h"
+
+/* C/C++ includes */
+#include <string>
+
+using namespace std;
+
+namespace ssh
+{
+    /* CClientTransport::start
+     * Runs the connection over an already connected stream without a thread of its own.
+     * The version string and the SSH_MSG_KEXINIT are sent here, step does the rest whenever
+     * the caller learns that the stream has events, e.g. from INetwork::setListener. The
+     * transport owns the stream even if the call fails.
+     */
+    int CClientTransport::start(ssh::INetwork * network)
+    {
+        if( !network )
+            return sshd_ERROR;
+
+        ds = network;
+        m_addr.clear();
+        m_port.clear();
+
+        setStatus(sshd_STATUS_CONNECTING);
+        m_phase         = CLIENT_PHASE_VERSION;
+        m_phaseStart    = GetMonotonicTime();
+        m_bannerLines   = 0;
+
+        ds->setBlockingMode( false );
+        if( sendVersionAndKex() != sshd_OK ) {
+            sshd_Log(sshd_EVENT_FATAL, "Failed to write local protocol version.");
+            stepFailed();
+            return sshd_ERROR;
+        }
+        return sshd_OK;
+    }
+
+    /* CClientTransport::step
+     * Reads what has arrived, handles it and writes what is ready to be sent, until nothing
+     * more can be done without waiting. Returns sshd_OK while the connection is open.
+     */
+    int CClientTransport::step()
+    {
+        bool progress = true;
+        int res = sshd_OK;
+
+        if( m_phase == CLIENT_PHASE_CLOSED )
+            return sshd_DISCONNECTED;
+
+        while( progress && res == sshd_OK )
+        {
+            progress = false;
+            if( m_phase == CLIENT_PHASE_VERSION )
+                res = stepVersion( progress );
+            else
+                res = stepPackets( progress );
+        }
+
+        if( res != sshd_OK )
+            stepFailed();
+        return res;
+    }
+
+    /* CClientTransport::close
+     * Closes a connection run by step.
+     */
+    void CClientTransport::close()
+    {
+        if( m_phase == CLIENT_PHASE_CLOSED )
+            return;
+
+        sshd_Log(sshd_EVENT_NOTIFY, "Connection closed by user.");
+        if( m_phase == CLIENT_PHASE_VERSION )
+            ds->disconnect();
+        else
+            disconnect( SSH_DISCONNECT_BY_APPLICATION );
+
+        m_phase = CLIENT_PHASE_CLOSED;
+        setStatus(sshd_STATUS_CLOSED);
+        if( m_pNotify )
+            m_pNotify->OnCloseEvent(this);
+    }
+
+    /* CClientTransport::stepFailed
+     * Closes the stream of a failed connection and reports it the way Task does.
+     */
+    void CClientTransport::stepFailed()
+    {
+        bool established = m_phase > CLIENT_PHASE_KEX;
+
+        ds->disconnect();
+        m_phase = CLIENT_PHASE_CLOSED;
+
+        if( !established ) {
+            if( m_pNotify )
+                m_pNotify->OnConnectFailure(this);
+            setStatus(sshd_STATUS_FAILURE);
+        } else {
+            setStatus(sshd_STATUS_CLOSED);
+            if( m_pNotify )
+                m_pNotify->OnCloseEvent(this);
+        }
+    }
+
+    /* CClientTransport::stepVersion
+     * Reads the lines the server sends before its version string, then starts the initial
+     * keyexchange.
+     */
+    int CClientTransport::stepVersion(bool & progress)
+    {
+        string line;
+        int res, limitValue;
+
+        while( (res = readLineNonblock( line )) == sshd_OK )
+        {
+            progress = true;
+            if( line.find("SSH-") != 0 )
+            {
+                /* The server MAY send additional messages before the protocol version string */
+                if( !m_settings.GetValue(SSHD_SETTING_MAX_MOTD_COMMENTS, limitValue) )
+                    limitValue = 250;
+                if( (++m_bannerLines) > limitValue ) {
+                    sshd_Log(sshd_EVENT_FATAL, "Server is spamming us!.");
+                    return sshd_ERROR;
+                }
+                continue;
+            }
+
+            m_remoteVersion = line;
+            res = checkRemoteVersion();
+            if( res == sshd_PROTOCOL_VERSION_UNSUPPORTED ) {
+                sshd_Log(sshd_EVENT_FATAL, "Protocol version not supported.");
+                disconnect( SSH_DISCONNECT_PROTOCOL_VERSION_NOT_SUPPORTED );
+                return res;
+            } else if( res != sshd_OK ) {
+                sshd_Log(sshd_EVENT_FATAL, "Failed to exchange protocol version strings.");
+                disconnect( SSH_DISCONNECT_PROTOCOL_ERROR );
+                return res;
+            }
+            CHistogram::Get( HISTOGRAM_VERSION_EXCHANGE ).record( GetMonotonicTime() - m_phaseStart );
+
+            if( (res = startKeyExchange()) != sshd_OK )
+                return res;
+            m_phase = CLIENT_PHASE_KEX;
+            return sshd_OK;
+        }
+
+        if( res != sshd_NO_PACKET ) {
+            sshd_Log(sshd_EVENT_FATAL, "Failed to read remote protocol version.");
+            return res;
+        }
+        return sshd_OK;
+    }
+
+    /* CClientTransport::stepPackets
+     * Moves the output and the input on by at most a packet each. Progress is set if a
+     * packet was started, sent or handled, there may be more to do.
+     */
+    int CClientTransport::stepPackets(bool & progress)
+    {
+        uint64_t built = m_stats.counters.packetsOut;
+        int res;
+
+        /* output */
+        if( sendState.state != sshd_STATE_NO_PACKET )
+        {
+            res = sendPacketNonblock();
+            if( res == sshd_OK ) {
+                progress = true;
+            } else if( res != sshd_PACKET_PENDING ) {
+                sshd_Log(sshd_EVENT_FATAL, "Failed to send packet.");
+                return res;
+            }
+        }
+        else if( (res = kexStep()) != sshd_OK ) {
+            sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+            disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
+            return res;
+        }
+        else if( sendState.state == sshd_STATE_NO_PACKET && isSendAllowed() ) {
+            if( (res = stepOutput()) != sshd_OK )
+                return res;
+        }
+        if( m_stats.counters.packetsOut != built )
+            progress = true;
+
+        /* the initial keyexchange is done once the SSH_MSG_NEWKEYS has been sent */
+        if( m_phase == CLIENT_PHASE_KEX && !isKeyExchangeActive() &&
+            sendState.state == sshd_STATE_NO_PACKET )
+        {
+            m_phase = CLIENT_PHASE_AUTH_REQUEST;
+            progress = true;
+            if( m_pNotify )
+                m_pNotify->OnConnectSuccess(this);
+            sshd_Log(sshd_EVENT_NOTIFY, "Connection established.");
+        }
+
+        /* input */
+        res = readPacketNonblock();
+        if( res == sshd_NO_PACKET || res == sshd_PACKET_PENDING )
+            return sshd_OK;
+        if( res != sshd_OK ) {
+            sshd_Log(sshd_EVENT_FATAL, "Failed to read packet.");
+            return res;
+        }
+        progress = true;
+        return stepInput();
+    }
+
+    /* CClientTransport::stepOutput
+     * Starts the next packet of the current phase, if there is one.
+     */
+    int CClientTransport::stepOutput()
+    {
+        size_t dw;
+        int res;
+
+        switch( m_phase )
+        {
+        case CLIENT_PHASE_AUTH_REQUEST:
+        case CLIENT_PHASE_SERVICE_REQUEST:
+            {
+                if( !newPacket() ||
+                    !writeByte(SSH_MSG_SERVICE_REQUEST) ||
+                    !writeString(m_phase == CLIENT_PHASE_AUTH_REQUEST ? m_iAuth->getAuthServiceName() : m_pService->GetServiceName()) )
+                {
+                    return sshd_ERROR;
+                }
+                m_phase++;      /* wait for the SSH_MSG_SERVICE_ACCEPT */
+            }
+            break;
+        case CLIENT_PHASE_AUTH:
+            {
+                if( !m_iAuth->authIsDataAvailable() )
+                    return sshd_OK;
+
+                if( !newPacket() )
+                    return sshd_INTERNAL_ERROR;
+                if( m_iAuth->authReadPacket( sendState.pPayload, getMaxPayload(), &dw) != sshd_OK ) {
+                    sshd_Log(sshd_EVENT_FATAL, "Failed to read data from authentication service.");
+                    return sshd_ERROR;
+                }
+                m_writePos = (int) dw;
+            }
+            break;
+        case CLIENT_PHASE_CONNECTED:
+            {
+                if( !m_pService->isDataAvailable( 0 ) )
+                    return sshd_OK;
+
+                if( !newPacket() )
+                    return sshd_INTERNAL_ERROR;
+                if( m_pService->read( sendState.pPayload, getMaxPayload(), &sendState.payloadSize) != sshd_OK ) {
+                    sshd_Log(sshd_EVENT_FATAL, "Failed to read data from service.");
+                    disconnect( SSH_DISCONNECT_BY_APPLICATION );
+                    return sshd_ERROR;
+                }
+                m_writePos = sendState.payloadSize;
+            }
+            break;
+        default:
+            return sshd_OK;
+        }
+
+        res = sendPacketNonblock();
+        if( (res != sshd_OK) && (res != sshd_PACKET_PENDING) ) {
+            sshd_Log(sshd_EVENT_FATAL, "Failed to send packet.");
+            return res;
+        }
+        return sshd_OK;
+    }
+
+    /* CClientTransport::stepInput
+     * Handles the packet in the input buffer.
+     */
+    int CClientTransport::stepInput()
+    {
+        uint8_t type, msg;
+        string service;
+        int res;
+
+        getPacketType( type );
+        if( m_phase == CLIENT_PHASE_KEX )
+        {
+            res = (isKexPacket( type ) ? kexHandlePacket() : handlePacket());
+            if( res != sshd_OK ) {
+                sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+                disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
+            }
+            return res;
+        }
+
+        if( isTransportPacket() )
+            return handleTransportPacket();
+
+        switch( m_phase )
+        {
+        case CLIENT_PHASE_AUTH_ACCEPT:
+        case CLIENT_PHASE_SERVICE_ACCEPT:
+            {
+                const string & name = (m_phase == CLIENT_PHASE_AUTH_ACCEPT ? m_iAuth->getAuthServiceName() : m_pService->GetServiceName());
+                if( type != SSH_MSG_SERVICE_ACCEPT || !readByte(msg) || !readString(service) || (service != name) )
+                {
+                    sshd_Log(sshd_EVENT_FATAL, "Failed to read reply.");
+                    return sshd_ERROR;
+                }
+
+                if( m_phase == CLIENT_PHASE_AUTH_ACCEPT ) {
+                    sshd_Log(sshd_EVENT_NOTIFY, "Performing authentication.");
+                    m_phase = CLIENT_PHASE_AUTH;
+                } else {
+                    /* notify the service that it has been accepted by the server */
+                    m_pService->OnAccept();
+                    m_phase = CLIENT_PHASE_CONNECTED;
+                    setStatus(sshd_STATUS_CONNECTED);
+                }
+            }
+            break;
+        case CLIENT_PHASE_AUTH:
+            {
+                res = handleAuthPacket();
+                if( res == sshd_CLIENT_AUTHENTICATED ) {
+                    sshd_Log(sshd_EVENT_NOTIFY, "The client is authenticated.");
+                    if( !m_pService ) {
+                        sshd_Log(sshd_EVENT_FATAL, "No service specified.");
+                        return sshd_ERROR;
+                    }
+                    m_phase = CLIENT_PHASE_SERVICE_REQUEST;
+                } else if( res != sshd_OK ) {
+                    return sshd_ERROR;
+                }
+            }
+            break;
+        case CLIENT_PHASE_CONNECTED:
+            {
+                /* let the service handle any other messages */
+                res = m_pService->handle( readState.pPayload, readState.payloadSize );
+                if( res != sshd_OK ) {
+                    sshd_Log(sshd_EVENT_FATAL, "Error while handling reply.");
+                    return res;
+                }
+            }
+            break;
+        default:
+            return sshd_ERROR;  /* nothing was requested yet */
+        }
+        return sshd_OK;
+    }
+};
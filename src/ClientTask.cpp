@@ -66,11 +66,25 @@ namespace ssh
                     disconnect( SSH_DISCONNECT_PROTOCOL_ERROR );
                     return;
                 }
-            } else if( m_pService ) { /* check if the service has anything to send */
+            } else if( kexStep() != sshd_OK ) { /* keyexchange packets go first, may start a rekey */
+                sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+                disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
+                return;
+            } else if( sendState.state == sshd_STATE_NO_PACKET && isSendAllowed() && m_pService ) {
+                /* check if the service has anything to send, the data stays queued in the
+                   service while a keyexchange holds back the output */
 
                 if( m_pService->isDataAvailable( 0 ) )
                 {
-                    m_pService->read( sendState.pPayload, MAX_SSH_PAYLOAD, &sendState.payloadSize);
+                    if( !newPacket() ) {
+                        disconnect( SSH_DISCONNECT_BY_APPLICATION );
+                        return;
+                    }
+                    if( m_pService->read( sendState.pPayload, getMaxPayload(), &sendState.payloadSize) != sshd_OK ) {
+                        sshd_Log(sshd_EVENT_FATAL, "Failed to read data from service.");
+                        disconnect( SSH_DISCONNECT_BY_APPLICATION );
+                        return;
+                    }
                     m_writePos = sendState.payloadSize;
                     res = sendPacketNonblock();
                     if( (res != sshd_OK) && (res != sshd_PACKET_PENDING) ) {
@@ -157,13 +171,20 @@ namespace ssh
                     return sshd_ERROR;
                 }
             }
-            else if( m_iAuth->authIsDataAvailable() ) /* data is available to be sent */
+            else if( kexStep() != sshd_OK ) {
+                sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+                disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
+                return sshd_ERROR;
+            }
+            else if( sendState.state == sshd_STATE_NO_PACKET && isSendAllowed() &&
+                     m_iAuth->authIsDataAvailable() ) /* data is available to be sent */
             {
                 uint32_t dw;
 
-                newPacket();
+                if( !newPacket() )
+                    return sshd_INTERNAL_ERROR;
                 /* read a packet from the authentication service */
-                if( m_iAuth->authReadPacket( sendState.pPayload, MAX_SSH_PAYLOAD, &dw) != sshd_OK ) {
+                if( m_iAuth->authReadPacket( sendState.pPayload, getMaxPayload(), &dw) != sshd_OK ) {
                     sshd_Log(sshd_EVENT_FATAL, "Failed to read data from authentication service.");
                     return sshd_ERROR;
                 }
@@ -231,8 +252,8 @@ namespace ssh
         uint8_t type;
 
         /* first send the service request */
-        newPacket();
-        if( !writeByte(SSH_MSG_SERVICE_REQUEST) ||
+        if( !newPacket() ||
+            !writeByte(SSH_MSG_SERVICE_REQUEST) ||
             !writeString(name) )
         {
             return sshd_ERROR;
@@ -285,17 +306,18 @@ namespace ssh
         getPacketType( type );
         switch( type )
         {
-        case SSH_MSG_KEXINIT:
+        default:
             {
-                /* not the initial keyexchange, and the client wasn't the part that initiated the keyexchange */
-                res = performKeyExchange( false, false );
-                if( res != sshd_OK ) {
-                    sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+                if( isKexPacket( type ) ) {
+                    /* the keyexchange runs alongside the service traffic */
+                    res = kexHandlePacket();
+                    if( res != sshd_OK ) {
+                        sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+                        disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
+                    }
                     return res;
                 }
-                return sshd_OK; /* keyexchange successful */
             }
-        default:
             break;
         }
 
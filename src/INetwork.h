@@ -0,0 +1,68 @@
+/* INetwork.h
+ * The byte stream used by the transport layer.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _INETWORK_H_
+#define _INETWORK_H_
+
+/* C/C++ includes */
+#include <string>
+
+/* project includes */
+#include "types.h"
+
+namespace ssh
+{
+    /* INetworkListener
+     * Told when a stream may have become readable or writable, so one thread can drive many
+     * streams instead of waiting on each of them. It is called by the thread that moved the
+     * data, with the stream locked, and must only note the event.
+     */
+    class INetworkListener
+    {
+    public:
+        virtual ~INetworkListener() {}
+
+        virtual void OnNetworkEvent(void * context) = 0;
+    };
+
+    /* INetwork
+     * A bidirectional byte stream. The transport layer only uses this interface, so it can
+     * run over a socket (CNetwork) or an in-process pipe (CMemoryNetwork). The functions
+     * return the sshd_* codes from errors.h.
+     */
+    class INetwork
+    {
+    public:
+        virtual ~INetwork() {}
+
+        /* connects to a remote host, sshd_CONNECTION_PENDING while in progress */
+        virtual int connect(const char * host, const char * port)   = 0;
+        /* polls a pending connection attempt */
+        virtual int poll(int timeout)                               = 0;
+        virtual void disconnect()                                   = 0;
+
+        /* waits up to timeout milliseconds for data or for space in the output */
+        virtual bool dataAvailable(int timeout)                     = 0;
+        virtual bool writePossible(int timeout)                     = 0;
+
+        /* reads or writes up to count bytes, the number transferred is stored in the last argument */
+        virtual int readBytes(byte *, int count, int *)             = 0;
+        virtual int writeBytes(const byte *, int count, int *)      = 0;
+
+        /* writes or reads a raw CR LF terminated line */
+        virtual bool writeLine(const std::string &)                 = 0;
+        virtual bool readLine(std::string &)                        = 0;
+
+        /* sets blocking/non-blocking mode */
+        virtual INetwork & setBlockingMode(bool block = true)       = 0;
+
+        /* reports the stream's events to a listener, NULL removes it; false if the stream
+           can only be waited on */
+        virtual bool setListener(INetworkListener *, void *)        {return false;}
+    };
+};
+
+#endif
@@ -6,6 +6,7 @@
 
 /* project includes */
 #include "types.h"
+#include "defines.h"
 
 enum 
 {
@@ -28,11 +29,10 @@ namespace ssh
      * Contains the information for the SSH_MSG_KEXINIT message.
      */
     struct KeyExchangeInfo {
-        int         packetSize;
         byte        cookie[16];
         std::string algorithms[MAX_ALGORITHM_COUNT];
         byte        follows;
-        byte        paddingSize;
+        ByteVector  payload;    /* the raw SSH_MSG_KEXINIT payload, as hashed into the exchange hash */
     };
 };
 
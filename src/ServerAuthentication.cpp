@@ -7,6 +7,7 @@
 #include "sshd.h"
 #include "messages.h"
 #include "debug.h"
+#include "probes.h"
 
 /* standard includes */
 #include <string>
@@ -21,6 +22,7 @@ namespace ssh
     int CServerTransport::performAuthentication()
     {
         int res;
+        byte type;
         /* The first step in the authentication process is that the client
          * requests a authentication service.
          */
@@ -29,18 +31,32 @@ namespace ssh
         while( 1 )
         {
             sshd_CheckAbortEvent()
+            if( deadlinePassed() )
+                return sshd_CONNECTION_ABORTED;
             /*
              * Incoming data.
              */
             res = readPacketNonblock(50);
             if( res == sshd_OK )
             {
+                getPacketType( type );
+                if( isKexPacket( type ) ) {
+                    if( kexHandlePacket() != sshd_OK ) {
+                        disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
+                        return sshd_ERROR;
+                    }
+                    continue;
+                }
                 res = handleAuthPacket();
                 if( res == sshd_CLIENT_AUTHENTICATED ) {
                     /* client has been authenticated */
+                    m_stats.counters.authSuccess++;
+                    SSHD_PROBE2(auth__result, m_connectionId, 1);
                     return sshd_OK;
                 } else if( res != sshd_OK ) {
                     /* authentication failure */
+                    m_stats.counters.authFailure++;
+                    SSHD_PROBE2(auth__result, m_connectionId, 0);
                     return res;
                 }
             } else if( (res != sshd_PACKET_PENDING) && (res != sshd_NO_PACKET) ) {
@@ -58,13 +74,23 @@ namespace ssh
                     return sshd_ERROR;
                 }
             }
-            else if( m_pAuthService )   /* check if the authentication service has anything to send */
+            else if( kexStep() != sshd_OK ) {
+                sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+                disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
+                return sshd_ERROR;
+            }
+            else if( sendState.state == sshd_STATE_NO_PACKET && isSendAllowed() && m_pAuthService )
             {
+                /* check if the authentication service has anything to send */
                 if( m_pAuthService->isDataAvailable(0) ) 
                 {
                     /* data available to be sent */
                     uint32_t wrt = 0;
-                    res = m_pAuthService->read( sendState.pPayload, MAX_SSH_PAYLOAD, &wrt);
+                    if( !newPacket() ) {
+                        disconnect( SSH_DISCONNECT_BY_APPLICATION );
+                        return sshd_INTERNAL_ERROR;
+                    }
+                    res = m_pAuthService->read( sendState.pPayload, getMaxPayload(), &wrt);
                     if( res == sshd_OK ) {
                         m_writePos = wrt;
                         res = sendPacketNonblock();
@@ -115,6 +141,7 @@ namespace ssh
                  */
                 if( id >= 60 && id <= 79 ) /* let the authentication service handle the packets */
                 {
+                    SSHD_PROBE2(auth__attempt, m_connectionId, id);
                     res = m_pAuthService->handle(readState.pPayload, readState.payloadSize);
                     if( res == sshd_CLIENT_AUTHENTICATED )
                     {
@@ -122,8 +149,8 @@ namespace ssh
                         delete m_pAuthService;
                         m_pAuthService = 0;
                         /* notify client */
-                        newPacket();
-                        if( !writeByte( SSH_MSG_USERAUTH_SUCCESS ) ||
+                        if( !newPacket() ||
+                            !writeByte( SSH_MSG_USERAUTH_SUCCESS ) ||
                             (sendPacket() != sshd_OK) )
                         {
                             sshd_Log(sshd_EVENT_FATAL, "Failed to write authentication success reply.");
@@ -173,8 +200,8 @@ namespace ssh
         if( res == sshd_OK ) 
         {
             /* service created, write a reply */
-            newPacket();
-            if( !writeByte(SSH_MSG_SERVICE_ACCEPT) ||
+            if( !newPacket() ||
+                !writeByte(SSH_MSG_SERVICE_ACCEPT) ||
                 !writeString( service ) ||
                 (sendPacket() != sshd_OK) ) 
             {
@@ -7,8 +7,13 @@
 #include "CServerTransport.h"
 #include "sshd.h"
 #include "messages.h"
+#include "util.h"
+#include "CHistogram.h"
+#include "probes.h"
 
 /* c/c++ includes */
+#include <cstdio>
+#include <new>
 #include <string>
 
 /* 
@@ -24,28 +29,29 @@ namespace ssh
      */
     void CServerTransport::Task()
     {
-        int res;
+        CLogContext context( getConnectionId() );
+        CHistogramContext histograms;
 
         if( sshd_CheckAbortEvent_NoRet() ) {
             sshd_Log(sshd_EVENT_NOTIFY, "Connection attempt aborted by user.");
-            ds->disconnect();
-            return;
-        }
-
-        /* establish the connection */
-        res = establishConnection();
-        if( res != sshd_OK ) {
+        } else if( establishConnection() != sshd_OK ) {
             sshd_Log(sshd_EVENT_NOTIFY, "Failed to establish connection.");
-            ds->disconnect();
-            return;
+        } else {
+            /* run the primary task */
+            mainTask();
+            sshd_Log(sshd_EVENT_NOTIFY, "Connection closed.");
         }
-
-        /* run the primary task */
-        mainTask();
+        if( deadlinePassed() )
+            sshd_Log(sshd_EVENT_NOTIFY, "Login grace time exceeded.");
 
         /* make sure to disconnect */
         ds->disconnect();
-        sshd_Log(sshd_EVENT_NOTIFY, "Connection closed.");
+        releaseStartup();
+        SSHD_PROBE1(connection__close, getConnectionId());
+
+        /* the server deletes the connection once the thread has ended */
+        if( m_sshd )
+            m_sshd->connectionFinished( this );
     }
 
     /* CServerTransport::handlePacket
@@ -88,39 +94,138 @@ namespace ssh
                             return res;
                         }
                     }
-                    /* the service has been created, notify it? */
+                    if( !m_pService->init( m_settings ) ) {
+                        sshd_Log(sshd_EVENT_FATAL, "Failed to initialize requested service.");
+                        disconnect( SSH_DISCONNECT_BY_APPLICATION );
+                        return sshd_ERROR;
+                    }
+
+                    /* the main loop accepts the request once a packet may be sent */
+                    m_pendingAccept = serviceName;
                     return sshd_OK;
                 }
                 break;
             }
-        case SSH_MSG_KEXINIT:
+        default:
             {
-                /* send any outgoing packet */
-                if( sendState.state != sshd_STATE_NO_PACKET ) {
-                    res = sendPacket();
+                if( isKexPacket( type ) ) {
+                    /* the keyexchange runs alongside the service traffic */
+                    res = kexHandlePacket();
                     if( res != sshd_OK )
-                        return res;
+                        disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
+                    return res;
                 }
-                sshd_Log(sshd_EVENT_NOTIFY, "Keyexchange triggered by remote host");
-                /* perform the keyexchange */
-                if( performKeyExchange() != sshd_OK )
-                    return sshd_ERROR;
-
-                return sshd_OK;
+                /* only the connection protocol and later messages (RFC 4250 4.1.2) belong to
+                   the service, anything else is unexpected as before */
+                if( m_pService && type >= SSH_MSG_GLOBAL_REQUEST ) {
+                    if( m_recorder )
+                        m_recorder->record( RECORD_INPUT, readState.pPayload, readState.payloadSize );
+                    /* let the service handle the packet */
+                    return m_pService->handle(readState.pPayload, readState.payloadSize);
+                }
+                return sshd_ERROR;
             }
-        default:
-            return sshd_ERROR;
         }
         /**/
         return sshd_ERROR;
     }
 
+    /* CServerTransport::sendServiceAccept
+     * Accepts the requested service, the service may send once the reply is on its way.
+     */
+    int CServerTransport::sendServiceAccept()
+    {
+        int res;
+
+        if( !newPacket() ||
+            !writeByte( SSH_MSG_SERVICE_ACCEPT ) ||
+            !writeString( m_pendingAccept ) )
+        {
+            return sshd_ERROR;
+        }
+
+        res = sendPacketNonblock();
+        if( (res != sshd_OK) && (res != sshd_PACKET_PENDING) )
+            return res;
+
+        if( m_recorder )
+            m_recorder->record( RECORD_SERVICE, (const byte *) m_pendingAccept.data(), (uint32_t) m_pendingAccept.size() );
+        m_pendingAccept.clear();
+        m_pService->OnAccept();
+        return sshd_OK;
+    }
+
+    /* CServerTransport::hibernate
+     * Frees the memory of a connection that has been idle for a while, the transport and
+     * the service rebuild their state when the connection is used again.
+     */
+    bool CServerTransport::hibernate()
+    {
+        if( !CTransport::hibernate() )
+            return false;
+        if( m_pService )
+            m_pService->hibernate();
+
+        m_hibernating = true;
+        sshd_Log(sshd_EVENT_NOTIFY, "Connection is idle, hibernating.");
+        return true;
+    }
+
+    /* CServerTransport::wake
+     * Called when a hibernating connection becomes active again.
+     */
+    void CServerTransport::wake()
+    {
+        if( m_pService )
+            m_pService->wake();
+        m_hibernating = false;
+    }
+
+    /* CServerTransport::startRecording
+     * Starts recording the service traffic if a record directory is configured, the file
+     * is named after the server run and the connection.
+     */
+    void CServerTransport::startRecording()
+    {
+        string dir;
+        char name[128];
+
+        if( !m_settings.GetString(SSHD_SETTING_RECORD_DIRECTORY, dir) || dir.empty() )
+            return;
+
+        if( !(m_recorder = new (std::nothrow) CSessionRecorder) )
+            return;
+
+        sprintf( name, "session-%s-%u" SESSION_FILE_EXTENSION,
+                 m_sshd ? m_sshd->getRunName().c_str() : "", getConnectionId() );
+        if( dir[dir.size() - 1] != '/' && dir[dir.size() - 1] != '\\' )
+            dir += '/';
+
+        if( !m_recorder->open( dir + name ) ) {
+            sshd_Log(sshd_EVENT_WARNING, "Failed to create the session file.");
+            delete m_recorder;
+            m_recorder = NULL;
+        }
+    }
+
+    /* CServerTransport::releaseStartup
+     * Lets the admission control start another connection, the first call counts.
+     */
+    void CServerTransport::releaseStartup()
+    {
+        if( m_admission ) {
+            m_admission->release();
+            m_admission = NULL;
+        }
+    }
+
     /* CServerTransport::maintask
      *
      */
     void CServerTransport::mainTask()
     {
         int res;
+        uint64_t start = GetMonotonicTime();
         /* 
          * The first task the server needs to do is to authenticate the user.
          */
@@ -128,10 +233,15 @@ namespace ssh
             sshd_Log(sshd_EVENT_FATAL, "User authentication failed");
             return;
         }
+        CHistogram::Get( HISTOGRAM_AUTHENTICATION ).record( GetMonotonicTime() - start );
+        m_deadline = 0;
+        releaseStartup();
+        startRecording();
 
         /*
          * The user has been authenticated
          */
+        m_lastActivity = GetMonotonicTime();
         while( 1 )
         {
 
@@ -150,13 +260,37 @@ namespace ssh
                     sshd_Log(sshd_EVENT_FATAL, "Failed to send outgoing packet.");
                     return;
                 }
-            } else if( m_pService )     /* check if the service has anything to send */
+            }
+            else if( kexStep() != sshd_OK )     /* keyexchange packets go first, may start a rekey */
+            {
+                sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+                disconnect( SSH_DISCONNECT_KEY_EXCHANGE_FAILED );
+                return;
+            }
+            else if( sendState.state == sshd_STATE_NO_PACKET && isSendAllowed() && !m_pendingAccept.empty() )
+            {
+                if( sendServiceAccept() != sshd_OK ) {
+                    sshd_Log(sshd_EVENT_FATAL, "Failed to send SSH_MSG_SERVICE_ACCEPT message.");
+                    return;
+                }
+            }
+            else if( sendState.state == sshd_STATE_NO_PACKET && isSendAllowed() && m_pService && m_pendingAccept.empty() )
             {
+                /* check if the service has anything to send, the data stays queued in the
+                   service while a keyexchange holds back the output */
                 if( m_pService->isDataAvailable( 0 ) )
                 {
                     uint32_t wrt = 0;
+
+                    if( m_hibernating )
+                        wake();
+                    m_lastActivity = GetMonotonicTime();
                     /* read the data from the service to the output buffer */
-                    if( m_pService->read( sendState.pPayload, MAX_SSH_PAYLOAD, &wrt ) != sshd_OK )
+                    if( !newPacket() ) {
+                        disconnect( SSH_DISCONNECT_BY_APPLICATION );
+                        return;
+                    }
+                    if( m_pService->read( sendState.pPayload, getMaxPayload(), &wrt ) != sshd_OK )
                     {
                         sshd_Log(sshd_EVENT_FATAL, "Failed to read data from service.");
                         disconnect( SSH_DISCONNECT_BY_APPLICATION );
@@ -164,6 +298,8 @@ namespace ssh
                     }
                     /* check the size here? */
                     m_writePos = wrt;
+                    if( m_recorder )
+                        m_recorder->record( RECORD_OUTPUT, sendState.pPayload, wrt );
                     /* start sending the packet */
                     res = sendPacketNonblock();
                     if( (res != sshd_OK) && (res != sshd_PACKET_PENDING) ) {
@@ -174,9 +310,18 @@ namespace ssh
                 }
             }
 
-            /* handle any incoming packet */
-            res = readPacketNonblock();
+            /* handle any incoming packet, a hibernating connection with nothing to send
+               waits for the data instead of spinning */
+            if( m_hibernating && sendState.state == sshd_STATE_NO_PACKET && !isKeyExchangeActive() )
+                res = readPacketNonblock( SSHD_HIBERNATE_POLL_INTERVAL );
+            else
+                res = readPacketNonblock();
+
             if( res == sshd_OK ) {
+                if( m_hibernating )
+                    wake();
+                m_lastActivity = GetMonotonicTime();
+
                 res = handlePacket();
                 if( res != sshd_OK ) {
                     sshd_Log(sshd_EVENT_FATAL, "handlePacket() failed.");
@@ -187,6 +332,12 @@ namespace ssh
                 sshd_Log(sshd_EVENT_FATAL, "Failed to read packet.");
                 return;
             }
+            else if( res == sshd_NO_PACKET && !m_hibernating && m_idleHibernate &&
+                     GetMonotonicTime() - m_lastActivity >= m_idleHibernate )
+            {
+                /* stays awake if a packet or a keyexchange is in progress */
+                hibernate();
+            }
         }
     }
 
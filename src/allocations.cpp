@@ -0,0 +1,91 @@
+/* allocations.cpp
+ * Counts the heap allocations of each thread.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#include "types.h"
+#include "util.h"
+
+#if defined(SSHD_COUNT_ALLOCATIONS)
+
+#if defined(WIN32) || defined(_WIN32)
+#include <crtdbg.h>
+#define ALLOC_THREAD_LOCAL          __declspec(thread)
+#else
+#include <cstddef>
+#define ALLOC_THREAD_LOCAL          __thread
+#endif
+
+/* allocations made by the calling thread, a plain integer since only the owner updates it */
+static ALLOC_THREAD_LOCAL uint64_t s_allocations = 0;
+
+#if defined(WIN32) || defined(_WIN32)
+
+/* AllocationHook
+ * Called by the debug CRT for each heap operation.
+ */
+static int __cdecl AllocationHook(int type, void *, size_t, int, long, const unsigned char *, int)
+{
+    if( type == _HOOK_ALLOC || type == _HOOK_REALLOC )
+        s_allocations++;
+    return TRUE;
+}
+
+/* the hook is installed before main runs */
+static struct AllocationHookInstaller {
+    AllocationHookInstaller() {_CrtSetAllocHook( AllocationHook );}
+} s_installer;
+
+#else
+
+/*
+ * The C library allocation functions are replaced by counting ones, operator new and
+ * OpenSSL both end up here. The glibc entry points do the actual work.
+ */
+extern "C"
+{
+    void * __libc_malloc(size_t);
+    void * __libc_calloc(size_t, size_t);
+    void * __libc_realloc(void *, size_t);
+
+    void * malloc(size_t size)
+    {
+        s_allocations++;
+        return __libc_malloc( size );
+    }
+
+    void * calloc(size_t count, size_t size)
+    {
+        s_allocations++;
+        return __libc_calloc( count, size );
+    }
+
+    void * realloc(void * p, size_t size)
+    {
+        s_allocations++;
+        return __libc_realloc( p, size );
+    }
+}
+
+#endif
+
+/* GetThreadAllocations
+ * Returns the number of allocations made by the calling thread.
+ */
+uint64_t GetThreadAllocations()
+{
+    return s_allocations;
+}
+
+#else
+
+/* GetThreadAllocations
+ * Allocations are only counted in builds with SSHD_COUNT_ALLOCATIONS.
+ */
+uint64_t GetThreadAllocations()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,37 @@
+/* clock.cpp
+ * Implements the monotonic clock used for time measurements.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#if defined(WIN32) || defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "types.h"
+
+/* GetMonotonicTime
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t GetMonotonicTime()
+{
+#if defined(WIN32) || defined(_WIN32)
+    static LARGE_INTEGER freq = {0};
+    LARGE_INTEGER now;
+
+    if( !freq.QuadPart )
+        QueryPerformanceFrequency( &freq );
+
+    QueryPerformanceCounter( &now );
+    /* split the conversion to avoid overflowing the multiplication */
+    return (uint64_t) (now.QuadPart / freq.QuadPart) * 1000000000ULL +
+           (uint64_t) (now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
@@ -13,30 +13,30 @@
 
 namespace ssh
 {
-    /* CDiffieHellman::ClientKeyExchange
-     * Performs the client side key exchange.
+    /* CDiffieHellman::ClientWriteInit
+     * Generates the client keys and writes the SSH_MSG_KEXDH_INIT message to the output buffer.
      */
-    int CDiffieHellman::ClientKeyExchange(CHostKey * hostKey, bool guess)
+    bool CDiffieHellman::ClientWriteInit()
     {
         /* first generate the keys */
         if( !GenerateKeys( false ) ) {
-            return sshd_ERROR;
+            return false;
         }
 
-        /* send the generated key to the client */
-        m_ts->newPacket();
-        if( !m_ts->writeByte(SSH_MSG_KEXDH_INIT) ||     /* write packet type */
+        if( !m_ts->newPacket() ||
+            !m_ts->writeByte(SSH_MSG_KEXDH_INIT) ||     /* write packet type */
             !m_e->write(*m_ts) )                        /* write 'e' to packet */ 
         {
-            return sshd_ERROR;
-        }
-
-        /* Send the packet and wait for the server's reply */
-        if( m_ts->exchangeAndExpect(SSH_MSG_KEXDH_REPLY) != sshd_OK )
-        {
-            return sshd_ERROR;
+            return false;
         }
+        return true;
+    }
 
+    /* CDiffieHellman::ClientHandleReply
+     * Handles the SSH_MSG_KEXDH_REPLY in the input buffer and verifies the server.
+     */
+    int CDiffieHellman::ClientHandleReply(CHostKey * hostKey)
+    {
         /* parse the reply */
         if( parseKexdhReply(hostKey) != sshd_OK ) {
             return sshd_ERROR;
@@ -84,7 +84,7 @@ namespace ssh
             return sshd_ERROR;
 
         /* read the server's public key */
-        if( !m_ts->readBigInt(&m_f) )
+        if( !(m_f = m_ts->getKexArena().create<CBigInt>()) || !m_f->read(*m_ts) )
             return sshd_ERROR;
 
         /* read the signature */
@@ -14,30 +14,15 @@
 
 namespace ssh
 {
-    /* CDiffieHellman::ServerKeyExchange
-     * Performs the Diffie-Hellman keyexchange.
+    /* CDiffieHellman::ServerHandleInit
+     * Handles the SSH_MSG_KEXDH_INIT in the input buffer, computes the shared secret and
+     * signs the exchange hash.
      */
-    int CDiffieHellman::ServerKeyExchange(
-        CHostKey * hostkey, 
-        bool guess)
+    int CDiffieHellman::ServerHandleInit(CHostKey * hostkey)
     {
         byte id;
-        std::vector<byte> signature;
-    
-        /* If the client guessed correctly the first exchange packet is
-         * included in the KEXINIT packet, otherwise we need to wait for the
-         * client to send the first packet.
-         */
-
-        if( !guess ) { 
-            /* The client didn't guess or the guess was incorrect */
-            if( m_ts->readPacket() != sshd_OK ) {
-                sshd_Log(sshd_EVENT_FATAL, "Failed to read initial keyexchange packet.");
-                return ERR_FAILED;
-            }
-        }
 
-        m_e = new CBigInt();
+        m_e = m_ts->getKexArena().create<CBigInt>();
         if( !m_e )
             return ERR_FAILED;
 
@@ -76,12 +61,21 @@ namespace ssh
         }
 
         
-        if( !Sign(hostkey, m_exchange, signature) ) {
+        if( !Sign(hostkey, m_exchange, m_signature) ) {
             sshd_Log(sshd_EVENT_FATAL, "Failed to sign exchange hash.");
             return ERR_FAILED;
         }
 
-        m_ts->newPacket();
+        return sshd_OK;
+    }
+
+    /* CDiffieHellman::ServerWriteReply
+     * Writes the SSH_MSG_KEXDH_REPLY to the output buffer.
+     */
+    bool CDiffieHellman::ServerWriteReply(CHostKey * hostkey)
+    {
+        if( !m_ts->newPacket() )
+            return false;
 
         /*
          * Write the reply
@@ -89,18 +83,11 @@ namespace ssh
         if( !m_ts->writeByte(SSH_MSG_KEXDH_REPLY) ||
             !hostkey->WriteKeyblob( *m_ts ) ||
             !m_f->write( *m_ts ) || 
-            !hostkey->WriteSignature( *m_ts, signature ) )
+            !hostkey->WriteSignature( *m_ts, m_signature ) )
         {
             sshd_Log(sshd_EVENT_FATAL, "Failed to write KEXDH reply.");
-            return ERR_FAILED;
+            return false;
         }
-
-        /* send the packet */
-        if( m_ts->sendPacket() != OK ) {
-            sshd_Log(sshd_EVENT_FATAL, "Failed to send KEXDH reply.");
-            return ERR_FAILED;
-        }
-
-        return sshd_OK;
+        return true;
     }
 }
\ No newline at end of file
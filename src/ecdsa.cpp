@@ -0,0 +1,360 @@
+/* ecdsa.cpp
+ * ECDSA (NIST P-256) implementation using OpenSSL
+ *
+ * Copyright (c) 2006-2009 Magnus Leksell, all rights reserved.
+ */
+
+/* project includes */
+#include "ecdsa.h"
+#include "FileStream.h"
+#include "ArrayStream.h"
+#include "sha2.h"
+
+/* C/C++ includes */
+#include <string>
+#include <assert.h>
+
+#include <openssl/sha.h>
+
+#define ECDSA_CURVE_NAME            "nistp256"
+#define MAX_ECDSA_POINT_LENGTH      (133)   /* uncompressed point on the largest supported curve */
+#define MAX_ECDSA_KEYBLOB_LENGTH    (256)
+
+using namespace std;
+
+namespace ssh
+{
+    /* ecdsa::ecdsa
+     * Constructor.
+     */
+    ecdsa::ecdsa()
+    {
+        m_ec = NULL;
+    }
+
+    /* ecdsa::~ecdsa
+     * Destructor.
+     */
+    ecdsa::~ecdsa()
+    {
+        if( m_ec )
+            EC_KEY_free( m_ec );
+    }
+
+    /* ecdsa::loadKeys
+     * Loads the keys.
+     */
+    bool ecdsa::loadKeys(const ssh::CSettings & settings)
+    {
+        string priv;
+        if( !settings.GetString(SSHD_SETTING_ECDSA_PRIVATE_KEY_FILE, priv) )
+            return false;
+
+        return LoadKeyPair( priv.c_str() );
+    }
+
+    /* ecdsa::LoadKeyPair
+     * Loads the private key, the public key is derived from it.
+     */
+    bool ecdsa::LoadKeyPair(const char * priv)
+    {
+        string ident;
+        FileStream stream;
+        BIGNUM * d = NULL;
+        EC_POINT * pub = NULL;
+        bool res = false;
+
+        if( !stream.open( priv, FileStream::STREAM_MODE_READ ) )
+            return false;
+
+        if( !stream.readString( ident ) || (ident != "ecdsa-priv") )
+            return false;
+
+        if( !stream.readBigInt( &d ) )
+            return false;
+
+        if( m_ec )
+            EC_KEY_free( m_ec );
+
+        if( !(m_ec = EC_KEY_new_by_curve_name( NID_X9_62_prime256v1 )) )
+            goto cleanup;
+
+        /* calculate the public point from the private scalar */
+        if( !(pub = EC_POINT_new( EC_KEY_get0_group(m_ec) )) ||
+            !EC_POINT_mul( EC_KEY_get0_group(m_ec), pub, d, NULL, NULL, NULL ) ||
+            !EC_KEY_set_private_key( m_ec, d ) ||
+            !EC_KEY_set_public_key( m_ec, pub ) ||
+            !EC_KEY_check_key( m_ec ) )
+        {
+            goto cleanup;
+        }
+        res = true;
+
+cleanup:
+        if( pub )
+            EC_POINT_free( pub );
+        BN_clear_free( d );
+        return res;
+    }
+
+    /* ecdsa::GenerateKeyPair
+     * Generates a new keypair.
+     */
+    bool ecdsa::GenerateKeyPair()
+    {
+        if( m_ec )
+            EC_KEY_free( m_ec );
+
+        if( !(m_ec = EC_KEY_new_by_curve_name( NID_X9_62_prime256v1 )) )
+            return false;
+
+        return (EC_KEY_generate_key( m_ec ) == 1);
+    }
+
+    /* ecdsa::writePrivateKey
+     * Writes the private key to a file.
+     */
+    bool ecdsa::writePrivateKey(const char * filename)
+    {
+        ssh::FileStream stream;
+
+        if( !m_ec || !EC_KEY_get0_private_key( m_ec ) )
+            return false;
+
+        if( !stream.open( filename, FileStream::STREAM_MODE_WRITE ) )
+            return false;
+
+        if( !stream.writeString("ecdsa-priv") ||
+            !stream.writeBigInt( EC_KEY_get0_private_key( m_ec ) ) )
+        {
+            return false;
+        }
+        return true;
+    }
+
+    /* ecdsa::WritePublicKey
+     * Writes the public key to the stream.
+     */
+    bool ecdsa::WritePublicKey( CStream & stream )
+    {
+        byte point[MAX_ECDSA_POINT_LENGTH];
+        size_t length;
+
+        assert(m_ec != NULL);
+
+        length = EC_POINT_point2oct( EC_KEY_get0_group(m_ec),
+            EC_KEY_get0_public_key(m_ec),
+            POINT_CONVERSION_UNCOMPRESSED,
+            point,
+            sizeof(point),
+            NULL);
+        if( length == 0 )
+            return false;
+
+        if( !stream.writeString( GetName() ) ||         /* identifier */
+            !stream.writeString( ECDSA_CURVE_NAME ) ||  /* curve */
+            !stream.writeInt32( static_cast<uint32>(length) ) ||
+            !stream.writeBytes( point, static_cast<int>(length) ) )
+        {
+            return false;
+        }
+        return true;
+    }
+
+    /* ecdsa::readPublicKey
+     * Reads the curve name and the public point following the identifier.
+     */
+    bool ecdsa::readPublicKey( CStream & stream )
+    {
+        string curve;
+        byte point[MAX_ECDSA_POINT_LENGTH];
+        uint32 length;
+        EC_POINT * pub;
+        bool res;
+
+        if( !stream.readString( curve ) || (curve != ECDSA_CURVE_NAME) )
+            return false;
+
+        if( !stream.readInt32( length ) || (length == 0) || (length > MAX_ECDSA_POINT_LENGTH) ||
+            !stream.readBytes( point, length ) )
+        {
+            return false;
+        }
+
+        if( m_ec )
+            EC_KEY_free( m_ec );
+
+        if( !(m_ec = EC_KEY_new_by_curve_name( NID_X9_62_prime256v1 )) )
+            return false;
+
+        if( !(pub = EC_POINT_new( EC_KEY_get0_group(m_ec) )) )
+            return false;
+
+        res = (EC_POINT_oct2point( EC_KEY_get0_group(m_ec), pub, point, length, NULL ) == 1) &&
+              (EC_KEY_set_public_key( m_ec, pub ) == 1);
+
+        EC_POINT_free( pub );
+        return res;
+    }
+
+    /* ecdsa::ParseKeyblob
+     * Parses the keyblob sent by the server.
+     */
+    bool ecdsa::ParseKeyblob( const byte * src, uint32 length )
+    {
+        string ident;
+        ArrayStream stream( src, length );
+
+        if( !stream.readString( ident ) || (ident != GetName()) )
+            return false;
+
+        return readPublicKey( stream );
+    }
+
+    /* ecdsa::ParseKeyblob
+     * Parses the keyblob sent by the server.
+     */
+    bool ecdsa::ParseKeyblob( CStream & stream )
+    {
+        string ident;
+        uint32_t len;
+
+        if( !stream.readInt32(len) || (len == 0) || (len > MAX_ECDSA_KEYBLOB_LENGTH) )
+            return false;
+
+        if( !stream.readString( ident ) || (ident != GetName()) )
+            return false;
+
+        return readPublicKey( stream );
+    }
+
+    /* ecdsa::ParseSignature
+     * Parses the signature blob sent by the server.
+     */
+    bool ecdsa::ParseSignature( CStream & stream )
+    {
+        string ident;
+        uint32_t len, sigLen;
+
+        if( !stream.readInt32(len) || (len == 0) || (len > MAX_ECDSA_KEYBLOB_LENGTH) )
+            return false;
+
+        if( !stream.readString( ident ) || (ident != GetName()) )
+            return false;
+
+        if( !stream.readInt32(sigLen) || (sigLen == 0) || (sigLen > MAX_ECDSA_SIGNATURE_LENGTH) )
+            return false;
+
+        return stream.readVector( m_signature, sigLen );
+    }
+
+    /* ecdsa::ParseSignature
+     * Parses the signature blob sent by the server.
+     */
+    bool ecdsa::ParseSignature( const byte * src, uint32 length )
+    {
+        string ident;
+        uint32 sigLen;
+        ArrayStream stream( src, length );
+
+        if( !stream.readString( ident ) || (ident != GetName()) )
+            return false;
+
+        if( !stream.readInt32(sigLen) || !sigLen || (sigLen > MAX_ECDSA_SIGNATURE_LENGTH) )
+            return false;
+
+        return stream.readVector( m_signature, sigLen );
+    }
+
+    /* ecdsa::WriteSignature
+     * Writes the signature blob, the signature itself is already encoded as (mpint r, mpint s).
+     */
+    bool ecdsa::WriteSignature( ssh::CStream & stream, const std::vector<uint8_t> & sig )
+    {
+        size_t count = sizeof(uint32_t) + strlen( GetName() ) + sizeof(uint32_t) + sig.size();
+
+        if( !stream.writeInt32( static_cast<uint32_t>(count) ) ||
+            !stream.writeString( GetName() ) ||
+            !stream.writeInt32( static_cast<uint32_t>(sig.size()) ) ||
+            !stream.writeVector( sig ) )
+        {
+            return false;
+        }
+        return true;
+    }
+
+    /* ecdsa::Sign
+     * Signs the source data using the private key.
+     */
+    bool ecdsa::Sign( const std::vector<byte> & src, std::vector<byte> & signature )
+    {
+        byte digest[ SHA256_DIGEST_LENGTH ];
+        byte blob[ MAX_ECDSA_SIGNATURE_LENGTH ];
+        const BIGNUM * r, * s;
+        ECDSA_SIG * sig;
+        bool res;
+
+        if( !m_ec )
+            return false;
+
+        /* hash the exchange hash */
+        sha256().hash( src, digest );
+
+        if( !(sig = ECDSA_do_sign( digest, SHA256_DIGEST_LENGTH, m_ec )) )
+            return false;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        ECDSA_SIG_get0( sig, &r, &s );
+#else
+        r = sig->r;
+        s = sig->s;
+#endif
+        /* the signature is encoded as two mpints */
+        ArrayWriteStream stream( blob, sizeof(blob) );
+        res = stream.writeBigInt( r ) && stream.writeBigInt( s );
+        if( res )
+            signature.assign( blob, blob + stream.GetUsage() );
+
+        ECDSA_SIG_free( sig );
+        return res;
+    }
+
+    /* ecdsa::VerifyHost
+     * Verifies that the signature sent by the server matches the exchange hash.
+     */
+    bool ecdsa::VerifyHost( const std::vector<byte> & exchange )
+    {
+        byte digest[ SHA256_DIGEST_LENGTH ];
+        BIGNUM * r = NULL, * s = NULL;
+        ECDSA_SIG * sig;
+        int res;
+
+        if( !m_ec || m_signature.empty() )
+            return false;
+
+        ArrayStream stream( &m_signature[0], static_cast<uint32>(m_signature.size()) );
+        if( !stream.readBigInt( &r ) || !stream.readBigInt( &s ) ) {
+            if( r ) BN_free( r );
+            return false;
+        }
+
+        if( !(sig = ECDSA_SIG_new()) ) {
+            BN_free( r );
+            BN_free( s );
+            return false;
+        }
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        ECDSA_SIG_set0( sig, r, s );    /* owned by the signature */
+#else
+        BN_copy( sig->r, r );
+        BN_copy( sig->s, s );
+        BN_free( r );
+        BN_free( s );
+#endif
+        sha256().hash( exchange, digest );
+        res = ECDSA_do_verify( digest, SHA256_DIGEST_LENGTH, sig, m_ec );
+
+        ECDSA_SIG_free( sig );
+        return (res == 1);
+    }
+};
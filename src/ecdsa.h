@@ -0,0 +1,65 @@
+#ifndef _ECDSA_H_
+#define _ECDSA_H_
+
+/* project includes */
+#include "CHostKey.h"
+
+/* C/C++ includes */
+#include <vector>
+
+#if defined(USE_OPENSSL)
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#endif
+
+/* defines */
+#define MAX_ECDSA_SIGNATURE_LENGTH  (256)
+
+namespace ssh
+{
+    /* ecdsa
+     * ECDSA implementation using the NIST P-256 curve (ecdsa-sha2-nistp256).
+     */
+    class ecdsa : public CHostKey
+    {
+    public:
+        ecdsa();
+        ~ecdsa();
+
+        const char * GetName() const {return "ecdsa-sha2-nistp256";}
+
+        /* loads the private key from a file */
+        bool LoadKeyPair(const char *);
+        /* generates a keypair */
+        bool GenerateKeyPair();
+        /* writes the private key to a file */
+        bool writePrivateKey(const char *);
+
+        /* Parses the keyblob sent by the server */
+        bool ParseKeyblob( const byte *, uint32 );
+        bool ParseKeyblob( CStream & stream );
+
+        /* Parses the signature blob sent by the server */
+        bool ParseSignature( const byte *, uint32 );
+        bool ParseSignature( CStream & stream );
+        /* writes the signature blob */
+        bool WriteSignature( CStream & stream, const std::vector<uint8_t> & );
+
+        /* Verifies that the parsed signature matches */
+        bool VerifyHost( const std::vector<byte> & exchange );
+        bool Sign( const std::vector<byte> &, std::vector<byte> & );
+        bool WritePublicKey( CStream & );
+        /* loads the keypair */
+        bool loadKeys(const ssh::CSettings &);
+
+    protected:
+        bool readPublicKey( CStream & );
+
+#if defined(USE_OPENSSL)
+        EC_KEY * m_ec;
+#endif
+        std::vector<byte> m_signature;
+    };
+};
+
+#endif
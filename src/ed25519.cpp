@@ -0,0 +1,300 @@
+/* ed25519.cpp
+ * Ed25519 implementation using the OpenSSL EVP interface
+ *
+ * Copyright (c) 2006-2009 Magnus Leksell, all rights reserved.
+ */
+
+/* project includes */
+#include "ed25519.h"
+#include "FileStream.h"
+#include "ArrayStream.h"
+
+/* C/C++ includes */
+#include <string>
+#include <assert.h>
+
+#define MAX_ED25519_KEYBLOB_LENGTH  (128)
+
+using namespace std;
+
+namespace ssh
+{
+#if defined(SSHD_HAVE_ED25519)
+    /* ed25519::ed25519
+     * Constructor.
+     */
+    ed25519::ed25519()
+    {
+        m_key = NULL;
+    }
+
+    /* ed25519::~ed25519
+     * Destructor.
+     */
+    ed25519::~ed25519()
+    {
+        if( m_key )
+            EVP_PKEY_free( m_key );
+    }
+
+    /* ed25519::loadKeys
+     * Loads the keys.
+     */
+    bool ed25519::loadKeys(const ssh::CSettings & settings)
+    {
+        string priv;
+        if( !settings.GetString(SSHD_SETTING_ED25519_PRIVATE_KEY_FILE, priv) )
+            return false;
+
+        return LoadKeyPair( priv.c_str() );
+    }
+
+    /* ed25519::LoadKeyPair
+     * Loads the 32 byte private seed, the public key is derived from it.
+     */
+    bool ed25519::LoadKeyPair(const char * priv)
+    {
+        string ident;
+        FileStream stream;
+        byte seed[ED25519_KEY_LENGTH];
+        uint32 length;
+
+        if( !stream.open( priv, FileStream::STREAM_MODE_READ ) )
+            return false;
+
+        if( !stream.readString( ident ) || (ident != "ed25519-priv") )
+            return false;
+
+        if( !stream.readInt32( length ) || (length != ED25519_KEY_LENGTH) ||
+            !stream.readBytes( seed, ED25519_KEY_LENGTH ) )
+        {
+            return false;
+        }
+
+        if( m_key )
+            EVP_PKEY_free( m_key );
+
+        m_key = EVP_PKEY_new_raw_private_key( EVP_PKEY_ED25519, NULL, seed, ED25519_KEY_LENGTH );
+        OPENSSL_cleanse( seed, sizeof(seed) );
+
+        return (m_key != NULL);
+    }
+
+    /* ed25519::GenerateKeyPair
+     * Generates a new keypair.
+     */
+    bool ed25519::GenerateKeyPair()
+    {
+        EVP_PKEY_CTX * ctx;
+        bool res;
+
+        if( m_key ) {
+            EVP_PKEY_free( m_key );
+            m_key = NULL;
+        }
+
+        if( !(ctx = EVP_PKEY_CTX_new_id( EVP_PKEY_ED25519, NULL )) )
+            return false;
+
+        res = (EVP_PKEY_keygen_init( ctx ) == 1) && (EVP_PKEY_keygen( ctx, &m_key ) == 1);
+
+        EVP_PKEY_CTX_free( ctx );
+        return res;
+    }
+
+    /* ed25519::writePrivateKey
+     * Writes the private seed to a file.
+     */
+    bool ed25519::writePrivateKey(const char * filename)
+    {
+        ssh::FileStream stream;
+        byte seed[ED25519_KEY_LENGTH];
+        size_t length = sizeof(seed);
+        bool res;
+
+        if( !m_key || (EVP_PKEY_get_raw_private_key( m_key, seed, &length ) != 1) )
+            return false;
+
+        res = stream.open( filename, FileStream::STREAM_MODE_WRITE ) &&
+              stream.writeString( "ed25519-priv" ) &&
+              stream.writeInt32( static_cast<uint32>(length) ) &&
+              stream.writeBytes( seed, static_cast<int>(length) );
+
+        OPENSSL_cleanse( seed, sizeof(seed) );
+        return res;
+    }
+
+    /* ed25519::WritePublicKey
+     * Writes the public key to the stream.
+     */
+    bool ed25519::WritePublicKey( CStream & stream )
+    {
+        byte pub[ED25519_KEY_LENGTH];
+        size_t length = sizeof(pub);
+
+        assert(m_key != NULL);
+
+        if( EVP_PKEY_get_raw_public_key( m_key, pub, &length ) != 1 )
+            return false;
+
+        if( !stream.writeString( GetName() ) ||
+            !stream.writeInt32( static_cast<uint32>(length) ) ||
+            !stream.writeBytes( pub, static_cast<int>(length) ) )
+        {
+            return false;
+        }
+        return true;
+    }
+
+    /* ed25519::readPublicKey
+     * Reads the public key following the identifier.
+     */
+    bool ed25519::readPublicKey( CStream & stream )
+    {
+        byte pub[ED25519_KEY_LENGTH];
+        uint32 length;
+
+        if( !stream.readInt32( length ) || (length != ED25519_KEY_LENGTH) ||
+            !stream.readBytes( pub, ED25519_KEY_LENGTH ) )
+        {
+            return false;
+        }
+
+        if( m_key )
+            EVP_PKEY_free( m_key );
+
+        m_key = EVP_PKEY_new_raw_public_key( EVP_PKEY_ED25519, NULL, pub, ED25519_KEY_LENGTH );
+        return (m_key != NULL);
+    }
+
+    /* ed25519::ParseKeyblob
+     * Parses the keyblob sent by the server.
+     */
+    bool ed25519::ParseKeyblob( const byte * src, uint32 length )
+    {
+        string ident;
+        ArrayStream stream( src, length );
+
+        if( !stream.readString( ident ) || (ident != GetName()) )
+            return false;
+
+        return readPublicKey( stream );
+    }
+
+    /* ed25519::ParseKeyblob
+     * Parses the keyblob sent by the server.
+     */
+    bool ed25519::ParseKeyblob( CStream & stream )
+    {
+        string ident;
+        uint32_t len;
+
+        if( !stream.readInt32(len) || (len == 0) || (len > MAX_ED25519_KEYBLOB_LENGTH) )
+            return false;
+
+        if( !stream.readString( ident ) || (ident != GetName()) )
+            return false;
+
+        return readPublicKey( stream );
+    }
+
+    /* ed25519::ParseSignature
+     * Parses the signature blob sent by the server.
+     */
+    bool ed25519::ParseSignature( CStream & stream )
+    {
+        string ident;
+        uint32_t len, sigLen;
+
+        if( !stream.readInt32(len) || (len == 0) || (len > MAX_ED25519_KEYBLOB_LENGTH) )
+            return false;
+
+        if( !stream.readString( ident ) || (ident != GetName()) )
+            return false;
+
+        if( !stream.readInt32(sigLen) || (sigLen != ED25519_SIGNATURE_LENGTH) )
+            return false;
+
+        return stream.readVector( m_signature, sigLen );
+    }
+
+    /* ed25519::ParseSignature
+     * Parses the signature blob sent by the server.
+     */
+    bool ed25519::ParseSignature( const byte * src, uint32 length )
+    {
+        string ident;
+        uint32 sigLen;
+        ArrayStream stream( src, length );
+
+        if( !stream.readString( ident ) || (ident != GetName()) )
+            return false;
+
+        if( !stream.readInt32(sigLen) || (sigLen != ED25519_SIGNATURE_LENGTH) )
+            return false;
+
+        return stream.readVector( m_signature, sigLen );
+    }
+
+    /* ed25519::WriteSignature
+     * Writes the signature blob.
+     */
+    bool ed25519::WriteSignature( ssh::CStream & stream, const std::vector<uint8_t> & sig )
+    {
+        size_t count = sizeof(uint32_t) + strlen( GetName() ) + sizeof(uint32_t) + sig.size();
+
+        if( !stream.writeInt32( static_cast<uint32_t>(count) ) ||
+            !stream.writeString( GetName() ) ||
+            !stream.writeInt32( static_cast<uint32_t>(sig.size()) ) ||
+            !stream.writeVector( sig ) )
+        {
+            return false;
+        }
+        return true;
+    }
+
+    /* ed25519::Sign
+     * Signs the exchange hash, Ed25519 hashes the message internally.
+     */
+    bool ed25519::Sign( const std::vector<byte> & src, std::vector<byte> & signature )
+    {
+        EVP_MD_CTX * ctx;
+        size_t length = ED25519_SIGNATURE_LENGTH;
+        bool res;
+
+        if( !m_key || src.empty() )
+            return false;
+
+        if( !(ctx = EVP_MD_CTX_new()) )
+            return false;
+
+        signature.resize( ED25519_SIGNATURE_LENGTH );
+        res = (EVP_DigestSignInit( ctx, NULL, NULL, NULL, m_key ) == 1) &&
+              (EVP_DigestSign( ctx, &signature[0], &length, &src[0], src.size() ) == 1);
+
+        EVP_MD_CTX_free( ctx );
+        return res;
+    }
+
+    /* ed25519::VerifyHost
+     * Verifies that the signature sent by the server matches the exchange hash.
+     */
+    bool ed25519::VerifyHost( const std::vector<byte> & exchange )
+    {
+        EVP_MD_CTX * ctx;
+        bool res;
+
+        if( !m_key || exchange.empty() || (m_signature.size() != ED25519_SIGNATURE_LENGTH) )
+            return false;
+
+        if( !(ctx = EVP_MD_CTX_new()) )
+            return false;
+
+        res = (EVP_DigestVerifyInit( ctx, NULL, NULL, NULL, m_key ) == 1) &&
+              (EVP_DigestVerify( ctx, &m_signature[0], m_signature.size(), &exchange[0], exchange.size() ) == 1);
+
+        EVP_MD_CTX_free( ctx );
+        return res;
+    }
+#endif
+};
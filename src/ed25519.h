@@ -0,0 +1,65 @@
+#ifndef _ED25519_H_
+#define _ED25519_H_
+
+/* project includes */
+#include "CHostKey.h"
+
+/* C/C++ includes */
+#include <vector>
+
+#if defined(SSHD_HAVE_ED25519)
+#include <openssl/evp.h>
+#endif
+
+/* defines */
+#define ED25519_KEY_LENGTH          (32)
+#define ED25519_SIGNATURE_LENGTH    (64)
+
+namespace ssh
+{
+    /* ed25519
+     * Ed25519 implementation (ssh-ed25519).
+     */
+    class ed25519 : public CHostKey
+    {
+    public:
+        ed25519();
+        ~ed25519();
+
+        const char * GetName() const {return "ssh-ed25519";}
+
+        /* loads the private key from a file */
+        bool LoadKeyPair(const char *);
+        /* generates a keypair */
+        bool GenerateKeyPair();
+        /* writes the private key to a file */
+        bool writePrivateKey(const char *);
+
+        /* Parses the keyblob sent by the server */
+        bool ParseKeyblob( const byte *, uint32 );
+        bool ParseKeyblob( CStream & stream );
+
+        /* Parses the signature blob sent by the server */
+        bool ParseSignature( const byte *, uint32 );
+        bool ParseSignature( CStream & stream );
+        /* writes the signature blob */
+        bool WriteSignature( CStream & stream, const std::vector<uint8_t> & );
+
+        /* Verifies that the parsed signature matches */
+        bool VerifyHost( const std::vector<byte> & exchange );
+        bool Sign( const std::vector<byte> &, std::vector<byte> & );
+        bool WritePublicKey( CStream & );
+        /* loads the keypair */
+        bool loadKeys(const ssh::CSettings &);
+
+    protected:
+        bool readPublicKey( CStream & );
+
+#if defined(SSHD_HAVE_ED25519)
+        EVP_PKEY * m_key;
+#endif
+        std::vector<byte> m_signature;
+    };
+};
+
+#endif
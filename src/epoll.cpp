@@ -0,0 +1,259 @@
+/* epoll.cpp
+ * The epoll backend of the reactor.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* project includes */
+#include "CReactor.h"
+
+#if defined(__linux__)
+
+/* C/C++ includes */
+#include <new>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define EPOLL_MAX_EVENTS            (256)
+
+namespace ssh
+{
+    /* CEpollBackend
+     * Edge triggered epoll, each stream is registered once for both directions and is read
+     * and written until the socket or the buffer runs out.
+     */
+    class CEpollBackend : public CReactorBackend
+    {
+    public:
+        CEpollBackend(CReactor * reactor) : m_reactor( reactor ), m_epoll( -1 ), m_event( -1 ) {}
+        ~CEpollBackend();
+
+        bool init();
+        const char * name() const   {return "epoll";}
+
+        bool add(CReactorStream *);
+        bool remove(CReactorStream *);
+        void service(CReactorStream *);
+        void run(int timeout);
+        void wake();
+
+    protected:
+        void doRead(CReactorStream *);
+        void doWrite(CReactorStream *);
+
+        CReactor *  m_reactor;
+        int         m_epoll,
+                    m_event;    /* eventfd that wakes epoll_wait */
+    };
+
+    /* CEpollBackend::~CEpollBackend
+     * Destructor.
+     */
+    CEpollBackend::~CEpollBackend()
+    {
+        if( m_epoll >= 0 )
+            close( m_epoll );
+        if( m_event >= 0 )
+            close( m_event );
+    }
+
+    /* CEpollBackend::init
+     * Creates the epoll instance and the wake event.
+     */
+    bool CEpollBackend::init()
+    {
+        struct epoll_event ev;
+
+        if( (m_epoll = epoll_create1( EPOLL_CLOEXEC )) < 0 )
+            return false;
+        if( (m_event = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC )) < 0 )
+            return false;
+
+        ev.events   = EPOLLIN;
+        ev.data.ptr = NULL;
+        return epoll_ctl( m_epoll, EPOLL_CTL_ADD, m_event, &ev ) == 0;
+    }
+
+    /* CEpollBackend::add
+     * Registers the socket, reading starts right away in case data has already arrived.
+     */
+    bool CEpollBackend::add(CReactorStream * stream)
+    {
+        struct epoll_event ev;
+
+        int flags = fcntl( stream->m_sock, F_GETFL, 0 );
+        if( flags < 0 || fcntl( stream->m_sock, F_SETFL, flags | O_NONBLOCK ) < 0 )
+            return false;
+
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = stream;
+        if( epoll_ctl( m_epoll, EPOLL_CTL_ADD, stream->m_sock, &ev ) != 0 )
+            return false;
+
+        stream->m_backend = this;
+        service( stream );
+        return true;
+    }
+
+    /* CEpollBackend::remove
+     * Unregisters the socket, there is nothing in flight.
+     */
+    bool CEpollBackend::remove(CReactorStream * stream)
+    {
+        epoll_ctl( m_epoll, EPOLL_CTL_DEL, stream->m_sock, NULL );
+        stream->m_backend = NULL;
+        return true;
+    }
+
+    /* CEpollBackend::service
+     * Reads into space freed by the connection and sends what it wrote.
+     */
+    void CEpollBackend::service(CReactorStream * stream)
+    {
+        doRead( stream );
+        doWrite( stream );
+    }
+
+    /* CEpollBackend::doRead
+     * Reads until the socket would block or the input is full. The free space is only
+     * written by the reactor, so the socket is read without holding the lock.
+     */
+    void CEpollBackend::doRead(CReactorStream * stream)
+    {
+        bool changed = false;
+
+        stream->lock();
+        while( !stream->m_closed )
+        {
+            uint32_t space = stream->m_in.contiguousSpace();
+            if( !space ) {
+                /* continued when the connection reads */
+                stream->m_readBlocked = true;
+                break;
+            }
+            byte * dst = stream->m_in.data + stream->m_in.tail();
+            stream->unlock();
+
+            ssize_t n = recv( stream->m_sock, dst, space, 0 );
+
+            stream->lock();
+            if( n > 0 ) {
+                stream->m_in.count += (uint32_t) n;
+                changed = true;
+            } else if( n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+                stream->m_closed = true;
+                changed = true;
+            } else if( errno != EINTR ) {
+                break;
+            }
+        }
+        if( changed )
+            stream->broadcast();
+        stream->unlock();
+    }
+
+    /* CEpollBackend::doWrite
+     * Sends until the socket would block or the output is empty, both parts of a wrapped
+     * buffer in one call.
+     */
+    void CEpollBackend::doWrite(CReactorStream * stream)
+    {
+        bool changed = false;
+
+        stream->lock();
+        while( !stream->m_closed && stream->m_out.count )
+        {
+            struct iovec iov[2];
+            struct msghdr msg = {};
+            uint32_t first = stream->m_out.contiguous();
+
+            iov[0].iov_base = stream->m_out.data + stream->m_out.head;
+            iov[0].iov_len  = first;
+            iov[1].iov_base = stream->m_out.data;
+            iov[1].iov_len  = stream->m_out.count - first;
+            msg.msg_iov     = iov;
+            msg.msg_iovlen  = iov[1].iov_len ? 2 : 1;
+            stream->unlock();
+
+            /* the connection only appends, the bytes being sent stay put */
+            ssize_t n = sendmsg( stream->m_sock, &msg, MSG_NOSIGNAL );
+
+            stream->lock();
+            if( n > 0 ) {
+                stream->m_out.head   = (stream->m_out.head + (uint32_t) n) % REACTOR_BUFFER_SIZE;
+                stream->m_out.count -= (uint32_t) n;
+                changed = true;
+            } else if( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+                stream->m_closed = true;
+                changed = true;
+            } else if( n == 0 || errno != EINTR ) {
+                break;      /* continued on EPOLLOUT */
+            }
+        }
+        if( changed )
+            stream->broadcast();
+        stream->unlock();
+    }
+
+    /* CEpollBackend::run
+     * Waits for the sockets, a wake only ends the wait.
+     */
+    void CEpollBackend::run(int timeout)
+    {
+        struct epoll_event events[EPOLL_MAX_EVENTS];
+
+        int n = epoll_wait( m_epoll, events, EPOLL_MAX_EVENTS, timeout );
+        for(int i = 0; i < n; i++)
+        {
+            CReactorStream * stream = (CReactorStream *) events[i].data.ptr;
+            if( !stream ) {
+                uint64_t value;
+                if( read( m_event, &value, sizeof(value) ) < 0 ) {
+                    /* already drained */
+                }
+                continue;
+            }
+
+            if( events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR) )
+                doRead( stream );
+            if( events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR) )
+                doWrite( stream );
+        }
+    }
+
+    /* CEpollBackend::wake
+     * Ends the current wait.
+     */
+    void CEpollBackend::wake()
+    {
+        uint64_t value = 1;
+        if( write( m_event, &value, sizeof(value) ) < 0 ) {
+            /* the counter is already set */
+        }
+    }
+
+    /* CreateEpollBackend
+     * Creates the backend, init is called by the reactor.
+     */
+    CReactorBackend * CreateEpollBackend(CReactor * reactor)
+    {
+        return new (std::nothrow) CEpollBackend( reactor );
+    }
+};
+
+#else
+
+namespace ssh
+{
+    CReactorBackend * CreateEpollBackend(CReactor *)
+    {
+        return NULL;
+    }
+};
+
+#endif
@@ -4,24 +4,21 @@
 #include "messages.h"
 #include "debug.h"
 #include "errors.h"
+#include "probes.h"
 
 using namespace std;
 
 namespace ssh
 {
     /* CTransport::exchangeProtocolVersions
-     * Exchanges the protocol version strings.
+     * Exchanges the protocol version strings. The local SSH_MSG_KEXINIT is sent together with
+     * the version string, so the keyexchange does not have to wait for another round trip.
      */
     int CTransport::exchangeProtocolVersions()
     {
-        ProtocolVersion remoteVersion;
-    
-        /* construct the local protocol string */
-        buildLocalVersionString();
-
-        /* first write the local protocol string */
-        if( !ds->writeLine(m_localVersion) ) {
-            sshd_Log(sshd_FATAL_ERROR, "Failed to write local protocol version.");
+        /* first write the local protocol string and the keyexchange packet */
+        if( sendVersionAndKex() != sshd_OK ) {
+            sshd_Log(sshd_EVENT_FATAL, "Failed to write local protocol version.");
             return sshd_ERROR;
         }
 
@@ -29,8 +26,8 @@ namespace ssh
            to the server.
          */
         if( isServer() ) {
-            if( !ds->readLine(m_remoteVersion) ) {
-                sshd_Log(sshd_FATAL_ERROR, "Failed to read remote protocol version.");
+            if( !readLine(m_remoteVersion) ) {
+                sshd_Log(sshd_EVENT_FATAL, "Failed to read remote protocol version.");
                 return sshd_ERROR;
             }
         } 
@@ -47,8 +44,8 @@ namespace ssh
             while( 1 )
             {
                 /* read a single line */
-                if( !ds->readLine(line) ) {
-                    sshd_Log(sshd_FATAL_ERROR, "Failed to read line.");
+                if( !readLine(line) ) {
+                    sshd_Log(sshd_EVENT_FATAL, "Failed to read line.");
                     return sshd_ERROR;
                 }
 
@@ -60,16 +57,30 @@ namespace ssh
                 }
 
                 if( (++count) > limitValue ) {/* prevent the server from spamming us */
-                    sshd_Log(sshd_FATAL_ERROR, "Server is spamming us!.");
+                    sshd_Log(sshd_EVENT_FATAL, "Server is spamming us!.");
                     return sshd_ERROR;      
                 }
             }
         }
 
+        return checkRemoteVersion();
+    }
+
+    /* CTransport::checkRemoteVersion
+     * Verifies the remote protocol version string once it has been read.
+     */
+    int CTransport::checkRemoteVersion()
+    {
+        ProtocolVersion remoteVersion;
+
+        /* drop the read-ahead buffer now unless the peer already sent packet data */
+        if( m_readAheadPos == m_readAheadCount )
+            releaseReadAhead();
+
         /* now parse the remote protocol version */
         if( !parseProtocolVersion(m_remoteVersion, &remoteVersion) )
         {
-            sshd_Log(sshd_FATAL_ERROR, "Failed to parse protocol string.");
+            sshd_Log(sshd_EVENT_FATAL, "Failed to parse protocol string.");
             return sshd_ERROR;
         }
 
@@ -83,6 +94,195 @@ namespace ssh
         return sshd_OK;
     }
 
+    /* CTransport::sendVersionAndKex
+     * Writes the local protocol version string immediately followed by the SSH_MSG_KEXINIT
+     * packet, both are sent in a single write.
+     */
+    int CTransport::sendVersionAndKex()
+    {
+        uint32_t length, queued;
+        bool res;
+
+        if( !buildLocalKex() )
+            return sshd_INTERNAL_ERROR;
+
+        /* guess the keyexchange and send the first keyexchange packet without waiting for
+           the remote SSH_MSG_KEXINIT */
+        if( (m_guessedKex = createGuessedKex()) != NULL )
+        {
+            m_localKex.follows = 1;
+            m_localKex.payload[m_localKex.payload.size() - KEXINIT_FOLLOWS_TRAILER] = 1;
+        }
+
+        const std::string & version = m_template->GetVersionString();
+        length = static_cast<uint32_t>(version.size()) + 2;
+
+        if( !newPacket() )
+            return sshd_INTERNAL_ERROR;
+        if( !writeVector(m_localKex.payload) )
+            return sshd_ERROR;
+
+        buildPacket();
+
+        if( sendState.dataSize + length > sendState.bufSize )
+            return sshd_ERROR;
+
+        /* move the packet and put the CR LF terminated version string in front of it */
+        memmove( sendState.pData + length, sendState.pData, sendState.dataSize );
+        memcpy( sendState.pData, version.c_str(), version.size() );
+        sendState.pData[length - 2] = 0x0D;
+        sendState.pData[length - 1] = 0x0A;
+        sendState.dataSize += length;
+
+        if( m_guessedKex )
+        {
+            /* build the guessed packet directly after the SSH_MSG_KEXINIT packet */
+            queued = sendState.dataSize;
+            sendState.pData     += queued;
+            sendState.pPayload  = sendState.pData + sizeof(ssh_hdr);
+            sendState.bufSize   -= queued;
+
+            res = m_guessedKex->ClientWriteInit();
+            if( res )
+                buildPacket();
+
+            sendState.pData     -= queued;
+            sendState.pPayload  = sendState.pData + sizeof(ssh_hdr);
+            sendState.bufSize   += queued;
+            sendState.dataSize  += queued;
+
+            if( !res )
+                return sshd_ERROR;
+        }
+
+        if( sendPacket() != sshd_OK )
+            return sshd_ERROR;
+
+        m_localKexSent = true;
+        SSHD_PROBE1(kexinit__sent, m_connectionId);
+        return sshd_OK;
+    }
+
+    /* CTransport::guessMatches
+     * Returns true if a guessed keyexchange is correct, that is if both sides prefer the same
+     * keyexchange and hostkey algorithms (RFC 4253 section 7).
+     */
+    bool CTransport::guessMatches(const std::string client[], const std::string server[]) const
+    {
+        const int guessed[] = {KEYEXCHANGE_METHOD, SERVER_HOSTKEY};
+
+        for(int i = 0; i < 2; i++) {
+            const std::string & c = client[guessed[i]], & s = server[guessed[i]];
+            size_t clen = c.find(','), slen = s.find(',');
+
+            if( clen == string::npos ) clen = c.length();
+            if( slen == string::npos ) slen = s.length();
+
+            if( clen != slen || c.compare(0, clen, s, 0, slen) != 0 )
+                return false;
+        }
+        return true;
+    }
+
+    /* CTransport::readLine
+     * Reads a CR LF terminated line. The socket is read in chunks and any data following the
+     * line is left in the read-ahead buffer. Fails once the handshake deadline has passed.
+     */
+    bool CTransport::readLine(std::string & line)
+    {
+        int res, count;
+
+        while( (res = takeLine( line )) == sshd_NO_PACKET )
+        {
+            /* wait in slices instead of blocking in the read, to notice the deadline */
+            if( m_deadline ) {
+                if( deadlinePassed() )
+                    return false;
+                if( !ds->dataAvailable( SSHD_DEADLINE_POLL_INTERVAL ) )
+                    continue;
+            }
+
+            res = ds->readBytes( m_readAhead + m_readAheadCount, SSHD_READ_AHEAD_SIZE - m_readAheadCount, &count );
+            if( res != sshd_OK )
+                return false;
+            m_readAheadCount += count;
+        }
+        return res == sshd_OK;
+    }
+
+    /* CTransport::readLineNonblock
+     * Reads a CR LF terminated line without waiting, sshd_NO_PACKET until all of it has
+     * arrived.
+     */
+    int CTransport::readLineNonblock(std::string & line)
+    {
+        int res, count;
+
+        while( (res = takeLine( line )) == sshd_NO_PACKET )
+        {
+            if( !ds->dataAvailable( 0 ) )
+                return sshd_NO_PACKET;
+
+            res = ds->readBytes( m_readAhead + m_readAheadCount, SSHD_READ_AHEAD_SIZE - m_readAheadCount, &count );
+            if( res != sshd_OK )
+                return res;
+            if( !count )
+                return sshd_NO_PACKET;
+            m_readAheadCount += count;
+        }
+        return res;
+    }
+
+    /* CTransport::takeLine
+     * Takes a complete line from the read-ahead buffer. Returns sshd_NO_PACKET, with room
+     * made at the end of the buffer, if more data has to be read first.
+     */
+    int CTransport::takeLine(std::string & line)
+    {
+        if( !m_readAhead && !(m_readAhead = new (std::nothrow) byte[SSHD_READ_AHEAD_SIZE]) )
+            return sshd_INTERNAL_ERROR;
+
+        /* look for a complete line in the buffered data */
+        for(uint32_t i = m_readAheadPos; i < m_readAheadCount; i++)
+        {
+            byte c = m_readAhead[i];
+            if( c == 0 || c > 127 ) /* illegal character */
+                return sshd_PROTOCOL_ERROR;
+
+            if( c == 0x0A ) {
+                /* the line feed must be preceded by a carriage return */
+                if( i == m_readAheadPos || m_readAhead[i - 1] != 0x0D )
+                    return sshd_PROTOCOL_ERROR;
+
+                line.assign( reinterpret_cast<const char *>(m_readAhead + m_readAheadPos), i - 1 - m_readAheadPos );
+                m_readAheadPos = i + 1;
+                return sshd_OK;
+            }
+        }
+
+        if( m_readAheadCount - m_readAheadPos >= SSHD_READ_AHEAD_SIZE )
+            return sshd_PROTOCOL_ERROR;     /* line too long */
+
+        /* move the partial line to the beginning of the buffer */
+        if( m_readAheadPos > 0 ) {
+            memmove( m_readAhead, m_readAhead + m_readAheadPos, m_readAheadCount - m_readAheadPos );
+            m_readAheadCount -= m_readAheadPos;
+            m_readAheadPos = 0;
+        }
+        return sshd_NO_PACKET;
+    }
+
+    /* CTransport::releaseReadAhead
+     * Frees the read-ahead buffer, it is only needed around the version exchange.
+     */
+    void CTransport::releaseReadAhead()
+    {
+        delete [] m_readAhead;
+        m_readAhead         = NULL;
+        m_readAheadPos      = 0;
+        m_readAheadCount    = 0;
+    }
+
     /* CTransport::parseProtocolVersion
      * Parses the protocol version string and extracts the version information.
      */
@@ -115,82 +315,6 @@ namespace ssh
         return true;
     }
 
-    /* CTransport::exchangeKeyExchanges
-     * Exchanges the keyexchange packets. This function both handles the initial keyexchange proces 
-     * and the two different cases which may occur when the connection has been established
-     */
-    int CTransport::exchangeKeyExchanges(const KeyExchangeInfo & local,
-            KeyExchangeInfo & remote,
-            bool bInitiator,
-            bool bInitial)
-    {
-        int res;
-        uint8_t type;
-
-        newPacket();
-        /* write the local keyexchange information */
-        if( !writeKex(local) ) {
-            return sshd_ERROR;
-        }
-        if( bInitial ) {
-            /*
-             * Initial keyexchange
-             */
-            res = exchangeAndExpect(SSH_MSG_KEXINIT);
-            if( !readKex( remote ) )
-                return sshd_PROTOCOL_ERROR;
-        } else {
-            /*
-             * Not the first keyexchange.
-             */
-            if( bInitiator ) {
-                /*  local side is the initiator , send the packet and wait until
-                    the remote side respons with a SSH_MSG_KEXINIT message */
-                res = sendPacket(4000);
-                if( res != sshd_OK )
-                    return sshd_ERROR;
-
-                /* maybe we should have a upper limit on how long we will wait? */
-                while( 1 ) {
-
-                    sshd_CheckAbortEvent()
-                    res = readPacketNonblock(100);
-                    if( res == sshd_OK )
-                    {
-                        /* a packet has been read */
-                        getPacketType( type );
-                        if( type == SSH_MSG_KEXINIT ) {
-                            /* parse the SSH_MSG_KEXINIT message */
-                            if( !readKex( remote ) )
-                                return sshd_PROTOCOL_ERROR;
-                            break;
-                        }
-                        /* handle packets */
-                        res = handlePacket();
-                        if( res != sshd_OK )
-                            return res;
-                    } 
-                    else if( res != sshd_PACKET_PENDING || res != sshd_NO_PACKET )
-                    {
-                        /* Error */
-                        return res;
-                    }
-                }
-            } else {
-                /* the local side is not the initiator and the remote kex should already be 
-                   read before calling this function */
-            }
-        }
-    
-        /* */
-        m_localKex.packetSize   = sendState.hdr.packetSize;
-        m_localKex.paddingSize  = sendState.hdr.padding;
-        m_remoteKex.packetSize  = readState.hdr.packetSize;
-        m_remoteKex.paddingSize = readState.hdr.padding;
-
-        return sshd_OK;
-    }
-
     /* CTransport::exchangeAndExpect
      * Sends the current packet in the output buffer and waits a for a reply 
      */
@@ -0,0 +1,744 @@
+/* io_uring.cpp
+ * The io_uring backend of the reactor.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+/* project includes */
+#include "CReactor.h"
+#include "CLogger.h"
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+
+/* C/C++ includes */
+#include <new>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <vector>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES               (256)           /* submission queue */
+#define URING_CQ_ENTRIES            (4096)          /* completion queue, multishot receives post many */
+#define URING_BUFFERS               (256)           /* provided receive buffers, a power of two */
+#define URING_BUFFER_SIZE           (16 * 1024)
+#define URING_BUFFER_GROUP          (0)
+#define URING_MAX_PARKED            (4)             /* received buffers a full stream may hold */
+#define URING_FIXED_BUFFERS         (4096)          /* registered output buffer slots */
+
+/* the operation is stored in the low bits of the user data, next to the stream pointer */
+#define URING_OP_WAKE               (0)
+#define URING_OP_RECV               (1)
+#define URING_OP_SEND               (2)
+#define URING_OP_CANCEL             (3)
+#define URING_OP_MASK               (3)
+
+namespace ssh
+{
+    /* the system calls, there is no wrapper in the C library */
+    static int uring_setup(unsigned entries, struct io_uring_params * p)
+    {
+        return (int) syscall( __NR_io_uring_setup, entries, p );
+    }
+
+    static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void * arg, size_t size)
+    {
+        return (int) syscall( __NR_io_uring_enter, fd, submit, wait, flags, arg, size );
+    }
+
+    static int uring_register(int fd, unsigned op, void * arg, unsigned count)
+    {
+        return (int) syscall( __NR_io_uring_register, fd, op, arg, count );
+    }
+
+    /* UringStream
+     * The state of a stream in the backend.
+     */
+    struct UringStream
+    {
+        /* part of a received buffer that did not fit in the input */
+        struct Parked {
+            uint16_t    bid;
+            uint32_t    offset,
+                        length;
+        };
+
+        CReactorStream *    stream;
+        int                 inflight;       /* operations that will still complete */
+        int                 sending;        /* send operations in flight */
+        int                 slot;           /* registered buffer of the output, or -1 */
+        bool                receiving;      /* a receive is armed */
+        bool                canceling;      /* the receive is being canceled */
+        bool                starved;        /* the receive ran out of buffers */
+        bool                removing;
+        std::deque<Parked>  parked;
+    };
+
+    /* CUringBackend
+     * Receives with a multishot recv per stream into a ring of provided buffers and sends
+     * each stream's output from a registered buffer, so the kernel neither maps user memory
+     * nor needs a new request per packet. All the requests queued while servicing the
+     * streams are submitted, and the completions reaped, by one io_uring_enter per turn of
+     * the reactor.
+     */
+    class CUringBackend : public CReactorBackend
+    {
+    public:
+        CUringBackend(CReactor * reactor);
+        ~CUringBackend();
+
+        bool init();
+        const char * name() const   {return "io_uring";}
+        bool raisesSigpipe() const  {return m_fixedWrites;}
+
+        bool add(CReactorStream *);
+        bool remove(CReactorStream *);
+        void service(CReactorStream *);
+        void run(int timeout);
+        void wake();
+
+    protected:
+        struct io_uring_sqe * getSqe();
+        void submit(unsigned wait, int timeout);
+
+        void armWake();
+        void armRecv(UringStream *);
+        void cancelRecv(UringStream *);
+        void sendMore(UringStream *);
+        void drainParked(UringStream *);
+        void deliver(UringStream *, uint16_t bid, uint32_t length);
+        void recycle(uint16_t bid);
+        void setClosed(UringStream *);
+
+        void complete(struct io_uring_cqe *);
+        void completeRecv(UringStream *, struct io_uring_cqe *);
+        void completeSend(UringStream *, struct io_uring_cqe *);
+
+        bool canReceive(UringStream * u) const {
+            return !u->receiving && !u->removing && !u->starved && u->parked.empty() && !u->stream->m_closed;
+        }
+
+        CReactor *              m_reactor;
+        int                     m_ring,
+                                m_event;
+        bool                    m_multishot;    /* cleared if the kernel rejects multishot recv */
+
+        /* the mapped rings */
+        void *                  m_sqMap,
+             *                  m_cqMap;
+        size_t                  m_sqSize,
+                                m_cqSize;
+        struct io_uring_sqe *   m_sqes;
+        unsigned *              m_sqHead,
+                 *              m_sqTail,
+                                m_sqMask,
+                                m_sqEntries,
+                                m_sqLocal;      /* tail including the unsubmitted entries */
+        unsigned *              m_cqHead,
+                 *              m_cqTail,
+                                m_cqMask;
+        struct io_uring_cqe *   m_cqes;
+
+        /* the provided receive buffers */
+        struct io_uring_buf_ring *  m_bufRing;
+        byte *                  m_buffers;
+        uint16_t                m_bufTail;
+        std::list<UringStream *>    m_starved;
+
+        /* the registered output buffers, empty if registration is not supported */
+        std::vector<int>        m_freeSlots;
+        bool                    m_fixedWrites;  /* the buffer table has been registered */
+
+        uint64_t                m_wakeValue;
+    };
+
+    /* CUringBackend::CUringBackend
+     * Constructor.
+     */
+    CUringBackend::CUringBackend(CReactor * reactor)
+    {
+        m_reactor   = reactor;
+        m_ring      = -1;
+        m_event     = -1;
+        m_multishot = true;
+        m_sqMap     = MAP_FAILED;
+        m_cqMap     = MAP_FAILED;
+        m_sqSize    = m_cqSize = 0;
+        m_sqes      = (struct io_uring_sqe *) MAP_FAILED;
+        m_sqLocal   = 0;
+        m_bufRing   = (struct io_uring_buf_ring *) MAP_FAILED;
+        m_buffers   = NULL;
+        m_bufTail   = 0;
+        m_fixedWrites = false;
+        m_wakeValue = 0;
+    }
+
+    /* CUringBackend::~CUringBackend
+     * Destructor, closing the ring ends what is still in flight.
+     */
+    CUringBackend::~CUringBackend()
+    {
+        if( m_ring >= 0 )
+            close( m_ring );
+        if( m_event >= 0 )
+            close( m_event );
+        if( m_sqes != MAP_FAILED )
+            munmap( m_sqes, URING_ENTRIES * sizeof(struct io_uring_sqe) );
+        if( m_sqMap != MAP_FAILED )
+            munmap( m_sqMap, m_sqSize );
+        if( m_cqMap != MAP_FAILED )
+            munmap( m_cqMap, m_cqSize );
+        if( m_bufRing != MAP_FAILED )
+            munmap( m_bufRing, URING_BUFFERS * sizeof(struct io_uring_buf) );
+        delete [] m_buffers;
+    }
+
+    /* CUringBackend::init
+     * Creates the ring and registers the buffers, fails if the kernel lacks a feature the
+     * backend needs, the reactor then uses epoll.
+     */
+    bool CUringBackend::init()
+    {
+        struct io_uring_params p;
+
+        memset( &p, 0, sizeof(p) );
+        p.flags         = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        p.cq_entries    = URING_CQ_ENTRIES;
+        if( (m_ring = uring_setup( URING_ENTRIES, &p )) < 0 ) {
+            /* kernels before 5.19 know neither of the optimizations */
+            memset( &p, 0, sizeof(p) );
+            p.flags         = IORING_SETUP_CQSIZE;
+            p.cq_entries    = URING_CQ_ENTRIES;
+            if( (m_ring = uring_setup( URING_ENTRIES, &p )) < 0 )
+                return false;
+        }
+        if( !(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP) )
+            return false;
+
+        /* map the rings */
+        m_sqSize    = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cqSize    = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        m_sqMap     = mmap( NULL, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQ_RING );
+        m_cqMap     = mmap( NULL, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_CQ_RING );
+        m_sqes      = (struct io_uring_sqe *) mmap( NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQES );
+        if( m_sqMap == MAP_FAILED || m_cqMap == MAP_FAILED || m_sqes == MAP_FAILED )
+            return false;
+
+        m_sqHead    = (unsigned *) ((byte *) m_sqMap + p.sq_off.head);
+        m_sqTail    = (unsigned *) ((byte *) m_sqMap + p.sq_off.tail);
+        m_sqMask    = *(unsigned *) ((byte *) m_sqMap + p.sq_off.ring_mask);
+        m_sqEntries = p.sq_entries;
+        m_sqLocal   = *m_sqTail;
+        m_cqHead    = (unsigned *) ((byte *) m_cqMap + p.cq_off.head);
+        m_cqTail    = (unsigned *) ((byte *) m_cqMap + p.cq_off.tail);
+        m_cqMask    = *(unsigned *) ((byte *) m_cqMap + p.cq_off.ring_mask);
+        m_cqes      = (struct io_uring_cqe *) ((byte *) m_cqMap + p.cq_off.cqes);
+
+        /* the entries are always used in order */
+        unsigned * array = (unsigned *) ((byte *) m_sqMap + p.sq_off.array);
+        for(unsigned i = 0; i < p.sq_entries; i++)
+            array[i] = i;
+
+        /* the provided buffers the receives pick from */
+        m_bufRing = (struct io_uring_buf_ring *) mmap( NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        m_buffers = new (std::nothrow) byte[URING_BUFFERS * URING_BUFFER_SIZE];
+        if( m_bufRing == MAP_FAILED || !m_buffers )
+            return false;
+
+        struct io_uring_buf_reg reg;
+        memset( &reg, 0, sizeof(reg) );
+        reg.ring_addr       = (uint64_t) (uintptr_t) m_bufRing;
+        reg.ring_entries    = URING_BUFFERS;
+        reg.bgid            = URING_BUFFER_GROUP;
+        if( uring_register( m_ring, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+            return false;
+
+        m_bufRing->tail = 0;
+        for(uint16_t bid = 0; bid < URING_BUFFERS; bid++)
+            recycle( bid );
+
+        /* a sparse table the output buffers are registered in as the streams are added,
+           the sends copy from user memory if it is not supported */
+        struct io_uring_rsrc_register rr;
+        memset( &rr, 0, sizeof(rr) );
+        rr.nr       = URING_FIXED_BUFFERS;
+        rr.flags    = IORING_RSRC_REGISTER_SPARSE;
+        if( uring_register( m_ring, IORING_REGISTER_BUFFERS2, &rr, sizeof(rr) ) == 0 ) {
+            m_fixedWrites = true;
+            m_freeSlots.reserve( URING_FIXED_BUFFERS );
+            for(int i = URING_FIXED_BUFFERS - 1; i >= 0; i--)
+                m_freeSlots.push_back( i );
+        }
+
+        if( (m_event = eventfd( 0, EFD_CLOEXEC )) < 0 )
+            return false;
+        armWake();
+        return true;
+    }
+
+    /* CUringBackend::getSqe
+     * Returns a cleared submission entry, submits the queued ones if the queue is full.
+     */
+    struct io_uring_sqe * CUringBackend::getSqe()
+    {
+        while( m_sqLocal - __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE ) >= m_sqEntries )
+            submit( 0, 0 );
+
+        struct io_uring_sqe * sqe = &m_sqes[m_sqLocal & m_sqMask];
+        memset( sqe, 0, sizeof(*sqe) );
+        m_sqLocal++;
+        return sqe;
+    }
+
+    /* CUringBackend::submit
+     * Submits the queued entries and waits for the given number of completions, or for
+     * timeout milliseconds.
+     */
+    void CUringBackend::submit(unsigned wait, int timeout)
+    {
+        unsigned pending = m_sqLocal - *m_sqTail;
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+
+        __atomic_store_n( m_sqTail, m_sqLocal, __ATOMIC_RELEASE );
+        if( !pending && !wait )
+            return;
+
+        memset( &arg, 0, sizeof(arg) );
+        ts.tv_sec       = timeout / 1000;
+        ts.tv_nsec      = (timeout % 1000) * 1000000L;
+        arg.sigmask_sz  = _NSIG / 8;
+        arg.ts          = (uint64_t) (uintptr_t) &ts;
+
+        int res = uring_enter( m_ring, pending, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg) );
+        if( res < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN )
+            sshd_Log(sshd_EVENT_WARNING, "io_uring_enter failed.");
+    }
+
+    /* CUringBackend::armWake
+     * Reads the wake event, the read completes when another thread calls wake.
+     */
+    void CUringBackend::armWake()
+    {
+        struct io_uring_sqe * sqe = getSqe();
+        sqe->opcode     = IORING_OP_READ;
+        sqe->fd         = m_event;
+        sqe->addr       = (uint64_t) (uintptr_t) &m_wakeValue;
+        sqe->len        = sizeof(m_wakeValue);
+        sqe->user_data  = URING_OP_WAKE;
+    }
+
+    /* CUringBackend::wake
+     * Completes the pending read of the wake event.
+     */
+    void CUringBackend::wake()
+    {
+        uint64_t value = 1;
+        if( write( m_event, &value, sizeof(value) ) < 0 ) {
+            /* the counter is already set */
+        }
+    }
+
+    /* CUringBackend::armRecv
+     * Starts receiving into the provided buffers, one request receives until it is
+     * canceled or the buffers run out.
+     */
+    void CUringBackend::armRecv(UringStream * u)
+    {
+        struct io_uring_sqe * sqe = getSqe();
+        sqe->opcode     = IORING_OP_RECV;
+        sqe->fd         = u->stream->m_sock;
+        sqe->flags      = IOSQE_BUFFER_SELECT;
+        sqe->buf_group  = URING_BUFFER_GROUP;
+        sqe->ioprio     = m_multishot ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data  = (uint64_t) (uintptr_t) u | URING_OP_RECV;
+
+        u->receiving = true;
+        u->inflight++;
+    }
+
+    /* CUringBackend::cancelRecv
+     * Stops the receive of a stream that holds too many buffers.
+     */
+    void CUringBackend::cancelRecv(UringStream * u)
+    {
+        if( !u->receiving || u->canceling )
+            return;
+
+        struct io_uring_sqe * sqe = getSqe();
+        sqe->opcode     = IORING_OP_ASYNC_CANCEL;
+        sqe->addr       = (uint64_t) (uintptr_t) u | URING_OP_RECV;
+        sqe->user_data  = (uint64_t) (uintptr_t) u | URING_OP_CANCEL;
+
+        u->canceling = true;
+        u->inflight++;
+    }
+
+    /* CUringBackend::add
+     * Registers the output buffer of the stream and starts receiving.
+     */
+    bool CUringBackend::add(CReactorStream * stream)
+    {
+        UringStream * u = new (std::nothrow) UringStream;
+        if( !u )
+            return false;
+
+        u->stream       = stream;
+        u->inflight     = 0;
+        u->sending      = 0;
+        u->slot         = -1;
+        u->receiving    = false;
+        u->canceling    = false;
+        u->starved      = false;
+        u->removing     = false;
+
+        if( !m_freeSlots.empty() )
+        {
+            struct iovec iov;
+            struct io_uring_rsrc_update2 up;
+
+            iov.iov_base    = stream->m_out.data;
+            iov.iov_len     = REACTOR_BUFFER_SIZE;
+            memset( &up, 0, sizeof(up) );
+            up.offset       = (uint32_t) m_freeSlots.back();
+            up.data         = (uint64_t) (uintptr_t) &iov;
+            up.nr           = 1;
+            if( uring_register( m_ring, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up) ) == 1 ) {
+                u->slot = m_freeSlots.back();
+                m_freeSlots.pop_back();
+            }
+        }
+
+        stream->m_backend = u;
+        armRecv( u );
+        sendMore( u );
+        return true;
+    }
+
+    /* CUringBackend::remove
+     * Cancels everything in flight for the socket, the stream is let go once all of it has
+     * completed.
+     */
+    bool CUringBackend::remove(CReactorStream * stream)
+    {
+        UringStream * u = (UringStream *) stream->m_backend;
+
+        if( !u->removing ) {
+            u->removing = true;
+            if( u->inflight > 0 ) {
+                struct io_uring_sqe * sqe = getSqe();
+                sqe->opcode         = IORING_OP_ASYNC_CANCEL;
+                sqe->fd             = stream->m_sock;
+                sqe->cancel_flags   = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+                sqe->user_data      = (uint64_t) (uintptr_t) u | URING_OP_CANCEL;
+                u->inflight++;
+            }
+        }
+        if( u->inflight > 0 )
+            return false;
+
+        if( u->slot >= 0 ) {
+            struct iovec iov;
+            struct io_uring_rsrc_update2 up;
+
+            memset( &iov, 0, sizeof(iov) );
+            memset( &up, 0, sizeof(up) );
+            up.offset   = (uint32_t) u->slot;
+            up.data     = (uint64_t) (uintptr_t) &iov;
+            up.nr       = 1;
+            if( uring_register( m_ring, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up) ) == 1 )
+                m_freeSlots.push_back( u->slot );
+        }
+
+        while( !u->parked.empty() ) {
+            recycle( u->parked.front().bid );
+            u->parked.pop_front();
+        }
+        m_starved.remove( u );
+
+        stream->m_backend = NULL;
+        delete u;
+        return true;
+    }
+
+    /* CUringBackend::service
+     * Moves parked input into space the connection freed and sends what it wrote.
+     */
+    void CUringBackend::service(CReactorStream * stream)
+    {
+        UringStream * u = (UringStream *) stream->m_backend;
+
+        drainParked( u );
+        if( canReceive( u ) )
+            armRecv( u );
+        sendMore( u );
+    }
+
+    /* CUringBackend::sendMore
+     * Sends the output unless a send is in flight, with a fixed write from the registered
+     * buffer when there is one. A wrapped buffer is sent as two linked requests, a short
+     * first write, or a short send thanks to MSG_WAITALL, breaks the link so the second
+     * part is never sent out of order.
+     */
+    void CUringBackend::sendMore(UringStream * u)
+    {
+        CReactorStream * stream = u->stream;
+        uint32_t head, first, count;
+
+        if( u->sending || u->removing )
+            return;
+
+        stream->lock();
+        head    = stream->m_out.head;
+        first   = stream->m_out.contiguous();
+        count   = stream->m_closed ? 0 : stream->m_out.count;
+        stream->unlock();
+
+        if( !count )
+            return;
+
+        uint32_t offsets[2] = {head, 0}, lengths[2] = {first, count - first};
+        int parts = lengths[1] ? 2 : 1;
+
+        for(int i = 0; i < parts; i++)
+        {
+            struct io_uring_sqe * sqe = getSqe();
+            sqe->fd         = stream->m_sock;
+            sqe->addr       = (uint64_t) (uintptr_t) (stream->m_out.data + offsets[i]);
+            sqe->len        = lengths[i];
+            sqe->user_data  = (uint64_t) (uintptr_t) u | URING_OP_SEND;
+            if( u->slot >= 0 ) {
+                sqe->opcode     = IORING_OP_WRITE_FIXED;
+                sqe->buf_index  = (uint16_t) u->slot;
+            } else {
+                sqe->opcode     = IORING_OP_SEND;
+                sqe->msg_flags  = MSG_NOSIGNAL | MSG_WAITALL;
+            }
+            if( i + 1 < parts )
+                sqe->flags  = IOSQE_IO_LINK;
+
+            u->sending++;
+            u->inflight++;
+        }
+    }
+
+    /* CUringBackend::recycle
+     * Gives a receive buffer back to the kernel and resumes the receives that ran out.
+     */
+    void CUringBackend::recycle(uint16_t bid)
+    {
+        /* not m_bufRing->bufs, C++ gives the empty struct in front of the array a size */
+        struct io_uring_buf * buf = (struct io_uring_buf *) m_bufRing + (m_bufTail & (URING_BUFFERS - 1));
+
+        buf->addr   = (uint64_t) (uintptr_t) (m_buffers + (size_t) bid * URING_BUFFER_SIZE);
+        buf->len    = URING_BUFFER_SIZE;
+        buf->bid    = bid;
+        m_bufTail++;
+        __atomic_store_n( &m_bufRing->tail, m_bufTail, __ATOMIC_RELEASE );
+
+        while( !m_starved.empty() ) {
+            UringStream * u = m_starved.front();
+            m_starved.pop_front();
+            u->starved = false;
+            if( canReceive( u ) )
+                armRecv( u );
+        }
+    }
+
+    /* CUringBackend::deliver
+     * Copies a received buffer into the input, the part that does not fit is parked until
+     * the connection reads.
+     */
+    void CUringBackend::deliver(UringStream * u, uint16_t bid, uint32_t length)
+    {
+        UringStream::Parked parked = {bid, 0, length};
+
+        u->parked.push_back( parked );
+        drainParked( u );
+
+        if( u->parked.size() >= URING_MAX_PARKED )
+            cancelRecv( u );
+    }
+
+    /* CUringBackend::drainParked
+     * Copies parked input, in order, while there is space.
+     */
+    void CUringBackend::drainParked(UringStream * u)
+    {
+        CReactorStream * stream = u->stream;
+        std::deque<uint16_t> done;
+
+        if( u->parked.empty() )
+            return;
+
+        stream->lock();
+        while( !u->parked.empty() )
+        {
+            UringStream::Parked & p = u->parked.front();
+            uint32_t n = stream->m_in.write( m_buffers + (size_t) p.bid * URING_BUFFER_SIZE + p.offset, p.length );
+            p.offset += n;
+            p.length -= n;
+            if( p.length ) {
+                stream->m_readBlocked = true;
+                break;
+            }
+            done.push_back( p.bid );
+            u->parked.pop_front();
+        }
+        stream->broadcast();
+        stream->unlock();
+
+        for(std::deque<uint16_t>::iterator it = done.begin(); it != done.end(); it++)
+            recycle( *it );
+    }
+
+    /* CUringBackend::setClosed
+     * Marks the connection as closed, the connection thread sees it on its next read.
+     */
+    void CUringBackend::setClosed(UringStream * u)
+    {
+        u->stream->lock();
+        u->stream->m_closed = true;
+        u->stream->broadcast();
+        u->stream->unlock();
+        cancelRecv( u );
+    }
+
+    /* CUringBackend::completeRecv
+     * Handles a received buffer, or the end of a receive.
+     */
+    void CUringBackend::completeRecv(UringStream * u, struct io_uring_cqe * cqe)
+    {
+        if( !(cqe->flags & IORING_CQE_F_MORE) ) {
+            u->receiving = false;
+            u->inflight--;
+        }
+
+        if( cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER) ) {
+            deliver( u, (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT), (uint32_t) cqe->res );
+        } else if( cqe->res == -ENOBUFS ) {
+            /* resumed once a buffer is recycled */
+            if( !u->starved && !u->removing ) {
+                u->starved = true;
+                m_starved.push_back( u );
+            }
+        } else if( cqe->res == -EINVAL && m_multishot ) {
+            /* a kernel without multishot receives, each receive is armed again */
+            m_multishot = false;
+        } else if( cqe->res != -ECANCELED && cqe->res != -EINTR && cqe->res != -EAGAIN ) {
+            setClosed( u );     /* the peer closed the connection, or an error */
+        }
+
+        if( !u->receiving ) {
+            u->canceling = false;
+            if( canReceive( u ) )
+                armRecv( u );
+        }
+    }
+
+    /* CUringBackend::completeSend
+     * Frees the sent output, the link of a wrapped buffer was canceled if the first part
+     * failed.
+     */
+    void CUringBackend::completeSend(UringStream * u, struct io_uring_cqe * cqe)
+    {
+        CReactorStream * stream = u->stream;
+
+        u->sending--;
+        u->inflight--;
+
+        if( cqe->res > 0 ) {
+            stream->lock();
+            stream->m_out.head   = (stream->m_out.head + (uint32_t) cqe->res) % REACTOR_BUFFER_SIZE;
+            stream->m_out.count -= (uint32_t) cqe->res;
+            stream->broadcast();
+            stream->unlock();
+        } else if( cqe->res < 0 && cqe->res != -ECANCELED ) {
+            setClosed( u );
+        }
+
+        if( !u->sending )
+            sendMore( u );
+    }
+
+    /* CUringBackend::complete
+     * Dispatches a completion on its operation.
+     */
+    void CUringBackend::complete(struct io_uring_cqe * cqe)
+    {
+        UringStream * u = (UringStream *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+
+        switch( cqe->user_data & URING_OP_MASK )
+        {
+        case URING_OP_WAKE:
+            armWake();
+            break;
+
+        case URING_OP_RECV:
+            completeRecv( u, cqe );
+            break;
+
+        case URING_OP_SEND:
+            completeSend( u, cqe );
+            break;
+
+        case URING_OP_CANCEL:
+            u->inflight--;
+            break;
+        }
+    }
+
+    /* CUringBackend::run
+     * Submits everything queued since the last turn and handles the completions, waiting
+     * for one if there are none.
+     */
+    void CUringBackend::run(int timeout)
+    {
+        bool ready = *m_cqHead != __atomic_load_n( m_cqTail, __ATOMIC_ACQUIRE );
+
+        submit( ready ? 0 : 1, timeout );
+
+        unsigned head = *m_cqHead;
+        while( head != __atomic_load_n( m_cqTail, __ATOMIC_ACQUIRE ) )
+        {
+            /* copied, handling it may queue requests that submit and reap */
+            struct io_uring_cqe cqe = m_cqes[head & m_cqMask];
+            head++;
+            __atomic_store_n( m_cqHead, head, __ATOMIC_RELEASE );
+            complete( &cqe );
+        }
+    }
+
+    /* CreateUringBackend
+     * Creates the backend, init is called by the reactor.
+     */
+    CReactorBackend * CreateUringBackend(CReactor * reactor)
+    {
+        return new (std::nothrow) CUringBackend( reactor );
+    }
+};
+
+#else
+
+namespace ssh
+{
+    CReactorBackend * CreateUringBackend(CReactor *)
+    {
+        return NULL;
+    }
+};
+
+#endif
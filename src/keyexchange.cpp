@@ -14,12 +14,432 @@
 #include "debug.h"
 #include "sshd.h"
 #include "CKeyExchange.h"
+#include "messages.h"
+#include "errors.h"
 #include "util.h"
+#include "CHistogram.h"
+#include "probes.h"
 
 using namespace std;
 
 namespace ssh
 {
+    /* CTransport::startKeyExchange
+     * Starts a keyexchange, the local SSH_MSG_KEXINIT is queued unless it has already been
+     * sent. Service data is held back until the local SSH_MSG_NEWKEYS has been sent.
+     */
+    int CTransport::startKeyExchange()
+    {
+        if( m_kexState != KEX_STATE_NONE )
+            return sshd_OK;     /* already in progress */
+
+        if( !m_localKexSent ) {
+            if( !buildLocalKex() )
+                return sshd_INTERNAL_ERROR;
+            m_kexOutput |= KEX_OUTPUT_KEXINIT;
+        }
+
+        m_kexState          = KEX_STATE_KEXINIT;
+        m_newkeysSent       = false;
+        m_newkeysReceived   = false;
+        m_discardGuess      = false;
+
+        m_kexStart          = GetMonotonicTime();
+        m_stats.counters.handshakesStarted++;
+        return sshd_OK;
+    }
+
+    /* CTransport::performKeyExchange
+     * Drives a keyexchange until it is complete. Used for the initial keyexchange where
+     * there is no other traffic to preserve.
+     */
+    int CTransport::performKeyExchange()
+    {
+        int res;
+        byte type;
+
+        if( (res = startKeyExchange()) != sshd_OK )
+            return res;
+
+        while( m_kexState != KEX_STATE_NONE )
+        {
+            sshd_CheckAbortEvent()
+            if( deadlinePassed() )
+                return sshd_CONNECTION_ABORTED;
+
+            /* output */
+            if( sendState.state == sshd_STATE_NO_PACKET ) {
+                if( (res = kexStep()) != sshd_OK )
+                    return res;
+            } else {
+                res = sendPacketNonblock(10);
+                if( (res != sshd_OK) && (res != sshd_PACKET_PENDING) )
+                    return res;
+            }
+
+            /* input */
+            res = readPacketNonblock(10);
+            if( res == sshd_OK )
+            {
+                getPacketType( type );
+                res = (isKexPacket( type ) ? kexHandlePacket() : handlePacket());
+                if( res != sshd_OK )
+                    return res;
+            }
+            else if( (res != sshd_NO_PACKET) && (res != sshd_PACKET_PENDING) ) {
+                return res;
+            }
+        }
+
+        /* make sure the SSH_MSG_NEWKEYS has been sent before anything else is written */
+        return flushPacket( 10000 );
+    }
+
+    /* CTransport::kexStep
+     * Writes the next pending keyexchange packet when the output buffer is free. Starts a
+     * keyexchange when one of the rekey limits has been reached.
+     */
+    int CTransport::kexStep()
+    {
+        int res;
+
+        if( sendState.state != sshd_STATE_NO_PACKET )
+            return sshd_OK;     /* wait until the current packet is sent */
+
+        if( m_kexState == KEX_STATE_NONE )
+        {
+            /* only rekey once the initial keyexchange is done */
+            if( m_sessionIdent.empty() || !rekeyNeeded() )
+                return sshd_OK;
+
+            sshd_Log(sshd_EVENT_NOTIFY, "Rekey limit reached, starting keyexchange.");
+            if( (res = startKeyExchange()) != sshd_OK )
+                return res;
+        }
+
+        if( !m_kexOutput )
+            return sshd_OK;
+
+        if( !newPacket() )
+            return sshd_INTERNAL_ERROR;
+        if( m_kexOutput & KEX_OUTPUT_KEXINIT )
+        {
+            if( !writeVector( m_localKex.payload ) )
+                return sshd_ERROR;
+            m_kexOutput &= ~KEX_OUTPUT_KEXINIT;
+            m_localKexSent = true;
+            SSHD_PROBE1(kexinit__sent, m_connectionId);
+        }
+        else if( m_kexOutput & KEX_OUTPUT_INIT )
+        {
+            if( !m_kex->ClientWriteInit() )
+                return sshd_ERROR;
+            m_kexOutput &= ~KEX_OUTPUT_INIT;
+        }
+        else if( m_kexOutput & KEX_OUTPUT_REPLY )
+        {
+            if( !m_kex->ServerWriteReply( m_kexHostKey ) )
+                return sshd_ERROR;
+            m_kexOutput &= ~KEX_OUTPUT_REPLY;
+        }
+        else if( m_kexOutput & KEX_OUTPUT_NEWKEYS )
+        {
+            if( !writeByte( SSH_MSG_NEWKEYS ) )
+                return sshd_ERROR;
+            m_kexOutput &= ~KEX_OUTPUT_NEWKEYS;
+
+            /* the SSH_MSG_NEWKEYS is encrypted with the old keys when the packet is built,
+               everything after it uses the new keys */
+            buildPacket();
+            TakeAlgorithmsInUse( m_newKeys, true );
+            m_stats.sendCipher = m_newSendCipher;
+            m_newkeysSent = true;
+            SSHD_PROBE1(newkeys__sent, m_connectionId);
+
+            if( m_newkeysReceived )
+                finishKeyExchange();
+        }
+
+        /* start sending, the main loop completes the packet */
+        res = sendPacketNonblock();
+        if( (res != sshd_OK) && (res != sshd_PACKET_PENDING) )
+            return res;
+        return sshd_OK;
+    }
+
+    /* CTransport::kexHandlePacket
+     * Handles a keyexchange packet in the input buffer.
+     */
+    int CTransport::kexHandlePacket()
+    {
+        byte type;
+        int res;
+
+        getPacketType( type );
+        switch( type )
+        {
+        case SSH_MSG_KEXINIT:
+            {
+                if( m_kexState == KEX_STATE_NONE ) {
+                    /* keyexchange initiated by the remote side */
+                    sshd_Log(sshd_EVENT_NOTIFY, "Keyexchange triggered by remote host.");
+                    if( (res = startKeyExchange()) != sshd_OK )
+                        return res;
+                }
+                else if( m_kexState != KEX_STATE_KEXINIT ) {
+                    return sshd_PROTOCOL_ERROR;
+                }
+
+                if( !parseRemoteKex( m_remoteKex ) )
+                    return sshd_PROTOCOL_ERROR;
+                SSHD_PROBE1(kexinit__received, m_connectionId);
+
+                return decideKeyExchange();
+            }
+        case SSH_MSG_NEWKEYS:
+            {
+                if( m_kexState != KEX_STATE_NEWKEYS || m_newkeysReceived )
+                    return sshd_PROTOCOL_ERROR;
+
+                /* all following packets use the new keys */
+                TakeAlgorithmsInUse( m_newKeys, false );
+                m_stats.readCipher = m_newReadCipher;
+                m_newkeysReceived = true;
+                SSHD_PROBE1(newkeys__received, m_connectionId);
+
+                if( m_newkeysSent )
+                    finishKeyExchange();
+                return sshd_OK;
+            }
+        default:
+            {
+                /* keyexchange method specific message */
+                if( m_kexState != KEX_STATE_EXCHANGE )
+                    return sshd_PROTOCOL_ERROR;
+
+                if( m_discardGuess ) {
+                    /* RFC 4253 section 7, a wrongly guessed packet is silently ignored */
+                    m_discardGuess = false;
+                    return sshd_OK;
+                }
+
+                if( isServer() ) {
+                    res = m_kex->ServerHandleInit( m_kexHostKey );
+                    m_kexOutput |= KEX_OUTPUT_REPLY;
+                } else {
+                    res = m_kex->ClientHandleReply( m_kexHostKey );
+                }
+                if( res != sshd_OK ) {
+                    sshd_Log(sshd_EVENT_FATAL, "Keyexchange failed.");
+                    return res;
+                }
+                return takeNewKeys();
+            }
+        }
+    }
+
+    /* CTransport::decideKeyExchange
+     * Called when both SSH_MSG_KEXINIT messages are known. Decides the algorithms and creates
+     * the keyexchange instance.
+     */
+    int CTransport::decideKeyExchange()
+    {
+        std::string matches[MAX_ALGORITHM_COUNT];
+        const std::string * local = m_template->GetAlgorithms();
+        bool guess = false;
+
+        /* the client's preferences decides */
+        if( !(isServer() ? DecideAlgorithms(m_remoteKex.algorithms, local, matches, MAX_ALGORITHM_COUNT)
+                         : DecideAlgorithms(local, m_remoteKex.algorithms, matches, MAX_ALGORITHM_COUNT)) )
+        {
+            sshd_Log(sshd_EVENT_FATAL, "Algorithm missmatch.");
+            return sshd_ERROR;
+        }
+
+        if( isServer() ) {
+            /* a wrongly guessed keyexchange packet is ignored */
+            m_discardGuess = m_remoteKex.follows && !guessMatches(m_remoteKex.algorithms, local);
+        }
+        else if( m_guessedKex ) {
+            /* use the guessed keyexchange if the guess was correct, otherwise the server
+               ignores the guessed packet */
+            if( guessMatches(local, m_remoteKex.algorithms) ) {
+                m_kex = m_guessedKex;
+                guess = true;
+            } else {
+                CKeyExchange::Destroy( m_guessedKex );
+            }
+            m_guessedKex = NULL;
+        }
+
+        if( !m_kex && !(m_kex = CKeyExchange::CreateInstance(matches[KEYEXCHANGE_METHOD], this)) ) {
+            sshd_Log(sshd_EVENT_FATAL, "Failed to instansiate algorithms.");
+            return sshd_INTERNAL_ERROR;
+        }
+
+        if( !(m_kexHostKey = acquireHostKey(matches[SERVER_HOSTKEY])) ) {
+            sshd_Log(sshd_EVENT_FATAL, "No hostkey available for the negotiated algorithm.");
+            return sshd_INTERNAL_ERROR;
+        }
+
+        if( createAlgorithmInstances(matches, m_newKeys) != sshd_OK )
+            return sshd_INTERNAL_ERROR;
+
+        /* the bytes are counted per cipher once the new keys are in use */
+        m_newReadCipher = m_stats.selectCipher( matches[isServer() ? ENCRYPTION_CLIENT_TO_SERVER : ENCRYPTION_SERVER_TO_CLIENT] );
+        m_newSendCipher = m_stats.selectCipher( matches[isServer() ? ENCRYPTION_SERVER_TO_CLIENT : ENCRYPTION_CLIENT_TO_SERVER] );
+
+        /* large packets are only negotiated in the first keyexchange, the peer may send them
+           once it has sent its SSH_MSG_NEWKEYS */
+        if( m_sessionIdent.empty() &&
+            offersExtension(local[KEYEXCHANGE_METHOD], LARGE_PACKETS_EXTENSION) &&
+            offersExtension(m_remoteKex.algorithms[KEYEXCHANGE_METHOD], LARGE_PACKETS_EXTENSION) )
+        {
+            m_largePackets      = true;
+            m_readPacketLimit   = SSHD_LARGE_PACKET_SIZE;
+        }
+
+        /* the client starts the keyexchange method unless its guess already did */
+        if( !isServer() && !guess )
+            m_kexOutput |= KEX_OUTPUT_INIT;
+
+        m_kexState = KEX_STATE_EXCHANGE;
+        return sshd_OK;
+    }
+
+    /* CTransport::takeNewKeys
+     * Derives the new keys from the completed keyexchange method and queues the
+     * SSH_MSG_NEWKEYS message.
+     */
+    int CTransport::takeNewKeys()
+    {
+        KeyVector keyvec;
+        int res;
+        uint64_t start = GetMonotonicTime();
+
+        m_exchangeHash = m_kex->GetExchangeHash();
+        if( m_sessionIdent.empty() ) {
+            /* the first exchange hash is also the session identifier */
+            m_sessionIdent = m_exchangeHash;
+        }
+
+        res = DeriveKeys(m_exchangeHash, m_sessionIdent, *m_kex->GetSharedSecret(), m_kex->GetHash(), keyvec);
+        if( res != sshd_OK ) {
+            sshd_Log(sshd_EVENT_FATAL, "Key derivation process failed.");
+            return res;
+        }
+
+        InitializeKeys( m_newKeys, keyvec );
+        memset( &keyvec, 0, sizeof(keyvec) );
+        CHistogram::Get( HISTOGRAM_NEWKEYS ).record( GetMonotonicTime() - start );
+
+        m_kexOutput |= KEX_OUTPUT_NEWKEYS;
+        m_kexState = KEX_STATE_NEWKEYS;
+        return sshd_OK;
+    }
+
+    /* CTransport::finishKeyExchange
+     * Both sides have taken the new keys into use.
+     */
+    void CTransport::finishKeyExchange()
+    {
+        resetKeyExchange();
+
+        /* both sides know about the large packets once the keyexchange is done */
+        if( m_largePackets )
+            m_sendPacketLimit = SSHD_LARGE_PACKET_SIZE;
+
+        sendState.bytes     = 0;
+        sendState.packets   = 0;
+        readState.bytes     = 0;
+        readState.packets   = 0;
+        m_kexTime           = GetMonotonicTime();
+
+        m_stats.counters.handshakesCompleted++;
+        m_stats.counters.handshakeTime += m_kexTime - m_kexStart;
+        CHistogram::Get( HISTOGRAM_KEYEXCHANGE ).record( m_kexTime - m_kexStart );
+    }
+
+    /* CTransport::resetKeyExchange
+     * Releases the resources held by the keyexchange.
+     */
+    void CTransport::resetKeyExchange()
+    {
+        CKeyExchange::Destroy( m_kex );
+        m_kex = NULL;
+
+        if( m_kexHostKey ) {
+            releaseHostKey( m_kexHostKey );
+            m_kexHostKey = NULL;
+        }
+
+        deleteAlgorithmInstances( m_newKeys );
+
+        /* wipe the keyexchange temporaries, m_guessedKex only exists before the first
+           SSH_MSG_KEXINIT has been handled */
+        if( !m_guessedKex )
+            m_kexArena.reset();
+
+        m_kexState      = KEX_STATE_NONE;
+        m_kexOutput     = 0;
+        m_localKexSent  = false;
+        m_discardGuess  = false;
+    }
+
+    /* CTransport::rekeyNeeded
+     * Returns true if any of the rekey limits has been reached.
+     */
+    bool CTransport::rekeyNeeded() const
+    {
+        if( m_rekeyBytes && (sendState.bytes + readState.bytes) >= m_rekeyBytes )
+            return true;
+        if( m_rekeyPackets && (sendState.packets >= m_rekeyPackets || readState.packets >= m_rekeyPackets) )
+            return true;
+        if( m_rekeyInterval && (GetMonotonicTime() - m_kexTime) >= m_rekeyInterval )
+            return true;
+        return false;
+    }
+
+    /* CTransport::deadlinePassed
+     * Returns true if the handshake has a deadline and it has passed.
+     */
+    bool CTransport::deadlinePassed() const
+    {
+        return m_deadline && GetMonotonicTime() >= m_deadline;
+    }
+
+    /* NextName
+     * Finds the next name in a comma separated name-list without copying it.
+     */
+    static bool NextName(const std::string & list, size_t & pos, size_t & start, size_t & length)
+    {
+        if( pos > list.length() )
+            return false;
+
+        size_t end = list.find(',', pos);
+        if( end == string::npos )
+            end = list.length();
+
+        start   = pos;
+        length  = end - pos;
+        pos     = end + 1;
+        return true;
+    }
+
+    /* CTransport::offersExtension
+     * Returns true if the name-list contains the extension name.
+     */
+    bool CTransport::offersExtension(const std::string & list, const char * name) const
+    {
+        size_t pos = 0, start, length;
+
+        while( NextName(list, pos, start, length) ) {
+            if( list.compare(start, length, name) == 0 )
+                return true;
+        }
+        return false;
+    }
+
     /* CTransport::DecideAlgorithms
      * Decides what algorithms to use.
      */
@@ -40,6 +460,7 @@ namespace ssh
 
     /* CTransport::DecideAlgorithm
      * Decides what algorithm to used based on the server's and the client's preferred algorithms.
+     * The name-lists are scanned in place, only the match is copied.
      */
     bool CTransport::DecideAlgorithm
         (
@@ -48,23 +469,23 @@ namespace ssh
         std::string & match             /* selected algorithm */
         ) const
     {
-        vector<string> cVec, sVec;
+        size_t cPos = 0, cStart, cLength;
 
-        /* Split the strings */
-        SplitString(client, cVec, ',');
-        SplitString(server, sVec, ',');
-        
         /*  Select the first algorithm on the client list that is also on 
             the servers list
         */
-        for(vector<string>::const_iterator cIt = cVec.begin(); cIt != cVec.end(); cIt++)
+        while( NextName(client, cPos, cStart, cLength) )
         {
-            for(vector<string>::const_iterator sIt = sVec.begin(); sIt != sVec.end(); sIt++)
+            if( client.compare(cStart, cLength, LARGE_PACKETS_EXTENSION) == 0 )
+                continue;   /* not a real algorithm */
+
+            size_t sPos = 0, sStart, sLength;
+            while( NextName(server, sPos, sStart, sLength) )
             {
-                /* compare the strings */
-                if( (*cIt) == (*sIt) ) {
+                /* compare the names */
+                if( cLength == sLength && client.compare(cStart, cLength, server, sStart, sLength) == 0 ) {
                     /* found a matching algorithm */
-                    match = *sIt;
+                    match.assign(client, cStart, cLength);
                     return true;
                 }
             }
@@ -22,7 +22,8 @@ namespace ssh
 {
 
     /* CTransport::DeriveKeys
-     * Derives the required keys.
+     * Derives the required keys. K || H is the same for all keys, it is hashed once and the
+     * digest state is copied for each key and each extension round.
      */
     int CTransport::DeriveKeys
         (
@@ -34,8 +35,19 @@ namespace ssh
         ) const
     {
         int res;
+
+        ssh::CHashStream prefix( hash ), work( hash );
+        if( !prefix || !work )
+            return sshd_ERROR;  /* failed to initialize hash instance */
+
+        if( !SharedSecret.write( prefix ) ||            /* write the shared secret */
+            !prefix.writeVector( ExchangeHash ) )       /* write the exchange hash */
+        {
+            return sshd_ERROR;
+        }
+
         for(int i = 0; i < MAX_KEYS; i++) {
-            if( (res = DeriveKey(ExchangeHash, SessionIdentifier, SharedSecret, hash, 'A' + i, Keys[i], MAX_KEY_LENGTH)) != sshd_OK ) {
+            if( (res = DeriveKey(prefix, work, SessionIdentifier, 'A' + i, Keys[i], MAX_KEY_LENGTH)) != sshd_OK ) {
                 return res;
             }
         }
@@ -43,29 +55,26 @@ namespace ssh
     }
 
     /* CTransport::DeriveKey
-     * Derives a single key.
+     * Derives a single key from the hashed K || H prefix.
      */
     int CTransport::DeriveKey
         (
-        const ByteVector & exchangeHash,        /* Exchange hash */
+        const CHashStream & prefix,             /* hash state after K || H */
+        CHashStream & stream,                   /* work stream using the same hash */
         const ByteVector & sessionIdentifier,   /* Session identifier */
-        const CBigInt & sharedSecret,           /* The shared secret */
-        const char * hash,                      /* name of hash method */
         char unique,                            /* unique character for this key */
         KeyElement & key,                       /* Key to derive */
-        uint32_t length                             /* length of key do derive */
+        uint32_t length                         /* length of key do derive */
         ) const
     {
-        byte buf[64 + 64];
+        byte buf[MAX_KEY_LENGTH + MAX_DIGEST_LENGTH];
         unsigned int dlen, count = 0;
 
-        /* derive a single key */
-        ssh::CHashStream stream( hash );
-        if( !hash )
-            return sshd_ERROR;  /* failed to initialize hash instance */
+        if( length > MAX_KEY_LENGTH )
+            return sshd_ERROR;
 
-        if (!sharedSecret.write( stream ) ||        /* write the shared secret */
-            !stream.writeVector( exchangeHash ) ||      /* write exchange hash */
+        /* K1 = HASH(K || H || X || session_id) */
+        if( !stream.copy( prefix ) ||
             !stream.writeByte( unique ) ||              /* write the unique character */
             !stream.writeVector( sessionIdentifier) )   /* write the session identifier */
         {
@@ -75,20 +84,21 @@ namespace ssh
         stream.finalize( buf, &dlen );
         count += dlen;
 
+        /* Kn = HASH(K || H || K1 || ... || Kn-1) */
         while( count < length )
         {
-            stream.reset();
-            if( !sharedSecret.write( stream ) ||
-                !stream.writeVector( exchangeHash ) ||
+            if( !stream.copy( prefix ) ||
                 !stream.writeBytes( buf, count ) )
             {
+                memset( buf, 0, sizeof(buf) );
                 return sshd_ERROR;
             }
             stream.finalize( buf + count, &dlen );
             count += dlen;
         }
         /* copy the derived key */
-        memcpy( key.key, buf, 32);
+        memcpy( key.key, buf, length );
+        memset( buf, 0, sizeof(buf) );
         return sshd_OK;
     }
 
@@ -125,52 +135,20 @@ namespace ssh
 
 cleanup:
 
-        delete block.enc_client_to_server;
-        delete block.enc_server_to_client;
-        delete block.hmac_client_to_server;
-        delete block.hmac_server_to_client;
-
+        deleteAlgorithmInstances( block );
         return sshd_ERROR;
     }
 
-    /* CTransport::TakeKeysIntoUse
-     * Initializes the algorithms with the keys.
+    /* CTransport::deleteAlgorithmInstances
+     * Deletes the algorithm instances in the block.
      */
-    int CTransport::TakeKeysIntoUse(const KeyVector & vec, const string algorithms[MAX_ALGORITHM_COUNT])
+    void CTransport::deleteAlgorithmInstances( SecurityBlock & block )
     {
-        int res;
-        SecurityBlock block;
-
-        res = createAlgorithmInstances( algorithms, block );
-        if( res != sshd_OK ) {
-            goto cleanup;
-        }
-
-        /* initialize the keys */
-        InitializeKeys( block, vec );
-
-        /* send a SSH_MSG_NEWKEYS message before using the new algorithms/keys */
-        newPacket();
-        if( !writeByte(SSH_MSG_NEWKEYS) )
-            goto cleanup;
-
-        if( exchangeAndExpect( SSH_MSG_NEWKEYS ) != sshd_OK )
-            goto cleanup;
-
-        /* take the algorithms/keys into use */
-        res = TakeAlgorithmsInUse( block );
-        if( res != sshd_OK )
-            goto cleanup;
-
-        return sshd_OK;
-
-cleanup:
-    
         delete block.enc_client_to_server;
         delete block.enc_server_to_client;
         delete block.hmac_client_to_server;
         delete block.hmac_server_to_client;
 
-        return sshd_ERROR;
+        memset(&block, 0, sizeof(SecurityBlock));
     }
 };
\ No newline at end of file
@@ -21,10 +21,10 @@ namespace ssh
      */
     bool CTransport::writeBytes(const byte * src, int count)
     {
-        if( sendState.state != sshd_STATE_NO_PACKET ) { /* incorrect state */
+        if( sendState.state != sshd_STATE_NO_PACKET || !sendState.pData ) { /* incorrect state */
             return false;
         }
-        if( (m_writePos + count) > 32000 ) { /* packet to large */
+        if( (m_writePos + count) > getMaxPayload() ) { /* packet to large */
             return false;
         }
     
@@ -72,12 +72,13 @@ namespace ssh
     }
 
     /* CTransport::newPacket
-     *
+     * Starts a new packet in the output buffer, fails if no buffer could be borrowed.
      */
-    void CTransport::newPacket()
+    bool CTransport::newPacket()
     {
         sendState.state = sshd_STATE_NO_PACKET;
         m_writePos = 0;
+        return acquireSendBuffer();
     }
 
 };
\ No newline at end of file
@@ -0,0 +1,56 @@
+/* probes.h
+ * Static tracepoints.
+ *
+ * Copyright (c) 2009 Magnus Leksell, all rights reserved.
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * When built with SSHD_HAVE_SDT the probes are USDT tracepoints of the provider lwssh, a
+ * probe is a single nop until a tracer attaches to it, e.g.
+ *
+ *      bpftrace -e 'usdt:./sshd:lwssh:packet__read__done { @[arg1] = count(); }'
+ *
+ * Without it the probes and their arguments expand to nothing. With it the arguments are
+ * evaluated even when no tracer is attached and must be cheap. The connection identifier
+ * is always the first argument.
+ *
+ * Probes:
+ *      connection__accept      (connection)
+ *      connection__close       (connection)
+ *      packet__read__start     (connection)
+ *      packet__read__done      (connection, message type, payload size, sequence number)
+ *      mac__failure            (connection, sequence number)
+ *      packet__send__start     (connection, message type, payload size)
+ *      packet__send__done      (connection, bytes)
+ *      kexinit__sent           (connection)
+ *      kexinit__received       (connection)
+ *      newkeys__sent           (connection)
+ *      newkeys__received       (connection)
+ *      dh__compute             (connection, nanoseconds, secret size)
+ *      dh__sign                (connection, nanoseconds, result)
+ *      auth__attempt           (connection, message type)
+ *      auth__result            (connection, authenticated)
+ */
+
+#if defined(SSHD_HAVE_SDT) && !defined(WIN32) && !defined(_WIN32)
+
+#include <sys/sdt.h>
+
+#define SSHD_PROBE1(name, a)                DTRACE_PROBE1(lwssh, name, a)
+#define SSHD_PROBE2(name, a, b)             DTRACE_PROBE2(lwssh, name, a, b)
+#define SSHD_PROBE3(name, a, b, c)          DTRACE_PROBE3(lwssh, name, a, b, c)
+#define SSHD_PROBE4(name, a, b, c, d)       DTRACE_PROBE4(lwssh, name, a, b, c, d)
+
+#else
+
+#define SSHD_PROBE1(name, a)                do{} while(0)
+#define SSHD_PROBE2(name, a, b)             do{} while(0)
+#define SSHD_PROBE3(name, a, b, c)          do{} while(0)
+#define SSHD_PROBE4(name, a, b, c, d)       do{} while(0)
+
+#endif
+
+#endif
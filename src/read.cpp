@@ -10,13 +10,15 @@
 #include "messages.h"
 #include "errors.h"
 #include "sshd.h"
+#include "util.h"
+#include "CHistogram.h"
+#include "probes.h"
 
 #include <assert.h>
 #include <cstdio>
 
 #define MAX_DIGEST_SIZE (64)
 #define SSHD_MIN_PACKET_SIZE (8)
-#define SSHD_MAX_PACKET_SIZE (32000)
 
 namespace ssh
 {
@@ -46,8 +48,12 @@ namespace ssh
 
         //ssh_hdr * pHdr = (ssh_hdr *) readState.pData;
 
+        /* the previous packet has been handled, give its buffer back */
+        if( readState.state == sshd_STATE_NO_PACKET && readState.pData != m_readScratch )
+            releaseReadBuffer();
+
         /* check if any data is available */
-        if( !ds->dataAvailable( timeout ) )
+        if( !recvAvailable( timeout ) )
         {
             if( readState.state == sshd_STATE_NO_PACKET )
                 return sshd_NO_PACKET;
@@ -64,6 +70,7 @@ namespace ssh
             readState.pHdr      = (ssh_hdr *) readState.pData;
 
             m_readPos = 0;
+            SSHD_PROBE1(packet__read__start, m_connectionId);
         }
 
         if( readState.state == sshd_STATE_FIRST_BLOCK )
@@ -72,8 +79,9 @@ namespace ssh
             if( readState.count < readState.blockSize )
             {
                 /* havent read the first block yet */
-                res = ds->readBytes( readState.pData + readState.count, readState.blockSize - readState.count, &count);
+                res = recvBytes( readState.pData + readState.count, readState.blockSize - readState.count, &count);
                 if( res != sshd_OK ) {
+                    m_stats.countError( STATS_ERROR_NETWORK );
                     return res;
                 }
                 readState.count += count;
@@ -92,16 +100,18 @@ namespace ssh
                 readState.hdr.padding       = readState.pHdr->padding;
 
                 if( readState.hdr.packetSize < SSHD_MIN_PACKET_SIZE ||
-                    readState.hdr.packetSize > SSHD_MAX_PACKET_SIZE )
+                    readState.hdr.packetSize > m_readPacketLimit )
                 {
                     /* May be a decryption problem */
                     sshd_Log(sshd_EVENT_FATAL, "Invalid packet size, possibly a decryption error.");
+                    m_stats.countError( STATS_ERROR_PROTOCOL );
                     return sshd_PROTOCOL_ERROR;
                 }
 
                 if( readState.hdr.padding < 4 )
                 {
                     sshd_Log(sshd_EVENT_FATAL, "Invalid amount of padding in received packet.");
+                    m_stats.countError( STATS_ERROR_PROTOCOL );
                     return sshd_PROTOCOL_ERROR;
                 }
         
@@ -109,11 +119,18 @@ namespace ssh
                 readState.dataSize = readState.hdr.packetSize + sizeof(uint32_t);
                 if( readState.dataSize % readState.blockSize ) {
                     sshd_Log(sshd_EVENT_FATAL, "Packet size not a multiple of the block size.");
+                    m_stats.countError( STATS_ERROR_PROTOCOL );
                     return sshd_PROTOCOL_ERROR;
                 }
 
                 if( readState.hmac )
                     readState.dataSize += readState.hmac->GetDigestLength();
+
+                /* the first block is in the scratch area, borrow a buffer for the packet */
+                if( !acquireReadBuffer( readState.dataSize ) ) {
+                    m_stats.countError( STATS_ERROR_INTERNAL );
+                    return sshd_INTERNAL_ERROR;
+                }
     
                 /* set pointers */
                 readState.pPayload  = (readState.pData + sizeof(ssh_hdr));                          
@@ -132,9 +149,11 @@ namespace ssh
             int actual;
             uint8_t * dst = readState.pData + readState.count;
             /* read the data */
-            res = ds->readBytes(dst, readState.dataSize - readState.count, &actual);
-            if( res != sshd_OK )
+            res = recvBytes(dst, readState.dataSize - readState.count, &actual);
+            if( res != sshd_OK ) {
+                m_stats.countError( STATS_ERROR_NETWORK );
                 return sshd_ERROR;
+            }
 
             readState.count += actual;
             if( readState.count == readState.dataSize ) {
@@ -149,6 +168,7 @@ namespace ssh
             /* get the sequence number */
             uint32_t seq = readState.seq.update();
             seq = __htonl32( seq ); 
+            uint64_t start = (readState.cipher || readState.hmac) ? GetMonotonicTime() : 0;
 
             /* decrypt the rest of the packet if required */
             if( readState.cipher )
@@ -179,12 +199,24 @@ namespace ssh
                 if( memcmp( digest, readState.pMac, diglen ) != 0 )
                 {
                     sshd_Log(sshd_EVENT_FATAL, "HMAC missmatch.");
+                    m_stats.countError( STATS_ERROR_MAC );
+                    SSHD_PROBE2(mac__failure, m_connectionId, __ntohl32( seq ));
                     return sshd_ERROR;
                 }
             }
+            if( start ) {
+                uint64_t elapsed = GetMonotonicTime() - start;
+                m_stats.counters.cryptoTime += elapsed;
+                CHistogram::Get( HISTOGRAM_PACKET_OPEN ).record( elapsed );
+            }
             
             readState.state = sshd_STATE_NO_PACKET;
+            readState.bytes += readState.dataSize;
+            readState.packets++;
+            m_stats.countRead( readState.dataSize );
+
             type = readState.pPayload[0];
+            SSHD_PROBE4(packet__read__done, m_connectionId, type, readState.payloadSize, __ntohl32( seq ));
             if( type == SSH_MSG_IGNORE || type == SSH_MSG_DEBUG ) {
                 /* no need to propagate these messages */
                 return sshd_NO_PACKET;
@@ -195,4 +227,38 @@ namespace ssh
         sshd_Log(sshd_EVENT_FATAL, "Unexpected state encountered.");
         return sshd_ERROR;
     }
+
+    /* CTransport::recvAvailable
+     * Returns true if data is available, either left over from the version exchange or on
+     * the socket.
+     */
+    bool CTransport::recvAvailable(int timeout)
+    {
+        if( m_readAheadPos < m_readAheadCount )
+            return true;
+        return ds->dataAvailable( timeout );
+    }
+
+    /* CTransport::recvBytes
+     * Reads up to count bytes, any data left over from the version exchange is returned
+     * before the socket is read.
+     */
+    int CTransport::recvBytes(byte * dst, int count, int * rcount)
+    {
+        if( m_readAheadPos < m_readAheadCount )
+        {
+            uint32_t n = m_readAheadCount - m_readAheadPos;
+            if( n > static_cast<uint32_t>(count) )
+                n = count;
+
+            memcpy( dst, m_readAhead + m_readAheadPos, n );
+            m_readAheadPos += n;
+            *rcount = n;
+
+            if( m_readAheadPos == m_readAheadCount )
+                releaseReadAhead();     /* the version exchange data is consumed */
+            return sshd_OK;
+        }
+        return ds->readBytes( dst, count, rcount );
+    }
 };
\ No newline at end of file
@@ -169,30 +169,6 @@ namespace ssh
         return true;
     }
 
-    /*
-     * Writes a keyblob containing the public RSA key
-     */
-    bool rsa::WriteKeyblob(ssh::CStream & stream)
-    {
-        unsigned char src[4096];
-        ssh::ArrayWriteStream as( src, 4096 );
-        if( !as.writeString( "ssh-rsa" ) ||     /* write identifier */
-            !as.writeBigInt( m_rsa->e ) ||      /* write public key */
-            !as.writeBigInt( m_rsa->n ) )
-        {
-            return false;
-        }
-        uint32_t length = as.GetUsage();
-        /* packet begins with the blob length */
-        if( !stream.writeInt32( length ) ||
-            !stream.writeBytes( src, length ) )
-        {
-            return false;
-        }
-    
-        return true;
-    }
-
     /* 
      * rsa::ParseKeyblob
      * Parses the signature blob sent by the server
@@ -27,6 +27,8 @@ namespace ssh
         rsa();
         ~rsa();
 
+        const char * GetName() const {return "ssh-rsa";}
+
         /* loads a keypair from a file */
         bool LoadKeyPair(const char *, const char *);
         bool LoadKeyPair(const std::string &, const std::string &);
@@ -38,9 +40,6 @@ namespace ssh
         bool writePublicKey(const char *);
         /* writes the private key to a file */
         bool writePrivateKey(const char *);
-        /* writes a keyblob to the stream */
-        bool WriteKeyblob( CStream & stream );
-
         /* Parses the keyblob sent by the server */
         bool ParseKeyblob( const byte *, uint32 );
         bool ParseKeyblob(CStream & stream);
@@ -8,6 +8,9 @@
 #include "debug.h"
 #include "swap.h"
 #include "errors.h"
+#include "util.h"
+#include "CHistogram.h"
+#include "probes.h"
 #include <assert.h>
 
 namespace ssh
@@ -30,19 +33,16 @@ namespace ssh
      */
     int CTransport::sendPacketNonblock(int timeout)
     {
-        /* sequence number */
-        uint32 seq;
         int res, wcount;
+        if( !sendState.pData )
+            return sshd_ERROR;      /* nothing written, no buffer borrowed */
+
         if( sendState.state == sshd_STATE_NO_PACKET )
         {
             /*
              * Not currently sending anything.
              */
-            initSendState( seq );       /* initialize the send state */
-            sendCalcDigest( sendState.pData, sendState.dataSize, seq, sendState.pMac);
-            sendEncryptData();          /* encrypt data */
-
-            sendState.state = sshd_STATE_SENDING_PACKET;
+            buildPacket();
         }
      
         if( sendState.state == sshd_STATE_SENDING_PACKET )
@@ -55,6 +55,7 @@ namespace ssh
                 /* write the actual data */
                 res = ds->writeBytes(sendState.pData + sendState.count, sendState.dataSize - sendState.count, &wcount);
                 if( res != sshd_OK ) {
+                    m_stats.countError( STATS_ERROR_NETWORK );
                     return sshd_ERROR;
                 }
                 else
@@ -64,6 +65,8 @@ namespace ssh
                     {
                         /* entire packet has been sent */
                         sendState.state = sshd_STATE_NO_PACKET;
+                        SSHD_PROBE2(packet__send__done, m_connectionId, sendState.dataSize);
+                        releaseSendBuffer();
                         return sshd_OK;
                     } else {
                         return sshd_PACKET_PENDING;
@@ -78,6 +81,35 @@ namespace ssh
     }
 
 
+    /* CTransport::buildPacket
+     * Adds the header, padding and digest to the payload in the output buffer and encrypts
+     * the packet. The packet is then ready to be sent.
+     */
+    void CTransport::buildPacket()
+    {
+        uint32 seq;
+        uint64_t start;
+
+        initSendState( seq );       /* initialize the send state */
+        SSHD_PROBE3(packet__send__start, m_connectionId, sendState.pPayload[0], sendState.payloadSize);
+
+        start = (sendState.cipher || sendState.hmac) ? GetMonotonicTime() : 0;
+        sendCalcDigest( sendState.pData, sendState.dataSize, seq, sendState.pMac);
+        sendEncryptData();          /* encrypt data */
+        if( start ) {
+            uint64_t elapsed = GetMonotonicTime() - start;
+            m_stats.counters.cryptoTime += elapsed;
+            CHistogram::Get( HISTOGRAM_PACKET_SEAL ).record( elapsed );
+        }
+
+        /* counted towards the rekey limits */
+        sendState.bytes += sendState.dataSize;
+        sendState.packets++;
+        m_stats.countSend( sendState.dataSize );
+
+        sendState.state = sshd_STATE_SENDING_PACKET;
+    }
+
     /* CTransport::initSendState
      * Prepare the transport layer to send
      */
@@ -15,6 +15,7 @@ namespace ssh
         }
 
         T update() {return val++;}
+        T value() const {return val;}
     protected:
         T val;
     };
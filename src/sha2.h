@@ -0,0 +1,34 @@
+#ifndef _SHA2_H_
+#define _SHA2_H_
+
+/* project includes */
+#include "CHash.h"
+
+namespace ssh
+{
+    /* sha256
+     * SHA-256 implementation
+     */
+    class sha256 : public CHash
+    {
+    public:
+#if defined(USE_OPENSSL)
+        sha256() : CHash(EVP_sha256()) {
+        }
+#endif
+    };
+
+    /* sha512
+     * SHA-512 implementation
+     */
+    class sha512 : public CHash
+    {
+    public:
+#if defined(USE_OPENSSL)
+        sha512() : CHash(EVP_sha512()) {
+        }
+#endif
+    };
+};
+
+#endif
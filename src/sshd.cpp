@@ -7,7 +7,21 @@
 #include "sshd.h"
 #include <boost\shared_ptr.hpp>
 #include "errors.h"
+#include "probes.h"
+#include "util.h"
+#include "CStats.h"
+#include <cstdio>
+#include <ctime>
 #include <list>
+#include <set>
+#include <vector>
+
+#if defined(WIN32) || defined(_WIN32)
+#include <process.h>
+#else
+#include <csignal>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -18,20 +32,63 @@ namespace ssh
      */
     bool sshd::init(const char * name)
     {
+        /* move the log output off the connection threads */
+        if( !CLogger::GetInstance().start() )
+            sshd_Log(sshd_EVENT_WARNING, "Failed to start the log writer, logging synchronously.");
+
         if( name )
         {
             /* load the settings from the file */
             if( !m_settings.load( name ) )
                 return false;
         }
+
+        /* e.g. 20090314-120000-4711, keeps the files of earlier runs from being reused */
+        char run[64];
+        time_t now = time( NULL );
+        size_t len = strftime( run, sizeof(run), "%Y%m%d-%H%M%S", gmtime( &now ) );
+#if defined(WIN32) || defined(_WIN32)
+        sprintf( run + len, "-%u", (unsigned) _getpid() );
+#else
+        sprintf( run + len, "-%u", (unsigned) getpid() );
+#endif
+        m_runName = run;
         
         /* store key-pair */
         m_settings.StoreString(SSHD_SETTING_RSA_PUBLIC_KEY_FILE, "e:\\public.rsa");
         m_settings.StoreString(SSHD_SETTING_RSA_PRIVATE_KEY_FILE, "e:\\private.rsa");
 
+        /* load all the configured host keys and keep them resident */
+        if( !m_hostKeys.load( m_settings ) ) {
+            sshd_Log(sshd_EVENT_FATAL, "Failed to load any host key.");
+            return false;
+        }
+
+        /* order the keys by the cost of signing with them */
+        m_hostKeys.calibrate();
+
+        /* advertise the loaded keys, cheapest first, unless configured otherwise */
+        string hostkeys;
+        if( !m_settings.GetString(SSHD_SETTING_PREFERRED_HOSTKEY, hostkeys) )
+            m_settings.StoreString(SSHD_SETTING_PREFERRED_HOSTKEY, m_hostKeys.GetAlgorithmList());
+
+        /* serialize the handshake messages once the settings are complete */
+        if( !refreshHandshakeTemplate() ) {
+            sshd_Log(sshd_EVENT_FATAL, "Failed to build the handshake template.");
+            return false;
+        }
         return true;
     }
 
+    /* sshd::refreshHandshakeTemplate
+     * Builds a new handshake template when the settings generation has changed. Connections
+     * keep a reference to the template they were started with.
+     */
+    bool sshd::refreshHandshakeTemplate()
+    {
+        return CHandshakeTemplate::Refresh( m_template, m_settings );
+    }
+
     /* sshd::run
      *
      */
@@ -40,64 +97,235 @@ namespace ssh
         /*
          * These should be done in the calling thread instead ? 
          */
-        unsigned int port = 1337;
-        int status;
+        string addressList = SSHD_DEFAULT_LISTEN_ADDRESS;
+        vector<string> addresses;
+        int backlog = SSHD_DEFAULT_BACKLOG, threads = 1;
+
+        m_settings.GetString(SSHD_SETTING_LISTEN_ADDRESS, addressList);
+        m_settings.GetValue(SSHD_SETTING_LISTEN_BACKLOG, backlog);
+        m_settings.GetValue(SSHD_SETTING_ACCEPT_THREADS, threads);
 
-        ssh::CNetwork net;
-        if( !net.init() ) {
-            return;
+        vector<string> items;
+        SplitString( addressList, items, ',' );
+        for(vector<string>::iterator it = items.begin(); it != items.end(); it++) {
+            if( !Trim( *it ).empty() )
+                addresses.push_back( Trim( *it ) );
         }
 
-        /* don't block */
-        net.setBlockingMode(false);
+        /* the statistics are only served if a socket is configured */
+        string statsPath;
+        if( m_settings.GetString(SSHD_SETTING_STATS_SOCKET, statsPath) && !m_statsServer.start( statsPath ) )
+            sshd_Log(sshd_EVENT_WARNING, "Failed to create the statistics socket.");
 
-        /* listen to port */
-        if( !net.bind( port ) ) {
-            return;
+        /* the connections share a reactor thread for their socket I/O if configured */
+        string backend;
+        if( m_settings.GetString(SSHD_SETTING_NETWORK_BACKEND, backend) &&
+            CReactor::ParseBackend( backend ) != SSHD_BACKEND_SELECT )
+        {
+            m_reactor.reset( CReactor::Create( CReactor::ParseBackend( backend ) ) );
+            if( m_reactor && !m_reactor->spawn() )
+                m_reactor.reset();
+            if( !m_reactor )
+                sshd_Log(sshd_EVENT_WARNING, "Failed to start the network reactor, using select.");
+#if !defined(WIN32) && !defined(_WIN32)
+            /* a write to a connection the peer has closed must fail instead of raising
+               SIGPIPE, which only the io_uring fixed writes can */
+            else if( m_reactor->raisesSigpipe() )
+                signal( SIGPIPE, SIG_IGN );
+#endif
         }
 
-        /* loop until shutdown */
-        while( !m_abortEvent.isSignaled() )
+        m_admission.configure( m_settings );
+
+        /* each accept thread has its own sockets, this thread is the first one */
+        for(int i = 0; i < (threads > 1 ? threads : 1); i++)
         {
-            CNetwork * con = net.waitForConnections(250, &status);
-            if( status == SSHD_NETWORK_OK )
-            {
-                if( con )
-                {
-                    /* incoming connection */
-                    CServerTransport * transport = new CServerTransport( m_settings, con, this );
-                    transport->init();
-
-                    m_clients.push_back( transport );
-                    /* run the transport in a new thread */
-                    if( !transport->spawn() ) {
-                        /* failed to spawn thread */
-                    }
+            CAcceptor * acceptor = new (std::nothrow) CAcceptor( this );
+            if( !acceptor || !acceptor->listen( addresses, backlog, threads > 1 ) ) {
+                delete acceptor;
+                if( i == 0 ) {
+                    sshd_Log(sshd_EVENT_FATAL, "Failed to listen to the configured addresses.");
+                    performShutdown();
+                    return;
                 }
-            } else {
-                /*
-                 * Handle problem.
-                 */
+                sshd_Log(sshd_EVENT_WARNING, "SO_REUSEPORT is not available, using fewer accept threads.");
+                break;
             }
+            if( i > 0 && !acceptor->spawn() ) {
+                delete acceptor;
+                break;
+            }
+            m_acceptors.push_back( acceptor );
+        }
+
+        /* loop until shutdown, closed connections are deleted between the polls */
+        while( !m_abortEvent.isSignaled() ) {
+            m_acceptors[0]->poll( ACCEPT_POLL_INTERVAL );
+            reapConnections();
         }
+
         /* shutdown event, perform the required cleanup */
         performShutdown();
     }
 
+    /* sshd::shutdown
+     * Stops the accept loop, the connections are closed before the thread ends.
+     */
+    void sshd::shutdown()
+    {
+        Util::CThread::shutdown();
+    }
+
+    /* sshd::attach
+     * Runs the server side of a connection over the stream in a new thread, the server takes
+     * ownership of the stream. Called by the accept loop, or in place of it when the streams
+     * come from elsewhere (e.g. a CMemoryNetwork pair), but not by both.
+     */
+    bool sshd::attach(INetwork * con)
+    {
+        return startConnection( con, NULL );
+    }
+
+    /* sshd::startConnection
+     * Creates the transport of a connection and spawns its thread. The admission is handed
+     * to the transport just before the spawn, until then the startup is the caller's.
+     */
+    bool sshd::startConnection(INetwork * con, CAdmission * admission)
+    {
+        CServerTransport * transport = new (std::nothrow) CServerTransport( m_settings, con, this );
+        if( !transport ) {
+            delete con;
+            return false;
+        }
+
+        SSHD_PROBE1(connection__accept, transport->getConnectionId());
+        if( !transport->init() ) {
+            sshd_Log(sshd_EVENT_WARNING, "Failed to initialize connection.");
+            delete transport;   /* also closes the connection */
+            return false;
+        }
+
+        m_attachLock.acquire();
+        /* share the prebuilt handshake messages with the connection */
+        if( refreshHandshakeTemplate() )
+            transport->setHandshakeTemplate( m_template );
+        m_attachLock.release();
+
+        /* listed before the thread starts, it may end and be reaped at once */
+        m_attachLock.acquire();
+        m_clients.insert( transport );
+        m_attachLock.release();
+
+        /* run the transport in a new thread */
+        transport->setAdmission( admission );
+        if( !transport->spawn() ) {
+            /* failed to spawn thread, the startup is still the caller's */
+            transport->setAdmission( NULL );
+            m_attachLock.acquire();
+            m_clients.erase( transport );
+            m_attachLock.release();
+            delete transport;
+            return false;
+        }
+
+        reapConnections();
+        return true;
+    }
+
+    /* sshd::connectionFinished
+     * Queues a connection whose thread is ending to be deleted.
+     */
+    void sshd::connectionFinished(CServerTransport * transport)
+    {
+        m_attachLock.acquire();
+        m_finished.push_back( transport );
+        m_attachLock.release();
+    }
+
+    /* sshd::reapConnections
+     * Deletes the connections that have closed, which also adds their counters to the
+     * totals of the closed connections. Only the closed connections are visited, and they
+     * are deleted after the lock has been released.
+     */
+    void sshd::reapConnections()
+    {
+        vector<CServerTransport *> finished;
+
+        m_attachLock.acquire();
+        finished.swap( m_finished );
+        for(vector<CServerTransport *>::iterator it = finished.begin(); it != finished.end(); it++)
+            m_clients.erase( *it );
+        m_attachLock.release();
+
+        for(vector<CServerTransport *>::iterator it = finished.begin(); it != finished.end(); it++) {
+            (*it)->wait();
+            delete *it;
+        }
+    }
+
+    /* sshd::accept
+     * Runs a connection accepted by one of the accept threads, its socket I/O is moved to
+     * the reactor if there is one. Connections beyond the admission limits are closed
+     * right away, before a thread or any crypto is spent on them.
+     */
+    bool sshd::accept(CNetwork * con)
+    {
+        int reason;
+        if( !m_admission.admit( con->getPeerAddress(), &reason ) ) {
+            CStats::GetInstance().countRejected( reason );
+            delete con;
+            return false;
+        }
+
+        INetwork * stream = con;
+        if( m_reactor && !(stream = m_reactor->adopt( con )) ) {
+            m_admission.release();
+            return false;
+        }
+        if( !startConnection( stream, &m_admission ) ) {
+            m_admission.release();
+            return false;
+        }
+        return true;
+    }
+
     /* sshd::performShutdown
      *
      */
     void sshd::performShutdown()
     {
+        /* stop accepting, the first acceptor ran in this thread */
+        for(size_t i = 1; i < m_acceptors.size(); i++) {
+            m_acceptors[i]->shutdown();
+            m_acceptors[i]->wait();
+        }
+        for(size_t i = 0; i < m_acceptors.size(); i++)
+            delete m_acceptors[i];
+        m_acceptors.clear();
+
         /* initiate shutdown for each client. */
-        for(list<CServerTransport *>::iterator it = m_clients.begin(); it != m_clients.end(); it++) {
+        for(set<CServerTransport *>::iterator it = m_clients.begin(); it != m_clients.end(); it++) {
             (*it)->shutdown();
         }
         /* wait for all connections to be closed */
-        for(list<CServerTransport *>::iterator it = m_clients.begin(); it != m_clients.end(); it++)
+        for(set<CServerTransport *>::iterator it = m_clients.begin(); it != m_clients.end(); it++)
         {
             (*it)->wait();
+            delete *it;
         }
+        m_clients.clear();
+        m_finished.clear();
+
+        /* the connections have let go of their streams */
+        if( m_reactor ) {
+            m_reactor->shutdown();
+            m_reactor->wait();
+        }
+
+        m_statsServer.stop();
+
+        /* write the remaining log messages */
+        CLogger::GetInstance().stop();
     }
 
     /* sshd::registerAuthService
@@ -8,8 +8,19 @@
 #include "CServerTransport.h"
 #include "types.h"
 #include "CSettings.h"
+#include "CHostKeySet.h"
 #include "errors.h"
 #include "CThread.h"
+#include "CLogger.h"
+#include "CStatsServer.h"
+#include "CReactor.h"
+#include "CAcceptor.h"
+#include "CAdmission.h"
+#include "Mutex.h"
+
+/* C/C++ includes */
+#include <set>
+#include <vector>
 
 /*****************************************************************************/
 /*                              DEFINITIONS                                  */
@@ -18,17 +29,11 @@
 
 #define sshd_CheckAbortEvent()          if (m_abortEvent.isSignaled()) return sshd_CONNECTION_ABORTED;
 #define sshd_CheckAbortEvent_NoRet()    (m_abortEvent.isSignaled())
-#define sshd_Log(event, message) do{fprintf(stderr, message "\r\n");} while(0)
+
+#define SSHD_DEFAULT_LISTEN_ADDRESS     "127.0.0.1:" SSHD_DEFAULT_PORT
 
 namespace ssh
 {
-    typedef enum
-    {
-        sshd_EVENT_WARNING = 0,     /* warning *
-        sshd_EVENT_FATAL,           /* fatal error */
-        sshd_EVENT_NOTIFY           /* general notification */
-    } LogEvents;
-
     /* sshd
      * Secure Shell Server Deamon
      */
@@ -39,6 +44,12 @@ namespace ssh
         void Task();
         /* initiate server shutdown */
         void shutdown();
+        /* runs a connection over an already connected stream, takes ownership of it */
+        bool attach(INetwork *);
+        /* runs a connection accepted by an accept thread */
+        bool accept(CNetwork *);
+        /* called by a connection as the last step of its thread, it is deleted later */
+        void connectionFinished(CServerTransport *);
 
         /* registers a authentication service with the server */
         int registerAuthService( ssh::AuthenticationFactory , const std::string & name, void * );
@@ -48,9 +59,21 @@ namespace ssh
         int sshd::createAuthService( const std::string & serviceName, CTransport *, CAuthenticationService ** ) const;
         int sshd::createService( const std::string & serviceName, CService ** ) const;
 
+        /* returns the resident host keys */
+        const CHostKeySet & getHostKeys() const {return m_hostKeys;}
+        /* names this run of the server in the files it creates, start time and process id */
+        const std::string & getRunName() const  {return m_runName;}
+
     protected:
     
         void performShutdown();
+        /* rebuilds the shared handshake template if the settings have changed */
+        bool refreshHandshakeTemplate();
+        /* runs the connection in a new thread, it holds a startup of the admission control
+           until it authenticates if one is given */
+        bool startConnection(INetwork *, CAdmission *);
+        /* deletes the connections whose threads have ended */
+        void reapConnections();
 
         typedef struct {
             ssh::AuthenticationFactory  factory;
@@ -70,7 +93,23 @@ namespace ssh
 
         /* server settings */
         CSettings m_settings;
-        std::list<ssh::CServerTransport *> m_clients;
+        std::string m_runName;
+        /* the host keys, loaded once at startup */
+        CHostKeySet m_hostKeys;
+        /* the handshake messages shared by all connections */
+        boost::shared_ptr<const CHandshakeTemplate> m_template;
+        std::set<ssh::CServerTransport *> m_clients;
+        std::vector<ssh::CServerTransport *> m_finished;   /* closed, to be deleted */
+        /* attach is called by all the accept threads, m_clients and m_finished are only used
+           under the lock */
+        Util::Mutex m_attachLock;
+        std::vector<CAcceptor *> m_acceptors;
+        /* limits the unauthenticated connections from the accept threads */
+        CAdmission m_admission;
+        /* serves the performance counters */
+        CStatsServer m_statsServer;
+        /* does the socket I/O of the connections, unless each does its own */
+        boost::shared_ptr<CReactor> m_reactor;
     };
 };
 
@@ -22,4 +22,23 @@ std::string Trim(const std::string & str);
  *
  */
 std::string bin2hex(const std::vector<uint8_t> & data);
+
+/*
+ * TIME UTILITY
+ */
+
+/* GetMonotonicTime
+ * Returns a monotonic timestamp in nanoseconds, only useful for measuring intervals.
+ */
+uint64_t GetMonotonicTime();
+
+/*
+ * ALLOCATION UTILITY
+ */
+
+/* GetThreadAllocations
+ * Returns the number of heap allocations made by the calling thread. Always zero unless
+ * built with SSHD_COUNT_ALLOCATIONS, which replaces the allocator with a counting one.
+ */
+uint64_t GetThreadAllocations();
 #endif
\ No newline at end of file